@@ -22,44 +22,197 @@
 #include <aws/sts/model/AssumeRoleRequest.h>
 #include <aws/sts/STSClient.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
 GST_DEBUG_CATEGORY_STATIC (gst_aws_credentials_debug);
 #define GST_CAT_DEFAULT gst_aws_credentials_debug
 
 using namespace Aws::Auth;
 
 struct _GstAWSCredentials {
-  _GstAWSCredentials(GstAWSCredentialsProviderFactory factory) :
-    credentials_provider_factory(std::move(factory))
+  _GstAWSCredentials(GstAWSCredentialsProviderFactory factory, std::string id) :
+    credentials_provider_factory(std::move(factory)),
+    id(std::move(id))
   {
   }
 
   GstAWSCredentialsProviderFactory credentials_provider_factory;
+  // equal for credentials which yield the same provider
+  std::string id;
 };
 
+static GstAWSCredentials *
+_gst_aws_credentials_new_with_id (GstAWSCredentialsProviderFactory factory, std::string id)
+{
+  return new GstAWSCredentials(std::move(factory), std::move(id));
+}
+
 GstAWSCredentials *
 gst_aws_credentials_new (GstAWSCredentialsProviderFactory factory)
 {
-  return new GstAWSCredentials(std::move(factory));
+  // nothing is known about the factory, so only copies are equal
+  static std::atomic<guint64> counter(0);
+  return _gst_aws_credentials_new_with_id (std::move(factory),
+      "factory:" + std::to_string(++counter));
 }
 
 GstAWSCredentials *
 gst_aws_credentials_new_default (void)
 {
-  return gst_aws_credentials_new ([] {
+  return _gst_aws_credentials_new_with_id ([] {
     return std::unique_ptr<AWSCredentialsProvider> (new DefaultAWSCredentialsProviderChain ());
-  });
+  }, "default");
+}
+
+const std::string &
+gst_aws_credentials_get_id (GstAWSCredentials * credentials)
+{
+  return credentials->id;
 }
 
+/* Providers are shared by all the users of equal credentials while any of
+ * them is alive; credential resolution (e.g. probing the instance metadata
+ * service off EC2) only runs once per process for each credentials value.
+ * Every credentials value has its own lock, so that resolving one doesn't
+ * hold up the others, nor a factory which resolves other credentials. */
+class CredentialsProviderCache
+{
+public:
+  static CredentialsProviderCache & get_instance ()
+  {
+    static CredentialsProviderCache instance;
+    return instance;
+  }
+
+  std::shared_ptr<AWSCredentialsProvider> get (const std::string & id,
+      const GstAWSCredentialsProviderFactory & factory)
+  {
+    std::shared_ptr<Slot> slot;
+    {
+      std::lock_guard<std::mutex> lock (mtx);
+      purge ();
+      auto & entry = slots[id];
+      if (!entry)
+        entry = std::make_shared<Slot> ();
+      slot = entry;
+    }
+
+    std::lock_guard<std::mutex> slot_lock (slot->mtx);
+    if (auto provider = slot->provider.lock ())
+      return provider;
+
+    std::shared_ptr<AWSCredentialsProvider> provider = factory ();
+    if (provider)
+      slot->provider = provider;
+
+    return provider;
+  }
+
+  /* Failed resolutions are remembered for a while so that every request
+   * doesn't wait for the same timeouts again. */
+  bool is_known_unresolvable (const std::string & id)
+  {
+    std::lock_guard<std::mutex> lock (mtx);
+
+    auto it = failures.find (id);
+    return it != failures.end () && std::chrono::steady_clock::now () < it->second;
+  }
+
+  void set_unresolvable (const std::string & id)
+  {
+    std::lock_guard<std::mutex> lock (mtx);
+    failures[id] = std::chrono::steady_clock::now () + NEGATIVE_TTL;
+  }
+
+private:
+  static constexpr std::chrono::seconds NEGATIVE_TTL{60};
+
+  struct Slot
+  {
+    std::mutex mtx;
+    std::weak_ptr<AWSCredentialsProvider> provider;
+  };
+
+  /* Forgets the providers nobody uses and the failures which are over. */
+  void purge ()
+  {
+    for (auto it = slots.begin (); it != slots.end ();) {
+      // a slot only held here isn't being filled by another thread
+      bool is_unused = it->second.use_count () == 1 && it->second->provider.expired ();
+      it = is_unused ? slots.erase (it) : std::next (it);
+    }
+
+    auto now = std::chrono::steady_clock::now ();
+    for (auto it = failures.begin (); it != failures.end ();)
+      it = it->second <= now ? failures.erase (it) : std::next (it);
+  }
+
+  std::mutex mtx;
+  std::map<std::string, std::shared_ptr<Slot>> slots;
+  std::map<std::string, std::chrono::steady_clock::time_point> failures;
+};
+
+constexpr std::chrono::seconds CredentialsProviderCache::NEGATIVE_TTL;
+
+static bool
+refreshes_itself (AWSCredentialsProvider * provider);
+
+/* What gst_aws_credentials_create_provider() hands out: a reference to the
+ * shared provider of the credentials. */
+class SharedCredentialsProvider : public AWSCredentialsProvider
+{
+public:
+  SharedCredentialsProvider (std::string id, std::shared_ptr<AWSCredentialsProvider> provider) :
+    id (std::move (id)),
+    provider (std::move (provider)),
+    // such a provider retries sooner than the negative cache would
+    is_cached_when_unresolvable (!refreshes_itself (this->provider.get ()))
+  {
+  }
+
+  AWSCredentials GetAWSCredentials () override
+  {
+    auto & cache = CredentialsProviderCache::get_instance ();
+    if (is_cached_when_unresolvable && cache.is_known_unresolvable (id))
+      return AWSCredentials ();
+
+    auto credentials = provider->GetAWSCredentials ();
+    if (credentials.IsEmpty () && is_cached_when_unresolvable) {
+      GST_WARNING ("No AWS credentials found, not looking again for a while");
+      cache.set_unresolvable (id);
+    }
+    return credentials;
+  }
+
+private:
+  std::string id;
+  std::shared_ptr<AWSCredentialsProvider> provider;
+  bool is_cached_when_unresolvable;
+};
+
 std::unique_ptr<AWSCredentialsProvider>
 gst_aws_credentials_create_provider (GstAWSCredentials * credentials)
 {
-  return credentials->credentials_provider_factory();
+  auto provider = CredentialsProviderCache::get_instance ().get (credentials->id,
+      credentials->credentials_provider_factory);
+
+  if (!provider)
+    return NULL;
+
+  return std::unique_ptr<AWSCredentialsProvider> (
+      new SharedCredentialsProvider (credentials->id, std::move (provider)));
 }
 
 GstAWSCredentials *
 gst_aws_credentials_copy (GstAWSCredentials * credentials)
 {
-  return gst_aws_credentials_new (credentials->credentials_provider_factory);
+  return _gst_aws_credentials_new_with_id (credentials->credentials_provider_factory,
+      credentials->id);
 }
 
 void
@@ -80,27 +233,144 @@ is_null_or_empty(const char* str)
   return str == NULL || strcmp(str, "") == 0;
 }
 
-static std::unique_ptr<AWSCredentialsProvider>
-_gst_aws_credentials_assume_role(const gchar * role_arn, std::shared_ptr<AWSCredentialsProvider> base_provider)
+/* Credentials of an assumed IAM role. They're fetched on a background thread,
+ * the first ones as soon as the provider is created and the next ones well
+ * before they expire, so only the first requests may wait for STS. */
+class AssumeRoleCredentialsProvider : public AWSCredentialsProvider
 {
-  Aws::STS::Model::AssumeRoleOutcome response = Aws::STS::STSClient(base_provider)
-      .AssumeRole(Aws::STS::Model::AssumeRoleRequest().WithRoleArn(role_arn)
-      // Use access key of the currently used AWS account as a session name
-      .WithRoleSessionName(base_provider->GetAWSCredentials().GetAWSAccessKeyId()));
+public:
+  AssumeRoleCredentialsProvider (Aws::String role_arn, std::shared_ptr<AWSCredentialsProvider> base_provider) :
+    role_arn (std::move (role_arn)),
+    base_provider (std::move (base_provider)),
+    refresh_thread (&AssumeRoleCredentialsProvider::run, this)
+  {
+  }
 
-  if (!response.IsSuccess())
+  ~AssumeRoleCredentialsProvider () override
   {
-    return NULL;
+    {
+      std::lock_guard<std::mutex> lock (mtx);
+      is_stopped = true;
+    }
+    cv.notify_all ();
+    refresh_thread.join ();
+  }
+
+  AWSCredentials GetAWSCredentials () override
+  {
+    std::unique_lock<std::mutex> lock (mtx);
+
+    // empty credentials if the role couldn't be assumed in time; the
+    // request then fails rather than stalling its thread
+    if (!cv.wait_for (lock, FIRST_FETCH_TIMEOUT, [this] { return is_fetched || is_stopped; }))
+      GST_WARNING ("Role %s not assumed yet", role_arn.c_str ());
+    return credentials;
   }
 
-  Aws::STS::Model::Credentials role_credentials = response.GetResult().GetCredentials();
+private:
+  // how long before the expiration the credentials are renewed
+  static constexpr std::chrono::minutes REFRESH_MARGIN{5};
+  static constexpr std::chrono::seconds MIN_RETRY_DELAY{5};
+  static constexpr std::chrono::seconds MAX_RETRY_DELAY{60};
+  // how long a request waits for the first credentials
+  static constexpr std::chrono::seconds FIRST_FETCH_TIMEOUT{10};
+
+  static bool fetch (const Aws::String & role_arn, const std::shared_ptr<AWSCredentialsProvider> & base_provider,
+      AWSCredentials & role_credentials)
+  {
+    auto base_credentials = base_provider->GetAWSCredentials ();
+    if (base_credentials.IsEmpty ()) {
+      GST_WARNING ("No AWS credentials to assume role %s with", role_arn.c_str ());
+      return false;
+    }
+
+    Aws::STS::Model::AssumeRoleOutcome response = Aws::STS::STSClient (base_provider)
+        .AssumeRole (Aws::STS::Model::AssumeRoleRequest ().WithRoleArn (role_arn)
+        // Use access key of the currently used AWS account as a session name
+        .WithRoleSessionName (base_credentials.GetAWSAccessKeyId ()));
+
+    if (!response.IsSuccess ()) {
+      GST_WARNING ("Failed to assume role %s: %s", role_arn.c_str (),
+          response.GetError ().GetMessage ().c_str ());
+      return false;
+    }
+
+    auto result = response.GetResult ().GetCredentials ();
+    role_credentials = AWSCredentials (result.GetAccessKeyId (),
+        result.GetSecretAccessKey (), result.GetSessionToken (),
+        result.GetExpiration ());
+    return true;
+  }
 
+  std::chrono::system_clock::time_point get_refresh_time () const
+  {
+    auto next_refresh = credentials.GetExpiration ().UnderlyingTimestamp () - REFRESH_MARGIN;
+    GST_DEBUG ("Assumed role %s, renewing in %" G_GINT64_FORMAT " s", role_arn.c_str (),
+        (gint64) std::chrono::duration_cast<std::chrono::seconds> (
+            next_refresh - std::chrono::system_clock::now ()).count ());
+    return next_refresh;
+  }
+
+  void run ()
+  {
+    std::chrono::seconds retry_delay = MIN_RETRY_DELAY;
+    std::unique_lock<std::mutex> lock (mtx);
+    auto next_refresh = std::chrono::system_clock::now ();
+
+    while (!cv.wait_until (lock, next_refresh, [this] { return is_stopped; })) {
+      lock.unlock ();
+      AWSCredentials role_credentials;
+      bool ok = fetch (role_arn, base_provider, role_credentials);
+      lock.lock ();
+
+      if (ok) {
+        credentials = role_credentials;
+        retry_delay = MIN_RETRY_DELAY;
+        next_refresh = get_refresh_time ();
+      } else {
+        // keep the current credentials, they may still be valid
+        next_refresh = std::chrono::system_clock::now () + retry_delay;
+        retry_delay = std::min (retry_delay * 2, MAX_RETRY_DELAY);
+      }
+
+      if (!is_fetched) {
+        is_fetched = true;
+        cv.notify_all ();
+      }
+    }
+  }
+
+  Aws::String role_arn;
+  std::shared_ptr<AWSCredentialsProvider> base_provider;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  AWSCredentials credentials;
+  // set once the first credentials were fetched, or failed to be
+  bool is_fetched = false;
+  bool is_stopped = false;
+
+  // started last, once everything it uses is initialized
+  std::thread refresh_thread;
+};
+
+constexpr std::chrono::minutes AssumeRoleCredentialsProvider::REFRESH_MARGIN;
+constexpr std::chrono::seconds AssumeRoleCredentialsProvider::MIN_RETRY_DELAY;
+constexpr std::chrono::seconds AssumeRoleCredentialsProvider::MAX_RETRY_DELAY;
+constexpr std::chrono::seconds AssumeRoleCredentialsProvider::FIRST_FETCH_TIMEOUT;
+
+static bool
+refreshes_itself (AWSCredentialsProvider * provider)
+{
+  return dynamic_cast<AssumeRoleCredentialsProvider *> (provider) != NULL;
+}
+
+std::unique_ptr<AWSCredentialsProvider>
+gst_aws_credentials_assume_role (const gchar * role_arn, std::shared_ptr<AWSCredentialsProvider> base_provider)
+{
   return std::unique_ptr<AWSCredentialsProvider> (
-    new SimpleAWSCredentialsProvider (
-      AWSCredentials(role_credentials.GetAccessKeyId(),
-        role_credentials.GetSecretAccessKey(),
-        role_credentials.GetSessionToken())));
- }
+    new AssumeRoleCredentialsProvider (role_arn, std::move (base_provider)));
+}
 
 static std::unique_ptr<AWSCredentialsProvider>
 _gst_aws_credentials_create_provider(const gchar * access_key_id, const gchar * secret_access_key, const gchar * session_token)
@@ -165,7 +435,7 @@ _gst_aws_credentials_provider_from_string(const gchar * str)
   }
 
   if (!is_null_or_empty (iam_role))
-    provider = _gst_aws_credentials_assume_role(iam_role, std::move(provider));
+    provider = gst_aws_credentials_assume_role(iam_role, std::move(provider));
 
   g_strfreev (parameters);
 
@@ -176,9 +446,14 @@ static GstAWSCredentials *
 _gst_aws_credentials_from_string (const gchar * str)
 {
   std::string credentials_str = str;
-  return gst_aws_credentials_new ([credentials_str] {
+  // the id ends up in registry keys and logs, so it mustn't hold the secret
+  gchar *digest = g_compute_checksum_for_string (G_CHECKSUM_SHA256, str, -1);
+  std::string id = std::string ("string:") + digest;
+  g_free (digest);
+
+  return _gst_aws_credentials_new_with_id ([credentials_str] {
     return _gst_aws_credentials_provider_from_string (credentials_str.c_str());
-  });
+  }, std::move (id));
 }
 
 static gboolean
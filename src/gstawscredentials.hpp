@@ -23,6 +23,7 @@
 
 #include <aws/core/auth/AWSCredentialsProvider.h>
 #include <functional>
+#include <string>
 
 using GstAWSCredentialsProviderFactory = std::function<std::unique_ptr<Aws::Auth::AWSCredentialsProvider>()>;
 
@@ -34,4 +35,18 @@ GST_EXPORT
 std::unique_ptr<Aws::Auth::AWSCredentialsProvider>
 gst_aws_credentials_create_provider (GstAWSCredentials * credentials);
 
+/* Assumes the IAM role with the credentials of base_provider. The role is
+ * assumed and refreshed in the background, so this doesn't call STS; the
+ * provider gives empty credentials while the role can't be assumed. */
+GST_EXPORT
+std::unique_ptr<Aws::Auth::AWSCredentialsProvider>
+gst_aws_credentials_assume_role (const gchar * role_arn,
+    std::shared_ptr<Aws::Auth::AWSCredentialsProvider> base_provider);
+
+/* Identifies the credentials' value: two credentials with the same id yield
+ * equivalent providers and can share AWS clients. */
+GST_EXPORT
+const std::string &
+gst_aws_credentials_get_id (GstAWSCredentials * credentials);
+
 #endif /* __GST_AWS_CREDENTIALS_HPP__ */
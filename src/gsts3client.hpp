@@ -0,0 +1,76 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef __GST_S3_CLIENT_HPP__
+#define __GST_S3_CLIENT_HPP__
+
+#include "gstawscredentials.h"
+
+#include <aws/core/utils/threading/Executor.h>
+#include <aws/s3/S3Client.h>
+
+#include <memory>
+
+// SDK state shared by the uploaders and the downloaders of the process.
+namespace gst
+{
+namespace aws
+{
+namespace s3
+{
+
+class AwsApiHandle;
+
+// Keeps the SDK initialized while held.
+std::shared_ptr<AwsApiHandle> acquire_aws_sdk();
+
+// The bounded pool running the asynchronous requests of all the clients;
+// created with the settings of its first user.
+std::shared_ptr<Aws::Utils::Threading::Executor> acquire_s3_executor(size_t thread_count, const char* thread_name);
+
+struct S3ClientSettings
+{
+    Aws::String bucket;
+    // NULL or empty for the defaults
+    const char* region = nullptr;
+    const char* ca_file = nullptr;
+    const char* endpoint = nullptr;
+    bool use_http = false;
+    bool verify_ssl = true;
+    bool sign_payload = true;
+    unsigned max_connections = 25;
+    GstAWSCredentials* credentials = nullptr;
+};
+
+// Returns a client shared with the other users of the same settings, or
+// nullptr if the credentials can't be used. Without a region, the region of
+// the bucket is looked up (once per process); is_region_detected tells
+// whether that worked.
+std::shared_ptr<Aws::S3::S3Client> acquire_s3_client(const S3ClientSettings& settings,
+    std::shared_ptr<Aws::Utils::Threading::Executor> executor, bool& is_region_detected);
+
+// Makes the next client of the bucket look its region up again.
+void invalidate_bucket_region(const Aws::String& bucket, const Aws::String& endpoint);
+
+bool is_wrong_region_error(const Aws::S3::S3Error& error);
+
+} // namespace s3
+} // namespace aws
+} // namespace gst
+
+#endif /* __GST_S3_CLIENT_HPP__ */
@@ -0,0 +1,106 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#include "gsts3downloader.h"
+
+#define GET_CLASS_(downloader) ((GstS3Downloader*) (downloader))->klass
+
+void
+gst_s3_downloader_destroy (GstS3Downloader * downloader)
+{
+  GET_CLASS_ (downloader)->destroy (downloader);
+}
+
+guint64
+gst_s3_downloader_get_size (GstS3Downloader * downloader)
+{
+  return GET_CLASS_ (downloader)->get_size (downloader);
+}
+
+gboolean
+gst_s3_downloader_read (GstS3Downloader * downloader, guint64 offset,
+    gchar * buffer, gsize size, gsize * read_size)
+{
+  return GET_CLASS_ (downloader)->read (downloader, offset, buffer, size,
+      read_size);
+}
+
+GstStructure *
+gst_s3_downloader_get_stats (GstS3Downloader * downloader)
+{
+  if (!GET_CLASS_ (downloader)->get_stats)
+    return NULL;
+
+  return GET_CLASS_ (downloader)->get_stats (downloader);
+}
+
+gchar *
+gst_s3_downloader_get_error (GstS3Downloader * downloader)
+{
+  if (!GET_CLASS_ (downloader)->get_error)
+    return NULL;
+
+  return GET_CLASS_ (downloader)->get_error (downloader);
+}
+
+void
+gst_s3_downloader_prefetch (GstS3Downloader * downloader)
+{
+  if (GET_CLASS_ (downloader)->prefetch)
+    GET_CLASS_ (downloader)->prefetch (downloader);
+}
+
+gboolean
+gst_s3_downloader_read_buffer (GstS3Downloader * downloader,
+    guint64 offset, gsize size, GstBuffer ** buffer)
+{
+  GstMapInfo info;
+  gsize read_size = 0;
+  gboolean ret;
+
+  if (GET_CLASS_ (downloader)->read_buffer)
+    return GET_CLASS_ (downloader)->read_buffer (downloader, offset, size,
+        buffer);
+
+  *buffer = gst_buffer_new_allocate (NULL, size, NULL);
+  if (!gst_buffer_map (*buffer, &info, GST_MAP_WRITE)) {
+    gst_buffer_unref (*buffer);
+    *buffer = NULL;
+    return FALSE;
+  }
+
+  ret = gst_s3_downloader_read (downloader, offset, (gchar *) info.data, size,
+      &read_size);
+  gst_buffer_unmap (*buffer, &info);
+
+  if (!ret || read_size == 0) {
+    gst_buffer_unref (*buffer);
+    *buffer = NULL;
+  } else {
+    gst_buffer_set_size (*buffer, read_size);
+  }
+  return ret;
+}
+
+void
+gst_s3_downloader_set_flushing (GstS3Downloader * downloader,
+    gboolean flushing)
+{
+  if (GET_CLASS_ (downloader)->set_flushing)
+    GET_CLASS_ (downloader)->set_flushing (downloader, flushing);
+}
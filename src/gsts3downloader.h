@@ -0,0 +1,97 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef __GST_S3_DOWNLOADER_H__
+#define __GST_S3_DOWNLOADER_H__
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "gsts3downloaderconfig.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GstS3Downloader GstS3Downloader;
+
+typedef struct {
+  void (*destroy) (GstS3Downloader *);
+  guint64 (*get_size) (GstS3Downloader *);
+  gboolean (*read) (GstS3Downloader *, guint64, gchar *, gsize, gsize *);
+  GstStructure * (*get_stats) (GstS3Downloader *);
+  gchar * (*get_error) (GstS3Downloader *);
+  void (*prefetch) (GstS3Downloader *);
+  gboolean (*read_buffer) (GstS3Downloader *, guint64, gsize, GstBuffer **);
+  void (*set_flushing) (GstS3Downloader *, gboolean);
+} GstS3DownloaderClass;
+
+struct _GstS3Downloader {
+  GstS3DownloaderClass *klass;
+};
+
+typedef GstS3Downloader * (*GstS3DownloaderNewFunc) (const
+    GstS3DownloaderConfig * config);
+
+/* Lists the keys of config's bucket starting with prefix, in order, after
+ * start_after (NULL to start at the first one). Returns a NULL-terminated
+ * page of keys, empty once there are no more, or NULL if they couldn't be
+ * listed. */
+typedef gchar ** (*GstS3KeyListFunc) (const GstS3DownloaderConfig * config,
+    const gchar * prefix, const gchar * start_after);
+
+/* Looks config's key up in its bucket, setting exists to whether it is
+ * there. Returns FALSE if that couldn't be found out. */
+typedef gboolean (*GstS3KeyLookupFunc) (const GstS3DownloaderConfig * config,
+    gboolean * exists);
+
+void gst_s3_downloader_destroy (GstS3Downloader * downloader);
+
+/* Size of the object in bytes. */
+guint64 gst_s3_downloader_get_size (GstS3Downloader * downloader);
+
+/* Copies up to size bytes of the object, starting at offset, into buffer.
+ * read_size is set to the number of bytes copied, which is only less than
+ * size at the end of the object. Returns FALSE if the object couldn't be
+ * read. */
+gboolean gst_s3_downloader_read (GstS3Downloader * downloader,
+    guint64 offset, gchar * buffer, gsize size, gsize * read_size);
+
+/* Returns a new structure with the downloader's counters, or NULL if the
+ * downloader doesn't keep any. */
+GstStructure *gst_s3_downloader_get_stats (GstS3Downloader * downloader);
+
+/* Returns a new string describing why the last read failed, or NULL. */
+gchar *gst_s3_downloader_get_error (GstS3Downloader * downloader);
+
+/* Starts fetching the beginning of the object before it is read, so that
+ * the first read doesn't wait for a whole round trip. */
+void gst_s3_downloader_prefetch (GstS3Downloader * downloader);
+
+/* Like gst_s3_downloader_read, but returns the bytes in a new buffer,
+ * sharing the downloader's memory when it can instead of copying it.
+ * buffer is set to NULL at the end of the object. */
+gboolean gst_s3_downloader_read_buffer (GstS3Downloader * downloader,
+    guint64 offset, gsize size, GstBuffer ** buffer);
+
+/* While flushing, reads waiting for the object to arrive fail right away,
+ * so that the streaming thread can be stopped. */
+void gst_s3_downloader_set_flushing (GstS3Downloader * downloader,
+    gboolean flushing);
+
+G_END_DECLS
+
+#endif /* __GST_S3_DOWNLOADER_H__ */
@@ -0,0 +1,73 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef __GST_S3_DOWNLOADER_CONFIG_H__
+#define __GST_S3_DOWNLOADER_CONFIG_H__
+
+#include <glib.h>
+
+#include "gstawscredentials.h"
+
+G_BEGIN_DECLS
+
+#define GST_S3_DOWNLOADER_CONFIG_DEFAULT_RANGE_SIZE 8 * 1024 * 1024
+#define GST_S3_DOWNLOADER_CONFIG_DEFAULT_ALIGN_TO_PARTS TRUE
+#define GST_S3_DOWNLOADER_CONFIG_DEFAULT_MIN_READ_AHEAD 2
+#define GST_S3_DOWNLOADER_CONFIG_DEFAULT_MAX_READ_AHEAD 16
+#define GST_S3_DOWNLOADER_CONFIG_DEFAULT_CACHE_SIZE 64 * 1024 * 1024
+#define GST_S3_DOWNLOADER_CONFIG_DEFAULT_INIT_AWS_SDK TRUE
+#define GST_S3_DOWNLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_USE_HTTP FALSE
+#define GST_S3_DOWNLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_VERIFY_SSL TRUE
+#define GST_S3_DOWNLOADER_CONFIG_DEFAULT_MAX_CONNECTIONS 25
+
+typedef struct {
+  gchar * region;
+  gchar * bucket;
+  gchar * key;
+  gchar * location;
+  gchar * ca_file;
+  GstAWSCredentials * credentials;
+  gboolean init_aws_sdk;
+  gchar * aws_sdk_endpoint;
+  gboolean aws_sdk_use_http;
+  gboolean aws_sdk_verify_ssl;
+  guint max_connections;
+  gsize range_size; /* size of the ranges requested */
+  gboolean align_to_parts; /* use the part size of multipart objects */
+  guint min_read_ahead; /* ranges requested ahead of the reader */
+  guint max_read_ahead;
+  guint64 cache_size; /* bytes of fetched ranges kept for reading again */
+} GstS3DownloaderConfig;
+
+#define GST_S3_DOWNLOADER_CONFIG_INIT (GstS3DownloaderConfig) { \
+  NULL, NULL, NULL, NULL, NULL, NULL, \
+  GST_S3_DOWNLOADER_CONFIG_DEFAULT_INIT_AWS_SDK, \
+  NULL, \
+  GST_S3_DOWNLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_USE_HTTP, \
+  GST_S3_DOWNLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_VERIFY_SSL, \
+  GST_S3_DOWNLOADER_CONFIG_DEFAULT_MAX_CONNECTIONS, \
+  GST_S3_DOWNLOADER_CONFIG_DEFAULT_RANGE_SIZE, \
+  GST_S3_DOWNLOADER_CONFIG_DEFAULT_ALIGN_TO_PARTS, \
+  GST_S3_DOWNLOADER_CONFIG_DEFAULT_MIN_READ_AHEAD, \
+  GST_S3_DOWNLOADER_CONFIG_DEFAULT_MAX_READ_AHEAD, \
+  GST_S3_DOWNLOADER_CONFIG_DEFAULT_CACHE_SIZE \
+}
+
+G_END_DECLS
+
+#endif /* __GST_S3_DOWNLOADER_CONFIG_H__ */
@@ -22,14 +22,40 @@
 #include <gst/gst.h>
 
 #include "gsts3sink.h"
+#include "gsts3src.h"
+#include "gsts3multipartuploader.h"
+
+/* GST_S3_AWS_SDK_IDLE_TIMEOUT: seconds the AWS SDK is kept initialized after
+ * the last element stops using it, or "pinned" to keep it for the lifetime
+ * of the process. */
+static void
+gst_s3_elements_init_sdk_lifetime (void)
+{
+  const gchar *value = g_getenv ("GST_S3_AWS_SDK_IDLE_TIMEOUT");
+
+  if (!value)
+    return;
+
+  if (g_strcmp0 (value, "pinned") == 0)
+    gst_s3_multipart_uploader_set_sdk_idle_timeout (-1);
+  else
+    gst_s3_multipart_uploader_set_sdk_idle_timeout (MAX (0,
+            (gint) g_ascii_strtoll (value, NULL, 10)));
+}
 
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
+  gst_s3_elements_init_sdk_lifetime ();
+
   if (!gst_element_register (plugin, "s3sink", GST_RANK_NONE,
           gst_s3_sink_get_type ()))
     return FALSE;
 
+  if (!gst_element_register (plugin, "s3src", GST_RANK_NONE,
+          gst_s3_src_get_type ()))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -0,0 +1,190 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#include "gsts3keyframeindex.h"
+
+#include <string.h>
+
+#define INDEX_MAGIC "GSKI"
+#define INDEX_VERSION 1
+#define HEADER_SIZE 16
+#define ENTRY_SIZE 32
+
+struct _GstS3KeyframeIndex {
+  GArray *entries;
+};
+
+GstS3KeyframeIndex *
+gst_s3_keyframe_index_new (void)
+{
+  GstS3KeyframeIndex *index = g_new (GstS3KeyframeIndex, 1);
+
+  index->entries = g_array_new (FALSE, FALSE, sizeof (GstS3KeyframeIndexEntry));
+
+  return index;
+}
+
+void
+gst_s3_keyframe_index_free (GstS3KeyframeIndex * index)
+{
+  if (!index)
+    return;
+
+  g_array_free (index->entries, TRUE);
+  g_free (index);
+}
+
+void
+gst_s3_keyframe_index_add (GstS3KeyframeIndex * index, GstClockTime pts,
+    GstClockTime dts, guint64 offset, guint part_number)
+{
+  GstS3KeyframeIndexEntry entry;
+
+  entry.pts = pts;
+  entry.dts = dts;
+  entry.offset = offset;
+  entry.part_number = part_number;
+  g_array_append_val (index->entries, entry);
+}
+
+guint
+gst_s3_keyframe_index_get_size (GstS3KeyframeIndex * index)
+{
+  return index->entries->len;
+}
+
+/* Entries are looked up by PTS, or DTS where the PTS isn't known. */
+static GstClockTime
+gst_s3_keyframe_index_entry_time (const GstS3KeyframeIndexEntry * entry)
+{
+  return GST_CLOCK_TIME_IS_VALID (entry->pts) ? entry->pts : entry->dts;
+}
+
+GstClockTime
+gst_s3_keyframe_index_get_last_time (GstS3KeyframeIndex * index)
+{
+  if (index->entries->len == 0)
+    return GST_CLOCK_TIME_NONE;
+
+  return gst_s3_keyframe_index_entry_time (&g_array_index (index->entries,
+          GstS3KeyframeIndexEntry, index->entries->len - 1));
+}
+
+/* Returns the number of entries at or before time. */
+static guint
+gst_s3_keyframe_index_count_until (GstS3KeyframeIndex * index,
+    GstClockTime time)
+{
+  guint low = 0;
+  guint high = index->entries->len;
+  guint middle;
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (gst_s3_keyframe_index_entry_time (&g_array_index (index->entries,
+                GstS3KeyframeIndexEntry, middle)) <= time)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+
+const GstS3KeyframeIndexEntry *
+gst_s3_keyframe_index_lookup (GstS3KeyframeIndex * index, GstClockTime time)
+{
+  guint count;
+
+  if (index->entries->len == 0)
+    return NULL;
+
+  count = gst_s3_keyframe_index_count_until (index, time);
+
+  return &g_array_index (index->entries, GstS3KeyframeIndexEntry,
+      count > 0 ? count - 1 : 0);
+}
+
+const GstS3KeyframeIndexEntry *
+gst_s3_keyframe_index_lookup_after (GstS3KeyframeIndex * index,
+    GstClockTime time)
+{
+  guint count = gst_s3_keyframe_index_count_until (index, time);
+
+  if (count >= index->entries->len)
+    return NULL;
+
+  return &g_array_index (index->entries, GstS3KeyframeIndexEntry, count);
+}
+
+guint8 *
+gst_s3_keyframe_index_serialize (GstS3KeyframeIndex * index, gsize * size)
+{
+  guint8 *data;
+  guint8 *ptr;
+  guint idx;
+
+  *size = HEADER_SIZE + (gsize) index->entries->len * ENTRY_SIZE;
+  data = g_malloc0 (*size);
+
+  memcpy (data, INDEX_MAGIC, 4);
+  GST_WRITE_UINT32_LE (data + 4, INDEX_VERSION);
+  GST_WRITE_UINT32_LE (data + 8, index->entries->len);
+
+  ptr = data + HEADER_SIZE;
+  for (idx = 0; idx < index->entries->len; idx++) {
+    const GstS3KeyframeIndexEntry *entry =
+        &g_array_index (index->entries, GstS3KeyframeIndexEntry, idx);
+
+    GST_WRITE_UINT64_LE (ptr, entry->pts);
+    GST_WRITE_UINT64_LE (ptr + 8, entry->dts);
+    GST_WRITE_UINT64_LE (ptr + 16, entry->offset);
+    GST_WRITE_UINT32_LE (ptr + 24, entry->part_number);
+    ptr += ENTRY_SIZE;
+  }
+
+  return data;
+}
+
+GstS3KeyframeIndex *
+gst_s3_keyframe_index_parse (const guint8 * data, gsize size)
+{
+  GstS3KeyframeIndex *index;
+  guint32 count;
+  const guint8 *ptr;
+  guint idx;
+
+  if (size < HEADER_SIZE || memcmp (data, INDEX_MAGIC, 4) != 0
+      || GST_READ_UINT32_LE (data + 4) != INDEX_VERSION)
+    return NULL;
+
+  count = GST_READ_UINT32_LE (data + 8);
+  if ((size - HEADER_SIZE) / ENTRY_SIZE < count)
+    return NULL;
+
+  index = gst_s3_keyframe_index_new ();
+  ptr = data + HEADER_SIZE;
+  for (idx = 0; idx < count; idx++) {
+    gst_s3_keyframe_index_add (index, GST_READ_UINT64_LE (ptr),
+        GST_READ_UINT64_LE (ptr + 8), GST_READ_UINT64_LE (ptr + 16),
+        GST_READ_UINT32_LE (ptr + 24));
+    ptr += ENTRY_SIZE;
+  }
+
+  return index;
+}
@@ -0,0 +1,76 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef __GST_S3_KEYFRAME_INDEX_H__
+#define __GST_S3_KEYFRAME_INDEX_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* A keyframe index maps the timestamps of the keyframes of an object to
+ * their byte offsets, so that a time seek can go straight to the right
+ * range. s3sink uploads it next to the object; s3src loads it.
+ *
+ * The serialized form is little-endian: the magic "GSKI", a 32-bit version,
+ * a 32-bit entry count and 32 reserved bits, followed by the entries in
+ * stream order, each a 64-bit PTS, DTS and offset, a 32-bit part number and
+ * 32 reserved bits. */
+
+typedef struct {
+  GstClockTime pts;
+  GstClockTime dts;
+  guint64 offset;
+  guint part_number;
+} GstS3KeyframeIndexEntry;
+
+typedef struct _GstS3KeyframeIndex GstS3KeyframeIndex;
+
+GstS3KeyframeIndex *gst_s3_keyframe_index_new (void);
+
+void gst_s3_keyframe_index_free (GstS3KeyframeIndex * index);
+
+/* Entries are expected in stream order. */
+void gst_s3_keyframe_index_add (GstS3KeyframeIndex * index, GstClockTime pts,
+    GstClockTime dts, guint64 offset, guint part_number);
+
+guint gst_s3_keyframe_index_get_size (GstS3KeyframeIndex * index);
+
+/* The timestamp of the last entry, or GST_CLOCK_TIME_NONE. */
+GstClockTime gst_s3_keyframe_index_get_last_time (GstS3KeyframeIndex * index);
+
+/* Returns the last keyframe at or before time, or the first one if time is
+ * before all of them; NULL if the index is empty. */
+const GstS3KeyframeIndexEntry *gst_s3_keyframe_index_lookup (
+    GstS3KeyframeIndex * index, GstClockTime time);
+
+/* Returns the first keyframe after time, or NULL. */
+const GstS3KeyframeIndexEntry *gst_s3_keyframe_index_lookup_after (
+    GstS3KeyframeIndex * index, GstClockTime time);
+
+/* Returns a newly allocated serialized index of size bytes. */
+guint8 *gst_s3_keyframe_index_serialize (GstS3KeyframeIndex * index,
+    gsize * size);
+
+/* Returns the index serialized in data, or NULL if it isn't one. */
+GstS3KeyframeIndex *gst_s3_keyframe_index_parse (const guint8 * data,
+    gsize size);
+
+G_END_DECLS
+
+#endif /* __GST_S3_KEYFRAME_INDEX_H__ */
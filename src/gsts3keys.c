@@ -0,0 +1,100 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#include "gsts3keys.h"
+
+#include <string.h>
+
+gchar *
+gst_s3_keys_format (const gchar * key_template, guint index,
+    GstClockTime running_time)
+{
+  GString *key = g_string_new (NULL);
+  const gchar *ptr = key_template;
+  const gchar *end;
+  gchar *name;
+
+  while (*ptr) {
+    if (*ptr != '{' || (end = strchr (ptr, '}')) == NULL) {
+      g_string_append_c (key, *ptr++);
+      continue;
+    }
+
+    name = g_strndup (ptr + 1, end - ptr - 1);
+    if (g_str_equal (name, "index")) {
+      g_string_append_printf (key, "%u", index);
+    } else if (g_str_has_prefix (name, "index:")) {
+      g_string_append_printf (key, "%0*u",
+          (gint) g_ascii_strtoull (name + strlen ("index:"), NULL, 10), index);
+    } else if (g_str_equal (name, "utc")) {
+      GDateTime *now = g_date_time_new_now_utc ();
+      gchar *formatted = g_date_time_format (now, "%Y%m%dT%H%M%SZ");
+
+      g_string_append (key, formatted);
+      g_free (formatted);
+      g_date_time_unref (now);
+    } else if (g_str_equal (name, "running-time")) {
+      g_string_append_printf (key, "%" G_GUINT64_FORMAT,
+          GST_CLOCK_TIME_IS_VALID (running_time) ? running_time / GST_MSECOND :
+          0);
+    } else {
+      g_string_append_len (key, ptr, end - ptr + 1);
+    }
+    g_free (name);
+    ptr = end + 1;
+  }
+
+  return g_string_free (key, FALSE);
+}
+
+gboolean
+gst_s3_keys_is_indexed (const gchar * key_template)
+{
+  const gchar *ptr = strstr (key_template, "{index:");
+
+  return strstr (key_template, "{index}") != NULL
+      || (ptr != NULL && strchr (ptr, '}') != NULL);
+}
+
+gboolean
+gst_s3_keys_is_timed (const gchar * key_template)
+{
+  return strstr (key_template, "{utc}") != NULL
+      || strstr (key_template, "{running-time}") != NULL;
+}
+
+gchar *
+gst_s3_keys_get_single (const gchar * location, const gchar * key)
+{
+  GstUri *uri;
+  gchar *path;
+
+  if (location == NULL || location[0] == '\0')
+    return g_strdup (key);
+
+  uri = gst_uri_from_string (location);
+  if (!uri)
+    return NULL;
+  path = g_strdup (gst_uri_get_path (uri));
+  gst_uri_unref (uri);
+
+  if (path && path[0] == '/')
+    memmove (path, path + 1, strlen (path));
+
+  return path;
+}
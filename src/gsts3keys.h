@@ -0,0 +1,50 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef __GST_S3_KEYS_H__
+#define __GST_S3_KEYS_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* Key templates name the objects of a sequence. They may hold:
+ *  - {index}, the number of the object, or {index:N}, zero-padded to N digits
+ *  - {utc}, the time the object starts, e.g. 20190101T120000Z
+ *  - {running-time}, the running time the object starts at, in milliseconds
+ * Anything else is copied as is. */
+
+/* Returns a newly allocated key for the object numbered index, which starts
+ * at running_time (GST_CLOCK_TIME_NONE if unknown). */
+gchar *gst_s3_keys_format (const gchar * key_template, guint index,
+    GstClockTime running_time);
+
+/* Whether the template holds {index} or {index:N}. */
+gboolean gst_s3_keys_is_indexed (const gchar * key_template);
+
+/* Whether the keys depend on when the object starts. */
+gboolean gst_s3_keys_is_timed (const gchar * key_template);
+
+/* Returns a newly allocated copy of the key an element reads or writes
+ * without a template: the path of location if it is set, key otherwise.
+ * Returns NULL if location isn't a URI. */
+gchar *gst_s3_keys_get_single (const gchar * location, const gchar * key);
+
+G_END_DECLS
+
+#endif /* __GST_S3_KEYS_H__ */
@@ -0,0 +1,701 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#include "gsts3multipartdownloader.hpp"
+#include "gsts3client.hpp"
+
+#include <aws/s3/model/GetObjectRequest.h>
+#include <aws/s3/model/HeadObjectRequest.h>
+#include <aws/s3/model/ListObjectsV2Request.h>
+
+#include <gst/gst.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace gst
+{
+namespace aws
+{
+namespace s3
+{
+
+static bool is_null_or_empty(const char* str)
+{
+    return str == nullptr || strcmp(str, "") == 0;
+}
+
+static const Aws::String get_bucket_from_config(const GstS3DownloaderConfig * config)
+{
+    if (is_null_or_empty(config->location)) {
+        return config->bucket;
+    } else {
+        GstUri *uri = gst_uri_from_string(config->location);
+        Aws::String bucket(gst_uri_get_host(uri));
+        gst_uri_unref(uri);
+        return bucket;
+    }
+}
+
+static const Aws::String get_key_from_config(const GstS3DownloaderConfig * config)
+{
+    if (is_null_or_empty(config->location)) {
+        return config->key;
+    } else {
+        GstUri *uri = gst_uri_from_string(config->location);
+        Aws::String path(gst_uri_get_path(uri));
+        gst_uri_unref(uri);
+
+        if (path[0] == '/') {
+            return path.substr(1);
+        } else {
+            return path;
+        }
+    }
+}
+
+static S3ClientSettings get_client_settings(const GstS3DownloaderConfig * config)
+{
+    S3ClientSettings settings;
+    settings.bucket = get_bucket_from_config(config);
+    settings.region = config->region;
+    settings.ca_file = config->ca_file;
+    settings.endpoint = config->aws_sdk_endpoint;
+    settings.use_http = config->aws_sdk_use_http;
+    settings.verify_ssl = config->aws_sdk_verify_ssl;
+    settings.max_connections = config->max_connections;
+    settings.credentials = config->credentials;
+    return settings;
+}
+
+constexpr double ReadAheadController::SMOOTHING;
+constexpr double ReadAheadController::MIN_BUSY_SECONDS;
+
+// Aws::IOStream doesn't take ownership of its stream buffer
+class BlockStream : public Aws::IOStream
+{
+public:
+    explicit BlockStream(const std::vector<GstBuffer*>& buffers) :
+        Aws::IOStream(nullptr),
+        _stream_buffer(buffers)
+    {
+        rdbuf(&_stream_buffer);
+    }
+
+    size_t finish()
+    {
+        return _stream_buffer.finish();
+    }
+
+private:
+    BlockStreamBuf _stream_buffer;
+};
+
+// The message of an error response is only known if the SDK could read its
+// body back, so the status and the exception name are given as well.
+static std::string describe_range_error(const Aws::S3::S3Error& error)
+{
+    if (error.GetResponseCode() == Aws::Http::HttpResponseCode::PRECONDITION_FAILED)
+    {
+        // the ranges are requested with If-Match
+        return "The object was replaced while it was read";
+    }
+
+    std::ostringstream description;
+    description << "HTTP " << static_cast<int>(error.GetResponseCode());
+    if (!error.GetExceptionName().empty())
+    {
+        description << " " << error.GetExceptionName();
+    }
+    if (!error.GetMessage().empty())
+    {
+        description << ": " << error.GetMessage();
+    }
+    return description.str();
+}
+
+class RangeContext : public Aws::Client::AsyncCallerContext
+{
+public:
+    RangeContext(std::shared_ptr<BlockCache> cache, guint64 first, guint64 count, size_t size,
+        std::vector<BlockBuffer> buffers) :
+        _cache(std::move(cache)),
+        _first(first),
+        _count(count),
+        _size(size),
+        _buffers(std::move(buffers))
+    {
+    }
+
+    const std::shared_ptr<BlockCache>& get_cache() const
+    {
+        return _cache;
+    }
+
+    guint64 get_first() const
+    {
+        return _first;
+    }
+
+    guint64 get_count() const
+    {
+        return _count;
+    }
+
+    size_t get_size() const
+    {
+        return _size;
+    }
+
+    // The blocks the response is written to, once it has completed.
+    std::vector<BlockBuffer> take_buffers()
+    {
+        return std::move(_buffers);
+    }
+
+private:
+    std::shared_ptr<BlockCache> _cache;
+    guint64 _first;
+    guint64 _count;
+    size_t _size;
+    std::vector<BlockBuffer> _buffers;
+};
+
+class MultipartDownloader
+{
+public:
+    static std::unique_ptr<MultipartDownloader> create(const GstS3DownloaderConfig *config)
+    {
+        auto downloader = std::unique_ptr<MultipartDownloader>(new MultipartDownloader(config));
+        if (!downloader->_init_downloader(config))
+        {
+            return nullptr;
+        }
+        return downloader;
+    }
+
+    ~MultipartDownloader();
+
+    guint64 get_size() const
+    {
+        return _size;
+    }
+
+    bool read(guint64 offset, char* buffer, size_t size, size_t& read_size);
+
+    // Reads like read(), but into a buffer sharing the memory the ranges
+    // were downloaded to. buffer is nullptr at the end of the object.
+    bool read_buffer(guint64 offset, size_t size, GstBuffer*& buffer);
+
+    void prefetch()
+    {
+        _dispatch();
+    }
+
+    void set_flushing(bool flushing)
+    {
+        _cache->set_flushing(flushing);
+    }
+
+    GstStructure* get_stats() const;
+    std::string get_error() const;
+
+private:
+    explicit MultipartDownloader(const GstS3DownloaderConfig *config);
+
+    static constexpr size_t MAX_PART_RANGE_FACTOR = 4;
+
+    bool _init_downloader(const GstS3DownloaderConfig *config);
+    size_t _get_range_size(const GstS3DownloaderConfig *config);
+
+    bool _read(guint64 offset, size_t size, size_t& read_size,
+        const std::function<void(GstBuffer*, size_t, size_t)>& consumer);
+    void _dispatch();
+
+    static void _handle_range_completed(const Aws::S3::S3Client* client, const Aws::S3::Model::GetObjectRequest&,
+        const Aws::S3::Model::GetObjectOutcome& outcome, const std::shared_ptr<const Aws::Client::AsyncCallerContext>& ctx);
+
+    Aws::String _bucket;
+    Aws::String _key;
+    Aws::String _endpoint;
+    Aws::String _etag;
+    guint64 _size = 0;
+    bool _is_region_detected = false;
+
+    std::shared_ptr<AwsApiHandle> _api_handle;
+    std::shared_ptr<Aws::Utils::Threading::Executor> _executor;
+    std::shared_ptr<Aws::S3::S3Client> _s3_client;
+    std::shared_ptr<BlockCache> _cache;
+    // recycles the memory of the blocks once downstream is done with it
+    GstBufferPool* _pool = nullptr;
+
+    mutable std::mutex _error_mtx;
+    std::string _error;
+};
+
+constexpr size_t MultipartDownloader::MAX_PART_RANGE_FACTOR;
+
+MultipartDownloader::MultipartDownloader(const GstS3DownloaderConfig *config) :
+    _bucket(get_bucket_from_config(config)),
+    _key(get_key_from_config(config)),
+    _endpoint(is_null_or_empty(config->aws_sdk_endpoint) ? "" : config->aws_sdk_endpoint),
+    _api_handle(config->init_aws_sdk ? acquire_aws_sdk() : nullptr)
+{
+}
+
+MultipartDownloader::~MultipartDownloader()
+{
+    if (_cache)
+    {
+        _cache->shutdown();
+    }
+    if (_pool)
+    {
+        // buffers still cached or shared downstream are freed once released
+        gst_buffer_pool_set_active(_pool, FALSE);
+        gst_object_unref(_pool);
+    }
+}
+
+bool MultipartDownloader::_init_downloader(const GstS3DownloaderConfig *config)
+{
+    _executor = acquire_s3_executor(0, nullptr);
+    _s3_client = acquire_s3_client(get_client_settings(config), _executor, _is_region_detected);
+    if (!_s3_client)
+    {
+        return false;
+    }
+
+    auto outcome = _s3_client->HeadObject(Aws::S3::Model::HeadObjectRequest().WithBucket(_bucket).WithKey(_key));
+    if (!outcome.IsSuccess())
+    {
+        GST_ERROR("Failed to look up %s in bucket %s: %s", _key.c_str(), _bucket.c_str(),
+            outcome.GetError().GetMessage().c_str());
+        if (_is_region_detected && is_wrong_region_error(outcome.GetError()))
+        {
+            invalidate_bucket_region(_bucket, _endpoint);
+        }
+        return false;
+    }
+    _size = outcome.GetResult().GetContentLength();
+    // every range is requested for this version of the object
+    _etag = outcome.GetResult().GetETag();
+
+    size_t range_size = _get_range_size(config);
+    _pool = new_block_pool(range_size);
+    if (!_pool)
+    {
+        GST_ERROR("Failed to set up a pool of %" G_GSIZE_FORMAT " byte blocks", range_size);
+        return false;
+    }
+
+    GST_INFO("Downloading %" G_GUINT64_FORMAT " bytes in ranges of %" G_GSIZE_FORMAT " bytes", _size, range_size);
+    _cache = std::make_shared<BlockCache>(_size, range_size, config->cache_size, config->min_read_ahead,
+        ReadAheadController(config->min_read_ahead, config->max_read_ahead));
+    return true;
+}
+
+// Ranges matching the parts of a multipart object are each served from a
+// single stored part. Parts much bigger than the configured range size would
+// hold too much memory per range, so those keep the configured size.
+size_t MultipartDownloader::_get_range_size(const GstS3DownloaderConfig *config)
+{
+    size_t range_size = std::max<size_t>(config->range_size, 1);
+    if (!config->align_to_parts)
+    {
+        return range_size;
+    }
+
+    auto outcome = _s3_client->HeadObject(Aws::S3::Model::HeadObjectRequest()
+        .WithBucket(_bucket).WithKey(_key).WithPartNumber(1));
+    if (!outcome.IsSuccess() || outcome.GetResult().GetPartsCount() <= 1)
+    {
+        return range_size;
+    }
+
+    auto part_size = static_cast<size_t>(outcome.GetResult().GetContentLength());
+    if (part_size == 0 || part_size > range_size * MAX_PART_RANGE_FACTOR)
+    {
+        return range_size;
+    }
+    return part_size;
+}
+
+bool MultipartDownloader::read(guint64 offset, char* buffer, size_t size, size_t& read_size)
+{
+    return _read(offset, size, read_size, [&](GstBuffer* block, size_t start, size_t block_size) {
+        gst_buffer_extract(block, start, buffer, block_size);
+        buffer += block_size;
+    });
+}
+
+bool MultipartDownloader::read_buffer(guint64 offset, size_t size, GstBuffer*& buffer)
+{
+    buffer = gst_buffer_new();
+    size_t read_size = 0;
+    bool ret = _read(offset, size, read_size, [&](GstBuffer* block, size_t start, size_t block_size) {
+        // shares the block's memory, nothing is copied
+        buffer = gst_buffer_append(buffer, gst_buffer_copy_region(block, GST_BUFFER_COPY_MEMORY, start, block_size));
+    });
+
+    if (!ret || read_size == 0)
+    {
+        gst_buffer_unref(buffer);
+        buffer = nullptr;
+    }
+    return ret;
+}
+
+bool MultipartDownloader::_read(guint64 offset, size_t size, size_t& read_size,
+    const std::function<void(GstBuffer*, size_t, size_t)>& consumer)
+{
+    read_size = 0;
+    while (read_size < size && offset < _size)
+    {
+        _cache->prepare(offset, size - read_size);
+        _dispatch();
+
+        size_t consumed = 0;
+        std::string error;
+        if (!_cache->consume(offset, size - read_size, consumed, error, consumer))
+        {
+            GST_WARNING("Failed to download %s at offset %" G_GUINT64_FORMAT ": %s", _key.c_str(), offset, error.c_str());
+            std::lock_guard<std::mutex> l(_error_mtx);
+            _error = std::move(error);
+            return false;
+        }
+
+        offset += consumed;
+        read_size += consumed;
+    }
+
+    // the reader moved on, keep the read-ahead full
+    _dispatch();
+    return true;
+}
+
+void MultipartDownloader::_dispatch()
+{
+    guint64 first_block;
+    guint64 block_count;
+    while (_cache->take_run_to_request(first_block, block_count))
+    {
+        guint64 first = first_block * _cache->get_block_size();
+        guint64 last = std::min(first + block_count * _cache->get_block_size(), _size) - 1;
+
+        Aws::StringStream range;
+        range << "bytes=" << first << "-" << last;
+
+        Aws::S3::Model::GetObjectRequest request;
+        request.WithBucket(_bucket)
+            .WithKey(_key)
+            .WithIfMatch(_etag)
+            .WithRange(range.str());
+
+        // the body is written straight into the blocks
+        std::vector<BlockBuffer> buffers;
+        std::vector<GstBuffer*> targets;
+        for (guint64 offset = first; offset <= last; offset += _cache->get_block_size())
+        {
+            buffers.push_back(acquire_block(_pool, std::min<guint64>(_cache->get_block_size(), last + 1 - offset)));
+            targets.push_back(buffers.back().get());
+        }
+        request.SetResponseStreamFactory([targets]() {
+            return Aws::New<BlockStream>("RangeBody", targets);
+        });
+
+        auto context = std::make_shared<RangeContext>(_cache, first_block, block_count, last - first + 1,
+            std::move(buffers));
+        _s3_client->GetObjectAsync(request, _handle_range_completed, context);
+    }
+}
+
+void MultipartDownloader::_handle_range_completed(const Aws::S3::S3Client*, const Aws::S3::Model::GetObjectRequest&,
+    const Aws::S3::Model::GetObjectOutcome& outcome, const std::shared_ptr<const Aws::Client::AsyncCallerContext>& ctx)
+{
+    // the SDK hands the context back as const, but nothing else uses it
+    auto context = std::const_pointer_cast<RangeContext>(std::static_pointer_cast<const RangeContext>(ctx));
+    auto buffers = context->take_buffers();
+    if (!outcome.IsSuccess())
+    {
+        context->get_cache()->complete_run(context->get_first(), context->get_count(), {},
+            describe_range_error(outcome.GetError()));
+        return;
+    }
+
+    // the blocks can only be read once the stream lets go of them
+    auto stream = dynamic_cast<BlockStream*>(&outcome.GetResult().GetBody());
+    if (!stream || stream->finish() != context->get_size())
+    {
+        context->get_cache()->complete_run(context->get_first(), context->get_count(), {},
+            "Range ended early");
+        return;
+    }
+
+    context->get_cache()->complete_run(context->get_first(), context->get_count(), std::move(buffers), {});
+}
+
+GstStructure* MultipartDownloader::get_stats() const
+{
+    GstStructure* stats = gst_structure_new("s3-downloader-stats",
+        "size", G_TYPE_UINT64, _size,
+        NULL);
+    _cache->fill_stats(stats);
+    return stats;
+}
+
+std::string MultipartDownloader::get_error() const
+{
+    std::lock_guard<std::mutex> l(_error_mtx);
+    return _error;
+}
+
+// Lists a page of the keys under prefix which come after start_after.
+static bool list_keys(const GstS3DownloaderConfig *config, const char* prefix, const char* start_after,
+    std::vector<Aws::String>& keys)
+{
+    auto api_handle = config->init_aws_sdk ? acquire_aws_sdk() : nullptr;
+    auto settings = get_client_settings(config);
+    bool is_region_detected = false;
+    auto client = acquire_s3_client(settings, acquire_s3_executor(0, nullptr), is_region_detected);
+    if (!client)
+    {
+        return false;
+    }
+
+    Aws::S3::Model::ListObjectsV2Request request;
+    request.WithBucket(settings.bucket).WithPrefix(prefix ? prefix : "");
+    if (!is_null_or_empty(start_after))
+    {
+        request.SetStartAfter(start_after);
+    }
+
+    auto outcome = client->ListObjectsV2(request);
+    if (!outcome.IsSuccess())
+    {
+        GST_ERROR("Failed to list %s in bucket %s: %s", prefix ? prefix : "", settings.bucket.c_str(),
+            outcome.GetError().GetMessage().c_str());
+        if (is_region_detected && is_wrong_region_error(outcome.GetError()))
+        {
+            invalidate_bucket_region(settings.bucket, is_null_or_empty(settings.endpoint) ? "" : settings.endpoint);
+        }
+        return false;
+    }
+
+    for (const auto& object : outcome.GetResult().GetContents())
+    {
+        keys.push_back(object.GetKey());
+    }
+    return true;
+}
+
+// S3 answers a HEAD request for a missing key with a bare 404.
+static bool is_missing_key_error(const Aws::S3::S3Error& error)
+{
+    return error.GetResponseCode() == Aws::Http::HttpResponseCode::NOT_FOUND
+        || error.GetErrorType() == Aws::S3::S3Errors::NO_SUCH_KEY;
+}
+
+static bool lookup_key(const GstS3DownloaderConfig *config, bool& exists)
+{
+    auto api_handle = config->init_aws_sdk ? acquire_aws_sdk() : nullptr;
+    auto settings = get_client_settings(config);
+    auto key = get_key_from_config(config);
+    bool is_region_detected = false;
+    auto client = acquire_s3_client(settings, acquire_s3_executor(0, nullptr), is_region_detected);
+    if (!client)
+    {
+        return false;
+    }
+
+    auto outcome = client->HeadObject(Aws::S3::Model::HeadObjectRequest().WithBucket(settings.bucket).WithKey(key));
+    if (outcome.IsSuccess() || is_missing_key_error(outcome.GetError()))
+    {
+        exists = outcome.IsSuccess();
+        return true;
+    }
+
+    GST_ERROR("Failed to look up %s in bucket %s: %s", key.c_str(), settings.bucket.c_str(),
+        outcome.GetError().GetMessage().c_str());
+    if (is_region_detected && is_wrong_region_error(outcome.GetError()))
+    {
+        invalidate_bucket_region(settings.bucket, is_null_or_empty(settings.endpoint) ? "" : settings.endpoint);
+    }
+    return false;
+}
+
+} // namespace s3
+} // namespace aws
+} // namespace gst
+
+#define MULTIPART_DOWNLOADER_(downloader) reinterpret_cast<GstS3MultipartDownloader*>(downloader)
+
+using gst::aws::s3::MultipartDownloader;
+
+struct _GstS3MultipartDownloader
+{
+  GstS3Downloader base;
+  std::unique_ptr<MultipartDownloader> impl;
+
+  _GstS3MultipartDownloader(std::unique_ptr<MultipartDownloader> impl);
+};
+
+static void
+gst_s3_multipart_downloader_destroy (GstS3Downloader * downloader)
+{
+  delete
+  MULTIPART_DOWNLOADER_ (downloader);
+}
+
+static guint64
+gst_s3_multipart_downloader_get_size (GstS3Downloader * downloader)
+{
+  GstS3MultipartDownloader *self = MULTIPART_DOWNLOADER_ (downloader);
+  g_return_val_if_fail (self && self->impl, 0);
+  return self->impl->get_size ();
+}
+
+static gboolean
+gst_s3_multipart_downloader_read (GstS3Downloader * downloader,
+    guint64 offset, gchar * buffer, gsize size, gsize * read_size)
+{
+  GstS3MultipartDownloader *self = MULTIPART_DOWNLOADER_ (downloader);
+  g_return_val_if_fail (self && self->impl && read_size, FALSE);
+  return self->impl->read (offset, buffer, size, *read_size);
+}
+
+static gboolean
+gst_s3_multipart_downloader_read_buffer (GstS3Downloader * downloader,
+    guint64 offset, gsize size, GstBuffer ** buffer)
+{
+  GstS3MultipartDownloader *self = MULTIPART_DOWNLOADER_ (downloader);
+  g_return_val_if_fail (self && self->impl && buffer, FALSE);
+  return self->impl->read_buffer (offset, size, *buffer);
+}
+
+static GstStructure *
+gst_s3_multipart_downloader_get_stats (GstS3Downloader * downloader)
+{
+  GstS3MultipartDownloader *self = MULTIPART_DOWNLOADER_ (downloader);
+  g_return_val_if_fail (self && self->impl, NULL);
+  return self->impl->get_stats ();
+}
+
+static gchar *
+gst_s3_multipart_downloader_get_error (GstS3Downloader * downloader)
+{
+  GstS3MultipartDownloader *self = MULTIPART_DOWNLOADER_ (downloader);
+  g_return_val_if_fail (self && self->impl, NULL);
+  auto error = self->impl->get_error ();
+  return error.empty () ? NULL : g_strdup (error.c_str ());
+}
+
+static void
+gst_s3_multipart_downloader_prefetch (GstS3Downloader * downloader)
+{
+  GstS3MultipartDownloader *self = MULTIPART_DOWNLOADER_ (downloader);
+  g_return_if_fail (self && self->impl);
+  self->impl->prefetch ();
+}
+
+static void
+gst_s3_multipart_downloader_set_flushing (GstS3Downloader * downloader,
+    gboolean flushing)
+{
+  GstS3MultipartDownloader *self = MULTIPART_DOWNLOADER_ (downloader);
+  g_return_if_fail (self && self->impl);
+  self->impl->set_flushing (flushing);
+}
+
+static GstS3DownloaderClass default_class = {
+  gst_s3_multipart_downloader_destroy,
+  gst_s3_multipart_downloader_get_size,
+  gst_s3_multipart_downloader_read,
+  gst_s3_multipart_downloader_get_stats,
+  gst_s3_multipart_downloader_get_error,
+  gst_s3_multipart_downloader_prefetch,
+  gst_s3_multipart_downloader_read_buffer,
+  gst_s3_multipart_downloader_set_flushing
+};
+
+GstS3Downloader *
+gst_s3_multipart_downloader_new (const GstS3DownloaderConfig * config)
+{
+  g_return_val_if_fail (config, NULL);
+
+  auto impl = MultipartDownloader::create(config);
+
+  if (!impl)
+  {
+    return NULL;
+  }
+
+  return reinterpret_cast < GstS3Downloader * >(new GstS3MultipartDownloader (std::move (impl)));
+}
+
+_GstS3MultipartDownloader::_GstS3MultipartDownloader(std::unique_ptr<MultipartDownloader> impl) :
+    impl(std::move(impl))
+{
+  base.klass = &default_class;
+}
+
+gchar **
+gst_s3_multipart_downloader_list_keys (const GstS3DownloaderConfig * config,
+    const gchar * prefix, const gchar * start_after)
+{
+  g_return_val_if_fail (config, NULL);
+
+  std::vector<Aws::String> keys;
+  if (!gst::aws::s3::list_keys (config, prefix, start_after, keys))
+  {
+    return NULL;
+  }
+
+  gchar **page = g_new0 (gchar *, keys.size () + 1);
+  for (size_t idx = 0; idx < keys.size (); idx++)
+  {
+    page[idx] = g_strdup (keys[idx].c_str ());
+  }
+  return page;
+}
+
+gboolean
+gst_s3_multipart_downloader_lookup_key (const GstS3DownloaderConfig * config,
+    gboolean * exists)
+{
+  g_return_val_if_fail (config && exists, FALSE);
+
+  bool found = false;
+  if (!gst::aws::s3::lookup_key (config, found))
+  {
+    return FALSE;
+  }
+
+  *exists = found;
+  return TRUE;
+}
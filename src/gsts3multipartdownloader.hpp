@@ -0,0 +1,758 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef __GST_S3_MULTIPART_DOWNLOADER_HPP__
+#define __GST_S3_MULTIPART_DOWNLOADER_HPP__
+
+#include "gsts3multipartdownloader.h"
+
+#include <gst/gst.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#define GST_CAT_DEFAULT gst_s3_src_debug
+
+// Building blocks of the multipart downloader, shared with its unit tests.
+namespace gst
+{
+namespace aws
+{
+namespace s3
+{
+
+// Picks how many ranges are requested ahead of the reader. Keeping the
+// reader fed takes as many ranges in flight as it consumes while a range is
+// on its way (Little's law). The reader's rate is measured over the time it
+// spends away from read(), so a reader starved by the network still asks
+// for a deeper window. The window grows right away and shrinks a range at a
+// time.
+class ReadAheadController
+{
+public:
+    ReadAheadController(size_t min_depth, size_t max_depth) :
+        _min_depth(std::max<size_t>(min_depth, 1)),
+        _max_depth(std::max(max_depth, _min_depth)),
+        _depth(_min_depth)
+    {
+    }
+
+    size_t get_depth() const
+    {
+        return _depth;
+    }
+
+    void on_range_fetched(std::chrono::steady_clock::duration latency)
+    {
+        double seconds = std::chrono::duration<double>(latency).count();
+        _mean_latency = _mean_latency == 0 ? seconds :
+            (1 - SMOOTHING) * _mean_latency + SMOOTHING * seconds;
+    }
+
+    // busy: time the reader spent away from read() while consuming the range
+    void on_range_consumed(size_t size, std::chrono::steady_clock::duration busy)
+    {
+        double seconds = std::max(std::chrono::duration<double>(busy).count(), MIN_BUSY_SECONDS);
+        double rate = size / seconds;
+        _mean_rate = _mean_rate == 0 ? rate : (1 - SMOOTHING) * _mean_rate + SMOOTHING * rate;
+
+        if (_mean_latency == 0)
+        {
+            return;
+        }
+
+        double in_flight = _mean_rate * _mean_latency / size;
+        size_t needed = std::min(_max_depth, std::max(_min_depth, static_cast<size_t>(std::ceil(in_flight)) + 1));
+        if (needed > _depth)
+        {
+            GST_DEBUG("Reader consumes %.0f B/s, read-ahead: %" G_GSIZE_FORMAT " ranges", _mean_rate, needed);
+            _depth = needed;
+        }
+        else if (needed < _depth)
+        {
+            _depth--;
+        }
+    }
+
+private:
+    static constexpr double SMOOTHING = 0.25;
+    static constexpr double MIN_BUSY_SECONDS = 1e-6;
+
+    size_t _min_depth;
+    size_t _max_depth;
+    size_t _depth;
+    double _mean_latency = 0;
+    double _mean_rate = 0;
+};
+
+struct GstBufferDeleter
+{
+    void operator()(GstBuffer* buffer) const
+    {
+        gst_buffer_unref(buffer);
+    }
+};
+
+using BlockBuffer = std::unique_ptr<GstBuffer, GstBufferDeleter>;
+
+// Returns an active pool of block_size byte buffers, or nullptr. A buffer
+// whose memory is still shared downstream when it is released isn't
+// writable, so the pool drops it rather than hand that memory out again.
+inline GstBufferPool* new_block_pool(size_t block_size)
+{
+    GstBufferPool* pool = gst_buffer_pool_new();
+    GstStructure* config = gst_buffer_pool_get_config(pool);
+    gst_buffer_pool_config_set_params(config, nullptr, block_size, 0, 0);
+    if (!gst_buffer_pool_set_config(pool, config) || !gst_buffer_pool_set_active(pool, TRUE))
+    {
+        gst_object_unref(pool);
+        return nullptr;
+    }
+    return pool;
+}
+
+inline BlockBuffer acquire_block(GstBufferPool* pool, size_t size)
+{
+    GstBuffer* buffer = nullptr;
+    if (gst_buffer_pool_acquire_buffer(pool, &buffer, nullptr) != GST_FLOW_OK)
+    {
+        buffer = gst_buffer_new_allocate(nullptr, size, nullptr);
+    }
+    // the last block of the object is shorter, the pool resets its size
+    gst_buffer_set_size(buffer, size);
+    return BlockBuffer(buffer);
+}
+
+// Stream buffer over the memories of the blocks of a run, so that the SDK
+// writes the body of a ranged GET straight into them. What has been written
+// can be read back, as the SDK does to parse the body of an error response.
+class BlockStreamBuf : public std::streambuf
+{
+public:
+    explicit BlockStreamBuf(const std::vector<GstBuffer*>& buffers)
+    {
+        for (auto buffer : buffers)
+        {
+            Map map = { buffer, GST_MAP_INFO_INIT };
+            if (!gst_buffer_map(buffer, &map.info, GST_MAP_WRITE))
+            {
+                // nothing past this can be written, the run comes out short
+                break;
+            }
+            _maps.push_back(map);
+        }
+        _set_map(0);
+    }
+
+    ~BlockStreamBuf() override
+    {
+        finish();
+    }
+
+    // Unmaps the blocks and returns the number of bytes written to them.
+    size_t finish()
+    {
+        _written = _get_written();
+        setp(nullptr, nullptr);
+        setg(nullptr, nullptr, nullptr);
+        for (auto& map : _maps)
+        {
+            gst_buffer_unmap(map.buffer, &map.info);
+        }
+        _maps.clear();
+        return _written;
+    }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+            return traits_type::not_eof(ch);
+        }
+        if (!_next_map())
+        {
+            return traits_type::eof();
+        }
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+        return ch;
+    }
+
+    std::streamsize xsputn(const char* data, std::streamsize size) override
+    {
+        std::streamsize put = 0;
+        while (put < size && _next_map())
+        {
+            auto chunk = std::min<std::streamsize>(size - put, epptr() - pptr());
+            memcpy(pptr(), data + put, chunk);
+            pbump(static_cast<int>(chunk));
+            put += chunk;
+        }
+        return put;
+    }
+
+    int_type underflow() override
+    {
+        size_t start = gptr() ? gptr() - eback() : 0;
+        // a block read to its end is left once the next one is written to
+        while (_read_map < _current && _read_map + 1 < _maps.size() && start == _maps[_read_map].info.size)
+        {
+            _read_map++;
+            start = 0;
+        }
+
+        // the block being written may have grown since it was read
+        if (_read_map >= _maps.size() || start >= _get_written(_read_map))
+        {
+            return traits_type::eof();
+        }
+        char* data = _get_data(_read_map);
+        setg(data, data + start, data + _get_written(_read_map));
+        return traits_type::to_int_type(*gptr());
+    }
+
+    // Reading can start over anywhere in what has been written; writing
+    // only tells its position.
+    pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) override
+    {
+        if (which == std::ios_base::out)
+        {
+            if (direction != std::ios_base::cur || offset != 0)
+            {
+                return pos_type(off_type(-1));
+            }
+            return pos_type(off_type(_get_written()));
+        }
+
+        off_type position = offset;
+        if (direction == std::ios_base::cur)
+        {
+            position += gptr() ? _get_offset(_read_map) + (gptr() - eback()) : 0;
+        }
+        else if (direction == std::ios_base::end)
+        {
+            position += _get_written();
+        }
+        return seekpos(pos_type(position), which);
+    }
+
+    pos_type seekpos(pos_type position, std::ios_base::openmode which) override
+    {
+        off_type offset = position;
+        if (which != std::ios_base::in || offset < 0 || static_cast<size_t>(offset) > _get_written())
+        {
+            return pos_type(off_type(-1));
+        }
+
+        _read_map = 0;
+        while (_read_map + 1 < _maps.size() && static_cast<size_t>(offset) >= _get_offset(_read_map + 1))
+        {
+            _read_map++;
+        }
+        if (_read_map < _maps.size())
+        {
+            char* data = _get_data(_read_map);
+            setg(data, data + (offset - _get_offset(_read_map)), data + _get_written(_read_map));
+        }
+        return position;
+    }
+
+private:
+    struct Map
+    {
+        GstBuffer* buffer;
+        GstMapInfo info;
+    };
+
+    // Makes sure there is room to write, moving to the next block once the
+    // current one is full.
+    bool _next_map()
+    {
+        while (pptr() == epptr())
+        {
+            if (_current + 1 >= _maps.size())
+            {
+                return false;
+            }
+            _written += pptr() - pbase();
+            _set_map(_current + 1);
+        }
+        return true;
+    }
+
+    void _set_map(size_t index)
+    {
+        _current = index;
+        if (index >= _maps.size())
+        {
+            setp(nullptr, nullptr);
+            return;
+        }
+        char* data = _get_data(index);
+        setp(data, data + _maps[index].info.size);
+    }
+
+    char* _get_data(size_t index) const
+    {
+        return reinterpret_cast<char*>(_maps[index].info.data);
+    }
+
+    // offset of the block in the run; the blocks before the one being
+    // written are full
+    size_t _get_offset(size_t index) const
+    {
+        size_t offset = 0;
+        for (size_t i = 0; i < index && i < _maps.size(); i++)
+        {
+            offset += _maps[i].info.size;
+        }
+        return offset;
+    }
+
+    size_t _get_written() const
+    {
+        return _written + (pbase() ? pptr() - pbase() : 0);
+    }
+
+    size_t _get_written(size_t index) const
+    {
+        if (index < _current)
+        {
+            return _maps[index].info.size;
+        }
+        return index == _current && pbase() ? pptr() - pbase() : 0;
+    }
+
+    std::vector<Map> _maps;
+    size_t _current = 0;
+    size_t _written = 0;
+    size_t _read_map = 0;
+};
+
+// A block of the object: range_size bytes at a multiple of range_size, held
+// in a buffer of the downloader's pool.
+struct BlockState
+{
+    enum class Status { PENDING, DONE, FAILED };
+
+    Status status = Status::PENDING;
+    BlockBuffer buffer;
+    size_t size = 0;
+    // bytes allocated for the buffer, which may be more than its size
+    gsize memory = 0;
+    std::string error;
+    std::chrono::steady_clock::time_point requested_at;
+    std::list<guint64>::iterator lru_position;
+    bool is_in_lru = false;
+};
+
+// The blocks fetched so far, kept in memory up to a size cap and evicted
+// least recently used first, plus the read-ahead of the sequential reader.
+// The cap covers the memory allocated for the cached blocks and for the
+// blocks in flight, whose buffers are taken when they are requested.
+//
+// Reading through the blocks in order keeps up to the read-ahead depth of
+// them in flight, a GET each, so that they arrive in parallel. A read
+// which misses the cache away from the read-ahead restarts it there: the
+// missing blocks the read covers, and the next ones up to min-read-ahead,
+// are fetched by a single GET, which is what a demuxer jumping around in
+// pull mode needs. Blocks which are read again (e.g. an index at the end
+// of the file) are served from memory.
+class BlockCache
+{
+public:
+    BlockCache(guint64 object_size, size_t block_size, guint64 max_size, size_t coalesce_blocks,
+        ReadAheadController controller) :
+        _block_size(block_size),
+        _block_count((object_size + block_size - 1) / block_size),
+        _max_size(max_size),
+        _coalesce_blocks(std::max<size_t>(coalesce_blocks, 1)),
+        _controller(controller)
+    {
+    }
+
+    guint64 get_block_size() const
+    {
+        return _block_size;
+    }
+
+    // Makes sure the blocks holding [offset, offset + size) are fetched,
+    // moving the read-ahead there if they aren't cached.
+    void prepare(guint64 offset, size_t size)
+    {
+        guint64 index = offset / _block_size;
+        std::lock_guard<std::mutex> l(_mtx);
+        if (index >= _read_block && index <= _next_block)
+        {
+            // sequential
+            _read_block = index;
+            return;
+        }
+
+        auto it = _blocks.find(index);
+        if (it != _blocks.end() && it->second.status != BlockState::Status::FAILED)
+        {
+            _cache_hits++;
+            return;
+        }
+
+        GST_DEBUG("Read-ahead moved to block %" G_GUINT64_FORMAT, index);
+        _cache_misses++;
+        _read_block = index;
+        _next_block = index;
+        _drop_failed();
+        _pending_run = std::max<guint64>(_coalesce_blocks, (offset % _block_size + size + _block_size - 1) / _block_size);
+        _busy = std::chrono::steady_clock::duration::zero();
+        _last_read = std::chrono::steady_clock::time_point();
+    }
+
+    // Hands out the next run of blocks to request with a single GET, if the
+    // read-ahead has room for it.
+    bool take_run_to_request(guint64& first, guint64& count)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        while (_next_block < _block_count && _is_requested(_next_block))
+        {
+            _next_block++;
+        }
+
+        size_t depth = std::max<size_t>(_controller.get_depth(), _pending_run);
+        if (_is_shut_down || _next_block >= _block_count || _next_block >= _read_block + depth)
+        {
+            return false;
+        }
+
+        first = _next_block;
+        count = 1;
+        while (count < _pending_run && first + count < _block_count && !_is_requested(first + count))
+        {
+            count++;
+        }
+        _pending_run = 1;
+
+        auto now = std::chrono::steady_clock::now();
+        for (guint64 index = first; index < first + count; index++)
+        {
+            auto& block = _blocks[index];
+            _unlink(block);
+            block = BlockState();
+            block.requested_at = now;
+        }
+        _next_block = first + count;
+        _in_flight++;
+        _in_flight_memory += count * _block_size;
+        return true;
+    }
+
+    // Hands over the buffers of the blocks of a run, in order.
+    void complete_run(guint64 first, guint64 count, std::vector<BlockBuffer> buffers, std::string error)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        _in_flight--;
+        _in_flight_memory -= count * _block_size;
+
+        if (error.empty())
+        {
+            _fetched_ranges++;
+            for (const auto& buffer : buffers)
+            {
+                _fetched_bytes += gst_buffer_get_size(buffer.get());
+            }
+        }
+
+        for (guint64 index = first; index < first + count; index++)
+        {
+            auto it = _blocks.find(index);
+            if (it == _blocks.end() || it->second.status != BlockState::Status::PENDING)
+            {
+                continue;
+            }
+
+            auto& block = it->second;
+            if (!error.empty())
+            {
+                block.status = BlockState::Status::FAILED;
+                block.error = error;
+                continue;
+            }
+
+            if (index == first)
+            {
+                _controller.on_range_fetched(std::chrono::steady_clock::now() - block.requested_at);
+            }
+            block.status = BlockState::Status::DONE;
+            block.buffer = std::move(buffers[index - first]);
+            block.size = gst_buffer_get_sizes(block.buffer.get(), nullptr, &block.memory);
+            _touch(index, block);
+        }
+
+        if (error.empty())
+        {
+            _evict();
+        }
+        else
+        {
+            _drop_failed();
+        }
+        _block_cv.notify_all();
+    }
+
+    // Hands what the block holding offset has from there on, up to size
+    // bytes, to consume(block buffer, start, size) once it has arrived;
+    // nothing if it has been evicted since it was prepared. Returns false
+    // (with the reason in error) if it couldn't be fetched.
+    bool consume(guint64 offset, size_t size, size_t& consumed, std::string& error,
+        const std::function<void(GstBuffer*, size_t, size_t)>& consumer)
+    {
+        guint64 index = offset / _block_size;
+        std::unique_lock<std::mutex> lk(_mtx);
+
+        auto now = std::chrono::steady_clock::now();
+        if (_last_read != std::chrono::steady_clock::time_point())
+        {
+            _busy += now - _last_read;
+        }
+
+        auto it = _blocks.find(index);
+        if (it == _blocks.end())
+        {
+            // evicted since it was prepared, the next prepare fetches it again
+            consumed = 0;
+            return true;
+        }
+
+        if (it->second.status == BlockState::Status::PENDING)
+        {
+            _waits++;
+            // a block away from the read-ahead may be dropped or evicted as
+            // soon as its run completes, so it is looked up again
+            _block_cv.wait(lk, [&] {
+                it = _blocks.find(index);
+                return _is_shut_down || _is_flushing || it == _blocks.end()
+                    || it->second.status != BlockState::Status::PENDING;
+            });
+            _wait_time += std::chrono::steady_clock::now() - now;
+        }
+        _last_read = std::chrono::steady_clock::now();
+
+        if (it == _blocks.end())
+        {
+            consumed = 0;
+            return true;
+        }
+
+        auto& block = it->second;
+
+        if (block.status == BlockState::Status::PENDING && !_is_shut_down)
+        {
+            // still on its way, the read after flushing picks it up
+            error = "Download was interrupted";
+            return false;
+        }
+
+        if (block.status != BlockState::Status::DONE)
+        {
+            error = block.status == BlockState::Status::FAILED ? block.error : "Download was stopped";
+            // the next read fetches it again
+            _unlink(block);
+            _blocks.erase(it);
+            if (_is_in_read_ahead(index))
+            {
+                _next_block = index;
+            }
+            return false;
+        }
+
+        size_t start = offset - index * _block_size;
+        consumed = std::min(size, block.size - start);
+        consumer(block.buffer.get(), start, consumed);
+        _touch(index, block);
+
+        if (start + consumed == block.size && _is_in_read_ahead(index))
+        {
+            _controller.on_range_consumed(block.size, _busy);
+            _busy = std::chrono::steady_clock::duration::zero();
+            _read_block = index + 1;
+            _evict();
+        }
+        return true;
+    }
+
+    // While flushing, a read waiting for a block gives up right away.
+    void set_flushing(bool flushing)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        _is_flushing = flushing;
+        _block_cv.notify_all();
+    }
+
+    // Unblocks the reader and waits for the requests in flight.
+    void shutdown()
+    {
+        std::unique_lock<std::mutex> lk(_mtx);
+        _is_shut_down = true;
+        _block_cv.notify_all();
+        _block_cv.wait(lk, [this] { return _in_flight == 0; });
+    }
+
+    void fill_stats(GstStructure* stats) const
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        gst_structure_set(stats,
+            "range-size", G_TYPE_UINT64, _block_size,
+            "read-ahead", G_TYPE_UINT, static_cast<guint>(_controller.get_depth()),
+            "fetched-ranges", G_TYPE_UINT64, _fetched_ranges,
+            "fetched-bytes", G_TYPE_UINT64, _fetched_bytes,
+            "cached-bytes", G_TYPE_UINT64, _cached_size,
+            "cached-ranges", G_TYPE_UINT, static_cast<guint>(_blocks.size()),
+            "cache-hits", G_TYPE_UINT64, _cache_hits,
+            "cache-misses", G_TYPE_UINT64, _cache_misses,
+            "read-waits", G_TYPE_UINT64, _waits,
+            "wait-time", G_TYPE_UINT64, static_cast<guint64>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(_wait_time).count()),
+            NULL);
+    }
+
+private:
+    bool _is_requested(guint64 index) const
+    {
+        auto it = _blocks.find(index);
+        return it != _blocks.end() && it->second.status != BlockState::Status::FAILED;
+    }
+
+    // Marks a fetched block as the most recently used one.
+    void _touch(guint64 index, BlockState& block)
+    {
+        if (block.is_in_lru)
+        {
+            _lru.splice(_lru.begin(), _lru, block.lru_position);
+            return;
+        }
+        _lru.push_front(index);
+        block.lru_position = _lru.begin();
+        block.is_in_lru = true;
+        _cached_size += block.memory;
+    }
+
+    void _unlink(BlockState& block)
+    {
+        if (block.is_in_lru)
+        {
+            _lru.erase(block.lru_position);
+            block.is_in_lru = false;
+            _cached_size -= block.memory;
+        }
+    }
+
+    bool _is_in_read_ahead(guint64 index) const
+    {
+        return index >= _read_block && index < _next_block;
+    }
+
+    // Forgets the blocks which failed away from the read-ahead; the ones
+    // in it stay until the reader gets to them and reports the error.
+    void _drop_failed()
+    {
+        for (auto it = _blocks.begin(); it != _blocks.end();)
+        {
+            if (it->second.status == BlockState::Status::FAILED && !_is_in_read_ahead(it->first))
+            {
+                it = _blocks.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    // Drops the least recently used blocks over the size cap, but not the
+    // ones the reader is about to get to.
+    void _evict()
+    {
+        auto it = _lru.end();
+        while (_cached_size + _in_flight_memory > _max_size && it != _lru.begin())
+        {
+            --it;
+            guint64 index = *it;
+            if (_is_in_read_ahead(index))
+            {
+                continue;
+            }
+
+            auto block = _blocks.find(index);
+            it = _lru.erase(it);
+            block->second.is_in_lru = false;
+            _cached_size -= block->second.memory;
+            _blocks.erase(block);
+        }
+    }
+
+    mutable std::mutex _mtx;
+    std::condition_variable _block_cv;
+
+    guint64 _block_size;
+    guint64 _block_count;
+    guint64 _max_size;
+    size_t _coalesce_blocks;
+    ReadAheadController _controller;
+
+    std::map<guint64, BlockState> _blocks;
+    // fetched blocks, most recently used first
+    std::list<guint64> _lru;
+    // memory of the fetched blocks
+    guint64 _cached_size = 0;
+    // memory of the blocks on their way
+    guint64 _in_flight_memory = 0;
+
+    guint64 _read_block = 0;
+    guint64 _next_block = 0;
+    // blocks the next GET covers, if missing
+    size_t _pending_run = 1;
+    size_t _in_flight = 0;
+    bool _is_shut_down = false;
+    bool _is_flushing = false;
+
+    std::chrono::steady_clock::time_point _last_read;
+    std::chrono::steady_clock::duration _busy = std::chrono::steady_clock::duration::zero();
+
+    guint64 _fetched_ranges = 0;
+    guint64 _fetched_bytes = 0;
+    guint64 _cache_hits = 0;
+    guint64 _cache_misses = 0;
+    guint64 _waits = 0;
+    std::chrono::steady_clock::duration _wait_time = std::chrono::steady_clock::duration::zero();
+};
+
+} // namespace s3
+} // namespace aws
+} // namespace gst
+
+#endif /* __GST_S3_MULTIPART_DOWNLOADER_HPP__ */
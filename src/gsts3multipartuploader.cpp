@@ -17,7 +17,8 @@
  * Boston, MA 02110-1301, USA.
  */
 
-#include "gsts3multipartuploader.h"
+#include "gsts3multipartuploader.hpp"
+#include "gsts3client.hpp"
 
 #include "gstawscredentials.hpp"
 
@@ -25,14 +26,22 @@
 #include <aws/core/auth/AWSCredentials.h>
 #include <aws/core/auth/AWSCredentialsProviderChain.h>
 #include <aws/core/utils/HashingUtils.h>
+#include <aws/core/utils/crypto/Factories.h>
+#include <aws/core/utils/crypto/Hash.h>
+#include <aws/core/utils/crypto/HashResult.h>
 #include <aws/core/utils/logging/AWSLogging.h>
 #include <aws/core/utils/logging/LogSystemInterface.h>
-#include <aws/core/utils/ResourceManager.h>
 #include <aws/core/utils/stream/PreallocatedStreamBuf.h>
+#include <aws/core/utils/threading/Executor.h>
+#include <aws/core/utils/StringUtils.h>
+#include <aws/crt/crypto/Hash.h>
+#include <aws/s3/model/AbortMultipartUploadRequest.h>
 #include <aws/s3/model/CompleteMultipartUploadRequest.h>
 #include <aws/s3/model/CreateMultipartUploadRequest.h>
 #include <aws/s3/model/GetBucketLocationRequest.h>
 #include <aws/s3/model/GetBucketLocationResult.h>
+#include <aws/s3/model/ListPartsRequest.h>
+#include <aws/s3/model/PutObjectRequest.h>
 #include <aws/s3/model/UploadPartRequest.h>
 #include <aws/s3/S3Client.h>
 #include <aws/s3/S3ClientConfiguration.h>
@@ -40,6 +49,26 @@
 #include <aws/sts/STSClient.h>
 
 #include <gst/gst.h>
+#include <glib/gstdio.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 namespace gst
 {
@@ -113,35 +142,339 @@ private:
     }
 };
 
+class AwsApiHandle;
+
+// Keeps the SDK initialized for a while after the last uploader is gone, so
+// that pipelines which are restarted often don't pay for InitAPI every time.
+// It's never destroyed: a kept SDK is left to the end of the process rather
+// than shut down among the static destructors. Its thread only wakes up when
+// a kept SDK is due to be shut down.
+class AwsApiKeeper
+{
+public:
+    static AwsApiKeeper& get_instance()
+    {
+        static auto instance = new AwsApiKeeper();
+        return *instance;
+    }
+
+    // seconds: 0 to shut the SDK down as soon as it's unused, -1 to never do it
+    void set_idle_timeout(gint seconds)
+    {
+        // shutting the SDK down takes a while and takes the SDK lock, so
+        // handles are always dropped without the keeper's lock held
+        std::shared_ptr<AwsApiHandle> dropped;
+        {
+            std::lock_guard<std::mutex> l(_mtx);
+            _idle_timeout = seconds;
+            if (_idle_timeout == 0)
+            {
+                dropped = std::move(_handle);
+            }
+            else if (_idle_timeout > 0 && !_is_running)
+            {
+                _is_running = true;
+                std::thread(&AwsApiKeeper::_run, this).detach();
+            }
+        }
+        _check_cv.notify_all();
+    }
+
+    // Takes over the SDK once nobody uses it any more.
+    void keep(std::shared_ptr<AwsApiHandle> handle)
+    {
+        {
+            std::lock_guard<std::mutex> l(_mtx);
+            if (_idle_timeout != 0)
+            {
+                std::swap(_handle, handle);
+                _idle_since = std::chrono::steady_clock::now();
+            }
+        }
+        _check_cv.notify_all();
+    }
+
+    // Hands the kept SDK back to a new user.
+    std::shared_ptr<AwsApiHandle> take()
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        return std::move(_handle);
+    }
+
+private:
+    AwsApiKeeper() = default;
+
+    void _run()
+    {
+        std::unique_lock<std::mutex> lk(_mtx);
+
+        while (true)
+        {
+            if (!_handle || _idle_timeout <= 0)
+            {
+                _check_cv.wait(lk);
+                continue;
+            }
+
+            auto deadline = _idle_since + std::chrono::seconds(_idle_timeout);
+            if (std::chrono::steady_clock::now() < deadline)
+            {
+                _check_cv.wait_until(lk, deadline);
+                continue;
+            }
+
+            auto handle = std::move(_handle);
+            lk.unlock();
+            handle.reset();
+            lk.lock();
+        }
+    }
+
+    std::mutex _mtx;
+    std::condition_variable _check_cv;
+    std::shared_ptr<AwsApiHandle> _handle;
+    std::chrono::steady_clock::time_point _idle_since;
+    gint _idle_timeout = 0;
+    bool _is_running = false;
+};
+
+// Keeps the SDK initialized while held. InitAPI and ShutdownAPI both run
+// under the same lock, so a handle requested while the SDK is being shut
+// down waits for the shutdown to finish and then initializes it again.
+// There are two kinds of references: the ones handed out, and the one they
+// share with the keeper, which finally shuts the SDK down.
 class AwsApiHandle
 {
     public:
         static std::shared_ptr<AwsApiHandle> GetHandle() {
-            static std::weak_ptr<AwsApiHandle> instance;
-            if (auto ptr = instance.lock()) {
-                return ptr;
+            auto& state = _get_state();
+            std::lock_guard<std::mutex> l(state.mtx);
+            if (auto handle = state.handle.lock()) {
+                return handle;
             }
 
-            std::shared_ptr<AwsApiHandle> ptr(new AwsApiHandle());
-            instance = ptr;
-            return ptr;
-        }
+            auto sdk = AwsApiKeeper::get_instance().take();
+            if (!sdk) {
+                // still alive if its last user is just handing it over
+                sdk = state.sdk.lock();
+            }
+            if (!sdk) {
+                if (!state.is_initialized) {
+                    Aws::Utils::Logging::InitializeAWSLogging(std::make_shared<Logger>());
+                    Aws::InitAPI(Aws::SDKOptions {});
+                    state.is_initialized = true;
+                }
+                sdk = std::shared_ptr<AwsApiHandle>(new AwsApiHandle(), _release);
+                state.sdk = sdk;
+            }
 
-        virtual ~AwsApiHandle() {
-            Aws::ShutdownAPI(Aws::SDKOptions {});
-            Aws::Utils::Logging::ShutdownAWSLogging();
+            std::shared_ptr<AwsApiHandle> handle(sdk.get(), [sdk](AwsApiHandle*) mutable {
+                // moved out, the deleter itself lives as long as weak references
+                AwsApiKeeper::get_instance().keep(std::move(sdk));
+            });
+            state.handle = handle;
+            return handle;
         }
 
-    protected:
-        AwsApiHandle() {
-            Aws::Utils::Logging::InitializeAWSLogging(std::make_shared<Logger>());
-            Aws::SDKOptions options;
-            Aws::InitAPI(options);
+        // Makes the SDK take the SHA-256 of a PartStream from the stream
+        // rather than reading the part again. The factory is process-wide,
+        // so it's only installed once an uploader asks for it; whatever else
+        // the SDK hashes gets the same digests as before. S3 clients created
+        // earlier keep hashing the parts themselves.
+        void hash_part_streams() {
+            auto& state = _get_state();
+            std::lock_guard<std::mutex> l(state.mtx);
+            if (!state.is_part_stream_sha256_installed) {
+                Aws::Utils::Crypto::SetSha256Factory(std::make_shared<PartStreamSha256Factory>());
+                state.is_part_stream_sha256_installed = true;
+            }
         }
 
     private:
+        struct State
+        {
+            std::mutex mtx;
+            std::weak_ptr<AwsApiHandle> handle;
+            std::weak_ptr<AwsApiHandle> sdk;
+            bool is_initialized = false;
+            bool is_part_stream_sha256_installed = false;
+        };
+
+        AwsApiHandle() = default;
         AwsApiHandle(const AwsApiHandle&) = delete;
         AwsApiHandle& operator=(const AwsApiHandle&) = delete;
+
+        static State& _get_state() {
+            // never destroyed, like the keeper
+            static auto state = new State();
+            return *state;
+        }
+
+        static void _release(AwsApiHandle* sdk) {
+            auto& state = _get_state();
+            std::lock_guard<std::mutex> l(state.mtx);
+            delete sdk;
+            // unless a new user took over in the meantime
+            if (state.sdk.expired() && state.is_initialized) {
+                Aws::ShutdownAPI(Aws::SDKOptions {});
+                Aws::Utils::Logging::ShutdownAWSLogging();
+                state.is_initialized = false;
+                state.is_part_stream_sha256_installed = false;
+            }
+        }
+};
+
+// Regions of the buckets looked up by this process, so that only the first
+// uploader writing to a bucket pays for the GetBucketLocation round trip.
+class BucketRegionCache
+{
+public:
+    static BucketRegionCache& get_instance()
+    {
+        static BucketRegionCache instance;
+        return instance;
+    }
+
+    bool lookup(const Aws::String& bucket, const Aws::String& endpoint, Aws::String& region)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+
+        auto it = _regions.find(std::make_pair(bucket, endpoint));
+        if (it == _regions.end())
+        {
+            return false;
+        }
+        if (std::chrono::steady_clock::now() - it->second.second > TTL)
+        {
+            _regions.erase(it);
+            return false;
+        }
+
+        region = it->second.first;
+        return true;
+    }
+
+    void store(const Aws::String& bucket, const Aws::String& endpoint, const Aws::String& region)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        _regions[std::make_pair(bucket, endpoint)] = std::make_pair(region, std::chrono::steady_clock::now());
+    }
+
+    void invalidate(const Aws::String& bucket, const Aws::String& endpoint)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        _regions.erase(std::make_pair(bucket, endpoint));
+    }
+
+private:
+    BucketRegionCache() = default;
+
+    static constexpr std::chrono::hours TTL{1};
+
+    using Key = std::pair<Aws::String, Aws::String>;
+    using Entry = std::pair<Aws::String, std::chrono::steady_clock::time_point>;
+
+    std::mutex _mtx;
+    std::map<Key, Entry> _regions;
+};
+
+constexpr std::chrono::hours BucketRegionCache::TTL;
+
+// S3 answers with a 301 when a bucket is addressed in the wrong region
+bool is_wrong_region_error(const Aws::S3::S3Error& error)
+{
+    return error.GetResponseCode() == Aws::Http::HttpResponseCode::MOVED_PERMANENTLY
+        || error.GetExceptionName() == "PermanentRedirect";
+}
+
+void set_current_thread_name(const std::string& name)
+{
+#if defined(__linux__)
+    // the kernel limits names to 15 characters
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#elif defined(__APPLE__)
+    pthread_setname_np(name.c_str());
+#else
+    (void) name;
+#endif
+}
+
+// S3 clients shared by the uploaders of the process, so that connections
+// (and TLS sessions) are reused across objects and sinks. A client lives as
+// long as some uploader holds it.
+class S3ClientRegistry
+{
+public:
+    // region, endpoint, credentials, CA file, scheme, verify SSL, sign payload, max connections
+    using Key = std::tuple<Aws::String, Aws::String, std::string, Aws::String, int, bool, int, unsigned>;
+    using Factory = std::function<std::shared_ptr<Aws::S3::S3Client>()>;
+
+    static S3ClientRegistry& get_instance()
+    {
+        static S3ClientRegistry instance;
+        return instance;
+    }
+
+    static Key make_key(const Aws::S3::S3ClientConfiguration& client_config, GstAWSCredentials* credentials)
+    {
+        return Key(client_config.region, client_config.endpointOverride, gst_aws_credentials_get_id(credentials),
+            client_config.caFile, static_cast<int>(client_config.scheme), client_config.verifySSL,
+            static_cast<int>(client_config.payloadSigningPolicy), client_config.maxConnections);
+    }
+
+    // The client is created under the lock of its key only: creating it may
+    // resolve credentials (IMDS, STS), which mustn't hold up other keys.
+    std::shared_ptr<Aws::S3::S3Client> acquire(const Key& key, const Factory& factory)
+    {
+        std::shared_ptr<Slot> slot;
+        {
+            std::lock_guard<std::mutex> l(_mtx);
+            _purge();
+            auto& entry = _slots[key];
+            if (!entry)
+            {
+                entry = std::make_shared<Slot>();
+            }
+            slot = entry;
+        }
+
+        std::lock_guard<std::mutex> slot_lock(slot->mtx);
+        if (auto client = slot->client.lock())
+        {
+            return client;
+        }
+
+        auto client = factory();
+        if (client)
+        {
+            slot->client = client;
+        }
+
+        return client;
+    }
+
+private:
+    S3ClientRegistry() = default;
+
+    struct Slot
+    {
+        std::mutex mtx;
+        std::weak_ptr<Aws::S3::S3Client> client;
+    };
+
+    // forget the clients nobody uses any more
+    void _purge()
+    {
+        for (auto entry = _slots.begin(); entry != _slots.end();)
+        {
+            // a slot only held here isn't being filled by another thread
+            bool is_unused = entry->second.use_count() == 1 && entry->second->client.expired();
+            entry = is_unused ? _slots.erase(entry) : std::next(entry);
+        }
+    }
+
+    std::mutex _mtx;
+    std::map<Key, std::shared_ptr<Slot>> _slots;
 };
 
 static bool get_bucket_location(const char* bucket_name, const Aws::Client::ClientConfiguration& client_config, Aws::String& location)
@@ -163,6 +496,93 @@ static bool is_null_or_empty(const char* str)
     return str == nullptr || strcmp(str, "") == 0;
 }
 
+std::shared_ptr<AwsApiHandle> acquire_aws_sdk()
+{
+    return AwsApiHandle::GetHandle();
+}
+
+std::shared_ptr<Aws::Utils::Threading::Executor> acquire_s3_executor(size_t thread_count, const char* thread_name)
+{
+    return UploadExecutor::get_instance(thread_count, thread_name);
+}
+
+std::shared_ptr<Aws::S3::S3Client> acquire_s3_client(const S3ClientSettings& settings,
+    std::shared_ptr<Aws::Utils::Threading::Executor> executor, bool& is_region_detected)
+{
+    Aws::String endpoint(is_null_or_empty(settings.endpoint) ? "" : settings.endpoint);
+    is_region_detected = false;
+
+    Aws::S3::S3ClientConfiguration client_config;
+    if (!is_null_or_empty(settings.ca_file))
+    {
+        client_config.caFile = settings.ca_file;
+    }
+    if (is_null_or_empty(settings.region))
+    {
+        auto& region_cache = BucketRegionCache::get_instance();
+        Aws::String region;
+        if (region_cache.lookup(settings.bucket, endpoint, region))
+        {
+            is_region_detected = true;
+        }
+        else if (get_bucket_location(settings.bucket.c_str(), client_config, region))
+        {
+            region_cache.store(settings.bucket, endpoint, region);
+            is_region_detected = true;
+        }
+        else
+        {
+            GST_WARNING("Failed to look up the region of bucket %s", settings.bucket.c_str());
+        }
+
+        if (!region.empty())
+        {
+            client_config.region = std::move(region);
+        }
+    }
+    else
+    {
+        client_config.region = settings.region;
+    }
+
+    // Configure AWS SDK specific client configuration
+    if (!endpoint.empty())
+    {
+        client_config.endpointOverride = endpoint;
+    }
+    if (settings.use_http)
+    {
+        client_config.scheme = Aws::Http::Scheme::HTTP;
+    }
+    client_config.verifySSL = settings.verify_ssl;
+
+    const char* endpoint_provider_allocation_tag = "AWSS3EndpointProvider";
+
+    if (!settings.sign_payload) {
+        client_config.payloadSigningPolicy = Aws::Client::AWSAuthV4Signer::PayloadSigningPolicy::Never;
+        client_config.useVirtualAddressing = false;
+    }
+
+    client_config.maxConnections = settings.max_connections;
+    client_config.executor = std::move(executor);
+
+    auto credentials = settings.credentials;
+    return S3ClientRegistry::get_instance().acquire(S3ClientRegistry::make_key(client_config, credentials),
+        [credentials, &client_config, endpoint_provider_allocation_tag] () -> std::shared_ptr<Aws::S3::S3Client> {
+            auto credentials_provider = gst_aws_credentials_create_provider(credentials);
+            if (!credentials_provider)
+            {
+                return nullptr;
+            }
+            return std::make_shared<Aws::S3::S3Client>(std::move(credentials_provider), Aws::MakeShared<Aws::S3::Endpoint::S3EndpointProvider>(endpoint_provider_allocation_tag), client_config);
+        });
+}
+
+void invalidate_bucket_region(const Aws::String& bucket, const Aws::String& endpoint)
+{
+    BucketRegionCache::get_instance().invalidate(bucket, endpoint);
+}
+
 static const Aws::String get_bucket_from_config(const GstS3UploaderConfig * config)
 {
     if (is_null_or_empty(config->location)) {
@@ -192,147 +612,1253 @@ static const Aws::String get_key_from_config(const GstS3UploaderConfig * config)
     }
 }
 
-using BufferManager = Aws::Utils::ExclusiveOwnershipResourceManager<uint8_t*>;
-
-class PartState
+// Read-only, seekable view over the memories of a GstBufferList. It lets the
+// SDK read (and rewind, e.g. for signing) a part straight out of upstream
+// memory. The list is owned by the stream buffer and unreferenced together
+// with it.
+class BufferListStreamBuf : public std::streambuf
 {
 public:
-    explicit PartState(int part_number) :
-        _part_number(part_number)
+    explicit BufferListStreamBuf(GstBufferList* list) :
+        _list(list)
     {
+        for (guint i = 0; i < gst_buffer_list_length(_list); i++)
+        {
+            GstBuffer* buffer = gst_buffer_list_get(_list, i);
+            for (guint j = 0; j < gst_buffer_n_memory(buffer); j++)
+            {
+                _map_memory(gst_buffer_peek_memory(buffer, j));
+            }
+        }
+        _set_span(0, 0);
     }
 
-    int get_part_number() const
+    ~BufferListStreamBuf() override
     {
-        return _part_number;
+        for (auto& span : _spans)
+        {
+            gst_memory_unmap(span.memory, &span.info);
+        }
+        gst_buffer_list_unref(_list);
     }
 
-    Aws::String get_etag() const
+    size_t get_size() const
     {
-        return _etag;
+        return _size;
     }
-    void set_etag(Aws::String etag)
+
+protected:
+    int_type underflow() override
     {
-        _etag = std::move(etag);
+        if (gptr() < egptr())
+        {
+            return traits_type::to_int_type(*gptr());
+        }
+        if (_current + 1 >= _spans.size())
+        {
+            return traits_type::eof();
+        }
+        _set_span(_current + 1, 0);
+        return traits_type::to_int_type(*gptr());
     }
 
-    void set_md5_hash(Aws::Utils::ByteBuffer md5_hash)
+    std::streamsize showmanyc() override
     {
-        _md5_hash = std::move(md5_hash);
+        return _size - _position();
     }
 
-    bool verify_upload_outcome(const Aws::S3::Model::UploadPartOutcome& outcome) const
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
     {
-        Aws::StringStream ss;
-        ss << "\"" << Aws::Utils::HashingUtils::HexEncode(_md5_hash) << "\"";
-        return ss.str() == outcome.GetResult().GetETag();
+        off_type base = 0;
+        switch (dir)
+        {
+            case std::ios_base::beg: base = 0; break;
+            case std::ios_base::cur: base = _position(); break;
+            default: base = _size; break;
+        }
+        return seekpos(pos_type(base + off), which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+    {
+        off_type offset = pos;
+        if (!(which & std::ios_base::in) || offset < 0 || static_cast<size_t>(offset) > _size)
+        {
+            return pos_type(off_type(-1));
+        }
+        if (_spans.empty())
+        {
+            return pos_type(0);
+        }
+
+        // find the last span starting at or before the requested offset
+        auto it = std::upper_bound(_spans.begin(), _spans.end(), static_cast<size_t>(offset),
+            [](size_t value, const Span& span) { return value < span.offset; });
+        size_t index = std::distance(_spans.begin(), it) - 1;
+        _set_span(index, offset - _spans[index].offset);
+        return pos;
     }
 
 private:
-    Aws::Utils::ByteBuffer _md5_hash;
-    Aws::String _etag;
-    int _part_number;
-};
+    struct Span
+    {
+        GstMemory* memory;
+        GstMapInfo info;
+        size_t offset;
+    };
 
-using PartStateMap = std::map<int, PartState>;
+    void _map_memory(GstMemory* memory)
+    {
+        Span span;
+        span.memory = memory;
+        span.offset = _size;
+        if (!gst_memory_map(memory, &span.info, GST_MAP_READ))
+        {
+            GST_WARNING("Failed to map memory of a part");
+            return;
+        }
+        if (span.info.size == 0)
+        {
+            gst_memory_unmap(memory, &span.info);
+            return;
+        }
+        _size += span.info.size;
+        _spans.push_back(span);
+    }
 
-class PartStateCollection
-{
-public:
-    PartStateCollection(bool verify_hash) :
-        _verify_hash(verify_hash)
+    void _set_span(size_t index, size_t offset)
     {
+        _current = index;
+        if (_spans.empty())
+        {
+            setg(nullptr, nullptr, nullptr);
+            return;
+        }
+        char* data = reinterpret_cast<char*>(_spans[index].info.data);
+        setg(data, data + offset, data + _spans[index].info.size);
     }
 
-    void start(PartState state)
+    size_t _position() const
     {
-        std::lock_guard<std::mutex> l(_mtx);
+        if (_spans.empty())
+        {
+            return 0;
+        }
+        return _spans[_current].offset + (gptr() - eback());
+    }
 
-        int num = state.get_part_number();
-        _insert(_parts_in_flight, num, std::move(state));
+    GstBufferList* _list;
+    std::vector<Span> _spans;
+    size_t _current = 0;
+    size_t _size = 0;
+};
+
+static BufferPool::RingFactory buffer_ring_factory(const GstS3UploaderConfig * config)
+{
+    if (is_null_or_empty(config->buffer_location) || config->buffer_size == 0)
+    {
+        return nullptr;
     }
 
-    void mark_part_as_completed(int part_number, const Aws::String& etag)
+    std::string directory = config->buffer_location;
+    size_t buffer_count = config->buffer_count;
+    guint64 ring_size = config->buffer_ring_size;
+    guint64 max_inflight_bytes = config->max_inflight_bytes;
+
+    return [directory, buffer_count, ring_size, max_inflight_bytes](size_t slot_size) -> std::unique_ptr<MappedBufferRing> {
+        size_t slot_count = buffer_count;
+        if (ring_size > 0)
+        {
+            // the ring keeps its size, parts too big for it go on the heap
+            slot_count = ring_size / slot_size;
+            if (slot_count == 0)
+            {
+                return nullptr;
+            }
+        }
+        else if (max_inflight_bytes > 0)
+        {
+            slot_count = std::max<size_t>(slot_count, (max_inflight_bytes + slot_size - 1) / slot_size);
+        }
+
+        return MappedBufferRing::create(directory.c_str(), slot_size, std::max<size_t>(1, slot_count));
+    };
+}
+
+constexpr size_t PooledPartData::HASH_BLOCK_SIZE;
+
+// Directory holding the parts which can't be kept in memory, up to a size
+// cap. Parts are written one at a time, in large aligned blocks, so that the
+// disk sees long sequential writes even when several parts are spooled at
+// the same time. Uploaders spooling to the same directory share its spool,
+// and with it the cap.
+class PartSpool
+{
+public:
+    // max_size: 0 for no limit; only applies if there's no spool in the
+    // directory yet
+    static std::shared_ptr<PartSpool> get_instance(const std::string& directory, guint64 max_size)
     {
-        std::unique_lock<std::mutex> l(_mtx);
+        static std::mutex mtx;
+        static std::map<std::string, std::weak_ptr<PartSpool>> instances;
 
-        PartState state = std::move(_parts_in_flight.at(part_number));
-        _parts_in_flight.erase(part_number);
-        state.set_etag(etag);
-        _insert(_parts_completed, part_number, std::move(state));
+        std::lock_guard<std::mutex> l(mtx);
+        for (auto it = instances.begin(); it != instances.end();)
+        {
+            it = it->second.expired() ? instances.erase(it) : std::next(it);
+        }
 
-        l.unlock();
-        _upload_completed_cv.notify_one();
+        auto& instance = instances[directory];
+        if (auto spool = instance.lock())
+        {
+            if (spool->_max_size != max_size)
+            {
+                GST_WARNING("The spool in %s is already capped at %" G_GUINT64_FORMAT " bytes",
+                    directory.c_str(), spool->_max_size);
+            }
+            return spool;
+        }
+
+        auto spool = std::make_shared<PartSpool>(directory, max_size);
+        instance = spool;
+        return spool;
     }
 
-    void mark_part_as_failed(int part_number)
+    PartSpool(std::string directory, guint64 max_size) :
+        _directory(std::move(directory)),
+        _max_size(max_size)
     {
-        std::unique_lock<std::mutex> l(_mtx);
+    }
 
-        _insert(_parts_failed, part_number, std::move(_parts_in_flight.at(part_number)));
-        _parts_in_flight.erase(part_number);
+    const std::string& get_directory() const
+    {
+        return _directory;
+    }
 
-        l.unlock();
-        _upload_completed_cv.notify_one();
+    guint64 get_size() const
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        return _size;
     }
 
-    size_t get_failed_parts_count() const
+    // Makes room for a part; fails if the spool is full.
+    bool reserve(size_t size)
     {
-        return _parts_failed.size();
+        std::lock_guard<std::mutex> l(_mtx);
+        if (_max_size > 0 && _size + size > _max_size)
+        {
+            return false;
+        }
+        _size += size;
+        return true;
+    }
+
+    void release(size_t size)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        _size -= std::min<guint64>(size, _size);
+    }
+
+    bool write(std::streambuf& source, FILE* file)
+    {
+        std::lock_guard<std::mutex> l(_write_mtx);
+        if (!_block)
+        {
+            _block_storage.resize(BLOCK_SIZE + BLOCK_ALIGNMENT);
+            void* block = _block_storage.data();
+            size_t space = _block_storage.size();
+            _block = static_cast<char*>(std::align(BLOCK_ALIGNMENT, BLOCK_SIZE, block, space));
+        }
+
+        std::streamsize count;
+        while ((count = source.sgetn(_block, BLOCK_SIZE)) > 0)
+        {
+            if (fwrite(_block, 1, count, file) != static_cast<size_t>(count))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 1024 * 1024;
+    static constexpr size_t BLOCK_ALIGNMENT = 4096;
+
+    mutable std::mutex _mtx;
+    std::mutex _write_mtx;
+    std::string _directory;
+    guint64 _max_size;
+    guint64 _size = 0;
+    std::vector<char> _block_storage;
+    char* _block = nullptr;
+};
+
+constexpr size_t PartSpool::BLOCK_SIZE;
+constexpr size_t PartSpool::BLOCK_ALIGNMENT;
+
+// A part written out to a spool file rather than kept in memory.
+class SpilledPartData : public PartData
+{
+public:
+    // Takes over the room reserved in the spool for the part.
+    static std::unique_ptr<PartData> create(std::shared_ptr<PartSpool> spool, std::streambuf& source, size_t size)
+    {
+        const char* directory = spool->get_directory().c_str();
+        gchar* path = g_build_filename(directory, "gst-s3-part-XXXXXX", NULL);
+        gint fd = g_mkstemp(path);
+        if (fd < 0)
+        {
+            GST_WARNING("Failed to create a spill file in %s", directory);
+            g_free(path);
+            spool->release(size);
+            return nullptr;
+        }
+
+        // the whole part is written, even if it was partly sent already
+        source.pubseekpos(0, std::ios_base::in);
+
+        FILE* output = fdopen(fd, "wb");
+        bool is_written = output && setvbuf(output, NULL, _IONBF, 0) == 0 && spool->write(source, output);
+        if (output ? fclose(output) != 0 : g_close(fd, NULL) == FALSE)
+        {
+            is_written = false;
+        }
+
+        auto file_buffer = new std::filebuf();
+        if (!is_written || !file_buffer->open(path, std::ios_base::in | std::ios_base::binary))
+        {
+            GST_WARNING("Failed to spill a part to %s", path);
+            delete file_buffer;
+            g_unlink(path);
+            g_free(path);
+            spool->release(size);
+            return nullptr;
+        }
+
+        return std::unique_ptr<PartData>(new SpilledPartData(file_buffer, size, path, std::move(spool)));
+    }
+
+    ~SpilledPartData() override
+    {
+        g_unlink(_path);
+        g_free(_path);
+        _spool->release(get_size());
+    }
+
+private:
+    SpilledPartData(std::filebuf* file_buffer, size_t size, gchar* path, std::shared_ptr<PartSpool> spool) :
+        PartData(file_buffer, size),
+        _path(path),
+        _spool(std::move(spool))
+    {
+    }
+
+    gchar* _path;
+    std::shared_ptr<PartSpool> _spool;
+};
+
+class PartState
+{
+public:
+    PartState(int part_number, std::shared_ptr<PartData> data) :
+        _data(std::move(data)),
+        _part_number(part_number)
+    {
+    }
+
+    int get_part_number() const
+    {
+        return _part_number;
+    }
+
+    size_t get_size() const
+    {
+        return _data ? _data->get_size() : 0;
+    }
+
+    bool is_spilled() const
+    {
+        return _spilled;
+    }
+    void set_spilled(bool spilled)
+    {
+        _spilled = spilled;
+    }
+
+    const Aws::S3::Model::UploadPartRequest& get_request() const
+    {
+        return _request;
+    }
+    void set_request(Aws::S3::Model::UploadPartRequest request)
+    {
+        _request = std::move(request);
+    }
+
+    std::chrono::steady_clock::time_point get_send_time() const
+    {
+        return _send_time;
+    }
+
+    guint get_attempts() const
+    {
+        return _attempts;
+    }
+
+    void mark_as_sent()
+    {
+        _send_time = std::chrono::steady_clock::now();
+        _attempts++;
+    }
+
+    // Prepares the body to be sent again.
+    void rewind()
+    {
+        if (_data)
+        {
+            auto stream = _data->get_stream();
+            stream->clear();
+            stream->seekg(0, std::ios_base::beg);
+        }
+    }
+
+    // Moves the body of the part to the spool, which must have room for it.
+    bool spool(std::shared_ptr<PartSpool> spool)
+    {
+        auto stream = _data->get_stream();
+        auto spilled = SpilledPartData::create(std::move(spool), *stream->rdbuf(), _data->get_size());
+        if (!spilled)
+        {
+            return false;
+        }
+
+        if (stream->has_sha256())
+        {
+            spilled->get_stream()->set_sha256(stream->get_sha256());
+        }
+        _request.SetBody(spilled->get_stream());
+        _data = std::move(spilled);
+        _spilled = true;
+        return true;
+    }
+
+    // Drops the part body; called once the part won't be sent (again).
+    void release()
+    {
+        _request = Aws::S3::Model::UploadPartRequest();
+        _data.reset();
+    }
+
+    Aws::String get_etag() const
+    {
+        return _etag;
+    }
+    void set_etag(Aws::String etag)
+    {
+        _etag = std::move(etag);
+    }
+
+    // base64-encoded additional checksum, as acknowledged by S3
+    const Aws::String& get_checksum() const
+    {
+        return _checksum;
+    }
+    void set_checksum(Aws::String checksum)
+    {
+        _checksum = std::move(checksum);
+    }
+
+private:
+    std::shared_ptr<PartData> _data;
+    Aws::S3::Model::UploadPartRequest _request;
+    Aws::String _checksum;
+    Aws::String _etag;
+    std::chrono::steady_clock::time_point _send_time;
+    guint _attempts = 0;
+    int _part_number;
+    bool _spilled = false;
+};
+
+using PartStateMap = std::map<int, PartState>;
+
+static bool is_congestion_error(const Aws::S3::S3Error& error)
+{
+    switch (error.GetErrorType())
+    {
+        case Aws::S3::S3Errors::SLOW_DOWN:
+        case Aws::S3::S3Errors::THROTTLING:
+        case Aws::S3::S3Errors::REQUEST_TIMEOUT:
+        case Aws::S3::S3Errors::NETWORK_CONNECTION:
+            return true;
+        default:
+            return error.GetResponseCode() == Aws::Http::HttpResponseCode::SERVICE_UNAVAILABLE;
+    }
+}
+
+// the request didn't get an answer from S3 at all, e.g. the link is down
+static bool is_unreachable_error(const Aws::S3::S3Error& error)
+{
+    return error.GetErrorType() == Aws::S3::S3Errors::NETWORK_CONNECTION
+        || error.GetResponseCode() == Aws::Http::HttpResponseCode::REQUEST_NOT_MADE;
+}
+
+// The SDK client already retried the request as its retry strategy allows,
+// so the part is only retried on failures which a later attempt can fix,
+// rather than on whatever the SDK deems retryable.
+static bool is_retryable_error(const Aws::S3::S3Error& error)
+{
+    // BadDigest: the part was corrupted on its way to S3
+    return is_congestion_error(error)
+        || static_cast<int>(error.GetResponseCode()) >= 500
+        || error.GetExceptionName() == "BadDigest";
+}
+
+static Aws::S3::Model::ChecksumAlgorithm to_checksum_algorithm(GstS3UploaderChecksumAlgorithm algorithm)
+{
+    switch (algorithm)
+    {
+        case GST_S3_UPLOADER_CHECKSUM_ALGORITHM_CRC32C:
+            return Aws::S3::Model::ChecksumAlgorithm::CRC32C;
+        case GST_S3_UPLOADER_CHECKSUM_ALGORITHM_SHA256:
+            return Aws::S3::Model::ChecksumAlgorithm::SHA256;
+        default:
+            return Aws::S3::Model::ChecksumAlgorithm::NOT_SET;
+    }
+}
+
+static Aws::String get_part_checksum(const Aws::S3::Model::UploadPartResult& result)
+{
+    return result.GetChecksumCRC32C().empty() ? result.GetChecksumSHA256() : result.GetChecksumCRC32C();
+}
+
+static void set_part_checksum(Aws::S3::Model::CompletedPart& part,
+    Aws::S3::Model::ChecksumAlgorithm algorithm, const Aws::String& checksum)
+{
+    if (algorithm == Aws::S3::Model::ChecksumAlgorithm::CRC32C)
+    {
+        part.SetChecksumCRC32C(checksum);
+    }
+    else if (algorithm == Aws::S3::Model::ChecksumAlgorithm::SHA256)
+    {
+        part.SetChecksumSHA256(checksum);
+    }
+}
+
+static Aws::String get_object_checksum(const Aws::S3::Model::CompleteMultipartUploadResult& result,
+    Aws::S3::Model::ChecksumAlgorithm algorithm)
+{
+    return algorithm == Aws::S3::Model::ChecksumAlgorithm::CRC32C ? result.GetChecksumCRC32C() : result.GetChecksumSHA256();
+}
+
+Aws::String compute_composite_checksum(Aws::S3::Model::ChecksumAlgorithm algorithm,
+    const Aws::Vector<Aws::String>& part_checksums)
+{
+    Aws::String concatenated;
+    for (const auto& checksum : part_checksums)
+    {
+        auto raw = Aws::Utils::HashingUtils::Base64Decode(checksum);
+        concatenated.append(reinterpret_cast<const char*>(raw.GetUnderlyingData()), raw.GetLength());
+    }
+
+    auto digest = algorithm == Aws::S3::Model::ChecksumAlgorithm::CRC32C
+        ? Aws::Utils::HashingUtils::CalculateCRC32C(concatenated)
+        : Aws::Utils::HashingUtils::CalculateSHA256(concatenated);
+
+    return Aws::Utils::HashingUtils::Base64Encode(digest) + "-"
+        + Aws::Utils::StringUtils::to_string(part_checksums.size());
+}
+
+constexpr std::chrono::milliseconds RetryPolicy::MAX_DELAY;
+
+// Local record of a multipart upload: its ID and the parts S3 acknowledged.
+// It lets an upload interrupted by the death of the process be resumed
+// rather than sent again. Every line is flushed to disk once written.
+class UploadJournal
+{
+public:
+    struct Part
+    {
+        size_t size;
+        Aws::String etag;
+        Aws::String checksum;
+    };
+    using Parts = std::map<int, Part>;
+
+    explicit UploadJournal(std::string path) :
+        _path(std::move(path))
+    {
+    }
+
+    ~UploadJournal()
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        _close();
+    }
+
+    // Reads the journal left by a previous run; fails if there's none for
+    // the bucket and key.
+    bool load(const Aws::String& bucket, const Aws::String& key, Aws::String& upload_id, Parts& parts) const
+    {
+        std::ifstream input(_path);
+        std::string line;
+        Aws::String journal_bucket, journal_key;
+
+        if (!std::getline(input, line) || line != HEADER)
+        {
+            return false;
+        }
+
+        while (std::getline(input, line))
+        {
+            // a crash may have cut the last line short
+            if (input.eof())
+            {
+                GST_WARNING("Ignoring the unterminated last line of the upload journal %s", _path.c_str());
+                break;
+            }
+
+            auto separator = line.find(' ');
+            auto field = line.substr(0, separator);
+            auto value = separator == std::string::npos ? std::string() : line.substr(separator + 1);
+
+            if (field == "upload")
+            {
+                upload_id = value.c_str();
+            }
+            else if (field == "bucket")
+            {
+                journal_bucket = value.c_str();
+            }
+            else if (field == "key")
+            {
+                journal_key = value.c_str();
+            }
+            else if (field == "part")
+            {
+                std::istringstream part_line(value);
+                int part_number;
+                Part part;
+                std::string etag, checksum;
+                if ((part_line >> part_number >> part.size >> etag >> checksum) && (part_line >> std::ws).eof())
+                {
+                    part.etag = etag.c_str();
+                    part.checksum = checksum == NO_CHECKSUM ? "" : checksum.c_str();
+                    // a part sent again after a retry is journaled again
+                    parts[part_number] = part;
+                }
+                else
+                {
+                    GST_WARNING("Ignoring a corrupt part in the upload journal %s", _path.c_str());
+                }
+            }
+        }
+
+        return !upload_id.empty() && journal_bucket == bucket && journal_key == key;
+    }
+
+    // Replaces the journal with one for the given upload and the parts it
+    // already holds.
+    bool start(const Aws::String& bucket, const Aws::String& key, const Aws::String& upload_id, const Parts& parts)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        _close();
+
+        // written aside and renamed, so that a crash leaves either journal
+        auto temp_path = _path + ".tmp";
+        _file = g_fopen(temp_path.c_str(), "w");
+        if (!_file)
+        {
+            GST_WARNING("Failed to create the upload journal %s", temp_path.c_str());
+            return false;
+        }
+
+        fprintf(_file, "%s\nupload %s\nbucket %s\nkey %s\n", HEADER, upload_id.c_str(), bucket.c_str(), key.c_str());
+        for (const auto& part : parts)
+        {
+            _write_part(part.first, part.second);
+        }
+        if (!_sync() || g_rename(temp_path.c_str(), _path.c_str()) != 0)
+        {
+            GST_WARNING("Failed to write the upload journal %s", _path.c_str());
+            _close();
+            g_unlink(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    void record_part(int part_number, const Part& part)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        if (!_file)
+        {
+            return;
+        }
+
+        _write_part(part_number, part);
+        if (!_sync())
+        {
+            GST_WARNING("Failed to journal part %d in %s", part_number, _path.c_str());
+        }
+    }
+
+    // Called once the upload is completed or aborted.
+    void remove()
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        _close();
+        g_unlink(_path.c_str());
+    }
+
+private:
+    static constexpr const char* HEADER = "gst-s3-upload-journal 1";
+    static constexpr const char* NO_CHECKSUM = "-";
+
+    void _write_part(int part_number, const Part& part)
+    {
+        fprintf(_file, "part %d %" G_GSIZE_FORMAT " %s %s\n", part_number, part.size, part.etag.c_str(),
+            part.checksum.empty() ? NO_CHECKSUM : part.checksum.c_str());
+    }
+
+    bool _sync()
+    {
+        return fflush(_file) == 0 && g_fsync(fileno(_file)) == 0;
+    }
+
+    void _close()
+    {
+        if (_file)
+        {
+            fclose(_file);
+            _file = nullptr;
+        }
+    }
+
+    mutable std::mutex _mtx;
+    std::string _path;
+    FILE* _file = nullptr;
+};
+
+constexpr const char* UploadJournal::HEADER;
+constexpr const char* UploadJournal::NO_CHECKSUM;
+
+enum class PartAdmission
+{
+    MEMORY,
+    SPILL
+};
+
+// Tracks every part from the moment it's handed to the uploader until S3
+// acknowledges it. Parts are queued (pending) and sent in order, at most
+// a window of them at a time; the bytes they hold are accounted against
+// the in-flight budget, which is enforced according to the in-flight policy.
+//
+// With a dedicated spool, parts which don't fit in the budget are spooled
+// whatever the policy (which only applies once the spool is full), parts
+// which fail because S3 can't be reached are moved to the spool and retried
+// until it can be again, and spooled parts are drained with their own window.
+class PartStateCollection
+{
+public:
+    PartStateCollection(ConcurrencyController concurrency, RetryPolicy retry_policy,
+            size_t max_inflight_bytes, GstS3UploaderInflightPolicy policy,
+            std::shared_ptr<PartSpool> spool, bool is_spool_dedicated, size_t drain_window) :
+        _concurrency(std::move(concurrency)),
+        _retry_policy(std::move(retry_policy)),
+        _max_inflight_bytes(max_inflight_bytes),
+        _policy(policy),
+        _spool(std::move(spool)),
+        _is_spool_dedicated(is_spool_dedicated),
+        _drain_window(drain_window)
+    {
+    }
+
+    // Makes room for a new part of the given size, blocking, dropping
+    // queued parts or asking for the part to be spilled, as the policy says.
+    // A spilled part is written out by the caller, i.e. on the streaming
+    // thread, which trades the wait for the budget for a wait on the disk.
+    PartAdmission admit(size_t size)
+    {
+        std::unique_lock<std::mutex> lk(_mtx);
+
+        if (!_is_over_budget(size))
+        {
+            _reserve(size);
+            return PartAdmission::MEMORY;
+        }
+
+        _throttle_episodes++;
+
+        if ((_policy == GST_S3_UPLOADER_INFLIGHT_POLICY_SPILL || _is_spool_dedicated) && _spool->reserve(size))
+        {
+            _spilled_parts++;
+            _spilled_bytes += size;
+            return PartAdmission::SPILL;
+        }
+
+        if (_policy == GST_S3_UPLOADER_INFLIGHT_POLICY_LEAK_OLDEST_UNSENT)
+        {
+            _drop_oldest_pending(size);
+        }
+
+        // parts which are already being sent can't be dropped, wait for them
+        if (_is_over_budget(size))
+        {
+            auto start = std::chrono::steady_clock::now();
+            _upload_completed_cv.wait(lk, [this, size] { return !_is_over_budget(size); });
+            _blocked_time += std::chrono::steady_clock::now() - start;
+        }
+
+        _reserve(size);
+        return PartAdmission::MEMORY;
+    }
+
+    void enqueue(PartState state)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+
+        int num = state.get_part_number();
+        _pending_order.push_back(num);
+        _insert(_parts_pending, num, std::move(state));
+    }
+
+    // Moves the oldest pending part to the in-flight set if the send window
+    // allows it.
+    bool take_next_to_send(int& part_number, Aws::S3::Model::UploadPartRequest& request)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+
+        auto it = _pending_order.begin();
+        for (; it != _pending_order.end(); ++it)
+        {
+            if (_has_send_slot(_parts_pending.at(*it).is_spilled()))
+            {
+                break;
+            }
+            if (_drain_window == 0)
+            {
+                // spooled parts share the window, the oldest part goes first
+                return false;
+            }
+        }
+        if (it == _pending_order.end())
+        {
+            return false;
+        }
+
+        part_number = *it;
+        _pending_order.erase(it);
+        PartState state = std::move(_parts_pending.at(part_number));
+        _parts_pending.erase(part_number);
+        request = state.get_request();
+        state.mark_as_sent();
+        if (_drain_window > 0 && state.is_spilled())
+        {
+            _draining_parts++;
+        }
+        _insert(_parts_in_flight, part_number, std::move(state));
+
+        return true;
+    }
+
+    // Journals the parts as S3 acknowledges them.
+    void set_journal(std::shared_ptr<UploadJournal> journal)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        _journal = std::move(journal);
+    }
+
+    // Adds a part uploaded by an earlier run of a resumed upload.
+    void restore_completed_part(int part_number, const Aws::String& etag, const Aws::String& checksum)
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+
+        PartState state(part_number, nullptr);
+        state.set_etag(etag);
+        state.set_checksum(checksum);
+        _insert(_parts_completed, part_number, std::move(state));
+    }
+
+    void mark_part_as_completed(int part_number, const Aws::String& etag, const Aws::String& checksum)
+    {
+        std::unique_lock<std::mutex> l(_mtx);
+
+        PartState state = _take_in_flight(part_number);
+        size_t size = state.get_size();
+        _concurrency.on_part_completed(size, state.get_send_time(), std::chrono::steady_clock::now());
+        _release(state);
+        state.set_etag(etag);
+        state.set_checksum(checksum);
+        _insert(_parts_completed, part_number, std::move(state));
+        auto journal = _journal;
+
+        l.unlock();
+        _upload_completed_cv.notify_all();
+
+        if (journal)
+        {
+            journal->record_part(part_number, UploadJournal::Part{size, etag, checksum});
+        }
+    }
+
+    // Schedules another attempt of a part which failed to upload, as long
+    // as the failure is transient and the retry budget isn't exhausted.
+    // With a dedicated spool, parts are retried for as long as S3 can't be
+    // reached, out of the spool so that they don't hold the in-flight budget.
+    void mark_part_as_failed(int part_number, bool congested, bool retryable, bool unreachable,
+        const std::string& reason)
+    {
+        std::unique_lock<std::mutex> l(_mtx);
+
+        PartState state = _take_in_flight(part_number);
+        if (congested)
+        {
+            _concurrency.on_congestion(state.get_send_time(), std::chrono::steady_clock::now());
+        }
+
+        bool is_outage = unreachable && _is_spool_dedicated;
+        if (is_outage && retryable && !_is_shut_down && !state.is_spilled() && _spool->reserve(state.get_size()))
+        {
+            // writing the part out takes a while, leave it to the retry
+            // thread rather than blocking the thread S3 calls back on
+            _insert(_parts_to_spool, part_number, std::move(state));
+
+            l.unlock();
+            _retry_cv.notify_all();
+            return;
+        }
+
+        if (retryable && !_is_shut_down && (is_outage || _retry_policy.should_retry(state.get_attempts())))
+        {
+            _schedule_retry(part_number, std::move(state));
+
+            l.unlock();
+            _retry_cv.notify_all();
+            return;
+        }
+
+        GST_WARNING("Upload of part %d failed after %u attempt(s)", part_number, state.get_attempts());
+        if (_error.empty())
+        {
+            _error = "Upload of part " + std::to_string(part_number) + " failed after "
+                + std::to_string(state.get_attempts()) + " attempt(s): " + reason;
+        }
+        _release(state);
+        _insert(_parts_failed, part_number, std::move(state));
+
+        l.unlock();
+        _upload_completed_cv.notify_all();
+    }
+
+    // Blocks until some parts are due to be retried and moves them back to
+    // the front of the queue, spooling the parts which failed because S3
+    // can't be reached in the meantime. Returns false once the collection is
+    // shut down.
+    bool wait_for_retries()
+    {
+        std::unique_lock<std::mutex> lk(_mtx);
+
+        while (!_is_shut_down)
+        {
+            if (!_parts_to_spool.empty())
+            {
+                _spool_next(lk);
+                continue;
+            }
+
+            if (_retry_schedule.empty())
+            {
+                _retry_cv.wait(lk);
+                continue;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (_retry_schedule.begin()->first > now)
+            {
+                _retry_cv.wait_until(lk, _retry_schedule.begin()->first);
+                continue;
+            }
+
+            std::vector<int> due_parts;
+            while (!_retry_schedule.empty() && _retry_schedule.begin()->first <= now)
+            {
+                due_parts.push_back(_retry_schedule.begin()->second);
+                _retry_schedule.erase(_retry_schedule.begin());
+            }
+
+            // keep the queue ordered by part number
+            std::sort(due_parts.rbegin(), due_parts.rend());
+            for (int part_number : due_parts)
+            {
+                _insert(_parts_pending, part_number, std::move(_parts_retrying.at(part_number)));
+                _parts_retrying.erase(part_number);
+                _pending_order.push_front(part_number);
+            }
+            return true;
+        }
+
+        return false;
+    }
+
+    // Returns the reason of the first part which failed for good, or an
+    // empty string if all the parts can still be uploaded.
+    std::string get_error() const
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        return _error;
+    }
+
+    size_t get_failed_parts_count() const
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        return _parts_failed.size();
+    }
+
+    void wait_for_complete()
+    {
+        std::unique_lock<std::mutex> lk(_mtx);
+        _upload_completed_cv.wait(lk, [this] {
+            return _parts_pending.empty() && _parts_in_flight.empty() && _parts_retrying.empty()
+                && _parts_to_spool.empty() && _spooling_parts == 0;
+        });
+    }
+
+    // Drops the parts which haven't been sent yet and waits for the rest.
+    void shutdown()
+    {
+        std::unique_lock<std::mutex> lk(_mtx);
+        _is_shut_down = true;
+        for (auto& part : _parts_pending)
+        {
+            _release(part.second);
+        }
+        for (auto& part : _parts_retrying)
+        {
+            _release(part.second);
+        }
+        for (auto& part : _parts_to_spool)
+        {
+            _spool->release(part.second.get_size());
+            _release(part.second);
+        }
+        _parts_pending.clear();
+        _pending_order.clear();
+        _parts_retrying.clear();
+        _parts_to_spool.clear();
+        _retry_schedule.clear();
+        _retry_cv.notify_all();
+        _upload_completed_cv.wait(lk, [this] { return _parts_in_flight.empty() && _spooling_parts == 0; });
+    }
+
+    PartStateMap get_completed_parts() const
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        return _parts_completed;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        _parts_pending.clear();
+        _pending_order.clear();
+        _parts_in_flight.clear();
+        _parts_retrying.clear();
+        _parts_to_spool.clear();
+        _retry_schedule.clear();
+        _parts_completed.clear();
+        _error.clear();
+        _parts_failed.clear();
+    }
+
+    void fill_stats(GstStructure* stats) const
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        gst_structure_set(stats,
+            "inflight-bytes", G_TYPE_UINT64, static_cast<guint64>(_inflight_bytes),
+            "queued-parts", G_TYPE_UINT, static_cast<guint>(_parts_pending.size()),
+            "parts-in-flight", G_TYPE_UINT, static_cast<guint>(_parts_in_flight.size()),
+            "completed-parts", G_TYPE_UINT, static_cast<guint>(_parts_completed.size()),
+            "failed-parts", G_TYPE_UINT, static_cast<guint>(_parts_failed.size()),
+            "throttle-episodes", G_TYPE_UINT64, _throttle_episodes,
+            "blocked-time", G_TYPE_UINT64, static_cast<guint64>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(_blocked_time).count()),
+            "dropped-parts", G_TYPE_UINT64, _dropped_parts,
+            "dropped-bytes", G_TYPE_UINT64, _dropped_bytes,
+            "spilled-parts", G_TYPE_UINT64, _spilled_parts,
+            "spilled-bytes", G_TYPE_UINT64, _spilled_bytes,
+            "spool-bytes", G_TYPE_UINT64, _spool->get_size(),
+            "outage-spooled-parts", G_TYPE_UINT64, _outage_spooled_parts,
+            "draining-parts", G_TYPE_UINT, static_cast<guint>(_draining_parts),
+            "window", G_TYPE_UINT, static_cast<guint>(_concurrency.get_window()),
+            "window-backoffs", G_TYPE_UINT64, _concurrency.get_backoffs(),
+            "part-retries", G_TYPE_UINT64, _retries,
+            NULL);
+    }
+
+private:
+    static void _insert(PartStateMap& map, int number, PartState part)
+    {
+        map.insert(std::make_pair(number, std::move(part)));
+    }
+
+    void _schedule_retry(int part_number, PartState state)
+    {
+        auto delay = _retry_policy.get_delay(state.get_attempts());
+        GST_WARNING("Upload of part %d failed (attempt %u), retrying in %" G_GINT64_FORMAT " ms",
+            part_number, state.get_attempts(), static_cast<gint64>(delay.count()));
+
+        state.rewind();
+        _retries++;
+        _retry_schedule.insert(std::make_pair(std::chrono::steady_clock::now() + delay, part_number));
+        _insert(_parts_retrying, part_number, std::move(state));
+    }
+
+    // Moves the body of a part to the spool, which already has room for it,
+    // and schedules its retry. The lock is released while the part is written.
+    void _spool_next(std::unique_lock<std::mutex>& lk)
+    {
+        auto it = _parts_to_spool.begin();
+        int part_number = it->first;
+        PartState state = std::move(it->second);
+        _parts_to_spool.erase(it);
+
+        _spooling_parts++;
+        lk.unlock();
+        state.rewind();
+        bool is_spooled = state.spool(_spool);
+        lk.lock();
+        _spooling_parts--;
+
+        if (is_spooled)
+        {
+            GST_INFO("S3 is unreachable, moved part %d to the spool", part_number);
+            _inflight_parts--;
+            _inflight_bytes -= state.get_size();
+            _outage_spooled_parts++;
+        }
+
+        if (_is_shut_down)
+        {
+            _release(state);
+        }
+        else
+        {
+            _schedule_retry(part_number, std::move(state));
+        }
+        _upload_completed_cv.notify_all();
+    }
+
+    bool _has_send_slot(bool is_spilled) const
+    {
+        if (_drain_window > 0 && is_spilled)
+        {
+            return _draining_parts < _drain_window;
+        }
+        return _parts_in_flight.size() - _draining_parts < _concurrency.get_window();
     }
 
-    bool verify_upload_outcome(int part_number, const Aws::S3::Model::UploadPartOutcome& outcome) const
+    PartState _take_in_flight(int part_number)
     {
-        if (!_verify_hash)
+        PartState state = std::move(_parts_in_flight.at(part_number));
+        _parts_in_flight.erase(part_number);
+        if (_drain_window > 0 && state.is_spilled())
         {
-            return true;
+            _draining_parts--;
         }
-        std::lock_guard<std::mutex> l(_mtx);
-        return _parts_completed.at(part_number).verify_upload_outcome(outcome);
+        return state;
     }
 
-    void wait_for_complete()
+    bool _is_over_budget(size_t size) const
     {
-        std::unique_lock<std::mutex> lk(_mtx);
-        _upload_completed_cv.wait(lk, [this] { return _parts_in_flight.empty(); });
+        if (_inflight_parts == 0)
+        {
+            // a single part is always allowed, however big it is
+            return false;
+        }
+        if (_max_inflight_bytes == 0)
+        {
+            return _inflight_parts >= _concurrency.get_window();
+        }
+        return _inflight_bytes + size > _max_inflight_bytes;
     }
 
-    PartStateMap get_completed_parts() const
+    void _reserve(size_t size)
     {
-        std::lock_guard<std::mutex> l(_mtx);
-        return _parts_completed;
+        _inflight_parts++;
+        _inflight_bytes += size;
     }
 
-    void clear()
+    void _release(PartState& state)
     {
-        std::lock_guard<std::mutex> l(_mtx);
-        _parts_in_flight.clear();
-        _parts_completed.clear();
-        _parts_failed.clear();
+        if (!state.is_spilled())
+        {
+            _inflight_parts--;
+            _inflight_bytes -= state.get_size();
+        }
+        state.release();
     }
 
-private:
-    static void _insert(PartStateMap& map, int number, PartState part)
+    void _drop_oldest_pending(size_t size)
     {
-        map.insert(std::make_pair(number, std::move(part)));
+        while (_is_over_budget(size) && !_pending_order.empty())
+        {
+            int part_number = _pending_order.front();
+            _pending_order.pop_front();
+
+            PartState& state = _parts_pending.at(part_number);
+            GST_WARNING("In-flight budget exceeded, dropping part %d (%" G_GSIZE_FORMAT " bytes)",
+                part_number, state.get_size());
+            _dropped_parts++;
+            _dropped_bytes += state.get_size();
+            _release(state);
+            _parts_pending.erase(part_number);
+        }
     }
 
     std::condition_variable _upload_completed_cv;
+    std::condition_variable _retry_cv;
     mutable std::mutex _mtx;
 
+    std::deque<int> _pending_order;
+    PartStateMap _parts_pending;
     PartStateMap _parts_in_flight;
+    PartStateMap _parts_retrying;
+    PartStateMap _parts_to_spool;
+    std::multimap<std::chrono::steady_clock::time_point, int> _retry_schedule;
     PartStateMap _parts_completed;
     PartStateMap _parts_failed;
 
-    bool _verify_hash;
+    ConcurrencyController _concurrency;
+    RetryPolicy _retry_policy;
+    size_t _max_inflight_bytes;
+    GstS3UploaderInflightPolicy _policy;
+    std::shared_ptr<PartSpool> _spool;
+    bool _is_spool_dedicated;
+    size_t _drain_window;
+    size_t _draining_parts = 0;
+    size_t _spooling_parts = 0;
+    guint64 _outage_spooled_parts = 0;
+
+    size_t _inflight_parts = 0;
+    size_t _inflight_bytes = 0;
+
+    guint64 _throttle_episodes = 0;
+    std::chrono::steady_clock::duration _blocked_time = std::chrono::steady_clock::duration::zero();
+    guint64 _dropped_parts = 0;
+    guint64 _dropped_bytes = 0;
+    guint64 _spilled_parts = 0;
+    guint64 _spilled_bytes = 0;
+    guint64 _retries = 0;
+    bool _is_shut_down = false;
+    std::string _error;
+    std::shared_ptr<UploadJournal> _journal;
 };
 
 class MultipartUploaderContext : public Aws::Client::AsyncCallerContext
 {
 public:
-    MultipartUploaderContext(std::shared_ptr<PartStateCollection> states, std::shared_ptr<BufferManager> buffer_manager, int part_number) :
+    MultipartUploaderContext(std::shared_ptr<PartStateCollection> states, int part_number) :
         _part_states(std::move(states)),
-        _buffer_manager(std::move(buffer_manager)),
         _part_number(part_number)
     {
     }
@@ -342,11 +1868,6 @@ public:
         return _part_number;
     }
 
-    std::shared_ptr<BufferManager> get_buffer_manager() const
-    {
-        return _buffer_manager;
-    }
-
     std::shared_ptr<PartStateCollection> get_part_states() const
     {
         return _part_states;
@@ -354,223 +1875,470 @@ public:
 
 private:
     std::shared_ptr<PartStateCollection> _part_states;
-    std::shared_ptr<BufferManager> _buffer_manager;
     int _part_number;
 };
 
-class MultipartUploader
+MultipartUploader::MultipartUploader(const GstS3UploaderConfig *config) :
+    _bucket(std::move(get_bucket_from_config(config))),
+    _key(std::move(get_key_from_config(config))),
+    _api_handle(config->init_aws_sdk ? AwsApiHandle::GetHandle() : nullptr),
+    _spool(PartSpool::get_instance(is_null_or_empty(config->spool_location) ? g_get_tmp_dir() : config->spool_location,
+        config->max_spool_size)),
+    _part_states(std::make_shared<PartStateCollection>(
+        ConcurrencyController(config->buffer_count, config->max_concurrent_uploads, config->adaptive_concurrency),
+        RetryPolicy(config->max_part_retries, std::chrono::milliseconds(config->part_retry_delay)),
+        config->max_inflight_bytes, config->inflight_policy,
+        _spool, !is_null_or_empty(config->spool_location), config->spool_drain_concurrency)),
+    _buffer_pool(std::make_shared<BufferPool>(config->buffer_count, buffer_ring_factory(config), config->buffer_size)),
+    _part_size(config->buffer_size),
+    _endpoint(is_null_or_empty(config->aws_sdk_endpoint) ? "" : config->aws_sdk_endpoint)
+{
+}
+
+MultipartUploader::~MultipartUploader()
 {
-public:
-    static std::unique_ptr<MultipartUploader> create(const GstS3UploaderConfig *config)
+    _part_states->shutdown();
+    if (_retry_thread.joinable())
+    {
+        _retry_thread.join();
+    }
+
+    // an upload prepared ahead of time but never used would otherwise be
+    // left open (and billed) until a lifecycle rule removes it
+    if (_is_upload_created && _part_counter == 0)
     {
-        auto uploader = std::unique_ptr<MultipartUploader>(new MultipartUploader(config));
-        if (!uploader->_init_uploader(config))
+        Aws::S3::Model::AbortMultipartUploadRequest request;
+        request.WithBucket(_bucket)
+            .WithKey(_key)
+            .WithUploadId(_upload_id);
+        auto outcome = _s3_client->AbortMultipartUpload(request);
+        if (!outcome.IsSuccess())
         {
-            return nullptr;
+            GST_WARNING("Failed to abort the unused upload of %s: %s", _key.c_str(),
+                outcome.GetError().GetMessage().c_str());
+        }
+        else if (_journal)
+        {
+            _journal->remove();
         }
-        return uploader;
     }
+}
 
-    ~MultipartUploader();
-
-    bool upload(const char* data, size_t size);
-    bool complete();
-
-private:
-    explicit MultipartUploader(const GstS3UploaderConfig *config);
-    bool _init_uploader(const GstS3UploaderConfig * config);
-
-    void _init_buffer_manager(size_t buffer_count, size_t buffer_size);
-
-    std::unique_ptr<Aws::IOStream> _create_stream(const char* data, size_t size);
-
-    static void _handle_upload_completed(const Aws::S3::S3Client*, const Aws::S3::Model::UploadPartRequest&, const Aws::S3::Model::UploadPartOutcome& outcome, const std::shared_ptr<const Aws::Client::AsyncCallerContext>& ctx);
+void MultipartUploader::_run_retries()
+{
+    while (_part_states->wait_for_retries())
+    {
+        _dispatch(_s3_client.get(), _part_states);
+    }
+}
 
-    Aws::String _bucket;
-    Aws::String _key;
-    Aws::S3::Model::ObjectCannedACL _acl;
+bool MultipartUploader::_init_uploader(const GstS3UploaderConfig * config)
+{
+    S3ClientSettings settings;
+    settings.bucket = _bucket;
+    settings.region = config->region;
+    settings.ca_file = config->ca_file;
+    settings.endpoint = config->aws_sdk_endpoint;
+    settings.use_http = config->aws_sdk_use_http;
+    settings.verify_ssl = config->aws_sdk_verify_ssl;
+    settings.sign_payload = config->aws_sdk_s3_sign_payload;
+    settings.max_connections = config->max_connections;
+    settings.credentials = config->credentials;
+
+    // the client's signer picks its SHA-256 implementation when created
+    _checksum_algorithm = to_checksum_algorithm(config->checksum_algorithm);
+    _hash_payload = _api_handle && config->hash_on_copy && (config->aws_sdk_s3_sign_payload
+        || config->aws_sdk_use_http || _checksum_algorithm == Aws::S3::Model::ChecksumAlgorithm::SHA256);
+    if (_hash_payload)
+    {
+        _api_handle->hash_part_streams();
+    }
 
-    Aws::S3::Model::CreateMultipartUploadOutcome _upload_outcome;
+    _executor = UploadExecutor::get_instance(config->upload_threads, config->upload_thread_name);
+    if (!_s3_client)
+    {
+        _s3_client = acquire_s3_client(settings, _executor, _is_region_detected);
+    }
+    if (!_s3_client)
+    {
+        return false;
+    }
 
-    std::shared_ptr<AwsApiHandle> _api_handle;
-    std::unique_ptr<Aws::S3::S3Client> _s3_client;
+    _create_request.SetBucket(_bucket);
+    _create_request.SetKey(_key);
 
-    std::condition_variable _upload_completed_cv;
-    std::shared_ptr<PartStateCollection> _part_states;
+    if (!is_null_or_empty(config->acl))
+    {
+        _acl = Aws::S3::Model::ObjectCannedACLMapper::GetObjectCannedACLForName(Aws::String(config->acl));
+        _create_request.SetACL(_acl);
+    }
 
-    std::shared_ptr<BufferManager> _buffer_manager;
-    size_t _buffer_count = 0;
+    if (is_null_or_empty(config->content_type))
+    {
+        _create_request.SetContentType("application/octet-stream");
+    }
+    else
+    {
+        _create_request.SetContentType(config->content_type);
+    }
 
-    int _part_counter = 0;
-    bool _verify_hash = false;
-};
+    if (_checksum_algorithm != Aws::S3::Model::ChecksumAlgorithm::NOT_SET)
+    {
+        _create_request.SetChecksumAlgorithm(_checksum_algorithm);
+    }
 
-// TODO: There's a few things I didn't implement because they're not critical (yet), but might
-//       be needed in the (near) future:
-//        * retry mechanism
-//        * early failure notification - currently we notify user about the failure on complete() call
-//        * implement hash verification - _verify_hash is already there, just need to expose it
-//          as an option and test if works fine
-//        * tests - not sure if AWS provide any infrastructure/framework for testing this kind of code,
-//          or we have to rely on stable internet connection and run tests with credentials that allow
-//          uploading/downloading files from S3.
+    if (!is_null_or_empty(config->journal_location))
+    {
+        _journal = std::make_shared<UploadJournal>(config->journal_location);
+        _part_states->set_journal(_journal);
+        if (config->resume)
+        {
+            _resume();
+        }
+    }
 
-MultipartUploader::MultipartUploader(const GstS3UploaderConfig *config) :
-    _bucket(std::move(get_bucket_from_config(config))),
-    _key(std::move(get_key_from_config(config))),
-    _api_handle(config->init_aws_sdk ? AwsApiHandle::GetHandle() : nullptr),
-    _part_states(std::make_shared<PartStateCollection>(false))
-{
+    _retry_thread = std::thread(&MultipartUploader::_run_retries, this);
+    return true;
 }
 
-MultipartUploader::~MultipartUploader()
+// Makes the next uploader look the region up again if the cached one
+// turned out to be wrong (e.g. the bucket was re-created elsewhere).
+void MultipartUploader::_invalidate_region(const Aws::S3::S3Error& error)
 {
-    if (_buffer_manager)
+    if (_is_region_detected && is_wrong_region_error(error))
     {
-        for (auto buffer : _buffer_manager->ShutdownAndWait(_buffer_count))
-        {
-            free(buffer);
-        }
+        GST_WARNING("Bucket %s isn't in the cached region any more", _bucket.c_str());
+        invalidate_bucket_region(_bucket, _endpoint);
     }
 }
 
-void MultipartUploader::_init_buffer_manager(size_t buffer_count, size_t buffer_size)
+bool MultipartUploader::_create_upload()
 {
-    _buffer_manager = std::make_shared<BufferManager>();
-    _buffer_count = buffer_count;
+    auto outcome = _s3_client->CreateMultipartUpload(_create_request);
+    if (!outcome.IsSuccess())
+    {
+        GST_WARNING("Failed to create the multipart upload: %s", outcome.GetError().GetMessage().c_str());
+        _invalidate_region(outcome.GetError());
+        _is_upload_lost = true;
+        return false;
+    }
 
-    for (size_t i = 0; i < buffer_count; i++)
+    _upload_id = outcome.GetResult().GetUploadId();
+    _is_upload_created = true;
+    if (_journal)
     {
-        _buffer_manager->PutResource(reinterpret_cast<uint8_t*>(malloc(buffer_size)));
+        _journal->start(_bucket, _key, _upload_id, UploadJournal::Parts());
     }
+    return true;
 }
 
-bool MultipartUploader::_init_uploader(const GstS3UploaderConfig * config)
+// Picks up the upload recorded in the journal. Only the parts S3 still
+// lists, up to the first one which is missing or differs from the journal,
+// are kept; the data from there on has to be sent again.
+bool MultipartUploader::_resume()
 {
-    Aws::S3::S3ClientConfiguration client_config;
-    if (!is_null_or_empty(config->ca_file))
+    UploadJournal::Parts journal_parts;
+    if (!_journal->load(_bucket, _key, _upload_id, journal_parts))
     {
-        client_config.caFile = config->ca_file;
+        GST_INFO("No upload of %s to resume", _key.c_str());
+        _upload_id.clear();
+        return false;
     }
-    if (is_null_or_empty(config->region))
+
+    std::map<int, Aws::S3::Model::Part> listed_parts;
+    Aws::S3::Model::ListPartsRequest request;
+    request.WithBucket(_bucket)
+        .WithKey(_key)
+        .WithUploadId(_upload_id);
+    while (true)
     {
-        Aws::String region;
-        if (!get_bucket_location(config->bucket, client_config, region))
+        auto outcome = _s3_client->ListParts(request);
+        if (!outcome.IsSuccess())
         {
-            // TODO report warning
+            GST_WARNING("Can't resume upload %s of %s: %s", _upload_id.c_str(), _key.c_str(),
+                outcome.GetError().GetMessage().c_str());
+            _journal->remove();
+            _upload_id.clear();
+            return false;
         }
-        else if (!region.empty())
+        for (const auto& part : outcome.GetResult().GetParts())
         {
-            client_config.region = std::move(region);
+            listed_parts[part.GetPartNumber()] = part;
         }
+        if (!outcome.GetResult().GetIsTruncated())
+        {
+            break;
+        }
+        request.SetPartNumberMarker(outcome.GetResult().GetNextPartNumberMarker());
     }
-    else
+
+    UploadJournal::Parts parts;
+    for (int part_number = 1; ; part_number++)
+    {
+        auto listed = listed_parts.find(part_number);
+        if (listed == listed_parts.end())
+        {
+            break;
+        }
+
+        // a part S3 got but which wasn't journaled before the crash is fine
+        UploadJournal::Part part{static_cast<size_t>(listed->second.GetSize()), listed->second.GetETag(),
+            listed->second.GetChecksumCRC32C().empty() ? listed->second.GetChecksumSHA256() : listed->second.GetChecksumCRC32C()};
+        auto journaled = journal_parts.find(part_number);
+        if (journaled != journal_parts.end()
+            && (journaled->second.etag != part.etag || journaled->second.size != part.size))
+        {
+            GST_WARNING("Part %d of %s doesn't match the journal", part_number, _key.c_str());
+            break;
+        }
+
+        _part_states->restore_completed_part(part_number, part.etag, part.checksum);
+        _resumed_bytes += part.size;
+        parts[part_number] = std::move(part);
+    }
+
+    _resumed_parts = _part_counter = static_cast<int>(parts.size());
+    _is_upload_created = true;
+    _journal->start(_bucket, _key, _upload_id, parts);
+
+    GST_INFO("Resuming upload %s of %s after %d part(s), %" G_GUINT64_FORMAT " bytes",
+        _upload_id.c_str(), _key.c_str(), _resumed_parts, _resumed_bytes);
+    return true;
+}
+
+// Parts only grow, so a first part smaller than the part size is the last
+// one as well.
+bool MultipartUploader::_is_single_part(size_t size) const
+{
+    return !_is_upload_created && !_single_part && _part_counter == 0 && size < _part_size;
+}
+
+// Turns the part held for a single PutObject into the first part of a
+// multipart upload.
+bool MultipartUploader::_flush_single_part()
+{
+    if (!_single_part)
     {
-        client_config.region = config->region;
+        return true;
     }
 
-    auto credentials_provider = gst_aws_credentials_create_provider(config->credentials);
-    if (!credentials_provider)
+    auto part = std::move(_single_part);
+    if (_part_states->admit(part->get_size()) == PartAdmission::SPILL)
     {
-        return false;
+        part = SpilledPartData::create(_spool, *part->get_stream()->rdbuf(), part->get_size());
     }
 
-    // Configure AWS SDK specific client configuration
-    if (!is_null_or_empty(config->aws_sdk_endpoint))
+    return _enqueue(std::move(part));
+}
+
+bool MultipartUploader::_put_object()
+{
+    Aws::S3::Model::PutObjectRequest request;
+    request.WithBucket(_bucket)
+        .WithKey(_key)
+        .WithContentType(_create_request.GetContentType());
+    if (_create_request.ACLHasBeenSet())
     {
-        client_config.endpointOverride = Aws::String(config->aws_sdk_endpoint);
+        request.SetACL(_acl);
     }
-    if (config->aws_sdk_use_http)
+    if (_checksum_algorithm != Aws::S3::Model::ChecksumAlgorithm::NOT_SET)
     {
-        client_config.scheme = Aws::Http::Scheme::HTTP;
+        request.SetChecksumAlgorithm(_checksum_algorithm);
     }
-    client_config.verifySSL = config->aws_sdk_verify_ssl;
 
-    const char* endpoint_provider_allocation_tag = "AWSS3EndpointProvider";
+    if (_single_part)
+    {
+        request.SetContentLength(_single_part->get_size());
+        request.SetBody(_single_part->get_stream());
+    }
+    else
+    {
+        request.SetContentLength(0);
+        request.SetBody(Aws::MakeShared<Aws::StringStream>("PutObjectBody"));
+    }
 
-    if (!config->aws_sdk_s3_sign_payload) {
-        client_config.payloadSigningPolicy = Aws::Client::AWSAuthV4Signer::PayloadSigningPolicy::Never;
-        client_config.useVirtualAddressing = false;
+    auto outcome = _s3_client->PutObject(request);
+    _single_part.reset();
+    if (!outcome.IsSuccess())
+    {
+        GST_WARNING("Failed to upload the object: %s", outcome.GetError().GetMessage().c_str());
+        _invalidate_region(outcome.GetError());
+        return false;
     }
 
-    _s3_client = std::unique_ptr<Aws::S3::S3Client>(new Aws::S3::S3Client(std::move(credentials_provider), Aws::MakeShared<Aws::S3::Endpoint::S3EndpointProvider>(endpoint_provider_allocation_tag), client_config));
+    _checksum = _checksum_algorithm == Aws::S3::Model::ChecksumAlgorithm::CRC32C
+        ? outcome.GetResult().GetChecksumCRC32C() : outcome.GetResult().GetChecksumSHA256();
+    return true;
+}
 
-    _init_buffer_manager(config->buffer_count, config->buffer_size);
+// Creates the multipart upload right away rather than with the second
+// part; the object won't be sent with a single PutObject then.
+bool MultipartUploader::prepare()
+{
+    if (_is_upload_created)
+    {
+        return true;
+    }
+    return !_is_upload_lost && !_single_part && _create_upload();
+}
 
-    Aws::S3::Model::CreateMultipartUploadRequest upload_request;
-    upload_request.SetBucket(_bucket);
-    upload_request.SetKey(_key);
+bool MultipartUploader::upload(const char* data, size_t size)
+{
+    // no point in sending more data once a part is lost
+    if (!_part_states->get_error().empty())
+    {
+        return false;
+    }
 
-    if (!is_null_or_empty(config->acl))
+    if (_is_single_part(size))
     {
-        _acl = Aws::S3::Model::ObjectCannedACLMapper::GetObjectCannedACLForName(Aws::String(config->acl));
-        upload_request.SetACL(_acl);
+        // likely the whole object, hold it until complete() tells
+        _single_part = PooledPartData::create(_buffer_pool, data, size, _hash_payload);
+        return true;
     }
 
-    if (is_null_or_empty(config->content_type))
+    if (!_flush_single_part())
     {
-        upload_request.SetContentType("application/octet-stream");
+        return false;
     }
-    else
+
+    if (_part_states->admit(size) == PartAdmission::SPILL)
     {
-        upload_request.SetContentType(config->content_type);
+        Aws::Utils::Stream::PreallocatedStreamBuf source(reinterpret_cast<unsigned char*>(const_cast<char*>(data)), size);
+        return _enqueue(SpilledPartData::create(_spool, source, size));
     }
 
-    _upload_outcome = _s3_client->CreateMultipartUpload(upload_request);
-    return _upload_outcome.IsSuccess();
+    return _enqueue(PooledPartData::create(_buffer_pool, data, size, _hash_payload));
 }
 
-std::unique_ptr<Aws::IOStream> MultipartUploader::_create_stream(const char* data, size_t size)
+bool MultipartUploader::upload(GstBufferList* list, size_t size)
 {
-    auto buffer = _buffer_manager->Acquire();
-    memcpy(buffer, data, size);
+    auto stream_buffer = new BufferListStreamBuf(list);
+    std::unique_ptr<PartData> data(new PartData(stream_buffer, stream_buffer->get_size()));
+    if (!_part_states->get_error().empty())
+    {
+        return false;
+    }
+
+    if (data->get_size() != size)
+    {
+        GST_WARNING("Part buffer list holds %" G_GSIZE_FORMAT " bytes, expected %" G_GSIZE_FORMAT,
+            data->get_size(), size);
+        return false;
+    }
+
+    if (_is_single_part(size))
+    {
+        _single_part = std::move(data);
+        return true;
+    }
+
+    if (!_flush_single_part())
+    {
+        return false;
+    }
+
+    if (_part_states->admit(size) == PartAdmission::SPILL)
+    {
+        // writing the part out releases the upstream memory right away
+        data = SpilledPartData::create(_spool, *stream_buffer, size);
+    }
 
-    return std::unique_ptr<Aws::IOStream>(
-        new Aws::IOStream(new Aws::Utils::Stream::PreallocatedStreamBuf(buffer, size)));
+    return _enqueue(std::move(data));
 }
 
-bool MultipartUploader::upload(const char* data, size_t size)
+bool MultipartUploader::_enqueue(std::unique_ptr<PartData> data)
 {
+    if (!data || (!_is_upload_created && !_create_upload()))
+    {
+        return false;
+    }
+
     int part_number = ++_part_counter;
+    bool spilled = dynamic_cast<SpilledPartData*>(data.get()) != nullptr;
 
-    std::shared_ptr<Aws::IOStream> stream = _create_stream(data, size);
+    auto stream = data->get_stream();
     Aws::S3::Model::UploadPartRequest request;
     request.WithBucket(_bucket)
         .WithKey(_key)
         .WithPartNumber(part_number)
-        .WithUploadId(_upload_outcome.GetResult().GetUploadId())
-        .WithContentLength(size);
+        .WithUploadId(_upload_id)
+        .WithContentLength(data->get_size());
     request.SetBody(stream);
-
-    PartState part_state(part_number);
-
-    if (_verify_hash)
+    if (_checksum_algorithm != Aws::S3::Model::ChecksumAlgorithm::NOT_SET)
     {
-        Aws::Utils::ByteBuffer md5_of_stream(Aws::Utils::HashingUtils::CalculateMD5(*stream));
-        request.SetContentMD5(Aws::Utils::HashingUtils::Base64Encode(md5_of_stream));
-        part_state.set_md5_hash(md5_of_stream);
+        // the SDK computes the checksum when the request is sent, i.e. on
+        // the client's executor rather than on the streaming thread
+        request.SetChecksumAlgorithm(_checksum_algorithm);
     }
 
-    _part_states->start(std::move(part_state));
+    PartState part_state(part_number, std::move(data));
+    part_state.set_spilled(spilled);
 
-    auto context = std::make_shared<MultipartUploaderContext>(_part_states, _buffer_manager, part_number);
+    part_state.set_request(std::move(request));
+    _part_states->enqueue(std::move(part_state));
 
-    _s3_client->UploadPartAsync(request, _handle_upload_completed, context);
+    _dispatch(_s3_client.get(), _part_states);
 
     return true;
 }
 
+void MultipartUploader::_dispatch(const Aws::S3::S3Client* client, const std::shared_ptr<PartStateCollection>& states)
+{
+    int part_number;
+    Aws::S3::Model::UploadPartRequest request;
+
+    while (states->take_next_to_send(part_number, request))
+    {
+        auto context = std::make_shared<MultipartUploaderContext>(states, part_number);
+        client->UploadPartAsync(request, _handle_upload_completed, context);
+    }
+}
+
+GstStructure* MultipartUploader::get_stats() const
+{
+    GstStructure* stats = gst_structure_new_empty("s3-uploader-stats");
+    _part_states->fill_stats(stats);
+    _executor->fill_stats(stats);
+    if (!_checksum.empty())
+    {
+        gst_structure_set(stats, "checksum", G_TYPE_STRING, _checksum.c_str(), NULL);
+    }
+    if (!_expected_checksum.empty())
+    {
+        gst_structure_set(stats, "expected-checksum", G_TYPE_STRING, _expected_checksum.c_str(), NULL);
+    }
+    gst_structure_set(stats,
+        "resumed-parts", G_TYPE_UINT, static_cast<guint>(_resumed_parts),
+        "resumed-bytes", G_TYPE_UINT64, _resumed_bytes,
+        NULL);
+    return stats;
+}
+
+std::string MultipartUploader::get_error() const
+{
+    return _part_states->get_error();
+}
+
 bool MultipartUploader::complete()
 {
+    if (!_is_upload_created)
+    {
+        return !_is_upload_lost && _put_object();
+    }
+
     _part_states->wait_for_complete();
 
     Aws::S3::Model::CompletedMultipartUpload completed_multipart_upload;
+    Aws::Vector<Aws::String> part_checksums;
     for (const auto& part : _part_states->get_completed_parts())
     {
         Aws::S3::Model::CompletedPart completed_part;
         completed_part.SetETag(part.second.get_etag());
         completed_part.SetPartNumber(part.second.get_part_number());
+        set_part_checksum(completed_part, _checksum_algorithm, part.second.get_checksum());
         completed_multipart_upload.AddParts(completed_part);
+        part_checksums.push_back(part.second.get_checksum());
     }
 
     size_t parts_failed_count = _part_states->get_failed_parts_count();
@@ -579,35 +2347,71 @@ bool MultipartUploader::complete()
     Aws::S3::Model::CompleteMultipartUploadRequest upload_request;
     upload_request.SetBucket(_bucket);
     upload_request.SetKey(_key);
-    upload_request.SetUploadId(_upload_outcome.GetResult().GetUploadId());
+    upload_request.SetUploadId(_upload_id);
 
     upload_request.WithMultipartUpload(completed_multipart_upload);
 
-    return parts_failed_count == 0 && _s3_client->CompleteMultipartUpload(upload_request).IsSuccess();
+    if (parts_failed_count != 0)
+    {
+        return false;
+    }
+
+    auto outcome = _s3_client->CompleteMultipartUpload(upload_request);
+    if (!outcome.IsSuccess())
+    {
+        return false;
+    }
+
+    if (_journal)
+    {
+        _journal->remove();
+    }
+
+    // the object is there whatever its checksum, so a mismatch is only
+    // reported; S3 may not echo the checksum at all
+    if (_checksum_algorithm != Aws::S3::Model::ChecksumAlgorithm::NOT_SET)
+    {
+        auto expected = compute_composite_checksum(_checksum_algorithm, part_checksums);
+        _checksum = get_object_checksum(outcome.GetResult(), _checksum_algorithm);
+        if (_checksum.empty())
+        {
+            _checksum = expected;
+        }
+        else if (_checksum != expected)
+        {
+            GST_WARNING("Object checksum mismatch: expected %s, got %s", expected.c_str(), _checksum.c_str());
+            _expected_checksum = expected;
+        }
+    }
+
+    return true;
 }
 
-void MultipartUploader::_handle_upload_completed(const Aws::S3::S3Client*,
-    const Aws::S3::Model::UploadPartRequest& request,
+void MultipartUploader::_handle_upload_completed(const Aws::S3::S3Client* client,
+    const Aws::S3::Model::UploadPartRequest&,
     const Aws::S3::Model::UploadPartOutcome& outcome,
     const std::shared_ptr<const Aws::Client::AsyncCallerContext>& ctx)
 {
     auto context = std::static_pointer_cast<const MultipartUploaderContext>(ctx);
 
-    auto original_stream_buffer = (Aws::Utils::Stream::PreallocatedStreamBuf*)request.GetBody()->rdbuf();
-    context->get_buffer_manager()->Release(original_stream_buffer->GetBuffer());
-    delete original_stream_buffer;
-
     auto states = context->get_part_states();
     int part_number = context->get_part_number();
 
-    if (outcome.IsSuccess() && states->verify_upload_outcome(part_number, outcome))
+    // marking the part releases its body (for zero-copy parts, the
+    // references to the upstream memory)
+    if (outcome.IsSuccess())
     {
-        states->mark_part_as_completed(part_number, outcome.GetResult().GetETag());
+        states->mark_part_as_completed(part_number, outcome.GetResult().GetETag(), get_part_checksum(outcome.GetResult()));
     }
     else
     {
-        states->mark_part_as_failed(part_number);
+        const auto& error = outcome.GetError();
+        GST_WARNING("Failed to upload part %d: %s", part_number, error.GetMessage().c_str());
+        states->mark_part_as_failed(part_number, is_congestion_error(error), is_retryable_error(error),
+            is_unreachable_error(error), std::string(error.GetExceptionName().c_str()) + ": " + error.GetMessage().c_str());
     }
+
+    _dispatch(client, states);
 }
 
 } // namespace s3
@@ -649,10 +2453,53 @@ gst_s3_multipart_uploader_complete (GstS3Uploader * uploader)
   g_return_val_if_fail (self && self->impl, FALSE);
   return self->impl->complete ();
 }
+
+static gboolean
+gst_s3_multipart_uploader_upload_part_list (GstS3Uploader *
+    uploader, GstBufferList * list, gsize size)
+{
+  GstS3MultipartUploader *self = MULTIPART_UPLOADER_ (uploader);
+  if (!self || !self->impl)
+  {
+    gst_buffer_list_unref (list);
+    g_return_val_if_reached (FALSE);
+  }
+  return self->impl->upload (list, size);
+}
+
+static GstStructure *
+gst_s3_multipart_uploader_get_stats (GstS3Uploader * uploader)
+{
+  GstS3MultipartUploader *self = MULTIPART_UPLOADER_ (uploader);
+  g_return_val_if_fail (self && self->impl, NULL);
+  return self->impl->get_stats ();
+}
+
+static gchar *
+gst_s3_multipart_uploader_get_error (GstS3Uploader * uploader)
+{
+  GstS3MultipartUploader *self = MULTIPART_UPLOADER_ (uploader);
+  g_return_val_if_fail (self && self->impl, NULL);
+  auto error = self->impl->get_error ();
+  return error.empty () ? NULL : g_strdup (error.c_str ());
+}
+
+static gboolean
+gst_s3_multipart_uploader_prepare (GstS3Uploader * uploader)
+{
+  GstS3MultipartUploader *self = MULTIPART_UPLOADER_ (uploader);
+  g_return_val_if_fail (self && self->impl, FALSE);
+  return self->impl->prepare ();
+}
+
 static GstS3UploaderClass default_class = {
   gst_s3_multipart_uploader_destroy,
   gst_s3_multipart_uploader_upload_part,
-  gst_s3_multipart_uploader_complete
+  gst_s3_multipart_uploader_complete,
+  gst_s3_multipart_uploader_upload_part_list,
+  gst_s3_multipart_uploader_get_stats,
+  gst_s3_multipart_uploader_get_error,
+  gst_s3_multipart_uploader_prepare
 };
 
 GstS3Uploader *
@@ -670,6 +2517,17 @@ gst_s3_multipart_uploader_new (const GstS3UploaderConfig * config)
   return reinterpret_cast < GstS3Uploader * >(new GstS3MultipartUploader (std::move (impl)));
 }
 
+void
+gst_s3_multipart_uploader_set_sdk_idle_timeout (gint seconds)
+{
+  AwsApiKeeper::get_instance ().set_idle_timeout (seconds);
+  if (seconds < 0)
+  {
+    // pinned: initialize it right away
+    AwsApiHandle::GetHandle ();
+  }
+}
+
 _GstS3MultipartUploader::_GstS3MultipartUploader(std::unique_ptr<MultipartUploader> impl) :
     impl(std::move(impl))
 {
@@ -29,6 +29,11 @@ typedef struct _GstS3MultipartUploader GstS3MultipartUploader;
 
 GstS3Uploader * gst_s3_multipart_uploader_new (const GstS3UploaderConfig * config);
 
+/* How long (in seconds) the AWS SDK initialized by uploaders stays up once
+ * none of them uses it: 0 (the default) shuts it down right away, -1 keeps
+ * it until the process exits and initializes it immediately. */
+void gst_s3_multipart_uploader_set_sdk_idle_timeout (gint seconds);
+
 G_END_DECLS
 
 #endif /* __GST_S3_MULTIPART_UPLOADER_H__ */
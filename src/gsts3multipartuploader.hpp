@@ -0,0 +1,991 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef __GST_S3_MULTIPART_UPLOADER_HPP__
+#define __GST_S3_MULTIPART_UPLOADER_HPP__
+
+#include "gsts3multipartuploader.h"
+
+#include <aws/core/client/AsyncCallerContext.h>
+#include <aws/core/utils/crypto/Factories.h>
+#include <aws/core/utils/crypto/Hash.h>
+#include <aws/core/utils/crypto/HashResult.h>
+#include <aws/core/utils/memory/stl/AWSStreamFwd.h>
+#include <aws/core/utils/stream/PreallocatedStreamBuf.h>
+#include <aws/core/utils/threading/Executor.h>
+#include <aws/crt/crypto/Hash.h>
+#include <aws/s3/model/CreateMultipartUploadRequest.h>
+#include <aws/s3/model/UploadPartRequest.h>
+#include <aws/s3/S3Client.h>
+
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define GST_CAT_DEFAULT gst_s3_sink_debug
+
+// Building blocks of the multipart uploader, shared with its unit tests.
+namespace gst
+{
+namespace aws
+{
+namespace s3
+{
+
+// Additive-increase/multiplicative-decrease control of the number of parts
+// uploaded in parallel. The window grows by one part for as long as every
+// round of uploads (one window worth of parts) achieves a higher throughput
+// than the previous one, and is halved when S3 asks to slow down, the
+// network gives up on a request or the time to upload a byte spikes.
+// A congestion event shows in every part in flight at the time, so the
+// window is halved at most once per round trip: only parts sent after the
+// last decrease can decrease it again.
+class ConcurrencyController
+{
+public:
+    ConcurrencyController(size_t window, size_t max_window, bool adaptive) :
+        _window(std::max<size_t>(window, 1)),
+        _max_window(adaptive ? std::max(max_window, _window) : _window),
+        _adaptive(adaptive)
+    {
+    }
+
+    size_t get_window() const
+    {
+        return _window;
+    }
+
+    guint64 get_backoffs() const
+    {
+        return _backoffs;
+    }
+
+    void on_part_completed(size_t size, std::chrono::steady_clock::time_point sent_at,
+        std::chrono::steady_clock::time_point completed_at)
+    {
+        if (!_adaptive || size == 0)
+        {
+            return;
+        }
+
+        double seconds_per_byte = std::chrono::duration<double>(completed_at - sent_at).count() / size;
+        if (_samples >= MIN_LATENCY_SAMPLES && seconds_per_byte > _mean_seconds_per_byte * LATENCY_SPIKE_FACTOR)
+        {
+            _back_off(sent_at, completed_at, "Part latency spiked");
+        }
+        _mean_seconds_per_byte = _samples == 0 ? seconds_per_byte :
+            (1 - LATENCY_SMOOTHING) * _mean_seconds_per_byte + LATENCY_SMOOTHING * seconds_per_byte;
+        _samples++;
+
+        if (_round_parts == 0)
+        {
+            _round_start = sent_at;
+        }
+        _round_bytes += size;
+        _round_parts++;
+
+        if (_round_parts >= _window)
+        {
+            double throughput = _round_bytes / std::chrono::duration<double>(completed_at - _round_start).count();
+            if (throughput > _last_round_throughput * THROUGHPUT_IMPROVEMENT && _window < _max_window)
+            {
+                _window++;
+                GST_DEBUG("Upload throughput improved to %.0f B/s, upload window: %" G_GSIZE_FORMAT, throughput, _window);
+            }
+            _last_round_throughput = throughput;
+            _round_parts = 0;
+            _round_bytes = 0;
+        }
+    }
+
+    void on_congestion(std::chrono::steady_clock::time_point sent_at,
+        std::chrono::steady_clock::time_point failed_at)
+    {
+        if (_adaptive)
+        {
+            _back_off(sent_at, failed_at, "Upload congested");
+        }
+    }
+
+private:
+    static constexpr double LATENCY_SPIKE_FACTOR = 2.0;
+    static constexpr double LATENCY_SMOOTHING = 0.2;
+    static constexpr double THROUGHPUT_IMPROVEMENT = 1.05;
+    static constexpr guint64 MIN_LATENCY_SAMPLES = 4;
+
+    void _back_off(std::chrono::steady_clock::time_point sent_at, std::chrono::steady_clock::time_point now,
+        const char* reason)
+    {
+        if (sent_at < _last_backoff)
+        {
+            // the window was already halved for this round trip
+            return;
+        }
+
+        GST_INFO("%s, halving upload window", reason);
+        _window = std::max<size_t>(_window / 2, 1);
+        _backoffs++;
+        _last_backoff = now;
+        _round_parts = 0;
+        _round_bytes = 0;
+        _last_round_throughput = 0;
+    }
+
+    size_t _window;
+    size_t _max_window;
+    bool _adaptive;
+
+    double _mean_seconds_per_byte = 0;
+    guint64 _samples = 0;
+    guint64 _backoffs = 0;
+    std::chrono::steady_clock::time_point _last_backoff;
+
+    std::chrono::steady_clock::time_point _round_start;
+    size_t _round_parts = 0;
+    size_t _round_bytes = 0;
+    double _last_round_throughput = 0;
+};
+
+// Jittered exponential backoff between attempts to upload a part.
+class RetryPolicy
+{
+public:
+    RetryPolicy(guint max_retries, std::chrono::milliseconds base_delay) :
+        _max_retries(max_retries),
+        _base_delay(base_delay)
+    {
+    }
+
+    // attempts: number of times the part has been sent so far
+    bool should_retry(guint attempts) const
+    {
+        return attempts <= _max_retries;
+    }
+
+    std::chrono::milliseconds get_delay(guint attempts) const
+    {
+        double delay = _base_delay.count() * std::pow(2.0, std::max<guint>(attempts, 1) - 1);
+        delay = std::min(delay, static_cast<double>(MAX_DELAY.count()));
+        // "equal jitter": half of the delay is fixed, the other half random
+        return std::chrono::milliseconds(static_cast<gint64>(delay / 2 + g_random_double_range(0, delay / 2)));
+    }
+
+private:
+    static constexpr std::chrono::milliseconds MAX_DELAY{30000};
+
+    guint _max_retries;
+    std::chrono::milliseconds _base_delay;
+};
+
+// Body of a part upload request. When the part's SHA-256 was computed while
+// the part was copied, the digest travels with the stream so that signing
+// the request doesn't need to read the whole part again.
+class PartStream : public Aws::IOStream
+{
+public:
+    explicit PartStream(std::streambuf* stream_buffer) :
+        Aws::IOStream(stream_buffer)
+    {
+    }
+
+    bool has_sha256() const
+    {
+        return _sha256.GetLength() > 0;
+    }
+
+    const Aws::Utils::ByteBuffer& get_sha256() const
+    {
+        return _sha256;
+    }
+
+    void set_sha256(Aws::Utils::ByteBuffer sha256)
+    {
+        _sha256 = std::move(sha256);
+    }
+
+private:
+    Aws::Utils::ByteBuffer _sha256;
+};
+
+// SHA-256 implementation handed to the SDK (used for SigV4 payload hashes
+// and SHA-256 checksums). It returns the digest of a PartStream without
+// reading it, and hashes everything else with the CRT.
+class PartStreamSha256 : public Aws::Utils::Crypto::Hash
+{
+public:
+    PartStreamSha256() :
+        _hash(Aws::Crt::Crypto::Hash::CreateSHA256())
+    {
+    }
+
+    Aws::Utils::Crypto::HashResult Calculate(const Aws::String& str) override
+    {
+        auto hash = Aws::Crt::Crypto::Hash::CreateSHA256();
+        hash.Update(Aws::Crt::ByteCursorFromArray(reinterpret_cast<const uint8_t*>(str.data()), str.size()));
+        return _digest(hash);
+    }
+
+    Aws::Utils::Crypto::HashResult Calculate(Aws::IStream& stream) override
+    {
+        auto part_stream = dynamic_cast<PartStream*>(&stream);
+        if (part_stream && part_stream->has_sha256())
+        {
+            return part_stream->get_sha256();
+        }
+
+        auto hash = Aws::Crt::Crypto::Hash::CreateSHA256();
+        auto start = stream.tellg();
+        char block[BLOCK_SIZE];
+        while (stream.good())
+        {
+            stream.read(block, sizeof(block));
+            hash.Update(Aws::Crt::ByteCursorFromArray(reinterpret_cast<const uint8_t*>(block), stream.gcount()));
+        }
+
+        // like the SDK's own implementations, leave the stream where it was
+        stream.clear();
+        stream.seekg(start, std::ios_base::beg);
+
+        return _digest(hash);
+    }
+
+    void Update(unsigned char* buffer, size_t size) override
+    {
+        _hash.Update(Aws::Crt::ByteCursorFromArray(buffer, size));
+    }
+
+    Aws::Utils::Crypto::HashResult GetHash() override
+    {
+        auto result = _digest(_hash);
+        _hash = Aws::Crt::Crypto::Hash::CreateSHA256();
+        return result;
+    }
+
+    static Aws::Utils::ByteBuffer digest(Aws::Crt::Crypto::Hash& hash)
+    {
+        Aws::Utils::ByteBuffer result(Aws::Crt::Crypto::SHA256_DIGEST_SIZE);
+        auto output = Aws::Crt::ByteBufFromEmptyArray(result.GetUnderlyingData(), result.GetLength());
+        if (!hash.Digest(output))
+        {
+            return Aws::Utils::ByteBuffer();
+        }
+        return result;
+    }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 16 * 1024;
+
+    static Aws::Utils::Crypto::HashResult _digest(Aws::Crt::Crypto::Hash& hash)
+    {
+        auto result = digest(hash);
+        if (result.GetLength() == 0)
+        {
+            return false;
+        }
+        return result;
+    }
+
+    Aws::Crt::Crypto::Hash _hash;
+};
+
+// Installed only once an uploader hashes its parts while copying them, see
+// AwsApiHandle::hash_part_streams().
+class PartStreamSha256Factory : public Aws::Utils::Crypto::HashFactory
+{
+public:
+    std::shared_ptr<Aws::Utils::Crypto::Hash> CreateImplementation() const override
+    {
+        return std::make_shared<PartStreamSha256>();
+    }
+};
+
+// Part buffers carved out of a shared mapping of an unlinked file, so that
+// the kernel can write them back and drop them under memory pressure rather
+// than keeping them resident. A buffer takes a run of whole slots, handed out
+// in ring order.
+class MappedBufferRing
+{
+public:
+    static std::unique_ptr<MappedBufferRing> create(const char* directory, size_t slot_size, size_t slot_count)
+    {
+#if defined(__linux__) || defined(__APPLE__)
+        gchar* path = g_build_filename(directory, "gst-s3-buffers-XXXXXX", NULL);
+        gint fd = g_mkstemp(path);
+        if (fd < 0)
+        {
+            GST_WARNING("Failed to create a buffer file in %s", directory);
+            g_free(path);
+            return nullptr;
+        }
+        g_unlink(path);
+        g_free(path);
+
+        size_t size = slot_size * slot_count;
+        void* base = MAP_FAILED;
+        if (ftruncate(fd, size) == 0)
+        {
+            base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        if (base == MAP_FAILED)
+        {
+            GST_WARNING("Failed to map %" G_GSIZE_FORMAT " bytes of buffers in %s", size, directory);
+            g_close(fd, NULL);
+            return nullptr;
+        }
+        // kept open to free the file blocks behind released buffers
+        return std::unique_ptr<MappedBufferRing>(new MappedBufferRing(static_cast<uint8_t*>(base), fd, slot_size, slot_count));
+#else
+        GST_WARNING("Memory-mapped buffers aren't supported on this platform");
+        return nullptr;
+#endif
+    }
+
+    ~MappedBufferRing()
+    {
+#if defined(__linux__) || defined(__APPLE__)
+        munmap(_base, _slot_size * _runs.size());
+        g_close(_fd, NULL);
+#endif
+    }
+
+    size_t get_slot_size() const
+    {
+        return _slot_size;
+    }
+
+    // Whether none of the buffers is in use.
+    bool is_idle()
+    {
+        std::lock_guard<std::mutex> l(_mtx);
+        return _used_slots == 0;
+    }
+
+    // Returns nullptr if there is no run of free slots big enough.
+    uint8_t* acquire(size_t size, size_t& capacity)
+    {
+        size_t slots = std::max<size_t>(1, (size + _slot_size - 1) / _slot_size);
+        std::lock_guard<std::mutex> l(_mtx);
+        if (slots > _runs.size())
+        {
+            return nullptr;
+        }
+
+        // a run can't wrap around, so the scan restarts from the beginning
+        // when it hits the end of the ring
+        for (size_t scanned = 0, start = _cursor; scanned < _runs.size();)
+        {
+            if (start + slots > _runs.size())
+            {
+                scanned += _runs.size() - start;
+                start = 0;
+                continue;
+            }
+
+            size_t end = start;
+            while (end < start + slots && _runs[end] == 0)
+            {
+                end++;
+            }
+            if (end == start + slots)
+            {
+                for (size_t i = 0; i < slots; i++)
+                {
+                    _runs[start + i] = slots - i;
+                }
+                _used_slots += slots;
+                _cursor = (start + slots) % _runs.size();
+                capacity = slots * _slot_size;
+                return _base + start * _slot_size;
+            }
+
+            // skip past the buffer in the way
+            size_t next = end + _runs[end];
+            scanned += next - start;
+            start = next % _runs.size();
+        }
+        return nullptr;
+    }
+
+    // Returns false if the buffer doesn't belong to the ring.
+    bool release(uint8_t* buffer)
+    {
+        if (buffer < _base || buffer >= _base + _slot_size * _runs.size())
+        {
+            return false;
+        }
+
+        size_t start = (buffer - _base) / _slot_size;
+        std::lock_guard<std::mutex> l(_mtx);
+        size_t slots = _runs[start];
+        // dropping the pages of a shared mapping (MADV_DONTNEED) would still
+        // have the kernel write them back; freeing the file blocks discards
+        // them, dirty or not
+#if defined(__linux__)
+        if (fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start * _slot_size, slots * _slot_size) != 0)
+        {
+            madvise(buffer, slots * _slot_size, MADV_REMOVE);
+        }
+#elif defined(__APPLE__)
+        fpunchhole_t hole = {0, 0, static_cast<off_t>(start * _slot_size), static_cast<off_t>(slots * _slot_size)};
+        fcntl(_fd, F_PUNCHHOLE, &hole);
+#endif
+        std::fill_n(_runs.begin() + start, slots, 0);
+        _used_slots -= slots;
+        return true;
+    }
+
+private:
+    MappedBufferRing(uint8_t* base, gint fd, size_t slot_size, size_t slot_count) :
+        _base(base),
+        _fd(fd),
+        _slot_size(slot_size),
+        _runs(slot_count, 0)
+    {
+    }
+
+    std::mutex _mtx;
+    uint8_t* _base;
+    gint _fd;
+    size_t _slot_size;
+    // for every slot, the number of slots left until the end of the buffer
+    // holding it, 0 if free
+    std::vector<size_t> _runs;
+    size_t _used_slots = 0;
+    size_t _cursor = 0;
+};
+
+// Recycles part buffers, so that a steady stream of parts doesn't go
+// through the allocator for every part.
+class BufferPool
+{
+public:
+    // Creates a ring with slots of the given size; returns nullptr if it
+    // can't.
+    using RingFactory = std::function<std::unique_ptr<MappedBufferRing>(size_t slot_size)>;
+
+    // With a ring factory, buffers are taken from a ring with slots of the
+    // part size, which is replaced by one with bigger slots as parts grow.
+    explicit BufferPool(size_t max_idle_buffers, RingFactory ring_factory = nullptr, size_t slot_size = 0) :
+        _max_idle_buffers(max_idle_buffers),
+        _ring_factory(std::move(ring_factory))
+    {
+        if (_ring_factory && slot_size > 0)
+        {
+            _ring = _ring_factory(slot_size);
+        }
+    }
+
+    ~BufferPool()
+    {
+        for (auto& buffer : _idle_buffers)
+        {
+            free(buffer.first);
+        }
+    }
+
+    uint8_t* acquire(size_t size, size_t& capacity)
+    {
+        if (_ring_factory)
+        {
+            std::lock_guard<std::mutex> l(_ring_mtx);
+            if ((!_ring || size > _ring->get_slot_size()) && size > _failed_slot_size)
+            {
+                _grow_ring(size);
+            }
+            if (_ring)
+            {
+                if (uint8_t* buffer = _ring->acquire(size, capacity))
+                {
+                    return buffer;
+                }
+                GST_DEBUG("Buffer ring is full, allocating %" G_GSIZE_FORMAT " bytes on the heap", size);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> l(_mtx);
+            for (auto it = _idle_buffers.begin(); it != _idle_buffers.end(); ++it)
+            {
+                if (it->second >= size)
+                {
+                    uint8_t* buffer = it->first;
+                    capacity = it->second;
+                    _idle_buffers.erase(it);
+                    return buffer;
+                }
+            }
+        }
+
+        capacity = size;
+        return reinterpret_cast<uint8_t*>(malloc(size));
+    }
+
+    void release(uint8_t* buffer, size_t capacity)
+    {
+        if (_ring_factory)
+        {
+            std::lock_guard<std::mutex> l(_ring_mtx);
+            if (_ring && _ring->release(buffer))
+            {
+                return;
+            }
+            for (auto it = _retired_rings.begin(); it != _retired_rings.end(); ++it)
+            {
+                if ((*it)->release(buffer))
+                {
+                    if ((*it)->is_idle())
+                    {
+                        _retired_rings.erase(it);
+                    }
+                    return;
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> l(_mtx);
+        _idle_buffers.emplace_back(buffer, capacity);
+        if (_idle_buffers.size() > _max_idle_buffers)
+        {
+            // keep the biggest buffers, they can serve any part
+            auto smallest = std::min_element(_idle_buffers.begin(), _idle_buffers.end(),
+                [](const IdleBuffer& a, const IdleBuffer& b) { return a.second < b.second; });
+            free(smallest->first);
+            _idle_buffers.erase(smallest);
+        }
+    }
+
+private:
+    using IdleBuffer = std::pair<uint8_t*, size_t>;
+
+    // The buffers still taken from the current ring keep it mapped until
+    // they are all released.
+    void _grow_ring(size_t slot_size)
+    {
+        auto ring = _ring_factory(slot_size);
+        if (!ring)
+        {
+            // not tried again until parts grow further
+            _failed_slot_size = slot_size;
+            return;
+        }
+
+        if (_ring && !_ring->is_idle())
+        {
+            _retired_rings.push_back(std::move(_ring));
+        }
+        _ring = std::move(ring);
+    }
+
+    std::mutex _mtx;
+    std::vector<IdleBuffer> _idle_buffers;
+    size_t _max_idle_buffers;
+
+    std::mutex _ring_mtx;
+    RingFactory _ring_factory;
+    std::unique_ptr<MappedBufferRing> _ring;
+    std::vector<std::unique_ptr<MappedBufferRing>> _retired_rings;
+    size_t _failed_slot_size = 0;
+};
+
+// Owns the body of a single part until its upload has finished.
+class PartData
+{
+public:
+    PartData(std::streambuf* stream_buffer, size_t size) :
+        _stream_buffer(stream_buffer),
+        _stream(std::make_shared<PartStream>(stream_buffer)),
+        _size(size)
+    {
+    }
+
+    virtual ~PartData() = default;
+
+    std::shared_ptr<PartStream> get_stream() const
+    {
+        return _stream;
+    }
+
+    size_t get_size() const
+    {
+        return _size;
+    }
+
+private:
+    // Aws::IOStream doesn't take ownership of its stream buffer
+    std::unique_ptr<std::streambuf> _stream_buffer;
+    std::shared_ptr<PartStream> _stream;
+    size_t _size;
+};
+
+class PooledPartData : public PartData
+{
+public:
+    // With hash_payload set, the SHA-256 of the part is computed along with
+    // the copy, a block at a time while the block is still in cache.
+    static std::unique_ptr<PartData> create(std::shared_ptr<BufferPool> pool, const char* data, size_t size,
+        bool hash_payload)
+    {
+        size_t capacity;
+        uint8_t* buffer = pool->acquire(size, capacity);
+        if (!hash_payload)
+        {
+            memcpy(buffer, data, size);
+            return std::unique_ptr<PartData>(new PooledPartData(std::move(pool), buffer, capacity, size));
+        }
+
+        auto hash = Aws::Crt::Crypto::Hash::CreateSHA256();
+        for (size_t offset = 0; offset < size; offset += HASH_BLOCK_SIZE)
+        {
+            size_t length = std::min(HASH_BLOCK_SIZE, size - offset);
+            memcpy(buffer + offset, data + offset, length);
+            hash.Update(Aws::Crt::ByteCursorFromArray(buffer + offset, length));
+        }
+
+        std::unique_ptr<PartData> part(new PooledPartData(std::move(pool), buffer, capacity, size));
+        part->get_stream()->set_sha256(PartStreamSha256::digest(hash));
+        return part;
+    }
+
+    ~PooledPartData() override
+    {
+        _pool->release(_buffer, _capacity);
+    }
+
+private:
+    PooledPartData(std::shared_ptr<BufferPool> pool, uint8_t* buffer, size_t capacity, size_t size) :
+        PartData(new Aws::Utils::Stream::PreallocatedStreamBuf(buffer, size), size),
+        _pool(std::move(pool)),
+        _buffer(buffer),
+        _capacity(capacity)
+    {
+    }
+
+    static constexpr size_t HASH_BLOCK_SIZE = 64 * 1024;
+
+    std::shared_ptr<BufferPool> _pool;
+    uint8_t* _buffer;
+    size_t _capacity;
+};
+
+// Names the calling thread, as far as the platform allows.
+void set_current_thread_name(const std::string& name);
+
+// The checksum S3 reports for a multipart object: the checksum of the
+// concatenated binary part checksums, suffixed with the number of parts.
+Aws::String compute_composite_checksum(Aws::S3::Model::ChecksumAlgorithm algorithm,
+    const Aws::Vector<Aws::String>& part_checksums);
+
+// Bounded pool running the asynchronous requests of all the S3 clients of
+// the process. The SDK's default executor starts a thread per request.
+// Every worker has its own queue; tasks are spread over the queues, and a
+// worker whose queue is empty steals from the others. Tasks are whole HTTP
+// requests, so a single lock over the queues isn't a bottleneck.
+class UploadExecutor : public Aws::Utils::Threading::Executor
+{
+public:
+    // The pool is created by the first uploader which needs it, with that
+    // uploader's settings, and lives as long as some client uses it.
+    static std::shared_ptr<UploadExecutor> get_instance(size_t thread_count, const char* thread_name)
+    {
+        static std::mutex mtx;
+        static std::weak_ptr<UploadExecutor> instance;
+
+        std::lock_guard<std::mutex> l(mtx);
+        if (auto executor = instance.lock())
+        {
+            return executor;
+        }
+
+        if (thread_count == 0)
+        {
+            thread_count = 4 * std::max(1u, std::thread::hardware_concurrency());
+        }
+        auto executor = std::make_shared<UploadExecutor>(thread_count,
+            thread_name ? thread_name : GST_S3_UPLOADER_CONFIG_DEFAULT_UPLOAD_THREAD_NAME);
+        instance = executor;
+        return executor;
+    }
+
+    UploadExecutor(size_t thread_count, std::string thread_name) :
+        _pool(std::make_shared<Pool>(thread_count))
+    {
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            auto pool = _pool;
+            _threads.emplace_back([pool, i, thread_name] {
+                set_current_thread_name(thread_name + "-" + std::to_string(i));
+                _run(*pool, i);
+            });
+        }
+    }
+
+    // The last reference to the pool can be dropped by one of its own tasks
+    // (e.g. by a request callback releasing the last uploader), in which case
+    // that worker can't be joined; it's left to finish the remaining tasks,
+    // with the state it shares with the pool.
+    ~UploadExecutor() override
+    {
+        {
+            std::lock_guard<std::mutex> l(_pool->mtx);
+            _pool->is_stopped = true;
+        }
+        _pool->task_available_cv.notify_all();
+
+        for (auto& thread : _threads)
+        {
+            if (thread.get_id() == std::this_thread::get_id())
+            {
+                thread.detach();
+            }
+            else
+            {
+                thread.join();
+            }
+        }
+    }
+
+    void fill_stats(GstStructure* stats) const
+    {
+        std::lock_guard<std::mutex> l(_pool->mtx);
+        gst_structure_set(stats,
+            "executor-threads", G_TYPE_UINT64, static_cast<guint64>(_threads.size()),
+            "executor-busy-threads", G_TYPE_UINT64, static_cast<guint64>(_pool->busy_threads),
+            "executor-queue-depth", G_TYPE_UINT64, static_cast<guint64>(_pool->queued_tasks),
+            "executor-max-queue-depth", G_TYPE_UINT64, static_cast<guint64>(_pool->max_queued_tasks),
+            "executor-stolen-tasks", G_TYPE_UINT64, _pool->stolen_tasks,
+            NULL);
+    }
+
+protected:
+    bool SubmitToThread(std::function<void()>&& task) override
+    {
+        std::unique_lock<std::mutex> l(_pool->mtx);
+        if (_pool->is_stopped)
+        {
+            return false;
+        }
+
+        _pool->queues[_pool->next_queue].push_back(std::move(task));
+        _pool->next_queue = (_pool->next_queue + 1) % _pool->queues.size();
+        _pool->queued_tasks++;
+        _pool->max_queued_tasks = std::max(_pool->max_queued_tasks, _pool->queued_tasks);
+
+        l.unlock();
+        _pool->task_available_cv.notify_one();
+        return true;
+    }
+
+private:
+    using TaskQueue = std::deque<std::function<void()>>;
+
+    // Everything the workers use, so that it outlives a detached worker.
+    struct Pool
+    {
+        explicit Pool(size_t thread_count) :
+            queues(thread_count)
+        {
+        }
+
+        std::mutex mtx;
+        std::condition_variable task_available_cv;
+        std::vector<TaskQueue> queues;
+        size_t next_queue = 0;
+        size_t queued_tasks = 0;
+        size_t max_queued_tasks = 0;
+        size_t busy_threads = 0;
+        guint64 stolen_tasks = 0;
+        bool is_stopped = false;
+    };
+
+    // Takes the oldest task of the worker's own queue, or else the newest
+    // task of the longest other queue.
+    static bool _take_task(Pool& pool, size_t index, std::function<void()>& task)
+    {
+        auto& own_queue = pool.queues[index];
+        if (!own_queue.empty())
+        {
+            task = std::move(own_queue.front());
+            own_queue.pop_front();
+            return true;
+        }
+
+        auto victim = std::max_element(pool.queues.begin(), pool.queues.end(),
+            [](const TaskQueue& a, const TaskQueue& b) { return a.size() < b.size(); });
+        if (victim->empty())
+        {
+            return false;
+        }
+
+        task = std::move(victim->back());
+        victim->pop_back();
+        pool.stolen_tasks++;
+        return true;
+    }
+
+    static void _run(Pool& pool, size_t index)
+    {
+        std::unique_lock<std::mutex> l(pool.mtx);
+        while (true)
+        {
+            std::function<void()> task;
+            if (!_take_task(pool, index, task))
+            {
+                // remaining tasks are run before the pool goes away
+                if (pool.is_stopped)
+                {
+                    return;
+                }
+                pool.task_available_cv.wait(l);
+                continue;
+            }
+
+            pool.queued_tasks--;
+            pool.busy_threads++;
+            l.unlock();
+
+            // the task (and whatever it holds) is released before the lock
+            // is taken again
+            task();
+            task = nullptr;
+
+            l.lock();
+            pool.busy_threads--;
+        }
+    }
+
+    std::shared_ptr<Pool> _pool;
+    std::vector<std::thread> _threads;
+};
+
+class AwsApiHandle;
+class PartSpool;
+class PartStateCollection;
+class UploadJournal;
+
+class MultipartUploader
+{
+public:
+    // client: the S3 client to send the requests with, instead of the one
+    // shared by the uploaders with the same settings
+    static std::unique_ptr<MultipartUploader> create(const GstS3UploaderConfig *config,
+        std::shared_ptr<Aws::S3::S3Client> client = nullptr)
+    {
+        auto uploader = std::unique_ptr<MultipartUploader>(new MultipartUploader(config));
+        uploader->_s3_client = std::move(client);
+        if (!uploader->_init_uploader(config))
+        {
+            return nullptr;
+        }
+        return uploader;
+    }
+
+    ~MultipartUploader();
+
+    bool upload(const char* data, size_t size);
+    bool upload(GstBufferList* list, size_t size);
+    bool prepare();
+    bool complete();
+
+    GstStructure* get_stats() const;
+    std::string get_error() const;
+
+private:
+    explicit MultipartUploader(const GstS3UploaderConfig *config);
+    bool _init_uploader(const GstS3UploaderConfig * config);
+
+    bool _enqueue(std::unique_ptr<PartData> data);
+
+    bool _is_single_part(size_t size) const;
+    bool _flush_single_part();
+    bool _create_upload();
+    bool _resume();
+    bool _put_object();
+    void _invalidate_region(const Aws::S3::S3Error& error);
+
+    static void _dispatch(const Aws::S3::S3Client* client, const std::shared_ptr<PartStateCollection>& states);
+
+    void _run_retries();
+
+    static void _handle_upload_completed(const Aws::S3::S3Client* client, const Aws::S3::Model::UploadPartRequest&, const Aws::S3::Model::UploadPartOutcome& outcome, const std::shared_ptr<const Aws::Client::AsyncCallerContext>& ctx);
+
+    Aws::String _bucket;
+    Aws::String _key;
+    Aws::S3::Model::ObjectCannedACL _acl;
+
+    // CreateMultipartUpload is only sent once there's more than one part;
+    // an object which fits in a single part is uploaded with PutObject
+    Aws::S3::Model::CreateMultipartUploadRequest _create_request;
+    Aws::String _upload_id;
+    bool _is_upload_created = false;
+    bool _is_upload_lost = false;
+    bool _is_region_detected = false;
+    std::unique_ptr<PartData> _single_part;
+
+    std::shared_ptr<AwsApiHandle> _api_handle;
+    std::shared_ptr<UploadExecutor> _executor;
+    std::shared_ptr<Aws::S3::S3Client> _s3_client;
+
+    std::shared_ptr<PartSpool> _spool;
+    std::shared_ptr<PartStateCollection> _part_states;
+
+    std::shared_ptr<BufferPool> _buffer_pool;
+    size_t _part_size;
+    Aws::String _endpoint;
+
+    std::thread _retry_thread;
+
+    Aws::S3::Model::ChecksumAlgorithm _checksum_algorithm = Aws::S3::Model::ChecksumAlgorithm::NOT_SET;
+    Aws::String _checksum;
+    // the checksum of the parts, when S3 reported a different one
+    Aws::String _expected_checksum;
+
+    // whether the SHA-256 of parts is needed (and our SDK hash factory,
+    // which picks it up, is installed)
+    bool _hash_payload = false;
+
+    int _part_counter = 0;
+
+    std::shared_ptr<UploadJournal> _journal;
+    int _resumed_parts = 0;
+    guint64 _resumed_bytes = 0;
+};
+
+} // namespace s3
+} // namespace aws
+} // namespace gst
+
+#endif /* __GST_S3_MULTIPART_UPLOADER_HPP__ */
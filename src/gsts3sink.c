@@ -35,10 +35,17 @@
 
 #include <string.h>
 
+#include <glib/gstdio.h>
 #include <gst/gst.h>
 #include <gst/gsturi.h>
 
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #include "gsts3sink.h"
+#include "gsts3keys.h"
 #include "gsts3multipartuploader.h"
 
 static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
@@ -50,8 +57,24 @@ GST_DEBUG_CATEGORY (gst_s3_sink_debug);
 #define GST_CAT_DEFAULT gst_s3_sink_debug
 
 #define MIN_BUFFER_SIZE 5 * 1024 * 1024
+/* S3 multipart upload limits */
+#define MAX_PART_SIZE (G_GUINT64_CONSTANT (5) * 1024 * 1024 * 1024)
+#define MAX_PART_COUNT 10000
 #define DEFAULT_BUFFER_SIZE GST_S3_UPLOADER_CONFIG_DEFAULT_BUFFER_SIZE
 #define DEFAULT_BUFFER_COUNT GST_S3_UPLOADER_CONFIG_DEFAULT_BUFFER_COUNT
+#define DEFAULT_ZERO_COPY FALSE
+#define DEFAULT_PART_SIZE_GROWTH_INTERVAL 1000
+#define DEFAULT_MAX_BUFFER_SIZE MAX_PART_SIZE
+#define DEFAULT_MAX_INFLIGHT_BYTES GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_INFLIGHT_BYTES
+#define DEFAULT_INFLIGHT_POLICY GST_S3_UPLOADER_CONFIG_DEFAULT_INFLIGHT_POLICY
+#define DEFAULT_CHECKSUM_ALGORITHM GST_S3_UPLOADER_CONFIG_DEFAULT_CHECKSUM_ALGORITHM
+#define DEFAULT_MAX_OBJECT_SIZE 0
+#define DEFAULT_MAX_OBJECT_DURATION 0
+#define DEFAULT_SPLIT_AT_KEYFRAME TRUE
+/* keeps the index of streams made of keyframes only (e.g. audio) small */
+#define MIN_INDEX_INTERVAL (100 * GST_MSECOND)
+/* one thread completing the previous object, one preparing the next */
+#define OBJECT_THREADS 2
 
 #define REQUIRED_BUT_UNUSED(x) (void)(x)
 
@@ -72,10 +95,39 @@ enum
   PROP_AWS_SDK_USE_HTTP,
   PROP_AWS_SDK_VERIFY_SSL,
   PROP_AWS_SDK_S3_SIGN_PAYLOAD,
+  PROP_ZERO_COPY,
+  PROP_MAX_INFLIGHT_BYTES,
+  PROP_INFLIGHT_POLICY,
+  PROP_STATS,
+  PROP_PART_SIZE_GROWTH_INTERVAL,
+  PROP_MAX_BUFFER_SIZE,
+  PROP_BUFFER_COUNT,
+  PROP_ADAPTIVE_CONCURRENCY,
+  PROP_MAX_CONCURRENT_UPLOADS,
+  PROP_MAX_PART_RETRIES,
+  PROP_PART_RETRY_DELAY,
+  PROP_CHECKSUM_ALGORITHM,
+  PROP_MAX_CONNECTIONS,
+  PROP_UPLOAD_THREADS,
+  PROP_UPLOAD_THREAD_NAME,
+  PROP_KEY_TEMPLATE,
+  PROP_MAX_OBJECT_SIZE,
+  PROP_MAX_OBJECT_DURATION,
+  PROP_SPLIT_AT_KEYFRAME,
+  PROP_JOURNAL_LOCATION,
+  PROP_RESUME,
+  PROP_SPOOL_LOCATION,
+  PROP_MAX_SPOOL_SIZE,
+  PROP_SPOOL_DRAIN_CONCURRENCY,
+  PROP_BUFFER_LOCATION,
+  PROP_BUFFER_RING_SIZE,
+  PROP_INDEX_SUFFIX,
+  PROP_HASH_ON_COPY,
   PROP_LAST
 };
 
 static void gst_s3_sink_dispose (GObject * object);
+static void gst_s3_sink_finalize (GObject * object);
 
 static void gst_s3_sink_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec);
@@ -87,10 +139,63 @@ static gboolean gst_s3_sink_stop (GstBaseSink * sink);
 static gboolean gst_s3_sink_event (GstBaseSink * sink, GstEvent * event);
 static GstFlowReturn gst_s3_sink_render (GstBaseSink * sink,
     GstBuffer * buffer);
+static GstFlowReturn gst_s3_sink_render_list (GstBaseSink * sink,
+    GstBufferList * list);
 static gboolean gst_s3_sink_query (GstBaseSink * bsink, GstQuery * query);
 
+static gboolean gst_s3_sink_fill (GstS3Sink * sink, GstBuffer * buffer);
 static gboolean gst_s3_sink_fill_buffer (GstS3Sink * sink, GstBuffer * buffer);
+static gboolean gst_s3_sink_fill_part_list (GstS3Sink * sink,
+    GstBuffer * buffer);
+static gsize gst_s3_sink_max_part_size (GstS3Sink * sink);
 static gboolean gst_s3_sink_flush_buffer (GstS3Sink * sink);
+static GstStructure *gst_s3_sink_get_stats (GstS3Sink * sink);
+static void gst_s3_sink_apply_size_hints (GstS3Sink * sink);
+static void gst_s3_sink_run_object_task (gpointer data, gpointer user_data);
+static gboolean gst_s3_sink_stop_objects (GstS3Sink * sink);
+
+#define GST_TYPE_S3_SINK_INFLIGHT_POLICY (gst_s3_sink_inflight_policy_get_type ())
+static GType
+gst_s3_sink_inflight_policy_get_type (void)
+{
+  static GType policy_type = 0;
+  static const GEnumValue policies[] = {
+    {GST_S3_UPLOADER_INFLIGHT_POLICY_BLOCK,
+        "Block the streaming thread until parts are uploaded", "block"},
+    {GST_S3_UPLOADER_INFLIGHT_POLICY_LEAK_OLDEST_UNSENT,
+        "Drop the oldest parts which haven't been sent yet",
+        "leak-oldest-unsent"},
+    {GST_S3_UPLOADER_INFLIGHT_POLICY_SPILL,
+        "Write new parts to temporary files, on the streaming thread, until "
+        "the budget frees up", "spill"},
+    {0, NULL, NULL}
+  };
+
+  if (!policy_type) {
+    policy_type = g_enum_register_static ("GstS3SinkInflightPolicy", policies);
+  }
+  return policy_type;
+}
+
+#define GST_TYPE_S3_SINK_CHECKSUM_ALGORITHM (gst_s3_sink_checksum_algorithm_get_type ())
+static GType
+gst_s3_sink_checksum_algorithm_get_type (void)
+{
+  static GType algorithm_type = 0;
+  static const GEnumValue algorithms[] = {
+    {GST_S3_UPLOADER_CHECKSUM_ALGORITHM_NONE, "No additional checksum",
+        "none"},
+    {GST_S3_UPLOADER_CHECKSUM_ALGORITHM_CRC32C, "CRC32C", "crc32c"},
+    {GST_S3_UPLOADER_CHECKSUM_ALGORITHM_SHA256, "SHA-256", "sha256"},
+    {0, NULL, NULL}
+  };
+
+  if (!algorithm_type) {
+    algorithm_type =
+        g_enum_register_static ("GstS3SinkChecksumAlgorithm", algorithms);
+  }
+  return algorithm_type;
+}
 
 /**
  * GstURIHandler Interface implementation
@@ -151,6 +256,7 @@ gst_s3_sink_class_init (GstS3SinkClass * klass)
   GST_DEBUG_CATEGORY_INIT (gst_s3_sink_debug, "s3sink", 0, "s3sink element");
 
   gobject_class->dispose = gst_s3_sink_dispose;
+  gobject_class->finalize = gst_s3_sink_finalize;
   gobject_class->set_property = gst_s3_sink_set_property;
   gobject_class->get_property = gst_s3_sink_get_property;
 
@@ -230,6 +336,220 @@ gst_s3_sink_class_init (GstS3SinkClass * klass)
           GST_S3_UPLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_S3_SIGN_PAYLOAD,
           G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_HASH_ON_COPY,
+      g_param_spec_boolean ("hash-on-copy", "Hash on copy",
+          "Compute the SHA-256 of every part (needed to sign payloads, over "
+          "HTTP or with the SHA256 checksum-algorithm) while copying it into "
+          "the part buffer, on the streaming thread, instead of having the "
+          "AWS SDK read the part again when sending it",
+          GST_S3_UPLOADER_CONFIG_DEFAULT_HASH_ON_COPY,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ZERO_COPY,
+      g_param_spec_boolean ("zero-copy", "Zero copy",
+          "Upload parts straight from the upstream memory instead of copying "
+          "it into an internal buffer. Upstream buffers stay referenced until "
+          "the part they belong to is uploaded, so upstream buffer pools must "
+          "be large enough to cover buffer-size bytes of data",
+          DEFAULT_ZERO_COPY,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_INFLIGHT_BYTES,
+      g_param_spec_uint64 ("max-inflight-bytes", "Max in-flight bytes",
+          "Maximum number of bytes held by parts which haven't been uploaded "
+          "yet (0 = as many parts as there are upload buffers)", 0,
+          G_MAXUINT64, DEFAULT_MAX_INFLIGHT_BYTES,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_INFLIGHT_POLICY,
+      g_param_spec_enum ("inflight-policy", "In-flight policy",
+          "What to do with new parts when max-inflight-bytes is reached. "
+          "An element message named 's3sink-throttled' is posted for every "
+          "episode of throttling", GST_TYPE_S3_SINK_INFLIGHT_POLICY,
+          DEFAULT_INFLIGHT_POLICY,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_CHECKSUM_ALGORITHM,
+      g_param_spec_enum ("checksum-algorithm", "Checksum algorithm",
+          "Checksum computed for every part while it's sent and verified by "
+          "S3. The checksum of the whole object is posted in an element "
+          "message named 's3sink-checksum' once the upload is completed, "
+          "saying whether it matches the checksums of the parts",
+          GST_TYPE_S3_SINK_CHECKSUM_ALGORITHM, DEFAULT_CHECKSUM_ALGORITHM,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PART_SIZE_GROWTH_INTERVAL,
+      g_param_spec_uint ("part-size-growth-interval", "Part size growth interval",
+          "Number of parts after which the part size doubles, up to "
+          "max-buffer-size, so that long streams fit in S3's limit of "
+          "10000 parts (0 = keep buffer-size for the whole upload)", 0,
+          G_MAXUINT, DEFAULT_PART_SIZE_GROWTH_INTERVAL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_BUFFER_SIZE,
+      g_param_spec_uint64 ("max-buffer-size", "Maximum buffering size",
+          "Size in bytes the part size may grow to, either following "
+          "part-size-growth-interval or to fit the stream size announced by "
+          "upstream", MIN_BUFFER_SIZE, MAX_PART_SIZE, DEFAULT_MAX_BUFFER_SIZE,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_BUFFER_COUNT,
+      g_param_spec_uint ("buffer-count", "Buffer count",
+          "Number of parts uploaded in parallel (the initial number when "
+          "adaptive-concurrency is enabled)", 1, G_MAXUINT,
+          DEFAULT_BUFFER_COUNT,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ADAPTIVE_CONCURRENCY,
+      g_param_spec_boolean ("adaptive-concurrency", "Adaptive concurrency",
+          "Grow the number of parts uploaded in parallel while throughput "
+          "improves and halve it on latency spikes and S3 throttling. "
+          "The current value is reported as 'window' in stats",
+          GST_S3_UPLOADER_CONFIG_DEFAULT_ADAPTIVE_CONCURRENCY,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_CONCURRENT_UPLOADS,
+      g_param_spec_uint ("max-concurrent-uploads", "Max concurrent uploads",
+          "Upper bound of parts uploaded in parallel when "
+          "adaptive-concurrency is enabled", 1, G_MAXUINT,
+          GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_CONCURRENT_UPLOADS,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_PART_RETRIES,
+      g_param_spec_uint ("max-part-retries", "Max part retries",
+          "Number of times a part is re-sent after a transient failure "
+          "before the upload fails", 0, G_MAXUINT,
+          GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_PART_RETRIES,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PART_RETRY_DELAY,
+      g_param_spec_uint ("part-retry-delay", "Part retry delay",
+          "Base delay (in milliseconds) before re-sending a failed part; "
+          "doubled on every attempt and randomized", 0, G_MAXUINT,
+          GST_S3_UPLOADER_CONFIG_DEFAULT_PART_RETRY_DELAY,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_CONNECTIONS,
+      g_param_spec_uint ("max-connections", "Max connections",
+          "Maximum number of connections of the S3 client. Sinks in a process "
+          "with the same region, endpoint, credentials, TLS settings and "
+          "max-connections share one client and its connections; the limit "
+          "applies to every client, not to the whole process", 1, G_MAXUINT,
+          GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_CONNECTIONS,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_UPLOAD_THREADS,
+      g_param_spec_uint ("upload-threads", "Upload threads",
+          "Number of threads sending the parts of all the sinks in the "
+          "process (0 = 4 per CPU). Only the sink which starts first sets it",
+          0, G_MAXUINT, GST_S3_UPLOADER_CONFIG_DEFAULT_UPLOAD_THREADS,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_UPLOAD_THREAD_NAME,
+      g_param_spec_string ("upload-thread-name", "Upload thread name",
+          "Name prefix of the upload threads. Only the sink which starts "
+          "first sets it", GST_S3_UPLOADER_CONFIG_DEFAULT_UPLOAD_THREAD_NAME,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_KEY_TEMPLATE,
+      g_param_spec_string ("key-template", "Key template",
+          "Keys of the objects written when max-object-size or "
+          "max-object-duration is set. {index} (or {index:N}, zero-padded "
+          "to N digits) is replaced with the object number, {utc} with the "
+          "UTC time the object starts at and {running-time} with its "
+          "running time in milliseconds", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_OBJECT_SIZE,
+      g_param_spec_uint64 ("max-object-size", "Max object size",
+          "Start a new object once the current one would exceed this many "
+          "bytes (0 = no limit). An element message named "
+          "'s3sink-object-completed' is posted for every object", 0,
+          G_MAXUINT64, DEFAULT_MAX_OBJECT_SIZE,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_OBJECT_DURATION,
+      g_param_spec_uint64 ("max-object-duration", "Max object duration",
+          "Start a new object once the current one spans this much running "
+          "time, in nanoseconds (0 = no limit)", 0, G_MAXUINT64,
+          DEFAULT_MAX_OBJECT_DURATION,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_SPLIT_AT_KEYFRAME,
+      g_param_spec_boolean ("split-at-keyframe", "Split at keyframe",
+          "Delay the start of a new object until the next keyframe, so that "
+          "every object can be decoded on its own",
+          DEFAULT_SPLIT_AT_KEYFRAME,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_JOURNAL_LOCATION,
+      g_param_spec_string ("journal-location", "Journal location",
+          "Path of a file recording the upload ID and the uploaded parts, so "
+          "that an interrupted upload can be resumed (not used when writing "
+          "multiple objects)", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_RESUME,
+      g_param_spec_boolean ("resume", "Resume",
+          "Continue the upload recorded in journal-location, after the last "
+          "part S3 still holds. The stream must be sent again from its "
+          "start: the bytes already uploaded are skipped. An element message "
+          "named 's3sink-resumed' tells how many", GST_S3_UPLOADER_CONFIG_DEFAULT_RESUME,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_SPOOL_LOCATION,
+      g_param_spec_string ("spool-location", "Spool location",
+          "Directory where parts are kept on disk while they can't be held "
+          "in memory or S3 can't be reached; they are uploaded once the link "
+          "is back (NULL = spill to the temporary directory only for the "
+          "'spill' in-flight policy)", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_SPOOL_SIZE,
+      g_param_spec_uint64 ("max-spool-size", "Max spool size",
+          "Maximum number of bytes kept in spool-location by all the sinks "
+          "spooling there, or in the temporary directory, as set by the "
+          "first of them; parts which don't fit stay in memory "
+          "(0 = no limit)", 0, G_MAXUINT64,
+          GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_SPOOL_SIZE,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_SPOOL_DRAIN_CONCURRENCY,
+      g_param_spec_uint ("spool-drain-concurrency", "Spool drain concurrency",
+          "Maximum number of spooled parts uploaded at the same time, so that "
+          "draining a backlog doesn't starve the live parts (0 = spooled "
+          "parts share the upload window)", 0, G_MAXUINT,
+          GST_S3_UPLOADER_CONFIG_DEFAULT_SPOOL_DRAIN_CONCURRENCY,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_BUFFER_LOCATION,
+      g_param_spec_string ("buffer-location", "Buffer location",
+          "Directory of the memory-mapped files holding the part buffers, so "
+          "that the kernel can page them out under memory pressure "
+          "(NULL = buffers are allocated on the heap)", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_BUFFER_RING_SIZE,
+      g_param_spec_uint64 ("buffer-ring-size", "Buffer ring size",
+          "Size of the memory-mapped file ring the part buffers are taken "
+          "from when buffer-location is set; parts which don't fit are "
+          "allocated on the heap (0 = room for buffer-count parts of the "
+          "current part size, or max-inflight-bytes if bigger)", 0, G_MAXUINT64,
+          GST_S3_UPLOADER_CONFIG_DEFAULT_BUFFER_RING_SIZE,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_INDEX_SUFFIX,
+      g_param_spec_string ("index-suffix", "Index suffix",
+          "Upload an index of the keyframes of every object, mapping their "
+          "timestamps to byte offsets, to the object's key followed by this "
+          "suffix (e.g. '.idx'); s3src uses it for time seeks", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Statistics of the upload", GST_TYPE_STRUCTURE,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
   gst_element_class_set_static_metadata (gstelement_class,
       "S3 Sink",
       "Sink/S3", "Write stream to an Amazon S3 bucket",
@@ -240,15 +560,22 @@ gst_s3_sink_class_init (GstS3SinkClass * klass)
   gstbasesink_class->stop = GST_DEBUG_FUNCPTR (gst_s3_sink_stop);
   gstbasesink_class->query = GST_DEBUG_FUNCPTR (gst_s3_sink_query);
   gstbasesink_class->render = GST_DEBUG_FUNCPTR (gst_s3_sink_render);
+  gstbasesink_class->render_list = GST_DEBUG_FUNCPTR (gst_s3_sink_render_list);
   gstbasesink_class->event = GST_DEBUG_FUNCPTR (gst_s3_sink_event);
 }
 
 static void
 gst_s3_destroy_uploader (GstS3Sink * sink)
 {
-  if (sink->uploader) {
-    gst_s3_uploader_destroy (sink->uploader);
-    sink->uploader = NULL;
+  GstS3Uploader *uploader;
+
+  GST_OBJECT_LOCK (sink);
+  uploader = sink->uploader;
+  sink->uploader = NULL;
+  GST_OBJECT_UNLOCK (sink);
+
+  if (uploader) {
+    gst_s3_uploader_destroy (uploader);
   }
 }
 
@@ -259,6 +586,17 @@ gst_s3_sink_init (GstS3Sink * s3sink)
   s3sink->config.credentials = gst_aws_credentials_new_default ();
   s3sink->uploader = NULL;
   s3sink->is_started = FALSE;
+  s3sink->zero_copy = DEFAULT_ZERO_COPY;
+  s3sink->part_size_growth_interval = DEFAULT_PART_SIZE_GROWTH_INTERVAL;
+  s3sink->max_buffer_size = DEFAULT_MAX_BUFFER_SIZE;
+  s3sink->uploader_new = gst_s3_multipart_uploader_new;
+  s3sink->max_object_size = DEFAULT_MAX_OBJECT_SIZE;
+  s3sink->max_object_duration = DEFAULT_MAX_OBJECT_DURATION;
+  s3sink->split_at_keyframe = DEFAULT_SPLIT_AT_KEYFRAME;
+  s3sink->index_suffix = NULL;
+  s3sink->keyframe_index = NULL;
+  g_mutex_init (&s3sink->object_lock);
+  g_cond_init (&s3sink->object_cond);
 
   gst_base_sink_set_sync (GST_BASE_SINK (s3sink), FALSE);
 }
@@ -274,6 +612,10 @@ gst_s3_sink_release_config (GstS3UploaderConfig * config)
   g_free (config->content_type);
   g_free (config->ca_file);
   g_free (config->aws_sdk_endpoint);
+  g_free (config->upload_thread_name);
+  g_free (config->journal_location);
+  g_free (config->spool_location);
+  g_free (config->buffer_location);
   gst_aws_credentials_free (config->credentials);
 
   *config = GST_S3_UPLOADER_CONFIG_INIT;
@@ -285,12 +627,25 @@ gst_s3_sink_dispose (GObject * object)
   GstS3Sink *sink = GST_S3_SINK (object);
 
   gst_s3_sink_release_config (&sink->config);
+  g_clear_pointer (&sink->key_template, g_free);
+  g_clear_pointer (&sink->index_suffix, g_free);
 
   gst_s3_destroy_uploader (sink);
 
   G_OBJECT_CLASS (parent_class)->dispose (object);
 }
 
+static void
+gst_s3_sink_finalize (GObject * object)
+{
+  GstS3Sink *sink = GST_S3_SINK (object);
+
+  g_mutex_clear (&sink->object_lock);
+  g_cond_clear (&sink->object_cond);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
 static void
 gst_s3_sink_set_string_property (GstS3Sink * sink, const gchar * value,
     gchar ** property, const gchar * property_name)
@@ -376,6 +731,98 @@ gst_s3_sink_set_property (GObject * object, guint prop_id,
     case PROP_AWS_SDK_S3_SIGN_PAYLOAD:
       sink->config.aws_sdk_s3_sign_payload = g_value_get_boolean (value);
       break;
+    case PROP_HASH_ON_COPY:
+      sink->config.hash_on_copy = g_value_get_boolean (value);
+      break;
+    case PROP_ZERO_COPY:
+      if (sink->is_started) {
+        GST_WARNING
+            ("Changing zero-copy property after starting the element is not supported.");
+      } else {
+        sink->zero_copy = g_value_get_boolean (value);
+      }
+      break;
+    case PROP_MAX_INFLIGHT_BYTES:
+      sink->config.max_inflight_bytes = g_value_get_uint64 (value);
+      break;
+    case PROP_PART_SIZE_GROWTH_INTERVAL:
+      sink->part_size_growth_interval = g_value_get_uint (value);
+      break;
+    case PROP_MAX_BUFFER_SIZE:
+      sink->max_buffer_size = g_value_get_uint64 (value);
+      break;
+    case PROP_BUFFER_COUNT:
+      sink->config.buffer_count = g_value_get_uint (value);
+      break;
+    case PROP_ADAPTIVE_CONCURRENCY:
+      sink->config.adaptive_concurrency = g_value_get_boolean (value);
+      break;
+    case PROP_MAX_CONCURRENT_UPLOADS:
+      sink->config.max_concurrent_uploads = g_value_get_uint (value);
+      break;
+    case PROP_MAX_PART_RETRIES:
+      sink->config.max_part_retries = g_value_get_uint (value);
+      break;
+    case PROP_PART_RETRY_DELAY:
+      sink->config.part_retry_delay = g_value_get_uint (value);
+      break;
+    case PROP_INFLIGHT_POLICY:
+      sink->config.inflight_policy = g_value_get_enum (value);
+      break;
+    case PROP_CHECKSUM_ALGORITHM:
+      sink->config.checksum_algorithm = g_value_get_enum (value);
+      break;
+    case PROP_MAX_CONNECTIONS:
+      sink->config.max_connections = g_value_get_uint (value);
+      break;
+    case PROP_UPLOAD_THREADS:
+      sink->config.upload_threads = g_value_get_uint (value);
+      break;
+    case PROP_UPLOAD_THREAD_NAME:
+      gst_s3_sink_set_string_property (sink, g_value_get_string (value),
+          &sink->config.upload_thread_name, "upload-thread-name");
+      break;
+    case PROP_KEY_TEMPLATE:
+      gst_s3_sink_set_string_property (sink, g_value_get_string (value),
+          &sink->key_template, "key-template");
+      break;
+    case PROP_MAX_OBJECT_SIZE:
+      sink->max_object_size = g_value_get_uint64 (value);
+      break;
+    case PROP_MAX_OBJECT_DURATION:
+      sink->max_object_duration = g_value_get_uint64 (value);
+      break;
+    case PROP_SPLIT_AT_KEYFRAME:
+      sink->split_at_keyframe = g_value_get_boolean (value);
+      break;
+    case PROP_JOURNAL_LOCATION:
+      gst_s3_sink_set_string_property (sink, g_value_get_string (value),
+          &sink->config.journal_location, "journal-location");
+      break;
+    case PROP_RESUME:
+      sink->config.resume = g_value_get_boolean (value);
+      break;
+    case PROP_SPOOL_LOCATION:
+      gst_s3_sink_set_string_property (sink, g_value_get_string (value),
+          &sink->config.spool_location, "spool-location");
+      break;
+    case PROP_MAX_SPOOL_SIZE:
+      sink->config.max_spool_size = g_value_get_uint64 (value);
+      break;
+    case PROP_SPOOL_DRAIN_CONCURRENCY:
+      sink->config.spool_drain_concurrency = g_value_get_uint (value);
+      break;
+    case PROP_BUFFER_LOCATION:
+      gst_s3_sink_set_string_property (sink, g_value_get_string (value),
+          &sink->config.buffer_location, "buffer-location");
+      break;
+    case PROP_BUFFER_RING_SIZE:
+      sink->config.buffer_ring_size = g_value_get_uint64 (value);
+      break;
+    case PROP_INDEX_SUFFIX:
+      gst_s3_sink_set_string_property (sink, g_value_get_string (value),
+          &sink->index_suffix, "index-suffix");
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -428,41 +875,442 @@ gst_s3_sink_get_property (GObject * object, guint prop_id, GValue * value,
     case PROP_AWS_SDK_S3_SIGN_PAYLOAD:
       g_value_set_boolean (value, sink->config.aws_sdk_s3_sign_payload);
       break;
+    case PROP_HASH_ON_COPY:
+      g_value_set_boolean (value, sink->config.hash_on_copy);
+      break;
+    case PROP_ZERO_COPY:
+      g_value_set_boolean (value, sink->zero_copy);
+      break;
+    case PROP_MAX_INFLIGHT_BYTES:
+      g_value_set_uint64 (value, sink->config.max_inflight_bytes);
+      break;
+    case PROP_PART_SIZE_GROWTH_INTERVAL:
+      g_value_set_uint (value, sink->part_size_growth_interval);
+      break;
+    case PROP_MAX_BUFFER_SIZE:
+      g_value_set_uint64 (value, sink->max_buffer_size);
+      break;
+    case PROP_BUFFER_COUNT:
+      g_value_set_uint (value, sink->config.buffer_count);
+      break;
+    case PROP_ADAPTIVE_CONCURRENCY:
+      g_value_set_boolean (value, sink->config.adaptive_concurrency);
+      break;
+    case PROP_MAX_CONCURRENT_UPLOADS:
+      g_value_set_uint (value, sink->config.max_concurrent_uploads);
+      break;
+    case PROP_MAX_PART_RETRIES:
+      g_value_set_uint (value, sink->config.max_part_retries);
+      break;
+    case PROP_PART_RETRY_DELAY:
+      g_value_set_uint (value, sink->config.part_retry_delay);
+      break;
+    case PROP_INFLIGHT_POLICY:
+      g_value_set_enum (value, sink->config.inflight_policy);
+      break;
+    case PROP_CHECKSUM_ALGORITHM:
+      g_value_set_enum (value, sink->config.checksum_algorithm);
+      break;
+    case PROP_MAX_CONNECTIONS:
+      g_value_set_uint (value, sink->config.max_connections);
+      break;
+    case PROP_UPLOAD_THREADS:
+      g_value_set_uint (value, sink->config.upload_threads);
+      break;
+    case PROP_UPLOAD_THREAD_NAME:
+      g_value_set_string (value, sink->config.upload_thread_name ?
+          sink->config.upload_thread_name :
+          GST_S3_UPLOADER_CONFIG_DEFAULT_UPLOAD_THREAD_NAME);
+      break;
+    case PROP_KEY_TEMPLATE:
+      g_value_set_string (value, sink->key_template);
+      break;
+    case PROP_MAX_OBJECT_SIZE:
+      g_value_set_uint64 (value, sink->max_object_size);
+      break;
+    case PROP_MAX_OBJECT_DURATION:
+      g_value_set_uint64 (value, sink->max_object_duration);
+      break;
+    case PROP_SPLIT_AT_KEYFRAME:
+      g_value_set_boolean (value, sink->split_at_keyframe);
+      break;
+    case PROP_JOURNAL_LOCATION:
+      g_value_set_string (value, sink->config.journal_location);
+      break;
+    case PROP_RESUME:
+      g_value_set_boolean (value, sink->config.resume);
+      break;
+    case PROP_SPOOL_LOCATION:
+      g_value_set_string (value, sink->config.spool_location);
+      break;
+    case PROP_MAX_SPOOL_SIZE:
+      g_value_set_uint64 (value, sink->config.max_spool_size);
+      break;
+    case PROP_SPOOL_DRAIN_CONCURRENCY:
+      g_value_set_uint (value, sink->config.spool_drain_concurrency);
+      break;
+    case PROP_BUFFER_LOCATION:
+      g_value_set_string (value, sink->config.buffer_location);
+      break;
+    case PROP_BUFFER_RING_SIZE:
+      g_value_set_uint64 (value, sink->config.buffer_ring_size);
+      break;
+    case PROP_INDEX_SUFFIX:
+      g_value_set_string (value, sink->index_suffix);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_s3_sink_get_stats (sink));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
   }
 }
 
+static GstStructure *
+gst_s3_sink_get_stats (GstS3Sink * sink)
+{
+  GstStructure *stats = NULL;
+
+  GST_OBJECT_LOCK (sink);
+  if (sink->uploader)
+    stats = gst_s3_uploader_get_stats (sink->uploader);
+  GST_OBJECT_UNLOCK (sink);
+
+  if (!stats)
+    stats = gst_structure_new_empty ("s3-uploader-stats");
+
+  return stats;
+}
+
 static gboolean
 gst_s3_sink_is_null_or_empty (const gchar * str)
 {
   return str == NULL || str[0] == '\0';
 }
 
+/* With buffer-location set, the staging buffer is a shared mapping of an
+ * unlinked file, which the kernel can page out instead of keeping it
+ * resident. Falls back to the heap if the file can't be mapped. */
+static gchar *
+gst_s3_sink_alloc_buffer (GstS3Sink * sink, gsize size)
+{
+#if defined(__linux__) || defined(__APPLE__)
+  gchar *path;
+  gint fd;
+  void *data = MAP_FAILED;
+
+  sink->buffer_map_size = 0;
+  if (gst_s3_sink_is_null_or_empty (sink->config.buffer_location))
+    return g_malloc (size);
+
+  path = g_build_filename (sink->config.buffer_location, "gst-s3-staging-XXXXXX",
+      NULL);
+  fd = g_mkstemp (path);
+  if (fd >= 0) {
+    g_unlink (path);
+    if (ftruncate (fd, size) == 0)
+      data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    g_close (fd, NULL);
+  }
+  g_free (path);
+
+  if (data == MAP_FAILED) {
+    GST_WARNING_OBJECT (sink, "failed to map a staging buffer in %s",
+        sink->config.buffer_location);
+    return g_malloc (size);
+  }
+
+  sink->buffer_map_size = size;
+  return data;
+#else
+  sink->buffer_map_size = 0;
+  return g_malloc (size);
+#endif
+}
+
+static void
+gst_s3_sink_free_buffer (GstS3Sink * sink)
+{
+#if defined(__linux__) || defined(__APPLE__)
+  if (sink->buffer && sink->buffer_map_size) {
+    munmap (sink->buffer, sink->buffer_map_size);
+    sink->buffer = NULL;
+  }
+#endif
+  g_free (sink->buffer);
+  sink->buffer = NULL;
+  sink->buffer_map_size = 0;
+}
+
+static void
+gst_s3_sink_resize_buffer (GstS3Sink * sink, gsize size)
+{
+  gchar *buffer = sink->buffer;
+  gsize map_size = sink->buffer_map_size;
+
+  if (!map_size) {
+    sink->buffer = g_realloc (buffer, size);
+    return;
+  }
+
+  sink->buffer = gst_s3_sink_alloc_buffer (sink, size);
+  /* the part shrinks only while it is empty */
+  memcpy (sink->buffer, buffer, MIN (sink->current_buffer_size, size));
+#if defined(__linux__) || defined(__APPLE__)
+  munmap (buffer, map_size);
+#endif
+}
+
+static gboolean
+gst_s3_sink_is_rolling (GstS3Sink * sink)
+{
+  return sink->max_object_size > 0 || sink->max_object_duration > 0;
+}
+
+/* The URI of the object written to key in the sink's bucket, or of the
+ * sink's single object when key is NULL. */
+static gchar *
+gst_s3_sink_get_object_uri (GstS3Sink * sink, const gchar * key)
+{
+  GstUri *uri;
+  gchar *result;
+
+  if (gst_s3_sink_is_null_or_empty (sink->config.location))
+    return g_strdup_printf ("s3://%s/%s", sink->config.bucket,
+        key ? key : sink->config.key);
+  if (!key)
+    return g_strdup (sink->config.location);
+
+  uri = gst_uri_from_string (sink->config.location);
+  result = g_strdup_printf ("s3://%s/%s", uri ? gst_uri_get_host (uri) : "",
+      key);
+  if (uri)
+    gst_uri_unref (uri);
+
+  return result;
+}
+
+/* Creates an uploader writing the given key to the sink's bucket. Unless
+ * prepared, a small object is sent in a single request when it's completed
+ * rather than as a multipart upload. */
+static GstS3Uploader *
+gst_s3_sink_new_object_uploader (GstS3Sink * sink, const gchar * key,
+    gboolean prepare)
+{
+  GstS3UploaderConfig config = sink->config;
+  GstS3Uploader *uploader;
+  GstUri *uri;
+
+  if (gst_s3_sink_is_null_or_empty (sink->config.location)) {
+    config.bucket = g_strdup (sink->config.bucket);
+  } else {
+    uri = gst_uri_from_string (sink->config.location);
+    config.bucket = g_strdup (uri ? gst_uri_get_host (uri) : NULL);
+    if (uri)
+      gst_uri_unref (uri);
+  }
+  config.key = (gchar *) key;
+  config.location = NULL;
+  config.journal_location = NULL;
+
+  uploader = sink->uploader_new (&config);
+  if (uploader && prepare && !gst_s3_uploader_prepare (uploader)) {
+    gst_s3_uploader_destroy (uploader);
+    uploader = NULL;
+  }
+
+  g_free (config.bucket);
+
+  return uploader;
+}
+
+typedef struct
+{
+  /* the object to complete, or NULL to create the uploader of key */
+  GstS3Uploader *uploader;
+  gchar *key;
+  guint index;
+  guint64 size;
+  GstS3KeyframeIndex *keyframe_index;
+} GstS3SinkObjectTask;
+
+static void
+gst_s3_sink_push_object_task (GstS3Sink * sink, GstS3SinkObjectTask * task)
+{
+  g_mutex_lock (&sink->object_lock);
+  sink->pending_object_tasks++;
+  g_mutex_unlock (&sink->object_lock);
+
+  g_thread_pool_push (sink->object_pool, task, NULL);
+}
+
+static void
+gst_s3_sink_prepare_next_object (GstS3Sink * sink, guint index,
+    GstClockTime running_time)
+{
+  GstS3SinkObjectTask *task = g_new0 (GstS3SinkObjectTask, 1);
+
+  task->index = index;
+  task->key = gst_s3_keys_format (sink->key_template, index, running_time);
+  g_free (sink->next_key);
+  sink->next_key = g_strdup (task->key);
+
+  GST_DEBUG_OBJECT (sink, "preparing object %u: %s", index, task->key);
+  gst_s3_sink_push_object_task (sink, task);
+}
+
+/* Makes the uploader prepared for the next object the current one, waiting
+ * for it if it isn't ready yet. */
+static gboolean
+gst_s3_sink_take_next_uploader (GstS3Sink * sink)
+{
+  GstS3Uploader *uploader;
+
+  g_mutex_lock (&sink->object_lock);
+  while (!sink->is_next_ready)
+    g_cond_wait (&sink->object_cond, &sink->object_lock);
+  uploader = sink->next_uploader;
+  sink->next_uploader = NULL;
+  sink->is_next_ready = FALSE;
+  g_mutex_unlock (&sink->object_lock);
+
+  if (!uploader) {
+    GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_WRITE,
+        ("Unable to initialize S3 uploader for %s.", sink->next_key), (NULL));
+    return FALSE;
+  }
+
+  GST_OBJECT_LOCK (sink);
+  sink->uploader = uploader;
+  GST_OBJECT_UNLOCK (sink);
+
+  g_free (sink->object_key);
+  sink->object_key = sink->next_key;
+  sink->next_key = NULL;
+
+  if (!gst_s3_keys_is_timed (sink->key_template))
+    gst_s3_sink_prepare_next_object (sink, sink->object_index + 1,
+        GST_CLOCK_TIME_NONE);
+
+  return TRUE;
+}
+
+/* Picks up the part schedule where the resumed upload left it. */
+static void
+gst_s3_sink_apply_resume (GstS3Sink * sink)
+{
+  GstStructure *stats = gst_s3_uploader_get_stats (sink->uploader);
+  guint parts = 0;
+  guint64 bytes = 0;
+
+  if (stats) {
+    gst_structure_get_uint (stats, "resumed-parts", &parts);
+    gst_structure_get_uint64 (stats, "resumed-bytes", &bytes);
+    gst_structure_free (stats);
+  }
+
+  if (parts == 0)
+    return;
+
+  sink->part_count = parts;
+  sink->resume_skip_bytes = bytes;
+  if (sink->part_size_growth_interval > 0) {
+    guint doublings = parts / sink->part_size_growth_interval;
+
+    while (doublings-- > 0 && sink->part_size < gst_s3_sink_max_part_size (sink))
+      sink->part_size = MIN ((guint64) sink->part_size * 2,
+          gst_s3_sink_max_part_size (sink));
+  }
+
+  GST_INFO_OBJECT (sink, "resuming after %u parts, skipping %" G_GUINT64_FORMAT
+      " bytes", parts, bytes);
+
+  gst_element_post_message (GST_ELEMENT_CAST (sink),
+      gst_message_new_element (GST_OBJECT_CAST (sink),
+          gst_structure_new ("s3sink-resumed",
+              "parts", G_TYPE_UINT, parts,
+              "offset", G_TYPE_UINT64, bytes, NULL)));
+}
+
 static gboolean
 gst_s3_sink_start (GstBaseSink * basesink)
 {
   GstS3Sink *sink = GST_S3_SINK (basesink);
-
-  if (gst_s3_sink_is_null_or_empty (sink->config.location) && (
+  gboolean is_rolling = gst_s3_sink_is_rolling (sink);
+
+  if (is_rolling) {
+    if (gst_s3_sink_is_null_or_empty (sink->key_template))
+      goto no_key_template;
+    if (gst_s3_sink_is_null_or_empty (sink->config.location)
+        && gst_s3_sink_is_null_or_empty (sink->config.bucket))
+      goto no_destination;
+  } else if (gst_s3_sink_is_null_or_empty (sink->config.location) && (
       gst_s3_sink_is_null_or_empty (sink->config.bucket)
       || gst_s3_sink_is_null_or_empty (sink->config.key)))
     goto no_destination;
 
+  if (is_rolling) {
+    sink->object_index = 0;
+    sink->object_bytes = 0;
+    sink->object_start_time = GST_CLOCK_TIME_NONE;
+    g_free (sink->object_key);
+    sink->object_key = gst_s3_keys_format (sink->key_template, 0, 0);
+    sink->object_pool = g_thread_pool_new (gst_s3_sink_run_object_task, sink,
+        OBJECT_THREADS, FALSE, NULL);
+  }
+
   if (sink->uploader == NULL) {
-    sink->uploader = gst_s3_multipart_uploader_new (&sink->config);
+    GstS3Uploader *uploader = is_rolling ?
+        gst_s3_sink_new_object_uploader (sink, sink->object_key, TRUE) :
+        sink->uploader_new (&sink->config);
+
+    GST_OBJECT_LOCK (sink);
+    sink->uploader = uploader;
+    GST_OBJECT_UNLOCK (sink);
   }
 
   if (!sink->uploader)
     goto init_failed;
 
-  g_free (sink->buffer);
-  sink->buffer = NULL;
+  /* the next object is created while this one is written */
+  if (is_rolling && !gst_s3_keys_is_timed (sink->key_template))
+    gst_s3_sink_prepare_next_object (sink, 1, GST_CLOCK_TIME_NONE);
+
+  gst_s3_sink_free_buffer (sink);
+  g_clear_pointer (&sink->part_list, gst_buffer_list_unref);
 
-  sink->buffer = g_malloc (sink->config.buffer_size);
+  sink->part_size = sink->config.buffer_size;
+  sink->part_count = 0;
+  sink->hint_bytes = 0;
+  sink->hint_duration = GST_CLOCK_TIME_NONE;
+  sink->hint_bitrate = 0;
+
+  sink->resume_skip_bytes = 0;
+  if (sink->config.resume)
+    gst_s3_sink_apply_resume (sink);
+
+  if (sink->zero_copy)
+    sink->part_list = gst_buffer_list_new ();
+  else
+    sink->buffer = gst_s3_sink_alloc_buffer (sink, sink->part_size);
   sink->current_buffer_size = 0;
   sink->total_bytes_written = 0;
+  sink->throttle_episodes = 0;
+  sink->throttle_blocked_time = 0;
+  sink->throttle_dropped_bytes = 0;
+  sink->throttle_spilled_bytes = 0;
+
+  g_clear_pointer (&sink->keyframe_index, gst_s3_keyframe_index_free);
+  if (!gst_s3_sink_is_null_or_empty (sink->index_suffix)) {
+    /* the keyframes of the parts a resumed upload holds aren't known, and an
+     * index without them would send seeks to the wrong place */
+    if (sink->part_count > 0)
+      GST_ELEMENT_WARNING (sink, RESOURCE, SETTINGS,
+          ("No keyframe index is uploaded for a resumed upload."), (NULL));
+    else
+      sink->keyframe_index = gst_s3_keyframe_index_new ();
+  }
 
   if ( gst_s3_sink_is_null_or_empty (sink->config.location) )
   {
@@ -486,32 +1334,223 @@ no_destination:
     return FALSE;
   }
 
+no_key_template:
+  {
+    GST_ELEMENT_ERROR (sink, RESOURCE, NOT_FOUND,
+        ("No key-template specified for writing multiple objects."), (NULL));
+    return FALSE;
+  }
+
 init_failed:
   {
     gst_s3_destroy_uploader (sink);
+    gst_s3_sink_stop_objects (sink);
     GST_ELEMENT_ERROR (sink, RESOURCE, OPEN_WRITE,
         ("Unable to initialize S3 uploader."), (NULL));
     return FALSE;
   }
 }
 
+static void
+gst_s3_sink_post_checksum_message (GstS3Sink * sink, GstS3Uploader * uploader)
+{
+  GstStructure *stats = gst_s3_uploader_get_stats (uploader);
+  const gchar *checksum;
+  const gchar *expected;
+
+  if (!stats)
+    return;
+
+  checksum = gst_structure_get_string (stats, "checksum");
+  expected = gst_structure_get_string (stats, "expected-checksum");
+  if (checksum) {
+    gst_element_post_message (GST_ELEMENT_CAST (sink),
+        gst_message_new_element (GST_OBJECT_CAST (sink),
+            gst_structure_new ("s3sink-checksum",
+                "algorithm", GST_TYPE_S3_SINK_CHECKSUM_ALGORITHM,
+                sink->config.checksum_algorithm,
+                "checksum", G_TYPE_STRING, checksum,
+                "matches", G_TYPE_BOOLEAN, expected == NULL, NULL)));
+  }
+  /* the object is complete, the application decides what to do with it */
+  if (expected)
+    GST_ELEMENT_WARNING (sink, RESOURCE, WRITE,
+        ("The checksum of the uploaded object doesn't match its parts."),
+        ("S3 reported %s, the parts add up to %s", checksum, expected));
+  gst_structure_free (stats);
+}
+
+/* Uploads the keyframe index of the object written to key. A missing index
+ * only costs slower seeks, so it doesn't fail the upload. */
+static void
+gst_s3_sink_upload_index (GstS3Sink * sink, const gchar * key,
+    GstS3KeyframeIndex * keyframe_index)
+{
+  gchar *index_key = g_strconcat (key, sink->index_suffix, NULL);
+  GstS3Uploader *uploader =
+      gst_s3_sink_new_object_uploader (sink, index_key, FALSE);
+  guint8 *data;
+  gsize size;
+  gboolean ret = FALSE;
+
+  data = gst_s3_keyframe_index_serialize (keyframe_index, &size);
+  if (uploader) {
+    ret = gst_s3_uploader_upload_part (uploader, (const gchar *) data, size)
+        && gst_s3_uploader_complete (uploader);
+    gst_s3_uploader_destroy (uploader);
+  }
+  g_free (data);
+
+  if (ret) {
+    GST_INFO_OBJECT (sink, "uploaded the index of %u keyframes to %s",
+        gst_s3_keyframe_index_get_size (keyframe_index), index_key);
+  } else {
+    GST_ELEMENT_WARNING (sink, RESOURCE, WRITE,
+        ("Failed to upload the keyframe index %s.", index_key), (NULL));
+  }
+  g_free (index_key);
+}
+
+/* Completes the object and uploads its keyframe index, if any, which is
+ * freed. */
+static gboolean
+gst_s3_sink_complete_object (GstS3Sink * sink, GstS3Uploader * uploader,
+    const gchar * key, guint index, guint64 size,
+    GstS3KeyframeIndex * keyframe_index)
+{
+  gboolean ret = gst_s3_uploader_complete (uploader);
+  gchar *single_key;
+
+  if (ret)
+    gst_s3_sink_post_checksum_message (sink, uploader);
+
+  if (ret && keyframe_index) {
+    if (key) {
+      gst_s3_sink_upload_index (sink, key, keyframe_index);
+    } else if ((single_key = gst_s3_keys_get_single (sink->config.location,
+                sink->config.key))) {
+      gst_s3_sink_upload_index (sink, single_key, keyframe_index);
+      g_free (single_key);
+    }
+  }
+  gst_s3_keyframe_index_free (keyframe_index);
+
+  if (!gst_s3_sink_is_rolling (sink))
+    return ret;
+
+  GST_INFO_OBJECT (sink, "object %u (%s, %" G_GUINT64_FORMAT " bytes) %s",
+      index, key, size, ret ? "completed" : "failed");
+
+  gst_element_post_message (GST_ELEMENT_CAST (sink),
+      gst_message_new_element (GST_OBJECT_CAST (sink),
+          gst_structure_new ("s3sink-object-completed",
+              "index", G_TYPE_UINT, index,
+              "key", G_TYPE_STRING, key,
+              "size", G_TYPE_UINT64, size,
+              "success", G_TYPE_BOOLEAN, ret, NULL)));
+
+  if (!ret) {
+    gchar *destination = gst_s3_sink_get_object_uri (sink, key);
+
+    g_mutex_lock (&sink->object_lock);
+    if (!sink->object_error)
+      sink->object_error = g_strdup_printf ("Failed to complete %s.",
+          destination);
+    g_mutex_unlock (&sink->object_lock);
+    g_free (destination);
+  }
+
+  return ret;
+}
+
+static void
+gst_s3_sink_run_object_task (gpointer data, gpointer user_data)
+{
+  GstS3SinkObjectTask *task = data;
+  GstS3Sink *sink = GST_S3_SINK (user_data);
+  GstS3Uploader *uploader;
+
+  if (task->uploader) {
+    gst_s3_sink_complete_object (sink, task->uploader, task->key, task->index,
+        task->size, task->keyframe_index);
+    gst_s3_uploader_destroy (task->uploader);
+  } else {
+    uploader = gst_s3_sink_new_object_uploader (sink, task->key, TRUE);
+
+    g_mutex_lock (&sink->object_lock);
+    sink->next_uploader = uploader;
+    sink->is_next_ready = TRUE;
+    g_mutex_unlock (&sink->object_lock);
+  }
+
+  g_mutex_lock (&sink->object_lock);
+  sink->pending_object_tasks--;
+  g_cond_broadcast (&sink->object_cond);
+  g_mutex_unlock (&sink->object_lock);
+
+  g_free (task->key);
+  g_free (task);
+}
+
+/* Waits for the objects still being completed and drops the one prepared
+ * for a split which didn't happen. */
+static gboolean
+gst_s3_sink_stop_objects (GstS3Sink * sink)
+{
+  gboolean ret = TRUE;
+
+  if (!sink->object_pool)
+    return TRUE;
+
+  g_mutex_lock (&sink->object_lock);
+  while (sink->pending_object_tasks > 0)
+    g_cond_wait (&sink->object_cond, &sink->object_lock);
+  g_mutex_unlock (&sink->object_lock);
+
+  g_thread_pool_free (sink->object_pool, FALSE, TRUE);
+  sink->object_pool = NULL;
+
+  if (sink->next_uploader)
+    gst_s3_uploader_destroy (sink->next_uploader);
+  sink->next_uploader = NULL;
+  sink->is_next_ready = FALSE;
+
+  if (sink->object_error) {
+    GST_WARNING_OBJECT (sink, "%s", sink->object_error);
+    ret = FALSE;
+  }
+  g_clear_pointer (&sink->object_error, g_free);
+  g_clear_pointer (&sink->object_key, g_free);
+  g_clear_pointer (&sink->next_key, g_free);
+
+  return ret;
+}
+
 static gboolean
 gst_s3_sink_stop (GstBaseSink * basesink)
 {
   GstS3Sink *sink = GST_S3_SINK (basesink);
   gboolean ret = TRUE;
 
-  if (sink->buffer) {
+  if (sink->buffer || sink->part_list) {
     gst_s3_sink_flush_buffer (sink);
-    ret = gst_s3_uploader_complete (sink->uploader);
-
-    g_free (sink->buffer);
-    sink->buffer = NULL;
+    if (sink->uploader)
+      ret = gst_s3_sink_complete_object (sink, sink->uploader,
+          sink->object_key, sink->object_index, sink->object_bytes,
+          sink->keyframe_index);
+    sink->keyframe_index = NULL;
+
+    gst_s3_sink_free_buffer (sink);
+    g_clear_pointer (&sink->part_list, gst_buffer_list_unref);
     sink->current_buffer_size = 0;
     sink->total_bytes_written = 0;
   }
 
   gst_s3_destroy_uploader (sink);
+  g_clear_pointer (&sink->keyframe_index, gst_s3_keyframe_index_free);
+
+  if (!gst_s3_sink_stop_objects (sink))
+    ret = FALSE;
 
   sink->is_started = FALSE;
 
@@ -579,6 +1618,50 @@ gst_s3_sink_event (GstBaseSink * base_sink, GstEvent * event)
     case GST_EVENT_EOS:
       gst_s3_sink_flush_buffer (sink);
       break;
+    case GST_EVENT_SEGMENT:
+    {
+      const GstSegment *segment;
+
+      gst_event_parse_segment (event, &segment);
+      if (segment->format == GST_FORMAT_BYTES && segment->stop != -1) {
+        sink->hint_bytes = segment->stop - segment->start;
+      } else if (segment->format == GST_FORMAT_TIME) {
+        if (segment->stop != -1)
+          sink->hint_duration = segment->stop - segment->start;
+        else if (segment->duration != -1)
+          sink->hint_duration = segment->duration;
+      }
+      gst_s3_sink_apply_size_hints (sink);
+      break;
+    }
+    case GST_EVENT_CAPS:
+    {
+      GstCaps *caps;
+      gint bitrate;
+
+      gst_event_parse_caps (event, &caps);
+      if (gst_caps_get_size (caps) > 0
+          && gst_structure_get_int (gst_caps_get_structure (caps, 0),
+              "bitrate", &bitrate) && bitrate > 0) {
+        sink->hint_bitrate = bitrate;
+        gst_s3_sink_apply_size_hints (sink);
+      }
+      break;
+    }
+    case GST_EVENT_TAG:
+    {
+      GstTagList *tags;
+      guint bitrate;
+
+      gst_event_parse_tag (event, &tags);
+      if (gst_tag_list_get_uint (tags, GST_TAG_MAXIMUM_BITRATE, &bitrate)
+          || gst_tag_list_get_uint (tags, GST_TAG_BITRATE, &bitrate)
+          || gst_tag_list_get_uint (tags, GST_TAG_NOMINAL_BITRATE, &bitrate)) {
+        sink->hint_bitrate = bitrate;
+        gst_s3_sink_apply_size_hints (sink);
+      }
+      break;
+    }
     default:
       break;
   }
@@ -586,72 +1669,418 @@ gst_s3_sink_event (GstBaseSink * base_sink, GstEvent * event)
   return GST_BASE_SINK_CLASS (parent_class)->event (base_sink, event);
 }
 
+static gsize
+gst_s3_sink_max_part_size (GstS3Sink * sink)
+{
+  return MIN (MAX (sink->max_buffer_size, sink->config.buffer_size),
+      G_MAXSIZE);
+}
+
+/* Number of bytes which can be uploaded within S3's part count limit when
+ * starting with parts of the given size and following the growth schedule. */
+static guint64
+gst_s3_sink_upload_capacity (GstS3Sink * sink, gsize part_size)
+{
+  gsize max_part_size = gst_s3_sink_max_part_size (sink);
+  guint64 capacity = 0;
+  guint parts = 0;
+  guint step;
+
+  while (parts < MAX_PART_COUNT) {
+    step = MAX_PART_COUNT - parts;
+    if (sink->part_size_growth_interval > 0)
+      step = MIN (step, sink->part_size_growth_interval);
+    capacity += (guint64) step * part_size;
+    parts += step;
+    part_size = MIN ((guint64) part_size * 2, max_part_size);
+  }
+
+  return capacity;
+}
+
+static void
+gst_s3_sink_set_part_size (GstS3Sink * sink, gsize part_size)
+{
+  if (part_size == sink->part_size)
+    return;
+
+  GST_INFO_OBJECT (sink, "part size changed to %" G_GSIZE_FORMAT " bytes",
+      part_size);
+
+  sink->part_size = part_size;
+  if (sink->buffer)
+    gst_s3_sink_resize_buffer (sink, part_size);
+}
+
+/* Grows the first part so that a stream of the size announced by upstream
+ * (with some headroom) fits in S3's part limit. Small streams keep the
+ * configured buffer-size. */
+static void
+gst_s3_sink_apply_size_hints (GstS3Sink * sink)
+{
+  gsize max_part_size = gst_s3_sink_max_part_size (sink);
+  guint64 expected_bytes = sink->hint_bytes;
+  gsize part_size = sink->part_size;
+
+  if (!sink->is_started || sink->part_count > 0)
+    return;
+
+  if (expected_bytes == 0 && GST_CLOCK_TIME_IS_VALID (sink->hint_duration)
+      && sink->hint_bitrate > 0) {
+    expected_bytes = gst_util_uint64_scale (sink->hint_duration,
+        sink->hint_bitrate / 8, GST_SECOND);
+  }
+  if (expected_bytes == 0)
+    return;
+
+  expected_bytes += expected_bytes / 2;
+  while (part_size < max_part_size
+      && gst_s3_sink_upload_capacity (sink, part_size) < expected_bytes) {
+    part_size = MIN ((guint64) part_size * 2, max_part_size);
+  }
+
+  GST_DEBUG_OBJECT (sink, "expecting %" G_GUINT64_FORMAT " bytes, first part "
+      "size %" G_GSIZE_FORMAT, expected_bytes, part_size);
+  gst_s3_sink_set_part_size (sink, part_size);
+}
+
+static GstClockTime
+gst_s3_sink_get_running_time (GstS3Sink * sink, GstBuffer * buffer)
+{
+  GstSegment *segment = &GST_BASE_SINK (sink)->segment;
+  GstClockTime timestamp = GST_BUFFER_DTS_OR_PTS (buffer);
+
+  if (segment->format != GST_FORMAT_TIME
+      || !GST_CLOCK_TIME_IS_VALID (timestamp))
+    return GST_CLOCK_TIME_NONE;
+
+  return gst_segment_to_running_time (segment, GST_FORMAT_TIME, timestamp);
+}
+
+/* Hands the current object over to be completed in the background and
+ * starts the next one with the prepared uploader. */
+static gboolean
+gst_s3_sink_split (GstS3Sink * sink, GstClockTime running_time)
+{
+  GstS3SinkObjectTask *task;
+
+  if (!gst_s3_sink_flush_buffer (sink))
+    return FALSE;
+
+  task = g_new0 (GstS3SinkObjectTask, 1);
+  GST_OBJECT_LOCK (sink);
+  task->uploader = sink->uploader;
+  sink->uploader = NULL;
+  GST_OBJECT_UNLOCK (sink);
+  task->key = sink->object_key;
+  task->index = sink->object_index;
+  task->size = sink->object_bytes;
+  task->keyframe_index = sink->keyframe_index;
+  sink->object_key = NULL;
+  if (sink->keyframe_index)
+    sink->keyframe_index = gst_s3_keyframe_index_new ();
+  gst_s3_sink_push_object_task (sink, task);
+
+  sink->object_index++;
+  sink->object_bytes = 0;
+  sink->object_start_time = running_time;
+  sink->part_count = 0;
+  gst_s3_sink_set_part_size (sink, sink->config.buffer_size);
+
+  /* the uploader is only needed once the first part is full, which leaves
+   * time to create it now that the key is known */
+  if (gst_s3_keys_is_timed (sink->key_template))
+    gst_s3_sink_prepare_next_object (sink, sink->object_index, running_time);
+
+  return TRUE;
+}
+
+static gboolean
+gst_s3_sink_split_if_needed (GstS3Sink * sink, GstBuffer * buffer)
+{
+  GstClockTime running_time = gst_s3_sink_get_running_time (sink, buffer);
+  gboolean is_full = FALSE;
+
+  if (!GST_CLOCK_TIME_IS_VALID (sink->object_start_time))
+    sink->object_start_time = running_time;
+
+  if (sink->object_bytes == 0)
+    return TRUE;
+
+  if (sink->max_object_size > 0
+      && sink->object_bytes + gst_buffer_get_size (buffer) >
+      sink->max_object_size)
+    is_full = TRUE;
+
+  if (sink->max_object_duration > 0
+      && GST_CLOCK_TIME_IS_VALID (running_time)
+      && GST_CLOCK_TIME_IS_VALID (sink->object_start_time)
+      && running_time >= sink->object_start_time + sink->max_object_duration)
+    is_full = TRUE;
+
+  if (!is_full || (sink->split_at_keyframe
+          && GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT)))
+    return TRUE;
+
+  return gst_s3_sink_split (sink, running_time);
+}
+
+/* Records where the buffer starts if it is a keyframe. */
+static void
+gst_s3_sink_index_buffer (GstS3Sink * sink, GstBuffer * buffer)
+{
+  GstClockTime time = GST_BUFFER_PTS_IS_VALID (buffer) ?
+      GST_BUFFER_PTS (buffer) : GST_BUFFER_DTS (buffer);
+  GstClockTime last_time;
+
+  if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT)
+      || !GST_CLOCK_TIME_IS_VALID (time))
+    return;
+
+  last_time = gst_s3_keyframe_index_get_last_time (sink->keyframe_index);
+  if (GST_CLOCK_TIME_IS_VALID (last_time)
+      && time < last_time + MIN_INDEX_INTERVAL)
+    return;
+
+  /* objects of a rolling upload are indexed separately */
+  gst_s3_keyframe_index_add (sink->keyframe_index, GST_BUFFER_PTS (buffer),
+      GST_BUFFER_DTS (buffer), gst_s3_sink_is_rolling (sink) ?
+      sink->object_bytes : sink->total_bytes_written, sink->part_count + 1);
+}
+
+/* Drops the start of the stream a resumed upload already holds. */
+static gboolean
+gst_s3_sink_fill_resumed (GstS3Sink * sink, GstBuffer * buffer)
+{
+  gsize size = gst_buffer_get_size (buffer);
+  gsize skipped = MIN (size, sink->resume_skip_bytes);
+  GstBuffer *rest;
+  gboolean ret;
+
+  sink->resume_skip_bytes -= skipped;
+  sink->total_bytes_written += skipped;
+  if (skipped == size)
+    return TRUE;
+
+  rest = gst_buffer_copy_region (buffer, GST_BUFFER_COPY_ALL, skipped,
+      size - skipped);
+  if (!rest) {
+    GST_ELEMENT_ERROR (sink, RESOURCE, NOT_FOUND,
+        ("Failed to reference the buffer memory."), (NULL));
+    return FALSE;
+  }
+  ret = gst_s3_sink_fill (sink, rest);
+  gst_buffer_unref (rest);
+
+  return ret;
+}
+
+static gboolean
+gst_s3_sink_fill (GstS3Sink * sink, GstBuffer * buffer)
+{
+  gboolean ret;
+
+  if (gst_buffer_n_memory (buffer) == 0)
+    return TRUE;
+
+  if (sink->resume_skip_bytes > 0)
+    return gst_s3_sink_fill_resumed (sink, buffer);
+
+  if (gst_s3_sink_is_rolling (sink)
+      && !gst_s3_sink_split_if_needed (sink, buffer))
+    return FALSE;
+
+  if (sink->keyframe_index)
+    gst_s3_sink_index_buffer (sink, buffer);
+
+  if (sink->zero_copy)
+    ret = gst_s3_sink_fill_part_list (sink, buffer);
+  else
+    ret = gst_s3_sink_fill_buffer (sink, buffer);
+
+  sink->object_bytes += gst_buffer_get_size (buffer);
+
+  return ret;
+}
+
+/* Parts are uploaded in the background; stop accepting data as soon as one
+ * of them is lost rather than finding out when the upload is completed.
+ * With rolling objects, a previous object may also have failed to be
+ * completed. */
+static gboolean
+gst_s3_sink_check_upload (GstS3Sink * sink)
+{
+  gchar *error = NULL;
+  gchar *destination;
+
+  if (sink->object_pool) {
+    g_mutex_lock (&sink->object_lock);
+    error = g_strdup (sink->object_error);
+    g_mutex_unlock (&sink->object_lock);
+  }
+  if (error) {
+    GST_ELEMENT_ERROR (sink, RESOURCE, WRITE, ("%s", error), (NULL));
+    g_free (error);
+    return FALSE;
+  }
+
+  if (sink->uploader)
+    error = gst_s3_uploader_get_error (sink->uploader);
+  if (!error)
+    return TRUE;
+
+  destination = gst_s3_sink_get_object_uri (sink,
+      sink->object_pool ? sink->object_key : NULL);
+  GST_ELEMENT_ERROR (sink, RESOURCE, WRITE,
+      ("Failed to upload a part of %s.", destination), ("%s", error));
+  g_free (destination);
+  g_free (error);
+
+  return FALSE;
+}
+
 static GstFlowReturn
 gst_s3_sink_render (GstBaseSink * base_sink, GstBuffer * buffer)
 {
   GstS3Sink *sink;
   GstFlowReturn flow;
-  guint8 n_mem;
 
   sink = GST_S3_SINK (base_sink);
 
-  n_mem = gst_buffer_n_memory (buffer);
+  if (!gst_s3_sink_check_upload (sink))
+    return GST_FLOW_ERROR;
 
-  if (n_mem > 0) {
-    if (gst_s3_sink_fill_buffer (sink, buffer)) {
-      flow = GST_FLOW_OK;
-    } else {
-      GST_WARNING ("Failed to flush the internal buffer");
-      flow = GST_FLOW_ERROR;
-    }
-  } else {
+  if (gst_s3_sink_fill (sink, buffer)) {
     flow = GST_FLOW_OK;
+  } else {
+    GST_WARNING ("Failed to flush the internal buffer");
+    flow = GST_FLOW_ERROR;
   }
 
   return flow;
 }
 
+static GstFlowReturn
+gst_s3_sink_render_list (GstBaseSink * base_sink, GstBufferList * list)
+{
+  GstS3Sink *sink;
+  guint idx, length;
+
+  sink = GST_S3_SINK (base_sink);
+  length = gst_buffer_list_length (list);
+
+  if (!gst_s3_sink_check_upload (sink))
+    return GST_FLOW_ERROR;
+
+  for (idx = 0; idx < length; idx++) {
+    if (!gst_s3_sink_fill (sink, gst_buffer_list_get (list, idx))) {
+      GST_WARNING ("Failed to flush the internal buffer");
+      return GST_FLOW_ERROR;
+    }
+  }
+
+  return GST_FLOW_OK;
+}
+
+static void
+gst_s3_sink_post_throttle_message (GstS3Sink * sink)
+{
+  GstStructure *stats = gst_s3_uploader_get_stats (sink->uploader);
+  guint64 episodes = 0, blocked_time = 0, dropped_bytes = 0, spilled_bytes = 0;
+
+  if (!stats)
+    return;
+
+  gst_structure_get_uint64 (stats, "throttle-episodes", &episodes);
+  gst_structure_get_uint64 (stats, "blocked-time", &blocked_time);
+  gst_structure_get_uint64 (stats, "dropped-bytes", &dropped_bytes);
+  gst_structure_get_uint64 (stats, "spilled-bytes", &spilled_bytes);
+  gst_structure_free (stats);
+
+  if (episodes == sink->throttle_episodes)
+    return;
+
+  GST_INFO_OBJECT (sink, "upload throttled, in-flight budget exceeded");
+
+  gst_element_post_message (GST_ELEMENT_CAST (sink),
+      gst_message_new_element (GST_OBJECT_CAST (sink),
+          gst_structure_new ("s3sink-throttled",
+              "policy", GST_TYPE_S3_SINK_INFLIGHT_POLICY,
+              sink->config.inflight_policy,
+              "blocked-time", G_TYPE_UINT64,
+              blocked_time - sink->throttle_blocked_time,
+              "dropped-bytes", G_TYPE_UINT64,
+              dropped_bytes - sink->throttle_dropped_bytes,
+              "spilled-bytes", G_TYPE_UINT64,
+              spilled_bytes - sink->throttle_spilled_bytes, NULL)));
+
+  sink->throttle_episodes = episodes;
+  sink->throttle_blocked_time = blocked_time;
+  sink->throttle_dropped_bytes = dropped_bytes;
+  sink->throttle_spilled_bytes = spilled_bytes;
+}
+
 static gboolean
 gst_s3_sink_flush_buffer (GstS3Sink * sink)
 {
   gboolean ret = TRUE;
 
   if (sink->current_buffer_size) {
-    ret = gst_s3_uploader_upload_part (sink->uploader, sink->buffer,
-        sink->current_buffer_size);
+    if (!sink->uploader && !gst_s3_sink_take_next_uploader (sink))
+      return FALSE;
+
+    if (sink->part_list) {
+      /* the uploader takes over the list and the memories it references */
+      ret = gst_s3_uploader_upload_part_list (sink->uploader, sink->part_list,
+          sink->current_buffer_size);
+      sink->part_list = gst_buffer_list_new ();
+    } else {
+      ret = gst_s3_uploader_upload_part (sink->uploader, sink->buffer,
+          sink->current_buffer_size);
+    }
     sink->current_buffer_size = 0;
+    sink->part_count++;
+
+    gst_s3_sink_post_throttle_message (sink);
+
+    if (sink->part_size_growth_interval > 0
+        && sink->part_count % sink->part_size_growth_interval == 0) {
+      gst_s3_sink_set_part_size (sink, MIN ((guint64) sink->part_size * 2,
+              gst_s3_sink_max_part_size (sink)));
+    }
   }
 
   return ret;
 }
 
 static gboolean
-gst_s3_sink_fill_buffer (GstS3Sink * sink, GstBuffer * buffer)
+gst_s3_sink_fill_memory (GstS3Sink * sink, GstMemory * memory)
 {
   GstMapInfo map_info = GST_MAP_INFO_INIT;
   gsize ptr = 0;
   gsize bytes_to_copy;
 
-  if (!gst_buffer_map (buffer, &map_info, GST_MAP_READ))
+  if (!gst_memory_map (memory, &map_info, GST_MAP_READ))
     goto map_failed;
 
-  do {
+  while (ptr < map_info.size) {
     bytes_to_copy =
-        MIN (sink->config.buffer_size - sink->current_buffer_size,
+        MIN (sink->part_size - sink->current_buffer_size,
         map_info.size - ptr);
     memcpy (sink->buffer + sink->current_buffer_size, map_info.data + ptr,
         bytes_to_copy);
     sink->current_buffer_size += bytes_to_copy;
-    if (sink->current_buffer_size == sink->config.buffer_size) {
+    if (sink->current_buffer_size == sink->part_size) {
       if (!gst_s3_sink_flush_buffer (sink)) {
+        gst_memory_unmap (memory, &map_info);
         return FALSE;
       }
     }
     ptr += bytes_to_copy;
     sink->total_bytes_written += bytes_to_copy;
-  } while (ptr < map_info.size);
+  }
 
-  gst_buffer_unmap (buffer, &map_info);
+  gst_memory_unmap (memory, &map_info);
   return TRUE;
 
 map_failed:
@@ -661,3 +2090,60 @@ map_failed:
     return FALSE;
   }
 }
+
+static gboolean
+gst_s3_sink_fill_buffer (GstS3Sink * sink, GstBuffer * buffer)
+{
+  guint idx, n_mem;
+
+  /* Copy each memory separately; mapping the whole buffer would first merge
+   * multi-memory buffers into a temporary copy. */
+  n_mem = gst_buffer_n_memory (buffer);
+  for (idx = 0; idx < n_mem; idx++) {
+    if (!gst_s3_sink_fill_memory (sink, gst_buffer_peek_memory (buffer, idx)))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+gst_s3_sink_fill_part_list (GstS3Sink * sink, GstBuffer * buffer)
+{
+  gsize size = gst_buffer_get_size (buffer);
+  gsize ptr = 0;
+  gsize bytes_to_take;
+  GstBuffer *region;
+
+  do {
+    bytes_to_take =
+        MIN (sink->part_size - sink->current_buffer_size, size - ptr);
+    if (bytes_to_take == size) {
+      region = gst_buffer_ref (buffer);
+    } else {
+      /* shares the memory of the upstream buffer, nothing is copied */
+      region = gst_buffer_copy_region (buffer, GST_BUFFER_COPY_MEMORY, ptr,
+          bytes_to_take);
+      if (!region)
+        goto copy_failed;
+    }
+    gst_buffer_list_add (sink->part_list, region);
+    sink->current_buffer_size += bytes_to_take;
+    if (sink->current_buffer_size == sink->part_size) {
+      if (!gst_s3_sink_flush_buffer (sink)) {
+        return FALSE;
+      }
+    }
+    ptr += bytes_to_take;
+    sink->total_bytes_written += bytes_to_take;
+  } while (ptr < size);
+
+  return TRUE;
+
+copy_failed:
+  {
+    GST_ELEMENT_ERROR (sink, RESOURCE, NOT_FOUND,
+        ("Failed to reference the buffer memory."), (NULL));
+    return FALSE;
+  }
+}
@@ -23,6 +23,7 @@
 #include <gst/base/gstbasesink.h>
 
 #include "gsts3uploader.h"
+#include "gsts3keyframeindex.h"
 #include "gstawscredentials.h"
 
 G_BEGIN_DECLS
@@ -53,12 +54,62 @@ struct _GstS3Sink {
   GstS3UploaderConfig config;
 
   GstS3Uploader *uploader;
+  GstS3UploaderNewFunc uploader_new;
 
   gchar *buffer;
+  gsize buffer_map_size; /* 0 if the buffer is on the heap */
+  GstBufferList *part_list;
+  gsize part_size;
+  guint part_count;
   gsize current_buffer_size;
   gsize total_bytes_written;
 
   gboolean is_started;
+  gboolean zero_copy;
+  guint part_size_growth_interval;
+  guint64 max_buffer_size;
+
+  /* stream size hints used to pick the size of the first part */
+  guint64 hint_bytes;
+  GstClockTime hint_duration;
+  guint hint_bitrate;
+
+  /* uploader counters at the end of the last throttling episode */
+  guint64 throttle_episodes;
+  guint64 throttle_blocked_time;
+  guint64 throttle_dropped_bytes;
+  guint64 throttle_spilled_bytes;
+
+  /* bytes of the stream a resumed upload already holds */
+  guint64 resume_skip_bytes;
+
+  /* rolling upload: a new object is started whenever the current one
+   * reaches max_object_size bytes or max_object_duration */
+  gchar *key_template;
+  guint64 max_object_size;
+  GstClockTime max_object_duration;
+  gboolean split_at_keyframe;
+
+  guint object_index;
+  gchar *object_key;
+  gchar *next_key;
+  guint64 object_bytes;
+  GstClockTime object_start_time;
+
+  /* uploaders of the next objects are created and the finished ones
+   * completed on object_pool; object_lock guards the fields below */
+  GThreadPool *object_pool;
+  GMutex object_lock;
+  GCond object_cond;
+  GstS3Uploader *next_uploader;
+  gboolean is_next_ready;
+  guint pending_object_tasks;
+  gchar *object_error;
+
+  /* keyframes of the current object, uploaded as <key><index_suffix> once
+   * the object is complete */
+  gchar *index_suffix;
+  GstS3KeyframeIndex *keyframe_index;
 };
 
 struct _GstS3SinkClass {
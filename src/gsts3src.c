@@ -0,0 +1,1224 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * SECTION:element-s3src
+ * @title: s3src
+ *
+ * Read an object from an Amazon S3 bucket. The object is fetched as
+ * concurrent byte ranges, which are handed downstream in order. The
+ * element can also be driven in pull mode; fetched ranges are cached, and
+ * a read elsewhere in the object fetches its ranges with a single request.
+ *
+ * With keys, prefix or key-template set, the element reads a sequence of
+ * objects back to back as a single stream. The next object is opened, and
+ * its first ranges requested, while the current one is read, so the
+ * boundaries between objects don't stall the stream. An element message
+ * named 's3src-object-started' is posted as every object starts.
+ *
+ * With index-suffix set, the keyframe index s3sink uploaded next to the
+ * object is loaded, and seeks in time go straight to the range of the
+ * keyframe they land on instead of leaving the demuxer to search for it.
+ *
+ * ## Example launch line
+ * |[
+ * gst-launch-1.0 s3src location=s3://test-bucket/recording.mp4 ! qtdemux ! fakesink
+ * ]| Demux an MP4 file stored in S3.
+ * |[
+ * gst-launch-1.0 s3src bucket=test-bucket prefix=recordings/cam1/ ! tsdemux ! fakesink
+ * ]| Replay the MPEG-TS segments stored under a prefix as one stream.
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <gst/gsturi.h>
+
+#include <string.h>
+
+#include "gsts3src.h"
+#include "gsts3keys.h"
+#include "gsts3multipartdownloader.h"
+
+static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+GST_DEBUG_CATEGORY (gst_s3_src_debug);
+#define GST_CAT_DEFAULT gst_s3_src_debug
+
+#define MIN_RANGE_SIZE (64 * 1024)
+#define DEFAULT_BLOCKSIZE (256 * 1024)
+#define DEFAULT_START_INDEX 0
+#define OBJECT_THREADS 1
+/* indexes are read in one go */
+#define MAX_INDEX_SIZE (64 * 1024 * 1024)
+
+#define REQUIRED_BUT_UNUSED(x) (void)(x)
+
+enum
+{
+  PROP_0,
+  PROP_BUCKET,
+  PROP_KEY,
+  PROP_LOCATION,
+  PROP_CA_FILE,
+  PROP_REGION,
+  PROP_INIT_AWS_SDK,
+  PROP_CREDENTIALS,
+  PROP_AWS_SDK_ENDPOINT,
+  PROP_AWS_SDK_USE_HTTP,
+  PROP_AWS_SDK_VERIFY_SSL,
+  PROP_MAX_CONNECTIONS,
+  PROP_RANGE_SIZE,
+  PROP_ALIGN_TO_PARTS,
+  PROP_MIN_READ_AHEAD,
+  PROP_MAX_READ_AHEAD,
+  PROP_CACHE_SIZE,
+  PROP_KEYS,
+  PROP_PREFIX,
+  PROP_KEY_TEMPLATE,
+  PROP_START_INDEX,
+  PROP_INDEX_SUFFIX,
+  PROP_STATS,
+  PROP_LAST
+};
+
+static void gst_s3_src_dispose (GObject * object);
+static void gst_s3_src_finalize (GObject * object);
+
+static void gst_s3_src_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec);
+static void gst_s3_src_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec);
+
+static gboolean gst_s3_src_start (GstBaseSrc * src);
+static gboolean gst_s3_src_stop (GstBaseSrc * src);
+static gboolean gst_s3_src_unlock (GstBaseSrc * src);
+static gboolean gst_s3_src_unlock_stop (GstBaseSrc * src);
+static gboolean gst_s3_src_is_seekable (GstBaseSrc * src);
+static gboolean gst_s3_src_get_size (GstBaseSrc * src, guint64 * size);
+static GstFlowReturn gst_s3_src_create (GstBaseSrc * src, guint64 offset,
+    guint length, GstBuffer ** buffer);
+static gboolean gst_s3_src_query (GstBaseSrc * src, GstQuery * query);
+static gboolean gst_s3_src_prepare_seek_segment (GstBaseSrc * src,
+    GstEvent * seek, GstSegment * segment);
+static GstStructure *gst_s3_src_get_stats (GstS3Src * src);
+static gboolean gst_s3_src_is_sequence (GstS3Src * src);
+
+/**
+ * GstURIHandler Interface implementation
+ */
+static GstURIType
+gst_s3_src_urihandler_get_type (GType type)
+{
+  REQUIRED_BUT_UNUSED(type);
+  return GST_URI_SRC;
+}
+
+static const gchar * const*
+gst_s3_src_urihandler_get_protocols (GType type)
+{
+  REQUIRED_BUT_UNUSED(type);
+  static const gchar *protocols[] = { "s3", NULL};
+  return protocols;
+}
+
+static gchar *
+gst_s3_src_urihandler_get_uri (GstURIHandler * handler)
+{
+  GValue value = {0};
+  g_object_get_property( G_OBJECT(handler), "location", &value);
+  return g_strdup_value_contents(&value);
+}
+
+static gboolean
+gst_s3_src_urihandler_set_uri (GstURIHandler * handler, const gchar * uri, GError **error)
+{
+  REQUIRED_BUT_UNUSED(error);
+  g_object_set( G_OBJECT(handler), "location", uri, NULL);
+  return TRUE;
+}
+
+static void
+gst_s3_src_urihandler_init (gpointer g_iface, gpointer iface_data)
+{
+  REQUIRED_BUT_UNUSED(iface_data);
+  GstURIHandlerInterface *iface = (GstURIHandlerInterface *) g_iface;
+  iface->get_type      = gst_s3_src_urihandler_get_type;
+  iface->get_protocols = gst_s3_src_urihandler_get_protocols;
+  iface->get_uri       = gst_s3_src_urihandler_get_uri;
+  iface->set_uri       = gst_s3_src_urihandler_set_uri;
+}
+
+#define gst_s3_src_parent_class parent_class
+G_DEFINE_TYPE_WITH_CODE (GstS3Src, gst_s3_src, GST_TYPE_BASE_SRC,
+  G_IMPLEMENT_INTERFACE (GST_TYPE_URI_HANDLER, gst_s3_src_urihandler_init));
+
+static void
+gst_s3_src_class_init (GstS3SrcClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *gstelement_class = GST_ELEMENT_CLASS (klass);
+  GstBaseSrcClass *gstbasesrc_class = GST_BASE_SRC_CLASS (klass);
+
+  GST_DEBUG_CATEGORY_INIT (gst_s3_src_debug, "s3src", 0, "s3src element");
+
+  gobject_class->dispose = gst_s3_src_dispose;
+  gobject_class->finalize = gst_s3_src_finalize;
+  gobject_class->set_property = gst_s3_src_set_property;
+  gobject_class->get_property = gst_s3_src_get_property;
+
+  g_object_class_install_property (gobject_class, PROP_BUCKET,
+      g_param_spec_string ("bucket", "S3 bucket",
+          "The bucket of the file to read (ignored when 'location' is set)", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_KEY,
+      g_param_spec_string ("key", "S3 key",
+          "The key of the file to read (ignored when 'location' is set)", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_LOCATION,
+      g_param_spec_string ("location", "S3 URI",
+          "The URI of the file to read", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_CA_FILE,
+      g_param_spec_string ("ca-file", "CA file",
+          "A path to a CA file", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_REGION,
+      g_param_spec_string ("region", "AWS Region",
+          "An AWS region (e.g. eu-west-2). Leave empty for region-autodetection "
+          "(Please note region-autodetection requires an extra network call)", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_INIT_AWS_SDK,
+      g_param_spec_boolean ("init-aws-sdk", "Init AWS SDK",
+          "Whether to initialize AWS SDK",
+          GST_S3_DOWNLOADER_CONFIG_DEFAULT_INIT_AWS_SDK,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_CREDENTIALS,
+      g_param_spec_boxed ("aws-credentials", "AWS credentials",
+          "The AWS credentials to use", GST_TYPE_AWS_CREDENTIALS,
+          G_PARAM_WRITABLE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_AWS_SDK_ENDPOINT,
+      g_param_spec_string ("aws-sdk-endpoint", "AWS SDK Endpoint",
+          "AWS SDK endpoint override (ip:port)", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_AWS_SDK_USE_HTTP,
+      g_param_spec_boolean ("aws-sdk-use-http", "AWS SDK Use HTTP",
+          "Whether to enable http for the AWS SDK (default https)",
+          GST_S3_DOWNLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_USE_HTTP,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_AWS_SDK_VERIFY_SSL,
+      g_param_spec_boolean ("aws-sdk-verify-ssl", "AWS SDK Verify SSL",
+          "Whether to enable/disable tls validation for the AWS SDK",
+          GST_S3_DOWNLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_VERIFY_SSL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_CONNECTIONS,
+      g_param_spec_uint ("max-connections", "Max connections",
+          "Maximum number of connections of the S3 client. Elements in a "
+          "process with the same region, endpoint, credentials, TLS settings "
+          "and max-connections share one client and its connections; the "
+          "limit applies to every client, not to the whole process", 1, G_MAXUINT,
+          GST_S3_DOWNLOADER_CONFIG_DEFAULT_MAX_CONNECTIONS,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_RANGE_SIZE,
+      g_param_spec_uint64 ("range-size", "Range size",
+          "Size of the byte ranges requested from S3", MIN_RANGE_SIZE,
+          G_MAXSIZE, GST_S3_DOWNLOADER_CONFIG_DEFAULT_RANGE_SIZE,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ALIGN_TO_PARTS,
+      g_param_spec_boolean ("align-to-parts", "Align to parts",
+          "Request the ranges of an object uploaded in parts along the part "
+          "boundaries, unless its parts are much bigger than range-size",
+          GST_S3_DOWNLOADER_CONFIG_DEFAULT_ALIGN_TO_PARTS,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MIN_READ_AHEAD,
+      g_param_spec_uint ("min-read-ahead", "Min read-ahead",
+          "Minimum number of ranges requested ahead of the reader", 1,
+          G_MAXUINT, GST_S3_DOWNLOADER_CONFIG_DEFAULT_MIN_READ_AHEAD,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_READ_AHEAD,
+      g_param_spec_uint ("max-read-ahead", "Max read-ahead",
+          "Maximum number of ranges requested ahead of the reader, and held "
+          "in memory while they are reordered. The read-ahead grows with the "
+          "rate downstream consumes data", 1, G_MAXUINT,
+          GST_S3_DOWNLOADER_CONFIG_DEFAULT_MAX_READ_AHEAD,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_CACHE_SIZE,
+      g_param_spec_uint64 ("cache-size", "Cache size",
+          "Bytes of fetched ranges kept in memory, least recently used "
+          "dropped first, so that reading them again (e.g. when a demuxer "
+          "seeks back in pull mode) needs no request; the ranges being "
+          "fetched count against it as well", 0, G_MAXUINT64,
+          GST_S3_DOWNLOADER_CONFIG_DEFAULT_CACHE_SIZE,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_KEYS,
+      g_param_spec_boxed ("keys", "S3 keys",
+          "Keys of the objects to read back to back as one stream, in order",
+          G_TYPE_STRV,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PREFIX,
+      g_param_spec_string ("prefix", "S3 key prefix",
+          "Read the objects whose keys start with this prefix back to back "
+          "as one stream, in key order (ignored when 'keys' is set)", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_KEY_TEMPLATE,
+      g_param_spec_string ("key-template", "Key template",
+          "Read the objects named from this template back to back as one "
+          "stream, until one of them doesn't exist (ignored when 'keys' or "
+          "'prefix' is set). It must hold {index} (or {index:N}, zero-padded "
+          "to N digits), replaced with the object number, as in s3sink", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_START_INDEX,
+      g_param_spec_uint ("start-index", "Start index",
+          "Number of the first object read with key-template", 0, G_MAXUINT,
+          DEFAULT_START_INDEX,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_INDEX_SUFFIX,
+      g_param_spec_string ("index-suffix", "Index suffix",
+          "Load the keyframe index s3sink uploaded to the object's key "
+          "followed by this suffix, and use it to turn seeks in time into "
+          "reads at the right offset", NULL,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Statistics of the download", GST_TYPE_STRUCTURE,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_set_static_metadata (gstelement_class,
+      "S3 Source",
+      "Source/S3", "Read stream from an Amazon S3 bucket",
+      "Marcin Kolny <marcin.kolny at gmail.com>");
+  gst_element_class_add_static_pad_template (gstelement_class, &srctemplate);
+
+  gstbasesrc_class->start = GST_DEBUG_FUNCPTR (gst_s3_src_start);
+  gstbasesrc_class->stop = GST_DEBUG_FUNCPTR (gst_s3_src_stop);
+  gstbasesrc_class->unlock = GST_DEBUG_FUNCPTR (gst_s3_src_unlock);
+  gstbasesrc_class->unlock_stop = GST_DEBUG_FUNCPTR (gst_s3_src_unlock_stop);
+  gstbasesrc_class->is_seekable = GST_DEBUG_FUNCPTR (gst_s3_src_is_seekable);
+  gstbasesrc_class->get_size = GST_DEBUG_FUNCPTR (gst_s3_src_get_size);
+  gstbasesrc_class->create = GST_DEBUG_FUNCPTR (gst_s3_src_create);
+  gstbasesrc_class->query = GST_DEBUG_FUNCPTR (gst_s3_src_query);
+  gstbasesrc_class->prepare_seek_segment =
+      GST_DEBUG_FUNCPTR (gst_s3_src_prepare_seek_segment);
+}
+
+static void
+gst_s3_destroy_downloader (GstS3Src * src)
+{
+  GstS3Downloader *downloader;
+
+  GST_OBJECT_LOCK (src);
+  downloader = src->downloader;
+  src->downloader = NULL;
+  GST_OBJECT_UNLOCK (src);
+
+  if (downloader) {
+    gst_s3_downloader_destroy (downloader);
+  }
+}
+
+static void
+gst_s3_src_init (GstS3Src * s3src)
+{
+  s3src->config = GST_S3_DOWNLOADER_CONFIG_INIT;
+  s3src->config.credentials = gst_aws_credentials_new_default ();
+  s3src->downloader = NULL;
+  s3src->downloader_new = gst_s3_multipart_downloader_new;
+  s3src->is_started = FALSE;
+  s3src->is_flushing = FALSE;
+
+  s3src->keys = NULL;
+  s3src->prefix = NULL;
+  s3src->key_template = NULL;
+  s3src->start_index = DEFAULT_START_INDEX;
+  s3src->list_keys = gst_s3_multipart_downloader_list_keys;
+  s3src->lookup_key = gst_s3_multipart_downloader_lookup_key;
+  s3src->object_index = 0;
+  s3src->object_key = NULL;
+  s3src->object_offset = 0;
+  s3src->object_pool = NULL;
+  g_mutex_init (&s3src->object_lock);
+  g_cond_init (&s3src->object_cond);
+  s3src->next_downloader = NULL;
+  s3src->next_key = NULL;
+  s3src->is_next_ready = FALSE;
+  s3src->pending_object_tasks = 0;
+  s3src->object_error = NULL;
+  g_queue_init (&s3src->listed_keys);
+  s3src->last_listed_key = NULL;
+  s3src->is_listing_done = FALSE;
+  s3src->index_suffix = NULL;
+  s3src->keyframe_index = NULL;
+
+  gst_base_src_set_blocksize (GST_BASE_SRC (s3src), DEFAULT_BLOCKSIZE);
+}
+
+static void
+gst_s3_src_release_config (GstS3DownloaderConfig * config)
+{
+  g_free (config->region);
+  g_free (config->bucket);
+  g_free (config->key);
+  g_free (config->location);
+  g_free (config->ca_file);
+  g_free (config->aws_sdk_endpoint);
+  gst_aws_credentials_free (config->credentials);
+
+  *config = GST_S3_DOWNLOADER_CONFIG_INIT;
+}
+
+static void
+gst_s3_src_dispose (GObject * object)
+{
+  GstS3Src *src = GST_S3_SRC (object);
+
+  gst_s3_src_release_config (&src->config);
+  g_clear_pointer (&src->keys, g_strfreev);
+  g_clear_pointer (&src->prefix, g_free);
+  g_clear_pointer (&src->key_template, g_free);
+  g_clear_pointer (&src->index_suffix, g_free);
+
+  gst_s3_destroy_downloader (src);
+
+  G_OBJECT_CLASS (parent_class)->dispose (object);
+}
+
+static void
+gst_s3_src_finalize (GObject * object)
+{
+  GstS3Src *src = GST_S3_SRC (object);
+
+  g_mutex_clear (&src->object_lock);
+  g_cond_clear (&src->object_cond);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+gst_s3_src_set_string_property (GstS3Src * src, const gchar * value,
+    gchar ** property, const gchar * property_name)
+{
+  if (src->is_started) {
+    GST_WARNING ("Changing the `%s' property on s3src "
+        "when streaming has started is not supported.", property_name);
+    return;
+  }
+
+  g_free (*property);
+
+  if (value != NULL) {
+    *property = g_strdup (value);
+    GST_INFO_OBJECT (src, "%s : %s", property_name, *property);
+  } else {
+    *property = NULL;
+  }
+}
+
+static void
+gst_s3_src_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstS3Src *src = GST_S3_SRC (object);
+
+  switch (prop_id) {
+    case PROP_BUCKET:
+      gst_s3_src_set_string_property (src, g_value_get_string (value),
+          &src->config.bucket, "bucket");
+      break;
+    case PROP_KEY:
+      gst_s3_src_set_string_property (src, g_value_get_string (value),
+          &src->config.key, "key");
+      break;
+    case PROP_LOCATION:
+      gst_s3_src_set_string_property (src, g_value_get_string (value),
+          &src->config.location, "location");
+      break;
+    case PROP_CA_FILE:
+      gst_s3_src_set_string_property (src, g_value_get_string (value),
+          &src->config.ca_file, "ca-file");
+      break;
+    case PROP_REGION:
+      gst_s3_src_set_string_property (src, g_value_get_string (value),
+          &src->config.region, "region");
+      break;
+    case PROP_INIT_AWS_SDK:
+      src->config.init_aws_sdk = g_value_get_boolean (value);
+      break;
+    case PROP_CREDENTIALS:
+      if (src->config.credentials)
+        gst_aws_credentials_free (src->config.credentials);
+      src->config.credentials = gst_aws_credentials_copy (g_value_get_boxed (value));
+      break;
+    case PROP_AWS_SDK_ENDPOINT:
+      gst_s3_src_set_string_property (src, g_value_get_string (value),
+          &src->config.aws_sdk_endpoint, "aws-sdk-endpoint");
+      break;
+    case PROP_AWS_SDK_USE_HTTP:
+      src->config.aws_sdk_use_http = g_value_get_boolean (value);
+      break;
+    case PROP_AWS_SDK_VERIFY_SSL:
+      src->config.aws_sdk_verify_ssl = g_value_get_boolean (value);
+      break;
+    case PROP_MAX_CONNECTIONS:
+      src->config.max_connections = g_value_get_uint (value);
+      break;
+    case PROP_RANGE_SIZE:
+      src->config.range_size = g_value_get_uint64 (value);
+      break;
+    case PROP_ALIGN_TO_PARTS:
+      src->config.align_to_parts = g_value_get_boolean (value);
+      break;
+    case PROP_MIN_READ_AHEAD:
+      src->config.min_read_ahead = g_value_get_uint (value);
+      break;
+    case PROP_MAX_READ_AHEAD:
+      src->config.max_read_ahead = g_value_get_uint (value);
+      break;
+    case PROP_CACHE_SIZE:
+      src->config.cache_size = g_value_get_uint64 (value);
+      break;
+    case PROP_KEYS:
+      g_strfreev (src->keys);
+      src->keys = g_value_dup_boxed (value);
+      break;
+    case PROP_PREFIX:
+      gst_s3_src_set_string_property (src, g_value_get_string (value),
+          &src->prefix, "prefix");
+      break;
+    case PROP_KEY_TEMPLATE:
+      gst_s3_src_set_string_property (src, g_value_get_string (value),
+          &src->key_template, "key-template");
+      break;
+    case PROP_START_INDEX:
+      src->start_index = g_value_get_uint (value);
+      break;
+    case PROP_INDEX_SUFFIX:
+      gst_s3_src_set_string_property (src, g_value_get_string (value),
+          &src->index_suffix, "index-suffix");
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_s3_src_get_property (GObject * object, guint prop_id, GValue * value,
+    GParamSpec * pspec)
+{
+  GstS3Src *src = GST_S3_SRC (object);
+
+  switch (prop_id) {
+    case PROP_BUCKET:
+      g_value_set_string (value, src->config.bucket);
+      break;
+    case PROP_KEY:
+      g_value_set_string (value, src->config.key);
+      break;
+    case PROP_LOCATION:
+      g_value_set_string (value, src->config.location);
+      break;
+    case PROP_CA_FILE:
+      g_value_set_string (value, src->config.ca_file);
+      break;
+    case PROP_REGION:
+      g_value_set_string (value, src->config.region);
+      break;
+    case PROP_INIT_AWS_SDK:
+      g_value_set_boolean (value, src->config.init_aws_sdk);
+      break;
+    case PROP_AWS_SDK_ENDPOINT:
+      g_value_set_string (value, src->config.aws_sdk_endpoint);
+      break;
+    case PROP_AWS_SDK_USE_HTTP:
+      g_value_set_boolean (value, src->config.aws_sdk_use_http);
+      break;
+    case PROP_AWS_SDK_VERIFY_SSL:
+      g_value_set_boolean (value, src->config.aws_sdk_verify_ssl);
+      break;
+    case PROP_MAX_CONNECTIONS:
+      g_value_set_uint (value, src->config.max_connections);
+      break;
+    case PROP_RANGE_SIZE:
+      g_value_set_uint64 (value, src->config.range_size);
+      break;
+    case PROP_ALIGN_TO_PARTS:
+      g_value_set_boolean (value, src->config.align_to_parts);
+      break;
+    case PROP_MIN_READ_AHEAD:
+      g_value_set_uint (value, src->config.min_read_ahead);
+      break;
+    case PROP_MAX_READ_AHEAD:
+      g_value_set_uint (value, src->config.max_read_ahead);
+      break;
+    case PROP_CACHE_SIZE:
+      g_value_set_uint64 (value, src->config.cache_size);
+      break;
+    case PROP_KEYS:
+      g_value_set_boxed (value, src->keys);
+      break;
+    case PROP_PREFIX:
+      g_value_set_string (value, src->prefix);
+      break;
+    case PROP_KEY_TEMPLATE:
+      g_value_set_string (value, src->key_template);
+      break;
+    case PROP_START_INDEX:
+      g_value_set_uint (value, src->start_index);
+      break;
+    case PROP_INDEX_SUFFIX:
+      g_value_set_string (value, src->index_suffix);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_s3_src_get_stats (src));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static GstStructure *
+gst_s3_src_get_stats (GstS3Src * src)
+{
+  GstStructure *stats = NULL;
+
+  GST_OBJECT_LOCK (src);
+  if (src->downloader)
+    stats = gst_s3_downloader_get_stats (src->downloader);
+  GST_OBJECT_UNLOCK (src);
+
+  if (!stats)
+    stats = gst_structure_new_empty ("s3-downloader-stats");
+
+  /* the counters above are those of the current object */
+  if (gst_s3_src_is_sequence (src))
+    gst_structure_set (stats, "objects", G_TYPE_UINT, src->object_index, NULL);
+
+  return stats;
+}
+
+static gboolean
+gst_s3_src_is_null_or_empty (const gchar * str)
+{
+  return str == NULL || str[0] == '\0';
+}
+
+static gboolean
+gst_s3_src_is_sequence (GstS3Src * src)
+{
+  return (src->keys && src->keys[0]) || src->prefix
+      || !gst_s3_src_is_null_or_empty (src->key_template);
+}
+
+/* Whether the keys of the sequence come from key-template. */
+static gboolean
+gst_s3_src_is_templated (GstS3Src * src)
+{
+  return !(src->keys && src->keys[0]) && !src->prefix;
+}
+
+/* Returns the key of the given object of the sequence, NULL past its end.
+ * Listing more keys may fail, which sets error. */
+static gchar *
+gst_s3_src_get_object_key (GstS3Src * src, guint index, gchar ** error)
+{
+  gchar **page;
+  guint idx;
+
+  if (src->keys && src->keys[0])
+    return index < g_strv_length (src->keys) ?
+        g_strdup (src->keys[index]) : NULL;
+
+  if (gst_s3_src_is_templated (src))
+    return gst_s3_keys_format (src->key_template, src->start_index + index,
+        GST_CLOCK_TIME_NONE);
+
+  if (g_queue_is_empty (&src->listed_keys) && !src->is_listing_done) {
+    page = src->list_keys (&src->config, src->prefix, src->last_listed_key);
+    if (!page) {
+      *error = g_strdup_printf ("Failed to list the objects under %s",
+          src->prefix);
+      return NULL;
+    }
+
+    for (idx = 0; page[idx]; idx++)
+      g_queue_push_tail (&src->listed_keys, page[idx]);
+    src->is_listing_done = idx == 0;
+    if (idx > 0) {
+      g_free (src->last_listed_key);
+      src->last_listed_key = g_strdup (page[idx - 1]);
+    }
+    /* the keys moved to the queue */
+    g_free (page);
+  }
+
+  return g_queue_pop_head (&src->listed_keys);
+}
+
+/* Creates a downloader reading the given key of the source's bucket. If that
+ * fails and is_missing is given, it is set to whether S3 reported the key
+ * missing. */
+static GstS3Downloader *
+gst_s3_src_new_object_downloader (GstS3Src * src, const gchar * key,
+    gboolean * is_missing)
+{
+  GstS3DownloaderConfig config = src->config;
+  GstS3Downloader *downloader;
+  GstUri *uri;
+  gboolean exists = TRUE;
+
+  if (gst_s3_src_is_null_or_empty (src->config.location)) {
+    config.bucket = g_strdup (src->config.bucket);
+  } else {
+    uri = gst_uri_from_string (src->config.location);
+    config.bucket = g_strdup (uri ? gst_uri_get_host (uri) : NULL);
+    if (uri)
+      gst_uri_unref (uri);
+  }
+  config.key = (gchar *) key;
+  config.location = NULL;
+
+  downloader = src->downloader_new (&config);
+  if (downloader)
+    gst_s3_downloader_prefetch (downloader);
+  else if (is_missing)
+    *is_missing = src->lookup_key (&config, &exists) && !exists;
+
+  g_free (config.bucket);
+
+  return downloader;
+}
+
+static void
+gst_s3_src_run_object_task (gpointer data, gpointer user_data)
+{
+  GstS3Src *src = GST_S3_SRC (user_data);
+  /* thread pools don't take NULL tasks */
+  guint index = GPOINTER_TO_UINT (data) - 1;
+  GstS3Downloader *downloader = NULL;
+  gboolean is_missing = FALSE;
+  gchar *error = NULL;
+  gchar *key;
+
+  key = gst_s3_src_get_object_key (src, index, &error);
+  if (key) {
+    GST_DEBUG_OBJECT (src, "opening object %u: %s", index, key);
+    downloader = gst_s3_src_new_object_downloader (src, key,
+        gst_s3_src_is_templated (src) ? &is_missing : NULL);
+
+    /* a template has no end but the first object which doesn't exist */
+    if (!downloader && !is_missing)
+      error = g_strdup_printf ("Unable to initialize S3 downloader for %s.",
+          key);
+  }
+
+  g_mutex_lock (&src->object_lock);
+  src->next_downloader = downloader;
+  g_free (src->next_key);
+  src->next_key = key;
+  g_free (src->object_error);
+  src->object_error = error;
+  src->is_next_ready = TRUE;
+  src->pending_object_tasks--;
+  g_cond_broadcast (&src->object_cond);
+  g_mutex_unlock (&src->object_lock);
+}
+
+static void
+gst_s3_src_prepare_next_object (GstS3Src * src, guint index)
+{
+  g_mutex_lock (&src->object_lock);
+  src->pending_object_tasks++;
+  g_mutex_unlock (&src->object_lock);
+
+  g_thread_pool_push (src->object_pool, GUINT_TO_POINTER (index + 1), NULL);
+}
+
+/* Makes the downloader opened for the next object the current one, waiting
+ * for it if it isn't ready yet. Returns GST_FLOW_EOS past the last object. */
+static GstFlowReturn
+gst_s3_src_take_next_downloader (GstS3Src * src, guint64 offset)
+{
+  GstS3Downloader *downloader;
+  gchar *key;
+  gchar *error;
+
+  g_mutex_lock (&src->object_lock);
+  while (!src->is_next_ready && !g_atomic_int_get (&src->is_flushing))
+    g_cond_wait (&src->object_cond, &src->object_lock);
+  if (!src->is_next_ready) {
+    /* the object is still being opened, it is taken after flushing */
+    g_mutex_unlock (&src->object_lock);
+    return GST_FLOW_FLUSHING;
+  }
+  downloader = src->next_downloader;
+  src->next_downloader = NULL;
+  key = src->next_key;
+  src->next_key = NULL;
+  error = src->object_error;
+  src->object_error = NULL;
+  src->is_next_ready = FALSE;
+  g_mutex_unlock (&src->object_lock);
+
+  if (error) {
+    GST_ELEMENT_ERROR (src, RESOURCE, OPEN_READ,
+        ("Unable to read object %u of the sequence.", src->object_index),
+        ("%s", error));
+    g_free (error);
+    g_free (key);
+    return GST_FLOW_ERROR;
+  }
+
+  if (!downloader) {
+    GST_INFO_OBJECT (src, "the sequence ends after %u objects (next: %s)",
+        src->object_index, GST_STR_NULL (key));
+    g_free (key);
+    return GST_FLOW_EOS;
+  }
+
+  GST_OBJECT_LOCK (src);
+  src->downloader = downloader;
+  /* unlock() may have missed it */
+  if (g_atomic_int_get (&src->is_flushing))
+    gst_s3_downloader_set_flushing (downloader, TRUE);
+  GST_OBJECT_UNLOCK (src);
+
+  g_free (src->object_key);
+  src->object_key = key;
+  src->object_offset = offset;
+
+  gst_element_post_message (GST_ELEMENT_CAST (src),
+      gst_message_new_element (GST_OBJECT_CAST (src),
+          gst_structure_new ("s3src-object-started",
+              "index", G_TYPE_UINT, src->object_index,
+              "key", G_TYPE_STRING, key,
+              "offset", G_TYPE_UINT64, offset, NULL)));
+
+  /* the next object is opened while this one is read */
+  src->object_index++;
+  gst_s3_src_prepare_next_object (src, src->object_index);
+
+  return GST_FLOW_OK;
+}
+
+/* Waits for the object being opened and drops it. */
+static void
+gst_s3_src_stop_objects (GstS3Src * src)
+{
+  if (!src->object_pool)
+    return;
+
+  g_mutex_lock (&src->object_lock);
+  while (src->pending_object_tasks > 0)
+    g_cond_wait (&src->object_cond, &src->object_lock);
+  g_mutex_unlock (&src->object_lock);
+
+  g_thread_pool_free (src->object_pool, FALSE, TRUE);
+  src->object_pool = NULL;
+
+  if (src->next_downloader)
+    gst_s3_downloader_destroy (src->next_downloader);
+  src->next_downloader = NULL;
+  src->is_next_ready = FALSE;
+  g_clear_pointer (&src->next_key, g_free);
+  g_clear_pointer (&src->object_error, g_free);
+  g_clear_pointer (&src->object_key, g_free);
+
+  g_queue_foreach (&src->listed_keys, (GFunc) g_free, NULL);
+  g_queue_clear (&src->listed_keys);
+  g_clear_pointer (&src->last_listed_key, g_free);
+  src->is_listing_done = FALSE;
+}
+
+/* Loads the keyframe index of the object. Without it seeks still work, the
+ * demuxer just has to find its way, so failures are only logged. */
+static void
+gst_s3_src_load_index (GstS3Src * src)
+{
+  gchar *key = gst_s3_keys_get_single (src->config.location,
+      src->config.key);
+  gchar *index_key = g_strconcat (key ? key : "", src->index_suffix, NULL);
+  GstS3Downloader *downloader;
+  guint64 size = 0;
+  gsize read_size = 0;
+  gchar *data = NULL;
+
+  downloader = gst_s3_src_new_object_downloader (src, index_key, NULL);
+  if (downloader)
+    size = gst_s3_downloader_get_size (downloader);
+
+  if (downloader && size <= MAX_INDEX_SIZE) {
+    data = g_malloc (size + 1);
+    if (gst_s3_downloader_read (downloader, 0, data, size, &read_size)
+        && read_size == size)
+      src->keyframe_index =
+          gst_s3_keyframe_index_parse ((const guint8 *) data, size);
+  }
+
+  if (src->keyframe_index) {
+    GST_INFO_OBJECT (src, "loaded %u keyframes from %s",
+        gst_s3_keyframe_index_get_size (src->keyframe_index), index_key);
+  } else {
+    GST_WARNING_OBJECT (src, "no usable keyframe index at %s", index_key);
+  }
+
+  if (downloader)
+    gst_s3_downloader_destroy (downloader);
+  g_free (data);
+  g_free (index_key);
+  g_free (key);
+}
+
+static gboolean
+gst_s3_src_start (GstBaseSrc * basesrc)
+{
+  GstS3Src *src = GST_S3_SRC (basesrc);
+
+  if (gst_s3_src_is_sequence (src)) {
+    if (gst_s3_src_is_null_or_empty (src->config.location)
+        && gst_s3_src_is_null_or_empty (src->config.bucket))
+      goto no_source;
+
+    /* without an index every object would have the same key, and with a
+     * time in it the keys can't be guessed */
+    if (gst_s3_src_is_templated (src)
+        && (!gst_s3_keys_is_indexed (src->key_template)
+            || gst_s3_keys_is_timed (src->key_template)))
+      goto bad_key_template;
+
+    /* objects are opened as the stream gets to them */
+    src->object_index = 0;
+    src->object_offset = 0;
+    src->object_pool = g_thread_pool_new (gst_s3_src_run_object_task, src,
+        OBJECT_THREADS, FALSE, NULL);
+    gst_s3_src_prepare_next_object (src, 0);
+    src->is_started = TRUE;
+
+    return TRUE;
+  }
+
+  if (gst_s3_src_is_null_or_empty (src->config.location) && (
+      gst_s3_src_is_null_or_empty (src->config.bucket)
+      || gst_s3_src_is_null_or_empty (src->config.key)))
+    goto no_source;
+
+  if (src->downloader == NULL) {
+    GstS3Downloader *downloader = src->downloader_new (&src->config);
+
+    GST_OBJECT_LOCK (src);
+    src->downloader = downloader;
+    GST_OBJECT_UNLOCK (src);
+  }
+
+  if (!src->downloader)
+    goto init_failed;
+
+  if (!gst_s3_src_is_null_or_empty (src->index_suffix))
+    gst_s3_src_load_index (src);
+
+  src->is_started = TRUE;
+
+  return TRUE;
+
+no_source:
+  {
+    GST_ELEMENT_ERROR (src, RESOURCE, NOT_FOUND,
+        ("No bucket or key specified for reading."), (NULL));
+    return FALSE;
+  }
+
+bad_key_template:
+  {
+    GST_ELEMENT_ERROR (src, RESOURCE, SETTINGS,
+        ("key-template %s must number the objects with {index}, "
+            "without {utc} or {running-time}.", src->key_template), (NULL));
+    return FALSE;
+  }
+
+init_failed:
+  {
+    GST_ELEMENT_ERROR (src, RESOURCE, OPEN_READ,
+        ("Unable to initialize S3 downloader."), (NULL));
+    return FALSE;
+  }
+}
+
+static gboolean
+gst_s3_src_stop (GstBaseSrc * basesrc)
+{
+  GstS3Src *src = GST_S3_SRC (basesrc);
+
+  gst_s3_src_stop_objects (src);
+  gst_s3_destroy_downloader (src);
+  g_clear_pointer (&src->keyframe_index, gst_s3_keyframe_index_free);
+  src->is_started = FALSE;
+
+  return TRUE;
+}
+
+/* Wakes the streaming thread up if it is waiting for S3. */
+static gboolean
+gst_s3_src_unlock (GstBaseSrc * basesrc)
+{
+  GstS3Src *src = GST_S3_SRC (basesrc);
+
+  g_mutex_lock (&src->object_lock);
+  g_atomic_int_set (&src->is_flushing, TRUE);
+  g_cond_broadcast (&src->object_cond);
+  g_mutex_unlock (&src->object_lock);
+
+  GST_OBJECT_LOCK (src);
+  if (src->downloader)
+    gst_s3_downloader_set_flushing (src->downloader, TRUE);
+  GST_OBJECT_UNLOCK (src);
+
+  return TRUE;
+}
+
+static gboolean
+gst_s3_src_unlock_stop (GstBaseSrc * basesrc)
+{
+  GstS3Src *src = GST_S3_SRC (basesrc);
+
+  g_atomic_int_set (&src->is_flushing, FALSE);
+
+  GST_OBJECT_LOCK (src);
+  if (src->downloader)
+    gst_s3_downloader_set_flushing (src->downloader, FALSE);
+  GST_OBJECT_UNLOCK (src);
+
+  return TRUE;
+}
+
+static gboolean
+gst_s3_src_is_seekable (GstBaseSrc * basesrc)
+{
+  /* the size of a sequence isn't known up front */
+  return !gst_s3_src_is_sequence (GST_S3_SRC (basesrc));
+}
+
+static gboolean
+gst_s3_src_get_size (GstBaseSrc * basesrc, guint64 * size)
+{
+  GstS3Src *src = GST_S3_SRC (basesrc);
+
+  if (!src->downloader || gst_s3_src_is_sequence (src))
+    return FALSE;
+
+  *size = gst_s3_downloader_get_size (src->downloader);
+  return TRUE;
+}
+
+/* Fills the buffer downstream provided, if any; otherwise pushes buffers
+ * sharing the memory the downloader received the object to. */
+static GstFlowReturn
+gst_s3_src_create (GstBaseSrc * basesrc, guint64 offset, guint length,
+    GstBuffer ** buffer)
+{
+  GstS3Src *src = GST_S3_SRC (basesrc);
+  GstBuffer *read_buffer = NULL;
+  GstMapInfo map_info;
+  GstFlowReturn flow;
+  gsize read_size = 0;
+  gboolean ret;
+
+  if (*buffer && !gst_buffer_map (*buffer, &map_info, GST_MAP_WRITE))
+    goto map_failed;
+
+  while (TRUE) {
+    if (!src->downloader
+        && (flow = gst_s3_src_take_next_downloader (src, offset))
+        != GST_FLOW_OK) {
+      if (*buffer)
+        gst_buffer_unmap (*buffer, &map_info);
+      return flow;
+    }
+
+    if (*buffer) {
+      ret = gst_s3_downloader_read (src->downloader,
+          offset - src->object_offset, (gchar *) map_info.data, length,
+          &read_size);
+    } else {
+      ret = gst_s3_downloader_read_buffer (src->downloader,
+          offset - src->object_offset, length, &read_buffer);
+      read_size = read_buffer ? gst_buffer_get_size (read_buffer) : 0;
+    }
+    if (!ret || read_size > 0 || !gst_s3_src_is_sequence (src))
+      break;
+
+    /* end of the current object, carry on with the next one */
+    gst_s3_destroy_downloader (src);
+  }
+
+  if (*buffer)
+    gst_buffer_unmap (*buffer, &map_info);
+
+  if (!ret && g_atomic_int_get (&src->is_flushing))
+    return GST_FLOW_FLUSHING;
+
+  if (!ret)
+    goto read_failed;
+
+  if (read_size == 0)
+    return GST_FLOW_EOS;
+
+  if (*buffer)
+    gst_buffer_set_size (*buffer, read_size);
+  else
+    *buffer = read_buffer;
+  GST_BUFFER_OFFSET (*buffer) = offset;
+  GST_BUFFER_OFFSET_END (*buffer) = offset + read_size;
+
+  return GST_FLOW_OK;
+
+map_failed:
+  {
+    GST_ELEMENT_ERROR (src, RESOURCE, READ,
+        ("Failed to map the output buffer."), (NULL));
+    return GST_FLOW_ERROR;
+  }
+
+read_failed:
+  {
+    gchar *error = gst_s3_downloader_get_error (src->downloader);
+
+    GST_ELEMENT_ERROR (src, RESOURCE, READ,
+        ("Failed to read from S3 at offset %" G_GUINT64_FORMAT ".", offset),
+        ("%s", error ? error : "unknown error"));
+    g_free (error);
+    return GST_FLOW_ERROR;
+  }
+}
+
+/* Converts a time to the offset of the keyframe to start reading from, or
+ * with is_stop, to the offset of the first keyframe past it. */
+static gint64
+gst_s3_src_time_to_offset (GstS3Src * src, GstClockTime time,
+    gboolean is_stop)
+{
+  const GstS3KeyframeIndexEntry *entry;
+
+  if (!GST_CLOCK_TIME_IS_VALID (time))
+    return -1;
+
+  if (is_stop) {
+    entry = gst_s3_keyframe_index_lookup_after (src->keyframe_index, time);
+    return entry ? (gint64) entry->offset : -1;
+  }
+
+  entry = gst_s3_keyframe_index_lookup (src->keyframe_index, time);
+  return entry ? (gint64) entry->offset : 0;
+}
+
+static gboolean
+gst_s3_src_query (GstBaseSrc * basesrc, GstQuery * query)
+{
+  GstS3Src *src = GST_S3_SRC (basesrc);
+  GstFormat src_format, dest_format;
+  gint64 src_value;
+
+  if (!src->keyframe_index)
+    return GST_BASE_SRC_CLASS (parent_class)->query (basesrc, query);
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_CONVERT:
+      gst_query_parse_convert (query, &src_format, &src_value, &dest_format,
+          NULL);
+      if (src_format != GST_FORMAT_TIME || dest_format != GST_FORMAT_BYTES)
+        break;
+
+      gst_query_set_convert (query, src_format, src_value, dest_format,
+          src_value == -1 ? -1 : gst_s3_src_time_to_offset (src, src_value,
+              FALSE));
+      return TRUE;
+    case GST_QUERY_SEEKING:
+      gst_query_parse_seeking (query, &src_format, NULL, NULL, NULL);
+      if (src_format != GST_FORMAT_TIME)
+        break;
+
+      gst_query_set_seeking (query, GST_FORMAT_TIME, TRUE, 0, -1);
+      return TRUE;
+    default:
+      break;
+  }
+
+  return GST_BASE_SRC_CLASS (parent_class)->query (basesrc, query);
+}
+
+/* Seeks in time are turned into a byte segment starting at the keyframe
+ * the seek lands on. */
+static gboolean
+gst_s3_src_prepare_seek_segment (GstBaseSrc * basesrc, GstEvent * seek,
+    GstSegment * segment)
+{
+  GstS3Src *src = GST_S3_SRC (basesrc);
+  GstSeekType start_type, stop_type;
+  GstSeekFlags flags;
+  GstFormat format;
+  gint64 start, stop;
+  gdouble rate;
+  gboolean update;
+
+  gst_event_parse_seek (seek, &rate, &format, &flags, &start_type, &start,
+      &stop_type, &stop);
+
+  if (format != GST_FORMAT_TIME || !src->keyframe_index
+      || segment->format != GST_FORMAT_BYTES
+      || (start_type != GST_SEEK_TYPE_SET && start_type != GST_SEEK_TYPE_NONE)
+      || (stop_type != GST_SEEK_TYPE_SET && stop_type != GST_SEEK_TYPE_NONE))
+    return GST_BASE_SRC_CLASS (parent_class)->prepare_seek_segment (basesrc,
+        seek, segment);
+
+  if (start_type == GST_SEEK_TYPE_SET)
+    start = gst_s3_src_time_to_offset (src, start, FALSE);
+  if (stop_type == GST_SEEK_TYPE_SET)
+    stop = gst_s3_src_time_to_offset (src, stop, TRUE);
+
+  GST_DEBUG_OBJECT (src, "time seek mapped to bytes %" G_GINT64_FORMAT
+      " - %" G_GINT64_FORMAT, start, stop);
+
+  return gst_segment_do_seek (segment, rate, GST_FORMAT_BYTES, flags,
+      start_type, start, stop_type, stop, &update);
+}
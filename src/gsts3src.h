@@ -0,0 +1,106 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef __GST_S3_SRC_H__
+#define __GST_S3_SRC_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstbasesrc.h>
+
+#include "gsts3downloader.h"
+#include "gsts3keyframeindex.h"
+#include "gstawscredentials.h"
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_S3_SRC \
+  (gst_s3_src_get_type())
+#define GST_S3_SRC(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_S3_SRC,GstS3Src))
+#define GST_S3_SRC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_S3_SRC,GstS3SrcClass))
+#define GST_IS_S3_SRC(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_S3_SRC))
+#define GST_IS_S3_SRC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_S3_SRC))
+#define GST_S3_SRC_CAST(obj) ((GstS3Src *)(obj))
+typedef struct _GstS3Src GstS3Src;
+typedef struct _GstS3SrcClass GstS3SrcClass;
+
+/**
+ * GstS3Src:
+ *
+ * Opaque #GstS3Src structure.
+ */
+struct _GstS3Src {
+  GstBaseSrc parent;
+
+  /*< private > */
+  GstS3DownloaderConfig config;
+
+  GstS3Downloader *downloader;
+  GstS3DownloaderNewFunc downloader_new;
+
+  gboolean is_started;
+  /* set by unlock() to stop a read waiting for S3, accessed atomically */
+  gint is_flushing;
+
+  /* object sequence: the objects named in keys, listed under prefix or
+   * named from key_template are read back to back as one stream */
+  gchar **keys;
+  gchar *prefix;
+  gchar *key_template;
+  guint start_index;
+  GstS3KeyListFunc list_keys;
+  GstS3KeyLookupFunc lookup_key;
+
+  guint object_index;
+  gchar *object_key;
+  guint64 object_offset;
+
+  /* the downloader of the next object is created on object_pool while the
+   * current one is read; object_lock guards the fields below */
+  GThreadPool *object_pool;
+  GMutex object_lock;
+  GCond object_cond;
+  GstS3Downloader *next_downloader;
+  gchar *next_key;
+  gboolean is_next_ready;
+  guint pending_object_tasks;
+  gchar *object_error;
+
+  /* keys listed under prefix and not read yet; only used on object_pool */
+  GQueue listed_keys;
+  gchar *last_listed_key;
+  gboolean is_listing_done;
+
+  /* keyframe index loaded from <key><index_suffix>, for time seeks */
+  gchar *index_suffix;
+  GstS3KeyframeIndex *keyframe_index;
+};
+
+struct _GstS3SrcClass {
+  GstBaseSrcClass parent_class;
+};
+
+GST_EXPORT
+GType gst_s3_src_get_type (void);
+
+G_END_DECLS
+
+#endif /* __GST_S3_SRC_H__ */
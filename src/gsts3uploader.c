@@ -20,3 +20,66 @@ gst_s3_uploader_complete (GstS3Uploader * uploader)
 {
   return GET_CLASS_ (uploader)->complete (uploader);
 }
+
+static gboolean
+gst_s3_uploader_upload_part_list_copy (GstS3Uploader * uploader,
+    GstBufferList * list, gsize size)
+{
+  gchar *buffer = g_malloc (size);
+  gsize offset = 0;
+  guint idx;
+  gboolean ret;
+
+  for (idx = 0; idx < gst_buffer_list_length (list); idx++) {
+    GstBuffer *part = gst_buffer_list_get (list, idx);
+    offset += gst_buffer_extract (part, 0, buffer + offset, size - offset);
+  }
+
+  ret = GET_CLASS_ (uploader)->upload_part (uploader, buffer, offset);
+  g_free (buffer);
+
+  return ret;
+}
+
+gboolean
+gst_s3_uploader_upload_part_list (GstS3Uploader * uploader,
+    GstBufferList * list, gsize size)
+{
+  gboolean ret;
+
+  /* uploaders that can't send upstream memory directly get a flat copy */
+  if (GET_CLASS_ (uploader)->upload_part_list)
+    return GET_CLASS_ (uploader)->upload_part_list (uploader, list, size);
+
+  ret = gst_s3_uploader_upload_part_list_copy (uploader, list, size);
+  gst_buffer_list_unref (list);
+
+  return ret;
+}
+
+GstStructure *
+gst_s3_uploader_get_stats (GstS3Uploader * uploader)
+{
+  if (!GET_CLASS_ (uploader)->get_stats)
+    return NULL;
+
+  return GET_CLASS_ (uploader)->get_stats (uploader);
+}
+
+gchar *
+gst_s3_uploader_get_error (GstS3Uploader * uploader)
+{
+  if (!GET_CLASS_ (uploader)->get_error)
+    return NULL;
+
+  return GET_CLASS_ (uploader)->get_error (uploader);
+}
+
+gboolean
+gst_s3_uploader_prepare (GstS3Uploader * uploader)
+{
+  if (!GET_CLASS_ (uploader)->prepare)
+    return TRUE;
+
+  return GET_CLASS_ (uploader)->prepare (uploader);
+}
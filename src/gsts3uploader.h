@@ -20,6 +20,7 @@
 #define __GST_S3_UPLOADER_H__
 
 #include <glib.h>
+#include <gst/gst.h>
 
 #include "gsts3uploaderconfig.h"
 
@@ -31,12 +32,19 @@ typedef struct {
   void (*destroy) (GstS3Uploader *);
   gboolean (*upload_part) (GstS3Uploader *, const gchar *, gsize);
   gboolean (*complete) (GstS3Uploader *);
+  gboolean (*upload_part_list) (GstS3Uploader *, GstBufferList *, gsize);
+  GstStructure * (*get_stats) (GstS3Uploader *);
+  gchar * (*get_error) (GstS3Uploader *);
+  gboolean (*prepare) (GstS3Uploader *);
 } GstS3UploaderClass;
 
 struct _GstS3Uploader {
   GstS3UploaderClass *klass;
 };
 
+typedef GstS3Uploader * (*GstS3UploaderNewFunc) (const GstS3UploaderConfig *
+    config);
+
 GstS3Uploader *gst_s3_uploader_new_default (const GstS3UploaderConfig * config);
 
 void gst_s3_uploader_destroy (GstS3Uploader * uploader);
@@ -46,6 +54,25 @@ gboolean gst_s3_uploader_upload_part (GstS3Uploader *
 
 gboolean gst_s3_uploader_complete (GstS3Uploader * uploader);
 
+/* Takes ownership of the list; the memories it references are sent as a
+ * single part without being copied, and unreferenced once the part upload
+ * finishes. */
+gboolean gst_s3_uploader_upload_part_list (GstS3Uploader * uploader,
+    GstBufferList * list, gsize size);
+
+/* Returns a new structure with the uploader's counters, or NULL if the
+ * uploader doesn't keep any. */
+GstStructure *gst_s3_uploader_get_stats (GstS3Uploader * uploader);
+
+/* Returns a new string describing why the upload can no longer succeed (e.g.
+ * a part failed after all its retries), or NULL if it can. Parts are sent
+ * asynchronously, so this may become non-NULL between two upload_part calls. */
+gchar *gst_s3_uploader_get_error (GstS3Uploader * uploader);
+
+/* Starts the upload before any part is sent (e.g. creates the multipart
+ * upload), so that the first parts don't wait for it. */
+gboolean gst_s3_uploader_prepare (GstS3Uploader * uploader);
+
 G_END_DECLS
 
 #endif /* __GST_S3_UPLOADER_H__ */
@@ -31,6 +31,36 @@ G_BEGIN_DECLS
 #define GST_S3_UPLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_USE_HTTP FALSE
 #define GST_S3_UPLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_VERIFY_SSL TRUE
 #define GST_S3_UPLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_S3_SIGN_PAYLOAD TRUE
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_INFLIGHT_BYTES 0
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_INFLIGHT_POLICY GST_S3_UPLOADER_INFLIGHT_POLICY_BLOCK
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_ADAPTIVE_CONCURRENCY FALSE
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_CONCURRENT_UPLOADS 16
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_PART_RETRIES 5
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_PART_RETRY_DELAY 500
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_CHECKSUM_ALGORITHM GST_S3_UPLOADER_CHECKSUM_ALGORITHM_NONE
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_CONNECTIONS 25
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_UPLOAD_THREADS 0
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_UPLOAD_THREAD_NAME "s3-upload"
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_RESUME FALSE
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_SPOOL_SIZE 1024 * 1024 * 1024
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_SPOOL_DRAIN_CONCURRENCY 0
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_BUFFER_RING_SIZE 0
+#define GST_S3_UPLOADER_CONFIG_DEFAULT_HASH_ON_COPY FALSE
+
+/* What to do with a new part when the parts which haven't been uploaded yet
+ * already hold max_inflight_bytes. */
+typedef enum {
+  GST_S3_UPLOADER_INFLIGHT_POLICY_BLOCK,
+  GST_S3_UPLOADER_INFLIGHT_POLICY_LEAK_OLDEST_UNSENT,
+  GST_S3_UPLOADER_INFLIGHT_POLICY_SPILL
+} GstS3UploaderInflightPolicy;
+
+/* Additional checksum sent with every part and verified by S3. */
+typedef enum {
+  GST_S3_UPLOADER_CHECKSUM_ALGORITHM_NONE,
+  GST_S3_UPLOADER_CHECKSUM_ALGORITHM_CRC32C,
+  GST_S3_UPLOADER_CHECKSUM_ALGORITHM_SHA256
+} GstS3UploaderChecksumAlgorithm;
 
 typedef struct {
   gchar * region;
@@ -48,6 +78,24 @@ typedef struct {
   gboolean aws_sdk_use_http;
   gboolean aws_sdk_verify_ssl;
   gboolean aws_sdk_s3_sign_payload;
+  guint64 max_inflight_bytes;
+  GstS3UploaderInflightPolicy inflight_policy;
+  gboolean adaptive_concurrency;
+  gsize max_concurrent_uploads;
+  guint max_part_retries;
+  guint part_retry_delay; /* in milliseconds */
+  GstS3UploaderChecksumAlgorithm checksum_algorithm;
+  guint max_connections;
+  guint upload_threads; /* 0 = 4 per CPU */
+  gchar * upload_thread_name;
+  gchar * journal_location; /* NULL = multipart uploads aren't journaled */
+  gboolean resume; /* continue the upload recorded in the journal */
+  gchar * spool_location; /* NULL = spill parts to the temporary directory */
+  guint64 max_spool_size; /* 0 = no limit */
+  guint spool_drain_concurrency; /* 0 = spooled parts share the upload window */
+  gchar * buffer_location; /* NULL = part buffers are allocated on the heap */
+  guint64 buffer_ring_size; /* 0 = room for buffer_count parts */
+  gboolean hash_on_copy; /* SHA-256 of the parts computed on the streaming thread */
 } GstS3UploaderConfig;
 
 #define GST_S3_UPLOADER_CONFIG_INIT (GstS3UploaderConfig) { \
@@ -58,7 +106,25 @@ typedef struct {
   NULL, \
   GST_S3_UPLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_USE_HTTP, \
   GST_S3_UPLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_VERIFY_SSL, \
-  GST_S3_UPLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_S3_SIGN_PAYLOAD \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_PROP_AWS_SDK_S3_SIGN_PAYLOAD, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_INFLIGHT_BYTES, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_INFLIGHT_POLICY, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_ADAPTIVE_CONCURRENCY, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_CONCURRENT_UPLOADS, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_PART_RETRIES, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_PART_RETRY_DELAY, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_CHECKSUM_ALGORITHM, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_CONNECTIONS, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_UPLOAD_THREADS, \
+  NULL, \
+  NULL, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_RESUME, \
+  NULL, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_SPOOL_SIZE, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_SPOOL_DRAIN_CONCURRENCY, \
+  NULL, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_BUFFER_RING_SIZE, \
+  GST_S3_UPLOADER_CONFIG_DEFAULT_HASH_ON_COPY \
 }
 
 G_END_DECLS
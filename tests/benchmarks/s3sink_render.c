@@ -0,0 +1,206 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Measures how many small buffers per second s3sink accepts when they are
+ * pushed one by one (render), in buffer lists (render_list) and as
+ * multi-memory buffers. Parts are discarded by a no-op uploader, so the
+ * numbers only reflect the cost of the element itself.
+ *
+ * The baseline modes reproduce the paths these replaced, for comparison:
+ * lists rendered a buffer at a time by the base class, and multi-memory
+ * buffers merged into a temporary copy before being copied into the part. */
+
+#include "gsts3uploader.h"
+#include "gsts3sink.h"
+
+#include <gst/gst.h>
+#include <gst/base/gstbasesink.h>
+
+#define PACKET_SIZE 188
+#define PACKETS_PER_LIST 64
+#define NUM_PACKETS (PACKETS_PER_LIST * 64 * 1024)
+
+static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+static void
+null_uploader_destroy (GstS3Uploader * uploader)
+{
+  g_free (uploader);
+}
+
+static gboolean
+null_uploader_upload_part (G_GNUC_UNUSED GstS3Uploader * uploader,
+    G_GNUC_UNUSED const gchar * buffer, G_GNUC_UNUSED gsize size)
+{
+  return TRUE;
+}
+
+static gboolean
+null_uploader_complete (G_GNUC_UNUSED GstS3Uploader * uploader)
+{
+  return TRUE;
+}
+
+static gboolean
+null_uploader_upload_part_list (G_GNUC_UNUSED GstS3Uploader * uploader,
+    GstBufferList * list, G_GNUC_UNUSED gsize size)
+{
+  gst_buffer_list_unref (list);
+  return TRUE;
+}
+
+static GstS3UploaderClass null_uploader_class = {
+  null_uploader_destroy,
+  null_uploader_upload_part,
+  null_uploader_complete,
+  null_uploader_upload_part_list
+};
+
+static GstS3Uploader *
+null_uploader_new (void)
+{
+  GstS3Uploader *uploader = g_new0 (GstS3Uploader, 1);
+  uploader->klass = &null_uploader_class;
+  return uploader;
+}
+
+typedef enum
+{
+  MODE_RENDER,
+  MODE_RENDER_LIST,
+  MODE_RENDER_LIST_BASELINE,
+  MODE_MULTI_MEMORY,
+  MODE_MULTI_MEMORY_BASELINE
+} BenchmarkMode;
+
+static GstBuffer *
+make_buffer (GstMemory * packet, guint n_packets)
+{
+  GstBuffer *buffer = gst_buffer_new ();
+  guint idx;
+
+  for (idx = 0; idx < n_packets; idx++)
+    gst_buffer_append_memory (buffer, gst_memory_ref (packet));
+
+  return buffer;
+}
+
+/* What mapping the whole buffer did: its memories merged into a new one. */
+static GstBuffer *
+merge_buffer (GstBuffer * buffer)
+{
+  GstBuffer *merged = gst_buffer_new ();
+
+  gst_buffer_append_memory (merged, gst_buffer_get_all_memory (buffer));
+  gst_buffer_unref (buffer);
+
+  return merged;
+}
+
+static void
+run_benchmark (const gchar * name, BenchmarkMode mode, gboolean zero_copy)
+{
+  GstElement *sink = gst_element_factory_make ("s3sink", NULL);
+  GstBaseSinkClass *base_sink_class = GST_BASE_SINK_GET_CLASS (sink);
+  GstFlowReturn (*render_list) (GstBaseSink *, GstBufferList *) =
+      base_sink_class->render_list;
+  GstPad *srcpad, *sinkpad;
+  GstMemory *packet;
+  GstSegment segment;
+  GstClockTime start, elapsed;
+  guint pushed = 0;
+
+  g_object_set (sink, "bucket", "bucket", "key", "key",
+      "zero-copy", zero_copy, NULL);
+  GST_S3_SINK (sink)->uploader = null_uploader_new ();
+  /* without render_list, the base class renders the buffers one by one */
+  if (mode == MODE_RENDER_LIST_BASELINE)
+    base_sink_class->render_list = NULL;
+
+  srcpad = gst_pad_new_from_static_template (&srctemplate, "src");
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_link (srcpad, sinkpad);
+  gst_object_unref (sinkpad);
+  gst_pad_set_active (srcpad, TRUE);
+
+  gst_element_set_state (sink, GST_STATE_PLAYING);
+
+  gst_segment_init (&segment, GST_FORMAT_BYTES);
+  gst_pad_push_event (srcpad, gst_event_new_stream_start ("benchmark"));
+  gst_pad_push_event (srcpad, gst_event_new_segment (&segment));
+
+  packet = gst_allocator_alloc (NULL, PACKET_SIZE, NULL);
+
+  start = gst_util_get_timestamp ();
+  while (pushed < NUM_PACKETS) {
+    if (mode == MODE_RENDER) {
+      gst_pad_push (srcpad, make_buffer (packet, 1));
+      pushed++;
+    } else if (mode == MODE_RENDER_LIST || mode == MODE_RENDER_LIST_BASELINE) {
+      GstBufferList *list = gst_buffer_list_new_sized (PACKETS_PER_LIST);
+      guint idx;
+
+      for (idx = 0; idx < PACKETS_PER_LIST; idx++)
+        gst_buffer_list_add (list, make_buffer (packet, 1));
+      gst_pad_push_list (srcpad, list);
+      pushed += PACKETS_PER_LIST;
+    } else {
+      /* the most memories a buffer can hold without being merged */
+      guint n_packets = gst_buffer_get_max_memory ();
+      GstBuffer *buffer = make_buffer (packet, n_packets);
+
+      if (mode == MODE_MULTI_MEMORY_BASELINE)
+        buffer = merge_buffer (buffer);
+      gst_pad_push (srcpad, buffer);
+      pushed += n_packets;
+    }
+  }
+  elapsed = gst_util_get_timestamp () - start;
+
+  g_print ("%-36s %12.0f packets/s\n", name,
+      (gdouble) pushed * GST_SECOND / MAX (elapsed, 1));
+
+  gst_memory_unref (packet);
+  gst_element_set_state (sink, GST_STATE_NULL);
+  base_sink_class->render_list = render_list;
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+
+int
+main (int argc, char *argv[])
+{
+  gst_init (&argc, &argv);
+
+  run_benchmark ("render", MODE_RENDER, FALSE);
+  run_benchmark ("render_list (baseline)", MODE_RENDER_LIST_BASELINE, FALSE);
+  run_benchmark ("render_list", MODE_RENDER_LIST, FALSE);
+  run_benchmark ("multi-memory (baseline)", MODE_MULTI_MEMORY_BASELINE, FALSE);
+  run_benchmark ("multi-memory", MODE_MULTI_MEMORY, FALSE);
+  run_benchmark ("render (zero-copy)", MODE_RENDER, TRUE);
+  run_benchmark ("render_list (zero-copy, baseline)",
+      MODE_RENDER_LIST_BASELINE, TRUE);
+  run_benchmark ("render_list (zero-copy)", MODE_RENDER_LIST, TRUE);
+  run_benchmark ("multi-memory (zero-copy)", MODE_MULTI_MEMORY, TRUE);
+
+  return 0;
+}
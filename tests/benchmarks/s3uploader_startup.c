@@ -0,0 +1,82 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Measures how long it takes to create and destroy an uploader, i.e. the
+ * start/stop cost of s3sink, when the AWS SDK is initialized and shut down
+ * for every uploader and when it's kept alive between them. The region is
+ * set and no part is uploaded, so no request is sent. */
+
+#include "gsts3multipartuploader.h"
+#include "gstawscredentials.h"
+
+#include <gst/gst.h>
+
+#define NUM_CYCLES 20
+
+static void
+run_benchmark (const gchar * name, gint idle_timeout)
+{
+  GstS3UploaderConfig config = GST_S3_UPLOADER_CONFIG_INIT;
+  GstClockTime start, first = 0, elapsed = 0;
+  guint idx;
+
+  config.region = (gchar *) "us-east-1";
+  config.bucket = (gchar *) "bucket";
+  config.key = (gchar *) "key";
+  config.credentials = gst_aws_credentials_new_default ();
+
+  gst_s3_multipart_uploader_set_sdk_idle_timeout (idle_timeout);
+
+  for (idx = 0; idx < NUM_CYCLES; idx++) {
+    GstS3Uploader *uploader;
+
+    start = gst_util_get_timestamp ();
+    uploader = gst_s3_multipart_uploader_new (&config);
+    gst_s3_uploader_destroy (uploader);
+
+    /* the first cycle initializes the SDK in both modes */
+    if (idx == 0)
+      first = gst_util_get_timestamp () - start;
+    else
+      elapsed += gst_util_get_timestamp () - start;
+  }
+
+  g_print ("%-32s first %8.3f ms, then %8.3f ms per uploader\n", name,
+      (gdouble) first / GST_MSECOND,
+      (gdouble) elapsed / GST_MSECOND / (NUM_CYCLES - 1));
+
+  gst_aws_credentials_free (config.credentials);
+}
+
+int
+main (int argc, char *argv[])
+{
+  GstElement *sink;
+
+  gst_init (&argc, &argv);
+
+  /* registers the debug category used by the uploader */
+  sink = gst_element_factory_make ("s3sink", NULL);
+  gst_object_unref (sink);
+
+  run_benchmark ("SDK shut down when unused", 0);
+  run_benchmark ("SDK kept alive", 60);
+
+  return 0;
+}
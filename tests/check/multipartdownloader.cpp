@@ -0,0 +1,571 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#include "gsts3multipartdownloader.hpp"
+
+#include <gst/check/gstcheck.h>
+
+#include <future>
+#include <iterator>
+#include <istream>
+#include <string>
+#include <vector>
+
+GST_DEBUG_CATEGORY (gst_s3_sink_debug);
+GST_DEBUG_CATEGORY (gst_s3_src_debug);
+
+using namespace gst::aws::s3;
+
+#define RANGE_SIZE 1000000
+
+static std::chrono::milliseconds
+ms (gint64 count)
+{
+  return std::chrono::milliseconds (count);
+}
+
+GST_START_TEST (test_read_ahead_should_start_at_min_depth)
+{
+  ReadAheadController controller (2, 16);
+
+  fail_unless_equals_int (2, controller.get_depth ());
+
+  /* nothing to go by until a range has been fetched */
+  controller.on_range_consumed (RANGE_SIZE, ms (1));
+  fail_unless_equals_int (2, controller.get_depth ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_read_ahead_should_grow_to_cover_latency)
+{
+  ReadAheadController controller (2, 16);
+
+  /* 100 MB/s for 95 ms: 9.5 ranges on their way, plus the one read */
+  controller.on_range_fetched (ms (95));
+  controller.on_range_consumed (RANGE_SIZE, ms (10));
+  fail_unless_equals_int (11, controller.get_depth ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_read_ahead_should_be_capped)
+{
+  ReadAheadController controller (2, 8);
+
+  controller.on_range_fetched (ms (95));
+  controller.on_range_consumed (RANGE_SIZE, ms (10));
+  fail_unless_equals_int (8, controller.get_depth ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_read_ahead_should_shrink_a_range_at_a_time)
+{
+  ReadAheadController controller (2, 16);
+
+  controller.on_range_fetched (ms (95));
+  controller.on_range_consumed (RANGE_SIZE, ms (10));
+  fail_unless_equals_int (11, controller.get_depth ());
+
+  /* the reader slows down */
+  controller.on_range_consumed (RANGE_SIZE, ms (10000));
+  fail_unless_equals_int (10, controller.get_depth ());
+  controller.on_range_consumed (RANGE_SIZE, ms (10000));
+  fail_unless_equals_int (9, controller.get_depth ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_read_ahead_should_keep_one_range)
+{
+  ReadAheadController controller (0, 0);
+
+  fail_unless_equals_int (1, controller.get_depth ());
+  controller.on_range_fetched (ms (95));
+  controller.on_range_consumed (RANGE_SIZE, ms (10));
+  fail_unless_equals_int (1, controller.get_depth ());
+}
+GST_END_TEST
+
+static void
+ignore_block (GstBuffer *, size_t, size_t)
+{
+}
+
+GST_START_TEST (test_flushing_should_wake_waiting_reader)
+{
+  BlockCache cache (RANGE_SIZE, RANGE_SIZE, 0, 1, ReadAheadController (1, 1));
+  std::vector<BlockBuffer> buffers;
+  guint64 first = 0;
+  guint64 count = 0;
+  size_t consumed = 0;
+  std::string error;
+
+  cache.prepare (0, RANGE_SIZE);
+  fail_unless (cache.take_run_to_request (first, count));
+
+  auto reader = std::async (std::launch::async, [&] {
+    return cache.consume (0, RANGE_SIZE, consumed, error, ignore_block);
+  });
+  cache.set_flushing (true);
+  fail_unless (reader.wait_for (std::chrono::seconds (10)) == std::future_status::ready);
+  fail_if (reader.get ());
+  fail_unless_equals_string ("Download was interrupted", error.c_str ());
+
+  /* the range in flight is kept for the read after flushing */
+  cache.set_flushing (false);
+  buffers.emplace_back (gst_buffer_new_allocate (NULL, RANGE_SIZE, NULL));
+  cache.complete_run (first, count, std::move (buffers), {});
+  fail_unless (cache.consume (0, RANGE_SIZE, consumed, error, ignore_block));
+  fail_unless_equals_int (RANGE_SIZE, consumed);
+
+  cache.shutdown ();
+}
+GST_END_TEST
+
+#define BLOCK_SIZE 1000
+
+static guint64
+get_cache_stat (const BlockCache & cache, const gchar * name)
+{
+  GstStructure *stats = gst_structure_new_empty ("stats");
+  const GValue *value;
+  guint64 result;
+
+  cache.fill_stats (stats);
+  value = gst_structure_get_value (stats, name);
+  fail_unless (value != NULL);
+  result = G_VALUE_HOLDS_UINT (value) ? g_value_get_uint (value) : g_value_get_uint64 (value);
+  gst_structure_free (stats);
+
+  return result;
+}
+
+/* answers a run of the cache with buffers of BLOCK_SIZE bytes, holding
+ * size bytes each */
+static void
+complete_run (BlockCache & cache, guint64 first, guint64 count, size_t size = BLOCK_SIZE)
+{
+  std::vector<BlockBuffer> buffers;
+
+  for (guint64 i = 0; i < count; i++) {
+    buffers.emplace_back (gst_buffer_new_allocate (NULL, BLOCK_SIZE, NULL));
+    gst_buffer_set_size (buffers.back ().get (), size);
+  }
+  cache.complete_run (first, count, std::move (buffers), {});
+}
+
+/* reads the block at index, fetching it if it has to */
+static void
+read_block (BlockCache & cache, guint64 index)
+{
+  guint64 first = 0;
+  guint64 count = 0;
+  size_t consumed = 0;
+  std::string error;
+
+  cache.prepare (index * BLOCK_SIZE, BLOCK_SIZE);
+  while (cache.take_run_to_request (first, count))
+    complete_run (cache, first, count);
+
+  fail_unless (cache.consume (index * BLOCK_SIZE, BLOCK_SIZE, consumed, error, ignore_block));
+  fail_unless_equals_int (BLOCK_SIZE, consumed);
+}
+
+GST_START_TEST (test_cache_should_evict_least_recently_used_blocks)
+{
+  BlockCache cache (5 * BLOCK_SIZE, BLOCK_SIZE, 2 * BLOCK_SIZE, 1, ReadAheadController (1, 1));
+  guint64 index;
+
+  for (index = 0; index < 5; index++)
+    read_block (cache, index);
+
+  fail_unless_equals_int (2, get_cache_stat (cache, "cached-ranges"));
+  fail_unless_equals_int (2 * BLOCK_SIZE, get_cache_stat (cache, "cached-bytes"));
+
+  /* the last blocks are still there, the first ones aren't */
+  cache.prepare (4 * BLOCK_SIZE, BLOCK_SIZE);
+  fail_unless_equals_int (1, get_cache_stat (cache, "cache-hits"));
+  cache.prepare (0, BLOCK_SIZE);
+  fail_unless_equals_int (1, get_cache_stat (cache, "cache-misses"));
+
+  cache.shutdown ();
+}
+GST_END_TEST
+
+GST_START_TEST (test_cache_should_count_allocated_memory)
+{
+  BlockCache cache (10, BLOCK_SIZE, 10 * BLOCK_SIZE, 1, ReadAheadController (1, 1));
+  guint64 first = 0;
+  guint64 count = 0;
+
+  cache.prepare (0, 10);
+  fail_unless (cache.take_run_to_request (first, count));
+  /* a short block still holds a whole buffer */
+  complete_run (cache, first, count, 10);
+
+  fail_unless_equals_int (BLOCK_SIZE, get_cache_stat (cache, "cached-bytes"));
+  cache.shutdown ();
+}
+GST_END_TEST
+
+GST_START_TEST (test_blocks_in_flight_should_count_against_cache_size)
+{
+  BlockCache cache (3 * BLOCK_SIZE, BLOCK_SIZE, 2 * BLOCK_SIZE, 1, ReadAheadController (2, 2));
+  guint64 first = 0;
+  guint64 count = 0;
+
+  size_t consumed = 0;
+  std::string error;
+
+  cache.prepare (0, BLOCK_SIZE);
+  fail_unless (cache.take_run_to_request (first, count));
+  fail_unless (cache.take_run_to_request (first, count));
+  complete_run (cache, 0, 1);
+  fail_unless (cache.consume (0, BLOCK_SIZE, consumed, error, ignore_block));
+  fail_unless (cache.take_run_to_request (first, count));
+  fail_unless_equals_int (2, first);
+
+  /* blocks 1 and 2 are on their way, so block 1 leaves no room for block 0 */
+  complete_run (cache, 1, 1);
+  fail_unless_equals_int (2, get_cache_stat (cache, "cached-ranges"));
+  fail_unless_equals_int (BLOCK_SIZE, get_cache_stat (cache, "cached-bytes"));
+
+  complete_run (cache, 2, 1);
+  cache.shutdown ();
+}
+GST_END_TEST
+
+GST_START_TEST (test_failed_blocks_should_be_dropped_away_from_reader)
+{
+  BlockCache cache (5 * BLOCK_SIZE, BLOCK_SIZE, 10 * BLOCK_SIZE, 1, ReadAheadController (2, 2));
+  guint64 first = 0;
+  guint64 count = 0;
+  size_t consumed = 0;
+  std::string error;
+
+  cache.prepare (0, BLOCK_SIZE);
+  fail_unless (cache.take_run_to_request (first, count));
+  fail_unless (cache.take_run_to_request (first, count));
+  fail_unless_equals_int (1, first);
+
+  /* the reader moves away while blocks 0 and 1 are on their way */
+  cache.prepare (3 * BLOCK_SIZE, BLOCK_SIZE);
+  cache.complete_run (1, 1, {}, "failed");
+  complete_run (cache, 0, 1);
+  fail_unless_equals_int (1, get_cache_stat (cache, "cached-ranges"));
+
+  /* the reader still learns about a block it is waiting for */
+  fail_unless (cache.take_run_to_request (first, count));
+  fail_unless_equals_int (3, first);
+  cache.complete_run (3, 1, {}, "failed");
+  fail_if (cache.consume (3 * BLOCK_SIZE, BLOCK_SIZE, consumed, error, ignore_block));
+  fail_unless_equals_string ("failed", error.c_str ());
+
+  cache.shutdown ();
+}
+GST_END_TEST
+
+GST_START_TEST (test_seek_should_coalesce_blocks_into_one_request)
+{
+  BlockCache cache (12 * BLOCK_SIZE, BLOCK_SIZE, 20 * BLOCK_SIZE, 4, ReadAheadController (1, 1));
+  guint64 first = 0;
+  guint64 count = 0;
+
+  cache.prepare (7 * BLOCK_SIZE, 10);
+  fail_unless (cache.take_run_to_request (first, count));
+  fail_unless_equals_int (7, first);
+  fail_unless_equals_int (4, count);
+  /* the read-ahead is back to its depth */
+  fail_if (cache.take_run_to_request (first, count));
+
+  /* a run stops at the blocks requested already */
+  cache.prepare (5 * BLOCK_SIZE, 10);
+  fail_unless (cache.take_run_to_request (first, count));
+  fail_unless_equals_int (5, first);
+  fail_unless_equals_int (2, count);
+
+  complete_run (cache, 7, 4);
+  complete_run (cache, 5, 2);
+  cache.shutdown ();
+}
+GST_END_TEST
+
+GST_START_TEST (test_seek_should_request_blocks_the_read_covers)
+{
+  BlockCache cache (12 * BLOCK_SIZE, BLOCK_SIZE, 20 * BLOCK_SIZE, 1, ReadAheadController (1, 1));
+  guint64 first = 0;
+  guint64 count = 0;
+
+  cache.prepare (7 * BLOCK_SIZE, 10);
+  fail_unless (cache.take_run_to_request (first, count));
+  fail_unless_equals_int (1, count);
+
+  /* deeper than the read-ahead */
+  cache.prepare (BLOCK_SIZE + 500, 3 * BLOCK_SIZE);
+  fail_unless (cache.take_run_to_request (first, count));
+  fail_unless_equals_int (1, first);
+  fail_unless_equals_int (4, count);
+
+  complete_run (cache, 7, 1);
+  complete_run (cache, 1, 4);
+  cache.shutdown ();
+}
+GST_END_TEST
+
+/* returns once a reader waits for a block */
+static void
+wait_for_reader (const BlockCache & cache)
+{
+  while (get_cache_stat (cache, "read-waits") == 0)
+    g_usleep (1000);
+}
+
+GST_START_TEST (test_reader_should_survive_dropped_block)
+{
+  BlockCache cache (5 * BLOCK_SIZE, BLOCK_SIZE, 10 * BLOCK_SIZE, 1, ReadAheadController (2, 2));
+  guint64 first = 0;
+  guint64 count = 0;
+  size_t consumed = 1;
+  std::string error;
+
+  cache.prepare (0, BLOCK_SIZE);
+  fail_unless (cache.take_run_to_request (first, count));
+  fail_unless (cache.take_run_to_request (first, count));
+
+  /* away and back to block 1 while it is on its way */
+  cache.prepare (3 * BLOCK_SIZE, BLOCK_SIZE);
+  cache.prepare (BLOCK_SIZE, BLOCK_SIZE);
+  auto reader = std::async (std::launch::async, [&] {
+    return cache.consume (BLOCK_SIZE, BLOCK_SIZE, consumed, error, ignore_block);
+  });
+  wait_for_reader (cache);
+
+  /* the failed block is dropped, the next prepare fetches it again */
+  cache.complete_run (1, 1, {}, "failed");
+  fail_unless (reader.wait_for (std::chrono::seconds (10)) == std::future_status::ready);
+  fail_unless (reader.get ());
+  fail_unless_equals_int (0, consumed);
+
+  complete_run (cache, 0, 1);
+  cache.shutdown ();
+}
+GST_END_TEST
+
+GST_START_TEST (test_reader_should_survive_evicted_block)
+{
+  BlockCache cache (6 * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE / 2, 2, ReadAheadController (1, 1));
+  guint64 first = 0;
+  guint64 count = 0;
+  size_t consumed = 1;
+  std::string error;
+
+  cache.prepare (3 * BLOCK_SIZE, 10);
+  fail_unless (cache.take_run_to_request (first, count));
+  fail_unless_equals_int (2, count);
+
+  /* away and back to block 4 while it is on its way */
+  cache.prepare (0, 10);
+  cache.prepare (4 * BLOCK_SIZE, 10);
+  auto reader = std::async (std::launch::async, [&] {
+    return cache.consume (4 * BLOCK_SIZE, 10, consumed, error, ignore_block);
+  });
+  wait_for_reader (cache);
+
+  /* the cache can't hold the run, so it is evicted as it arrives */
+  complete_run (cache, 3, 2);
+  fail_unless (reader.wait_for (std::chrono::seconds (10)) == std::future_status::ready);
+  fail_unless (reader.get ());
+  fail_unless_equals_int (0, consumed);
+  fail_unless_equals_int (0, get_cache_stat (cache, "cached-ranges"));
+
+  cache.shutdown ();
+}
+GST_END_TEST
+
+static std::string
+get_block_bytes (GstBuffer * block, gsize size)
+{
+  std::string bytes (size, '\0');
+
+  fail_unless_equals_int (size, gst_buffer_extract (block, 0, &bytes[0], size));
+  return bytes;
+}
+
+static std::string
+read_all (std::istream & stream)
+{
+  return std::string (std::istreambuf_iterator<char> (stream),
+      std::istreambuf_iterator<char> ());
+}
+
+GST_START_TEST (test_stream_should_write_across_blocks)
+{
+  BlockBuffer first (gst_buffer_new_allocate (NULL, 4, NULL));
+  BlockBuffer second (gst_buffer_new_allocate (NULL, 4, NULL));
+  BlockStreamBuf stream_buffer ({ first.get (), second.get () });
+  std::iostream stream (&stream_buffer);
+
+  stream << "abc" << "defgh";
+  fail_unless (stream.good ());
+  fail_unless_equals_int (8, stream_buffer.finish ());
+
+  fail_unless_equals_string ("abcd", get_block_bytes (first.get (), 4).c_str ());
+  fail_unless_equals_string ("efgh", get_block_bytes (second.get (), 4).c_str ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_stream_should_tell_short_body)
+{
+  BlockBuffer first (gst_buffer_new_allocate (NULL, 4, NULL));
+  BlockBuffer second (gst_buffer_new_allocate (NULL, 4, NULL));
+  BlockStreamBuf stream_buffer ({ first.get (), second.get () });
+  std::iostream stream (&stream_buffer);
+
+  stream << "abcde";
+  fail_unless (stream.good ());
+  /* the range ended early */
+  fail_unless_equals_int (5, stream_buffer.finish ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_stream_should_fail_past_last_block)
+{
+  BlockBuffer first (gst_buffer_new_allocate (NULL, 4, NULL));
+  BlockBuffer second (gst_buffer_new_allocate (NULL, 4, NULL));
+  BlockStreamBuf stream_buffer ({ first.get (), second.get () });
+  std::iostream stream (&stream_buffer);
+
+  stream << "abcdefghij";
+  fail_unless (stream.bad ());
+  fail_unless_equals_int (8, stream_buffer.finish ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_stream_should_read_back_what_was_written)
+{
+  BlockBuffer first (gst_buffer_new_allocate (NULL, 4, NULL));
+  BlockBuffer second (gst_buffer_new_allocate (NULL, 4, NULL));
+  BlockStreamBuf stream_buffer ({ first.get (), second.get () });
+  std::iostream stream (&stream_buffer);
+
+  /* as the SDK does with the body of an error response */
+  stream << "<Err";
+  fail_unless_equals_string ("<Err", read_all (stream).c_str ());
+  stream.clear ();
+  stream << "or/>";
+  fail_unless_equals_string ("or/>", read_all (stream).c_str ());
+
+  stream.clear ();
+  stream.seekg (0);
+  fail_unless_equals_string ("<Error/>", read_all (stream).c_str ());
+  stream.clear ();
+  stream.seekg (5);
+  fail_unless_equals_string ("r/>", read_all (stream).c_str ());
+
+  fail_unless_equals_int (8, stream_buffer.finish ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_pool_should_recycle_short_blocks)
+{
+  GstBufferPool *pool = new_block_pool (BLOCK_SIZE);
+  BlockBuffer block;
+  GstMemory *memory;
+
+  fail_if (pool == NULL);
+
+  /* the last block of an object */
+  block = acquire_block (pool, 10);
+  fail_unless_equals_int (10, gst_buffer_get_size (block.get ()));
+  memory = gst_buffer_peek_memory (block.get (), 0);
+  block.reset ();
+
+  block = acquire_block (pool, BLOCK_SIZE);
+  fail_unless (gst_buffer_peek_memory (block.get (), 0) == memory);
+  fail_unless_equals_int (BLOCK_SIZE, gst_buffer_get_size (block.get ()));
+  block.reset ();
+
+  gst_buffer_pool_set_active (pool, FALSE);
+  gst_object_unref (pool);
+}
+GST_END_TEST
+
+GST_START_TEST (test_pool_should_not_recycle_memory_held_downstream)
+{
+  GstBufferPool *pool = new_block_pool (BLOCK_SIZE);
+  BlockBuffer block;
+  GstBuffer *downstream;
+  GstMemory *memory;
+  GstMapInfo info;
+
+  fail_if (pool == NULL);
+
+  block = acquire_block (pool, BLOCK_SIZE);
+  gst_buffer_memset (block.get (), 0, 'a', BLOCK_SIZE);
+  memory = gst_buffer_peek_memory (block.get (), 0);
+  /* what read_buffer pushes shares the memory of the block */
+  downstream = gst_buffer_copy_region (block.get (), GST_BUFFER_COPY_MEMORY,
+      100, 100);
+  block.reset ();
+
+  block = acquire_block (pool, BLOCK_SIZE);
+  fail_if (gst_buffer_peek_memory (block.get (), 0) == memory);
+  gst_buffer_memset (block.get (), 0, 'b', BLOCK_SIZE);
+
+  fail_unless (gst_buffer_map (downstream, &info, GST_MAP_READ));
+  fail_unless_equals_int ('a', info.data[0]);
+  fail_unless_equals_int ('a', info.data[99]);
+  gst_buffer_unmap (downstream, &info);
+
+  gst_buffer_unref (downstream);
+  block.reset ();
+  gst_buffer_pool_set_active (pool, FALSE);
+  gst_object_unref (pool);
+}
+GST_END_TEST
+
+static Suite *
+multipartdownloader_suite (void)
+{
+  Suite *s = suite_create ("multipartdownloader");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_read_ahead_should_start_at_min_depth);
+  tcase_add_test (tc_chain, test_read_ahead_should_grow_to_cover_latency);
+  tcase_add_test (tc_chain, test_read_ahead_should_be_capped);
+  tcase_add_test (tc_chain, test_read_ahead_should_shrink_a_range_at_a_time);
+  tcase_add_test (tc_chain, test_read_ahead_should_keep_one_range);
+  tcase_add_test (tc_chain, test_flushing_should_wake_waiting_reader);
+  tcase_add_test (tc_chain, test_cache_should_evict_least_recently_used_blocks);
+  tcase_add_test (tc_chain, test_cache_should_count_allocated_memory);
+  tcase_add_test (tc_chain, test_blocks_in_flight_should_count_against_cache_size);
+  tcase_add_test (tc_chain, test_failed_blocks_should_be_dropped_away_from_reader);
+  tcase_add_test (tc_chain, test_seek_should_coalesce_blocks_into_one_request);
+  tcase_add_test (tc_chain, test_seek_should_request_blocks_the_read_covers);
+  tcase_add_test (tc_chain, test_reader_should_survive_dropped_block);
+  tcase_add_test (tc_chain, test_reader_should_survive_evicted_block);
+  tcase_add_test (tc_chain, test_stream_should_write_across_blocks);
+  tcase_add_test (tc_chain, test_stream_should_tell_short_body);
+  tcase_add_test (tc_chain, test_stream_should_fail_past_last_block);
+  tcase_add_test (tc_chain, test_stream_should_read_back_what_was_written);
+  tcase_add_test (tc_chain, test_pool_should_recycle_short_blocks);
+  tcase_add_test (tc_chain, test_pool_should_not_recycle_memory_held_downstream);
+
+  return s;
+}
+
+GST_CHECK_MAIN (multipartdownloader)
@@ -0,0 +1,1386 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#include "gsts3multipartuploader.hpp"
+#include "gsts3client.hpp"
+#include "gstawscredentials.hpp"
+
+#include <aws/core/Aws.h>
+#include <aws/core/utils/HashingUtils.h>
+#include <aws/s3/model/CompleteMultipartUploadRequest.h>
+#include <aws/s3/model/ListPartsRequest.h>
+#include <aws/s3/model/PutObjectRequest.h>
+#include <aws/s3/S3EndpointProvider.h>
+
+#include <gst/check/gstcheck.h>
+#include <glib/gstdio.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+
+GST_DEBUG_CATEGORY (gst_s3_sink_debug);
+GST_DEBUG_CATEGORY (gst_s3_src_debug);
+
+using namespace gst::aws::s3;
+
+using TimePoint = std::chrono::steady_clock::time_point;
+
+#define PART_SIZE (1024 * 1024)
+
+static TimePoint
+at (gint64 seconds)
+{
+  return TimePoint () + std::chrono::hours (1) + std::chrono::seconds (seconds);
+}
+
+static void
+complete_parts (ConcurrencyController & controller, size_t count,
+    TimePoint sent_at, TimePoint completed_at)
+{
+  for (size_t i = 0; i < count; i++)
+    controller.on_part_completed (PART_SIZE, sent_at, completed_at);
+}
+
+GST_START_TEST (test_concurrency_should_grow_while_throughput_improves)
+{
+  ConcurrencyController controller (1, 4, true);
+
+  /* every round sends a window worth of parts in a second */
+  complete_parts (controller, 1, at (0), at (1));
+  fail_unless_equals_int (2, controller.get_window ());
+  complete_parts (controller, 2, at (1), at (2));
+  fail_unless_equals_int (3, controller.get_window ());
+  complete_parts (controller, 3, at (2), at (3));
+  fail_unless_equals_int (4, controller.get_window ());
+
+  /* capped */
+  complete_parts (controller, 4, at (3), at (4));
+  fail_unless_equals_int (4, controller.get_window ());
+  fail_unless_equals_int (0, controller.get_backoffs ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_concurrency_should_back_off_once_per_round_trip)
+{
+  ConcurrencyController controller (8, 8, true);
+  gint i;
+
+  /* all the parts in flight are throttled by the same event */
+  for (i = 0; i < 8; i++)
+    controller.on_congestion (at (0), at (1));
+  fail_unless_equals_int (4, controller.get_window ());
+  fail_unless_equals_int (1, controller.get_backoffs ());
+
+  /* a part sent after the decrease reports a new event */
+  controller.on_congestion (at (2), at (3));
+  fail_unless_equals_int (2, controller.get_window ());
+  fail_unless_equals_int (2, controller.get_backoffs ());
+
+  /* never below a single part */
+  controller.on_congestion (at (4), at (5));
+  controller.on_congestion (at (6), at (7));
+  fail_unless_equals_int (1, controller.get_window ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_concurrency_should_back_off_once_per_latency_spike)
+{
+  ConcurrencyController controller (8, 8, true);
+
+  complete_parts (controller, 4, at (0), at (1));
+  fail_unless_equals_int (8, controller.get_window ());
+
+  /* ten times slower: only the first of these parts counts */
+  complete_parts (controller, 3, at (1), at (11));
+  fail_unless_equals_int (4, controller.get_window ());
+  fail_unless_equals_int (1, controller.get_backoffs ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_fixed_concurrency_should_not_change)
+{
+  ConcurrencyController controller (4, 16, false);
+
+  controller.on_congestion (at (0), at (1));
+  complete_parts (controller, 4, at (1), at (2));
+  complete_parts (controller, 4, at (2), at (3));
+  fail_unless_equals_int (4, controller.get_window ());
+  fail_unless_equals_int (0, controller.get_backoffs ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_retry_delay_should_double_within_jitter_bounds)
+{
+  RetryPolicy policy (5, std::chrono::milliseconds (100));
+  guint attempts;
+  gint i;
+
+  for (attempts = 1; attempts <= 4; attempts++) {
+    gint64 delay = 100 << (attempts - 1);
+
+    for (i = 0; i < 100; i++) {
+      gint64 jittered = policy.get_delay (attempts).count ();
+
+      fail_unless (jittered >= delay / 2 && jittered <= delay,
+          "attempt %u: %" G_GINT64_FORMAT " ms outside of [%" G_GINT64_FORMAT
+          ", %" G_GINT64_FORMAT "]", attempts, jittered, delay / 2, delay);
+    }
+  }
+}
+GST_END_TEST
+
+GST_START_TEST (test_retry_delay_should_be_randomized)
+{
+  RetryPolicy policy (5, std::chrono::milliseconds (1000));
+  gint64 first = policy.get_delay (1).count ();
+  gboolean varied = FALSE;
+  gint i;
+
+  for (i = 0; i < 100 && !varied; i++)
+    varied = policy.get_delay (1).count () != first;
+
+  fail_unless (varied);
+}
+GST_END_TEST
+
+GST_START_TEST (test_retry_delay_should_be_capped)
+{
+  RetryPolicy policy (G_MAXUINT, std::chrono::milliseconds (1000));
+  gint i;
+
+  for (i = 0; i < 100; i++) {
+    gint64 delay = policy.get_delay (64 + i).count ();
+
+    fail_unless (delay >= 15000 && delay <= 30000);
+  }
+}
+GST_END_TEST
+
+GST_START_TEST (test_retry_should_give_up_after_last_retry)
+{
+  RetryPolicy policy (3, std::chrono::milliseconds (100));
+  RetryPolicy no_retries (0, std::chrono::milliseconds (100));
+
+  /* the first attempt and three retries */
+  fail_unless (policy.should_retry (1));
+  fail_unless (policy.should_retry (3));
+  fail_if (policy.should_retry (4));
+
+  fail_if (no_retries.should_retry (1));
+}
+GST_END_TEST
+
+/* a few hashing blocks and a bit */
+#define HASHED_PART_SIZE (3 * 64 * 1024 + 100)
+
+static Aws::SDKOptions sdk_options;
+
+static void
+init_sdk (void)
+{
+  /* the mock clients don't need a region */
+  g_setenv ("AWS_EC2_METADATA_DISABLED", "true", TRUE);
+  Aws::InitAPI (sdk_options);
+}
+
+static void
+shutdown_sdk (void)
+{
+  Aws::ShutdownAPI (sdk_options);
+}
+
+static std::vector<char>
+random_bytes (size_t size)
+{
+  std::vector<char> bytes (size);
+  GRand *rand = g_rand_new_with_seed (size);
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    bytes[i] = (g_rand_int (rand) >> 24) & 0xff;
+  g_rand_free (rand);
+
+  return bytes;
+}
+
+static void
+assert_sha256 (const std::vector<char> & data,
+    const Aws::Utils::ByteBuffer & sha256)
+{
+  gchar *expected = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+      reinterpret_cast<const guchar *> (data.data ()), data.size ());
+
+  fail_unless_equals_string (expected,
+      Aws::Utils::HashingUtils::HexEncode (sha256).c_str ());
+  g_free (expected);
+}
+
+GST_START_TEST (test_part_copy_should_compute_sha256)
+{
+  auto data = random_bytes (HASHED_PART_SIZE);
+  auto pool = std::make_shared<BufferPool> (1);
+  auto part = PooledPartData::create (pool, data.data (), data.size (), true);
+  std::vector<char> copy (data.size ());
+
+  fail_unless (part->get_stream ()->has_sha256 ());
+  assert_sha256 (data, part->get_stream ()->get_sha256 ());
+
+  part->get_stream ()->read (copy.data (), copy.size ());
+  fail_unless (copy == data);
+}
+GST_END_TEST
+
+GST_START_TEST (test_part_copy_should_compute_known_sha256)
+{
+  auto pool = std::make_shared<BufferPool> (1);
+  auto part = PooledPartData::create (pool, "abc", 3, true);
+
+  fail_unless_equals_string ("ba7816bf8f01cfea414140de5dae2223"
+      "b00361a396177a9cb410ff61f20015ad",
+      Aws::Utils::HashingUtils::HexEncode (part->get_stream ()->get_sha256 ()).c_str ());
+}
+GST_END_TEST
+
+/* part checksums of "123456789" and "abc" */
+GST_START_TEST (test_composite_checksum_should_match_known_crc32c)
+{
+  Aws::Vector<Aws::String> parts = { "4waSgw==", "Nks/tw==" };
+
+  fail_unless_equals_string ("DmQUGQ==-2", compute_composite_checksum (
+          Aws::S3::Model::ChecksumAlgorithm::CRC32C, parts).c_str ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_composite_checksum_should_match_known_sha256)
+{
+  Aws::Vector<Aws::String> parts = {
+    "FeKw08M4keuw8e9gnsQZQgwg4yDOlMZfvIwzEkSOsiU=",
+    "ungWv48Bz+pBQUDeXa4iI7ADYaOWF3qctBD/YfIAFa0="
+  };
+
+  fail_unless_equals_string ("qrA/wXeZB3D42jo44oxVB6mWuJ3EM3uOMqjKxBMqGMA=-2",
+      compute_composite_checksum (Aws::S3::Model::ChecksumAlgorithm::SHA256,
+          parts).c_str ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_part_copy_without_hash_should_not_compute_sha256)
+{
+  auto data = random_bytes (HASHED_PART_SIZE);
+  auto pool = std::make_shared<BufferPool> (1);
+  auto part = PooledPartData::create (pool, data.data (), data.size (), false);
+
+  fail_if (part->get_stream ()->has_sha256 ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_part_stream_sha256_should_match_read_digest)
+{
+  auto data = random_bytes (HASHED_PART_SIZE);
+  auto pool = std::make_shared<BufferPool> (2);
+  auto hashed = PooledPartData::create (pool, data.data (), data.size (), true);
+  auto plain = PooledPartData::create (pool, data.data (), data.size (), false);
+  PartStreamSha256 sha256;
+
+  /* taken from the stream, which isn't read */
+  auto result = sha256.Calculate (*hashed->get_stream ());
+  fail_unless (result.IsSuccess ());
+  assert_sha256 (data, result.GetResult ());
+  fail_unless_equals_int (0, hashed->get_stream ()->tellg ());
+
+  /* read, and rewound for the request */
+  result = sha256.Calculate (*plain->get_stream ());
+  fail_unless (result.IsSuccess ());
+  assert_sha256 (data, result.GetResult ());
+  fail_unless_equals_int (0, plain->get_stream ()->tellg ());
+}
+GST_END_TEST
+
+/* rings of a single slot, in the temporary directory */
+static BufferPool::RingFactory
+single_slot_ring_factory (std::vector<size_t> & slot_sizes)
+{
+  return [&slot_sizes] (size_t slot_size) {
+    slot_sizes.push_back (slot_size);
+    return MappedBufferRing::create (g_get_tmp_dir (), slot_size, 1);
+  };
+}
+
+GST_START_TEST (test_buffer_ring_should_grow_with_parts)
+{
+  std::vector<size_t> slot_sizes;
+  BufferPool pool (1, single_slot_ring_factory (slot_sizes), 4096);
+  size_t capacity = 0;
+
+  uint8_t *small = pool.acquire (4096, capacity);
+  fail_unless (small != NULL);
+  memset (small, 0xab, 4096);
+
+  /* doesn't fit in the slots of the first ring */
+  uint8_t *big = pool.acquire (8192, capacity);
+  fail_unless (big != NULL);
+  fail_unless_equals_int (8192, capacity);
+  fail_unless_equals_int (2, slot_sizes.size ());
+  fail_unless_equals_int (8192, slot_sizes[1]);
+
+  /* the first ring stays mapped while its buffer is in use */
+  fail_unless_equals_int (0xab, small[4095]);
+  pool.release (small, 4096);
+  pool.release (big, 8192);
+
+  /* taken from the ring again rather than from the heap */
+  fail_unless (pool.acquire (8192, capacity) == big);
+  fail_unless_equals_int (2, slot_sizes.size ());
+  pool.release (big, 8192);
+}
+GST_END_TEST
+
+#if defined(__linux__)
+GST_START_TEST (test_released_ring_buffer_should_be_discarded)
+{
+  std::vector<size_t> slot_sizes;
+  BufferPool pool (1, single_slot_ring_factory (slot_sizes), 4096);
+  size_t capacity = 0;
+
+  uint8_t *buffer = pool.acquire (4096, capacity);
+  fail_unless (buffer != NULL);
+  memset (buffer, 0xab, 4096);
+  pool.release (buffer, capacity);
+
+  /* the dirty pages are dropped rather than written back */
+  buffer = pool.acquire (4096, capacity);
+  fail_unless_equals_int (0, buffer[0]);
+  fail_unless_equals_int (0, buffer[4095]);
+  pool.release (buffer, capacity);
+}
+GST_END_TEST
+#endif
+
+/* Answers the requests of an uploader without going to S3, and records them. */
+class MockS3Client : public Aws::S3::S3Client
+{
+public:
+  MockS3Client () :
+      Aws::S3::S3Client (Aws::Auth::AWSCredentials ("access-key-id", "secret-access-key"),
+          Aws::MakeShared<Aws::S3::Endpoint::S3EndpointProvider> ("MockS3Client"))
+  {
+  }
+
+  Aws::S3::Model::PutObjectOutcome
+  PutObject (const Aws::S3::Model::PutObjectRequest & request) const override
+  {
+    std::lock_guard<std::mutex> l (mtx);
+    std::ostringstream body;
+
+    body << request.GetBody ()->rdbuf ();
+    put_object_bodies.push_back (body.str ());
+    put_object_lengths.push_back (request.GetContentLength ());
+    return Aws::S3::Model::PutObjectResult ();
+  }
+
+  Aws::S3::Model::CreateMultipartUploadOutcome
+  CreateMultipartUpload (const Aws::S3::Model::CreateMultipartUploadRequest &) const override
+  {
+    std::lock_guard<std::mutex> l (mtx);
+    Aws::S3::Model::CreateMultipartUploadResult result;
+
+    create_count++;
+    result.SetUploadId ("upload-id");
+    return result;
+  }
+
+  Aws::S3::Model::UploadPartOutcome
+  UploadPart (const Aws::S3::Model::UploadPartRequest & request) const override
+  {
+    std::unique_lock<std::mutex> l (mtx);
+    Aws::S3::Model::UploadPartResult result;
+    std::ostringstream body;
+
+    held_cv.wait (l, [this] { return !hold_parts; });
+    part_attempts[request.GetPartNumber ()]++;
+    auto & errors = part_errors[request.GetPartNumber ()];
+    if (!errors.empty ()) {
+      auto error = errors.front ();
+      errors.pop_front ();
+      return error;
+    }
+    if (unreachable_uploads > 0) {
+      unreachable_uploads--;
+      return Aws::S3::S3Error (Aws::S3::S3Errors::NETWORK_CONNECTION,
+          "NetworkConnection", "S3 can't be reached", true);
+    }
+
+    body << request.GetBody ()->rdbuf ();
+    part_bodies[request.GetPartNumber ()] = body.str ();
+    part_lengths[request.GetPartNumber ()] = request.GetContentLength ();
+    result.SetETag (("etag-" + std::to_string (request.GetPartNumber ())).c_str ());
+    result.SetChecksumCRC32C (part_checksum);
+    return result;
+  }
+
+  Aws::S3::Model::CompleteMultipartUploadOutcome
+  CompleteMultipartUpload (const Aws::S3::Model::CompleteMultipartUploadRequest & request) const override
+  {
+    std::lock_guard<std::mutex> l (mtx);
+
+    completed_parts = request.GetMultipartUpload ().GetParts ().size ();
+    return Aws::S3::Model::CompleteMultipartUploadResult ()
+        .WithChecksumCRC32C (object_checksum);
+  }
+
+  Aws::S3::Model::ListPartsOutcome
+  ListParts (const Aws::S3::Model::ListPartsRequest &) const override
+  {
+    std::lock_guard<std::mutex> l (mtx);
+    Aws::S3::Model::ListPartsResult result;
+
+    result.SetParts (listed_parts);
+    result.SetIsTruncated (false);
+    return result;
+  }
+
+  void
+  list_part (int part_number, long long size)
+  {
+    listed_parts.push_back (Aws::S3::Model::Part ()
+        .WithPartNumber (part_number)
+        .WithSize (size)
+        .WithETag (("etag-" + std::to_string (part_number)).c_str ()));
+  }
+
+  /* blocks the parts sent until it's cleared */
+  void
+  set_hold_parts (bool hold)
+  {
+    std::lock_guard<std::mutex> l (mtx);
+
+    hold_parts = hold;
+    held_cv.notify_all ();
+  }
+
+  mutable std::mutex mtx;
+  mutable std::condition_variable held_cv;
+  bool hold_parts = false;
+  mutable guint unreachable_uploads = 0;
+  /* answered to the next attempts of a part */
+  mutable std::map<int, std::deque<Aws::S3::S3Error>> part_errors;
+  mutable std::map<int, guint> part_attempts;
+  mutable std::map<int, std::string> part_bodies;
+  Aws::Vector<Aws::S3::Model::Part> listed_parts;
+  mutable std::vector<std::string> put_object_bodies;
+  mutable std::vector<long long> put_object_lengths;
+  mutable guint create_count = 0;
+  mutable std::map<int, long long> part_lengths;
+  mutable size_t completed_parts = 0;
+  /* echoed by S3, none when empty */
+  Aws::String part_checksum;
+  Aws::String object_checksum;
+};
+
+static GstS3UploaderConfig
+uploader_config (gsize part_size)
+{
+  GstS3UploaderConfig config = GstS3UploaderConfig ();
+
+  config.bucket = const_cast<gchar *> ("some-bucket");
+  config.key = const_cast<gchar *> ("some-key");
+  config.region = const_cast<gchar *> ("us-east-1");
+  config.buffer_size = part_size;
+  config.buffer_count = 4;
+  config.init_aws_sdk = FALSE;
+  config.max_concurrent_uploads = 4;
+  config.upload_threads = 1;
+  config.upload_thread_name = const_cast<gchar *> ("s3-upload");
+
+  return config;
+}
+
+GST_START_TEST (test_empty_stream_should_put_empty_object)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  GstS3UploaderConfig config = uploader_config (PART_SIZE);
+  auto uploader = MultipartUploader::create (&config, client);
+
+  fail_unless (uploader != nullptr);
+  fail_unless (uploader->complete ());
+
+  fail_unless_equals_int (1, client->put_object_bodies.size ());
+  fail_unless_equals_int (0, client->put_object_lengths[0]);
+  fail_unless (client->put_object_bodies[0].empty ());
+  fail_unless_equals_int (0, client->create_count);
+}
+GST_END_TEST
+
+GST_START_TEST (test_small_object_should_be_put_in_one_request)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  GstS3UploaderConfig config = uploader_config (PART_SIZE);
+  auto uploader = MultipartUploader::create (&config, client);
+  auto data = random_bytes (1000);
+
+  fail_unless (uploader != nullptr);
+  fail_unless (uploader->upload (data.data (), data.size ()));
+  /* held until the end of the stream */
+  fail_unless_equals_int (0, client->put_object_bodies.size ());
+  fail_unless (uploader->complete ());
+
+  fail_unless_equals_int (1, client->put_object_bodies.size ());
+  fail_unless_equals_int (data.size (), client->put_object_lengths[0]);
+  fail_unless (client->put_object_bodies[0] == std::string (data.begin (), data.end ()));
+  fail_unless_equals_int (0, client->create_count);
+  fail_unless (client->part_lengths.empty ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_object_of_several_parts_should_use_multipart_upload)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  GstS3UploaderConfig config = uploader_config (1000);
+  auto uploader = MultipartUploader::create (&config, client);
+  auto data = random_bytes (1000);
+
+  fail_unless (uploader != nullptr);
+  fail_unless (uploader->upload (data.data (), 1000));
+  fail_unless (uploader->upload (data.data (), 10));
+  fail_unless (uploader->complete ());
+
+  fail_unless_equals_int (1, client->create_count);
+  fail_unless_equals_int (2, client->part_lengths.size ());
+  fail_unless_equals_int (1000, client->part_lengths[1]);
+  fail_unless_equals_int (10, client->part_lengths[2]);
+  fail_unless_equals_int (2, client->completed_parts);
+  fail_unless_equals_int (0, client->put_object_bodies.size ());
+}
+GST_END_TEST
+
+static Aws::S3::S3Error
+s3_error (Aws::S3::S3Errors type, const gchar * name,
+    Aws::Http::HttpResponseCode code, bool should_retry)
+{
+  Aws::S3::S3Error error (type, name, "injected failure", should_retry);
+
+  error.SetResponseCode (code);
+
+  return error;
+}
+
+static std::unique_ptr<MultipartUploader>
+upload_two_parts_with_retries (std::shared_ptr<MockS3Client> client)
+{
+  GstS3UploaderConfig config = uploader_config (1000);
+  auto data = random_bytes (1000);
+
+  config.max_part_retries = 2;
+  config.part_retry_delay = 1;
+
+  auto uploader = MultipartUploader::create (&config, client);
+
+  fail_unless (uploader != nullptr);
+  /* the failures only show once both parts are in */
+  client->set_hold_parts (true);
+  fail_unless (uploader->upload (data.data (), 1000));
+  fail_unless (uploader->upload (data.data (), 10));
+  client->set_hold_parts (false);
+
+  return uploader;
+}
+
+GST_START_TEST (test_failed_part_should_be_retried)
+{
+  auto client = std::make_shared<MockS3Client> ();
+
+  client->part_errors[1] = {
+    s3_error (Aws::S3::S3Errors::INTERNAL_FAILURE, "InternalError",
+        Aws::Http::HttpResponseCode::INTERNAL_SERVER_ERROR, true),
+    s3_error (Aws::S3::S3Errors::UNKNOWN, "BadDigest",
+        Aws::Http::HttpResponseCode::BAD_REQUEST, false)
+  };
+  auto uploader = upload_two_parts_with_retries (client);
+
+  fail_unless (uploader->complete ());
+  fail_unless_equals_int (3, client->part_attempts[1]);
+  fail_unless_equals_int (1, client->part_attempts[2]);
+  fail_unless_equals_int (2, client->completed_parts);
+}
+GST_END_TEST
+
+GST_START_TEST (test_failed_part_should_fail_upload_after_last_retry)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  auto error = s3_error (Aws::S3::S3Errors::SERVICE_UNAVAILABLE, "ServiceUnavailable",
+      Aws::Http::HttpResponseCode::SERVICE_UNAVAILABLE, true);
+
+  client->part_errors[1] = { error, error, error };
+  auto uploader = upload_two_parts_with_retries (client);
+
+  fail_if (uploader->complete ());
+  fail_unless_equals_int (3, client->part_attempts[1]);
+  fail_unless (client->part_errors[1].empty ());
+  fail_unless_equals_int (0, client->completed_parts);
+}
+GST_END_TEST
+
+GST_START_TEST (test_part_should_not_be_retried_on_sdk_retryable_error)
+{
+  auto client = std::make_shared<MockS3Client> ();
+
+  /* retried by the SDK client already */
+  client->part_errors[1] = {
+    s3_error (Aws::S3::S3Errors::REQUEST_TIME_TOO_SKEWED, "RequestTimeTooSkewed",
+        Aws::Http::HttpResponseCode::FORBIDDEN, true)
+  };
+  auto uploader = upload_two_parts_with_retries (client);
+
+  fail_if (uploader->complete ());
+  fail_unless_equals_int (1, client->part_attempts[1]);
+  fail_unless_equals_int (0, client->completed_parts);
+}
+GST_END_TEST
+
+static std::string
+get_stats_string (const MultipartUploader & uploader, const gchar * name)
+{
+  GstStructure *stats = uploader.get_stats ();
+  const gchar *value = gst_structure_get_string (stats, name);
+  std::string result = value ? value : "";
+
+  gst_structure_free (stats);
+
+  return result;
+}
+
+static std::unique_ptr<MultipartUploader>
+upload_two_crc32c_parts (std::shared_ptr<MockS3Client> client)
+{
+  GstS3UploaderConfig config = uploader_config (1000);
+  auto data = random_bytes (1000);
+
+  config.checksum_algorithm = GST_S3_UPLOADER_CHECKSUM_ALGORITHM_CRC32C;
+  client->part_checksum = "4waSgw==";
+
+  auto uploader = MultipartUploader::create (&config, client);
+
+  fail_unless (uploader != nullptr);
+  fail_unless (uploader->upload (data.data (), 1000));
+  fail_unless (uploader->upload (data.data (), 10));
+
+  return uploader;
+}
+
+GST_START_TEST (test_missing_object_checksum_should_be_computed_from_parts)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  auto uploader = upload_two_crc32c_parts (client);
+  Aws::Vector<Aws::String> parts = { "4waSgw==", "4waSgw==" };
+
+  fail_unless (uploader->complete ());
+  fail_unless_equals_string (compute_composite_checksum (
+          Aws::S3::Model::ChecksumAlgorithm::CRC32C, parts).c_str (),
+      get_stats_string (*uploader, "checksum").c_str ());
+  fail_unless (get_stats_string (*uploader, "expected-checksum").empty ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_checksum_mismatch_should_not_fail_completed_upload)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  auto uploader = upload_two_crc32c_parts (client);
+  Aws::Vector<Aws::String> parts = { "4waSgw==", "4waSgw==" };
+
+  client->object_checksum = "AAAAAA==-2";
+  fail_unless (uploader->complete ());
+  fail_unless_equals_int (2, client->completed_parts);
+  fail_unless_equals_string ("AAAAAA==-2",
+      get_stats_string (*uploader, "checksum").c_str ());
+  fail_unless_equals_string (compute_composite_checksum (
+          Aws::S3::Model::ChecksumAlgorithm::CRC32C, parts).c_str (),
+      get_stats_string (*uploader, "expected-checksum").c_str ());
+}
+GST_END_TEST
+
+GST_START_TEST (test_small_first_part_should_join_multipart_upload)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  GstS3UploaderConfig config = uploader_config (1000);
+  auto uploader = MultipartUploader::create (&config, client);
+  auto data = random_bytes (1000);
+
+  fail_unless (uploader != nullptr);
+  /* can't be the last part once another one follows */
+  fail_unless (uploader->upload (data.data (), 10));
+  fail_unless (uploader->upload (data.data (), 20));
+  fail_unless (uploader->complete ());
+
+  fail_unless_equals_int (1, client->create_count);
+  fail_unless_equals_int (10, client->part_lengths[1]);
+  fail_unless_equals_int (20, client->part_lengths[2]);
+  fail_unless_equals_int (0, client->put_object_bodies.size ());
+}
+GST_END_TEST
+
+/* a journal of the upload "upload-id" of some-key, ending with the given
+ * part lines */
+static gchar *
+write_journal (const gchar * parts)
+{
+  gchar *path = NULL;
+  gchar *contents;
+  gint fd;
+
+  fd = g_file_open_tmp ("s3-journal-XXXXXX", &path, NULL);
+  fail_unless (fd >= 0);
+  g_close (fd, NULL);
+
+  contents = g_strconcat ("gst-s3-upload-journal 1\n"
+      "upload upload-id\nbucket some-bucket\nkey some-key\n", parts, NULL);
+  fail_unless (g_file_set_contents (path, contents, -1, NULL));
+  g_free (contents);
+
+  return path;
+}
+
+static std::unique_ptr<MultipartUploader>
+resume_uploader (const std::shared_ptr<MockS3Client> & client, const gchar * journal)
+{
+  GstS3UploaderConfig config = uploader_config (1000);
+
+  config.journal_location = const_cast<gchar *> (journal);
+  config.resume = TRUE;
+
+  return MultipartUploader::create (&config, client);
+}
+
+static guint
+get_resumed_parts (const MultipartUploader & uploader)
+{
+  GstStructure *stats = uploader.get_stats ();
+  guint value = 0;
+
+  fail_unless (gst_structure_get_uint (stats, "resumed-parts", &value));
+  gst_structure_free (stats);
+
+  return value;
+}
+
+GST_START_TEST (test_resume_should_ignore_unterminated_journal_line)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  gchar *journal = write_journal ("part 1 1000 etag-1 -\n"
+      "part 2 1000 etag-2 -\npart 3 1000 garb");
+
+  client->list_part (1, 1000);
+  client->list_part (2, 1000);
+  auto uploader = resume_uploader (client, journal);
+
+  fail_unless (uploader != nullptr);
+  fail_unless_equals_int (2, get_resumed_parts (*uploader));
+  fail_unless_equals_int (0, client->create_count);
+
+  uploader.reset ();
+  g_unlink (journal);
+  g_free (journal);
+}
+GST_END_TEST
+
+GST_START_TEST (test_resume_should_stop_at_corrupt_journal_part)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  gchar *journal = write_journal ("part 1 1000 etag-1 -\n"
+      "part 2 1000 garbage -\n");
+
+  client->list_part (1, 1000);
+  client->list_part (2, 1000);
+  auto uploader = resume_uploader (client, journal);
+
+  /* S3 can't be trusted to hold what the journal claims from there on */
+  fail_unless (uploader != nullptr);
+  fail_unless_equals_int (1, get_resumed_parts (*uploader));
+
+  uploader.reset ();
+  g_unlink (journal);
+  g_free (journal);
+}
+GST_END_TEST
+
+GST_START_TEST (test_resume_should_send_again_parts_missing_on_s3)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  gchar *journal = write_journal ("part 1 1000 etag-1 -\n"
+      "part 2 1000 etag-2 -\npart 3 1000 etag-3 -\n");
+  auto data = random_bytes (1000);
+
+  client->list_part (1, 1000);
+  client->list_part (3, 1000);
+  auto uploader = resume_uploader (client, journal);
+
+  fail_unless (uploader != nullptr);
+  fail_unless_equals_int (1, get_resumed_parts (*uploader));
+
+  /* everything after the gap is sent again */
+  fail_unless (uploader->upload (data.data (), 1000));
+  fail_unless (uploader->upload (data.data (), 1000));
+  fail_unless (uploader->complete ());
+
+  fail_unless_equals_int (0, client->create_count);
+  fail_unless_equals_int (2, client->part_lengths.size ());
+  fail_unless_equals_int (1000, client->part_lengths[2]);
+  fail_unless_equals_int (1000, client->part_lengths[3]);
+  fail_unless_equals_int (3, client->completed_parts);
+  /* removed once the upload is completed */
+  fail_if (g_file_test (journal, G_FILE_TEST_EXISTS));
+
+  uploader.reset ();
+  g_free (journal);
+}
+GST_END_TEST
+
+static guint64
+get_uploader_stat (const MultipartUploader & uploader, const gchar * name)
+{
+  GstStructure *stats = uploader.get_stats ();
+  guint64 value = 0;
+
+  fail_unless (gst_structure_get_uint64 (stats, name, &value));
+  gst_structure_free (stats);
+
+  return value;
+}
+
+static GstS3UploaderConfig
+spool_config (const gchar * spool_location)
+{
+  GstS3UploaderConfig config = uploader_config (1000);
+
+  config.spool_location = const_cast<gchar *> (spool_location);
+  config.max_inflight_bytes = 1000;
+
+  return config;
+}
+
+GST_START_TEST (test_parts_over_budget_should_be_spooled)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  gchar *spool_location = g_dir_make_tmp ("s3-spool-XXXXXX", NULL);
+  GstS3UploaderConfig config = spool_config (spool_location);
+  auto uploader = MultipartUploader::create (&config, client);
+  auto data = random_bytes (3000);
+
+  fail_unless (uploader != nullptr);
+  client->set_hold_parts (true);
+  fail_unless (uploader->upload (data.data (), 1000));
+  /* the first part holds the whole budget */
+  fail_unless (uploader->upload (data.data () + 1000, 1000));
+  fail_unless (uploader->upload (data.data () + 2000, 1000));
+  fail_unless_equals_int (2, get_uploader_stat (*uploader, "spilled-parts"));
+  fail_unless_equals_int (2000, get_uploader_stat (*uploader, "spool-bytes"));
+
+  client->set_hold_parts (false);
+  fail_unless (uploader->complete ());
+
+  fail_unless_equals_int (3, client->completed_parts);
+  fail_unless (client->part_bodies[2] == std::string (data.begin () + 1000, data.begin () + 2000));
+  fail_unless (client->part_bodies[3] == std::string (data.begin () + 2000, data.end ()));
+  fail_unless_equals_int (0, get_uploader_stat (*uploader, "spool-bytes"));
+
+  /* nothing is left behind */
+  uploader.reset ();
+  fail_unless_equals_int (0, g_rmdir (spool_location));
+  g_free (spool_location);
+}
+GST_END_TEST
+
+GST_START_TEST (test_unreachable_parts_should_be_spooled_and_drained)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  gchar *spool_location = g_dir_make_tmp ("s3-spool-XXXXXX", NULL);
+  GstS3UploaderConfig config = spool_config (spool_location);
+  auto data = random_bytes (2000);
+
+  config.max_inflight_bytes = 0;
+  config.spool_drain_concurrency = 1;
+  auto uploader = MultipartUploader::create (&config, client);
+
+  fail_unless (uploader != nullptr);
+  client->unreachable_uploads = 5;
+  fail_unless (uploader->upload (data.data (), 1000));
+  fail_unless (uploader->upload (data.data () + 1000, 1000));
+  /* retried for as long as S3 can't be reached */
+  fail_unless (uploader->complete ());
+
+  fail_unless_equals_int (0, client->unreachable_uploads);
+  fail_unless (get_uploader_stat (*uploader, "outage-spooled-parts") > 0);
+  fail_unless_equals_int (2, client->completed_parts);
+  fail_unless (client->part_bodies[1] == std::string (data.begin (), data.begin () + 1000));
+  fail_unless (client->part_bodies[2] == std::string (data.begin () + 1000, data.end ()));
+  fail_unless_equals_int (0, get_uploader_stat (*uploader, "spool-bytes"));
+
+  uploader.reset ();
+  fail_unless_equals_int (0, g_rmdir (spool_location));
+  g_free (spool_location);
+}
+GST_END_TEST
+
+GST_START_TEST (test_uploaders_should_share_spool_of_directory)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  gchar *spool_location = g_dir_make_tmp ("s3-spool-XXXXXX", NULL);
+  GstS3UploaderConfig config = spool_config (spool_location);
+  auto data = random_bytes (2000);
+
+  config.max_spool_size = 1000;
+  auto first = MultipartUploader::create (&config, client);
+  auto second = MultipartUploader::create (&config, client);
+
+  fail_unless (first != nullptr);
+  fail_unless (second != nullptr);
+  client->set_hold_parts (true);
+  fail_unless (first->upload (data.data (), 1000));
+  fail_unless (first->upload (data.data () + 1000, 1000));
+
+  fail_unless_equals_int (1000, get_uploader_stat (*first, "spool-bytes"));
+  /* the part spooled by the first uploader counts against the cap of both */
+  fail_unless_equals_int (1000, get_uploader_stat (*second, "spool-bytes"));
+
+  client->set_hold_parts (false);
+  fail_unless (first->complete ());
+  fail_unless_equals_int (0, get_uploader_stat (*second, "spool-bytes"));
+
+  first.reset ();
+  second.reset ();
+  fail_unless_equals_int (0, g_rmdir (spool_location));
+  g_free (spool_location);
+}
+GST_END_TEST
+
+/* the first part goes in flight and holds the whole budget */
+static GstS3UploaderConfig
+budget_config (GstS3UploaderInflightPolicy policy)
+{
+  GstS3UploaderConfig config = uploader_config (1000);
+
+  config.max_inflight_bytes = 1000;
+  config.inflight_policy = policy;
+
+  return config;
+}
+
+GST_START_TEST (test_parts_over_budget_should_block)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  GstS3UploaderConfig config = budget_config (GST_S3_UPLOADER_INFLIGHT_POLICY_BLOCK);
+  auto uploader = MultipartUploader::create (&config, client);
+  auto data = random_bytes (2000);
+
+  fail_unless (uploader != nullptr);
+  client->set_hold_parts (true);
+  fail_unless (uploader->upload (data.data (), 1000));
+  auto blocked = std::async (std::launch::async, [&] {
+    return uploader->upload (data.data () + 1000, 1000);
+  });
+
+  fail_unless (blocked.wait_for (std::chrono::milliseconds (100)) == std::future_status::timeout);
+  client->set_hold_parts (false);
+  fail_unless (blocked.get ());
+  fail_unless (uploader->complete ());
+
+  fail_unless_equals_int (1, get_uploader_stat (*uploader, "throttle-episodes"));
+  fail_unless (get_uploader_stat (*uploader, "blocked-time") > 0);
+  fail_unless_equals_int (2, client->completed_parts);
+  fail_unless (client->part_bodies[2] == std::string (data.begin () + 1000, data.end ()));
+}
+GST_END_TEST
+
+GST_START_TEST (test_leak_policy_should_drop_oldest_unsent_part)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  GstS3UploaderConfig config = budget_config (GST_S3_UPLOADER_INFLIGHT_POLICY_LEAK_OLDEST_UNSENT);
+  auto data = random_bytes (3000);
+
+  /* a single part in flight, the next one waits in the queue */
+  config.max_inflight_bytes = 2000;
+  config.buffer_count = 1;
+  auto uploader = MultipartUploader::create (&config, client);
+
+  fail_unless (uploader != nullptr);
+  client->set_hold_parts (true);
+  fail_unless (uploader->upload (data.data (), 1000));
+  fail_unless (uploader->upload (data.data () + 1000, 1000));
+  fail_unless (uploader->upload (data.data () + 2000, 1000));
+  fail_unless_equals_int (1, get_uploader_stat (*uploader, "dropped-parts"));
+  fail_unless_equals_int (1000, get_uploader_stat (*uploader, "dropped-bytes"));
+
+  client->set_hold_parts (false);
+  fail_unless (uploader->complete ());
+
+  fail_unless_equals_int (2, client->completed_parts);
+  fail_unless (client->part_bodies.find (2) == client->part_bodies.end ());
+  fail_unless (client->part_bodies[3] == std::string (data.begin () + 2000, data.end ()));
+}
+GST_END_TEST
+
+GST_START_TEST (test_spill_policy_should_spool_to_temporary_directory_within_cap)
+{
+  auto client = std::make_shared<MockS3Client> ();
+  GstS3UploaderConfig config = budget_config (GST_S3_UPLOADER_INFLIGHT_POLICY_SPILL);
+  auto data = random_bytes (3000);
+
+  config.max_spool_size = 1000;
+  auto uploader = MultipartUploader::create (&config, client);
+
+  fail_unless (uploader != nullptr);
+  client->set_hold_parts (true);
+  fail_unless (uploader->upload (data.data (), 1000));
+  fail_unless (uploader->upload (data.data () + 1000, 1000));
+  fail_unless_equals_int (1, get_uploader_stat (*uploader, "spilled-parts"));
+  fail_unless_equals_int (1000, get_uploader_stat (*uploader, "spool-bytes"));
+
+  /* the spool is full, so the next part waits for the budget */
+  auto blocked = std::async (std::launch::async, [&] {
+    return uploader->upload (data.data () + 2000, 1000);
+  });
+  fail_unless (blocked.wait_for (std::chrono::milliseconds (100)) == std::future_status::timeout);
+  client->set_hold_parts (false);
+  fail_unless (blocked.get ());
+  fail_unless (uploader->complete ());
+
+  /* read back from the disk intact */
+  fail_unless_equals_int (3, client->completed_parts);
+  fail_unless (client->part_bodies[2] == std::string (data.begin () + 1000, data.begin () + 2000));
+  fail_unless (client->part_bodies[3] == std::string (data.begin () + 2000, data.end ()));
+  fail_unless_equals_int (1, get_uploader_stat (*uploader, "spilled-parts"));
+  fail_unless_equals_int (0, get_uploader_stat (*uploader, "spool-bytes"));
+}
+GST_END_TEST
+
+GST_START_TEST (test_equal_settings_should_share_client)
+{
+  GstAWSCredentials *credentials = gst_aws_credentials_new ([] {
+    return std::unique_ptr<Aws::Auth::AWSCredentialsProvider> (
+        new Aws::Auth::SimpleAWSCredentialsProvider ("access-key-id", "secret-access-key"));
+  });
+  auto executor = acquire_s3_executor (1, "s3-upload");
+  bool is_region_detected;
+  S3ClientSettings settings;
+
+  settings.bucket = "some-bucket";
+  settings.region = "us-east-1";
+  settings.credentials = credentials;
+
+  auto first = acquire_s3_client (settings, executor, is_region_detected);
+  auto second = acquire_s3_client (settings, executor, is_region_detected);
+  fail_unless (first != nullptr);
+  fail_unless (first == second);
+
+  /* the connection limit is a property of the client */
+  settings.max_connections = 5;
+  auto limited = acquire_s3_client (settings, executor, is_region_detected);
+  fail_unless (limited != nullptr);
+  fail_if (limited == first);
+
+  gst_aws_credentials_free (credentials);
+}
+GST_END_TEST
+
+GST_START_TEST (test_slow_client_creation_should_not_block_other_clients)
+{
+  std::promise<void> other_created;
+  auto other_created_future = other_created.get_future ();
+  GstAWSCredentials *slow = gst_aws_credentials_new ([&other_created_future] {
+    /* like probing the instance metadata service */
+    if (other_created_future.wait_for (std::chrono::seconds (10)) != std::future_status::ready)
+      return std::unique_ptr<Aws::Auth::AWSCredentialsProvider> ();
+    return std::unique_ptr<Aws::Auth::AWSCredentialsProvider> (
+        new Aws::Auth::SimpleAWSCredentialsProvider ("access-key-id", "secret-access-key"));
+  });
+  GstAWSCredentials *fast = gst_aws_credentials_new ([] {
+    return std::unique_ptr<Aws::Auth::AWSCredentialsProvider> (
+        new Aws::Auth::SimpleAWSCredentialsProvider ("access-key-id", "other-secret"));
+  });
+  auto executor = acquire_s3_executor (1, "s3-upload");
+  std::shared_ptr<Aws::S3::S3Client> slow_client;
+  S3ClientSettings slow_settings;
+  S3ClientSettings fast_settings;
+
+  slow_settings.bucket = fast_settings.bucket = "some-bucket";
+  slow_settings.region = fast_settings.region = "us-east-1";
+  slow_settings.credentials = slow;
+  fast_settings.credentials = fast;
+
+  std::thread creator ([&] {
+    bool is_region_detected;
+    slow_client = acquire_s3_client (slow_settings, executor, is_region_detected);
+  });
+  /* let the creator get into the credentials factory */
+  g_usleep (100 * 1000);
+
+  bool is_region_detected;
+  fail_unless (acquire_s3_client (fast_settings, executor, is_region_detected) != nullptr);
+  other_created.set_value ();
+  creator.join ();
+  fail_unless (slow_client != nullptr);
+
+  gst_aws_credentials_free (slow);
+  gst_aws_credentials_free (fast);
+}
+GST_END_TEST
+
+static guint64
+get_executor_stat (const UploadExecutor & executor, const gchar * name)
+{
+  GstStructure *stats = gst_structure_new_empty ("stats");
+  guint64 value = 0;
+
+  executor.fill_stats (stats);
+  fail_unless (gst_structure_get_uint64 (stats, name, &value));
+  gst_structure_free (stats);
+
+  return value;
+}
+
+GST_START_TEST (test_executor_should_start_configured_threads)
+{
+  auto executor = UploadExecutor::get_instance (3, "s3-test");
+  std::mutex mtx;
+  std::set<std::string> names;
+  std::promise<void> done;
+  gint remaining = 30;
+  gint i;
+
+  fail_unless_equals_int (3, get_executor_stat (*executor, "executor-threads"));
+  /* shared by every uploader of the process */
+  fail_unless (executor == UploadExecutor::get_instance (5, "other"));
+
+  for (i = 0; i < 30; i++) {
+    executor->Submit ([&] {
+      std::lock_guard<std::mutex> l (mtx);
+#if defined(__linux__)
+      char name[16];
+      pthread_getname_np (pthread_self (), name, sizeof (name));
+      names.insert (name);
+#endif
+      if (--remaining == 0)
+        done.set_value ();
+    });
+  }
+
+  fail_unless (done.get_future ().wait_for (std::chrono::seconds (10))
+      == std::future_status::ready);
+#if defined(__linux__)
+  for (const auto & name : names)
+    fail_unless (g_str_has_prefix (name.c_str (), "s3-test-"), "%s", name.c_str ());
+#endif
+}
+GST_END_TEST
+
+GST_START_TEST (test_idle_worker_should_steal_tasks)
+{
+  UploadExecutor executor (2, "s3-test");
+  std::promise<void> unblock;
+  std::shared_future<void> unblocked = unblock.get_future ().share ();
+  std::promise<void> done;
+  std::atomic<gint> remaining (4);
+  gint i;
+
+  /* one worker is stuck on the first task, while tasks keep landing in its
+   * queue every other submission */
+  executor.Submit ([unblocked] { unblocked.wait (); });
+  for (i = 0; i < 4; i++) {
+    executor.Submit ([&] {
+      if (--remaining == 0)
+        done.set_value ();
+    });
+  }
+
+  fail_unless (done.get_future ().wait_for (std::chrono::seconds (10))
+      == std::future_status::ready);
+  fail_unless (get_executor_stat (executor, "executor-stolen-tasks") >= 1);
+
+  unblock.set_value ();
+}
+GST_END_TEST
+
+GST_START_TEST (test_executor_released_by_own_task_should_not_join_itself)
+{
+  auto executor = std::make_shared<UploadExecutor> (2, "s3-test");
+  auto holder = std::make_shared<std::shared_ptr<UploadExecutor>> (executor);
+  std::promise<void> go;
+  std::shared_future<void> may_release = go.get_future ().share ();
+  std::promise<void> released;
+
+  executor->Submit ([holder, may_release, &released] {
+    may_release.wait ();
+    /* the last reference, dropped on a worker */
+    holder->reset ();
+    released.set_value ();
+  });
+  executor.reset ();
+  go.set_value ();
+
+  fail_unless (released.get_future ().wait_for (std::chrono::seconds (10))
+      == std::future_status::ready);
+}
+GST_END_TEST
+
+static void
+assert_sdk_initialized (void)
+{
+  /* the crypto factories only exist while the SDK is initialized */
+  auto sha256 = Aws::Utils::HashingUtils::CalculateSHA256 ("abc");
+
+  fail_unless_equals_string (
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+      Aws::Utils::HashingUtils::HexEncode (sha256).c_str ());
+}
+
+GST_START_TEST (test_sdk_handles_should_be_shared)
+{
+  auto first = acquire_aws_sdk ();
+  auto second = acquire_aws_sdk ();
+
+  fail_unless (first == second);
+  assert_sdk_initialized ();
+}
+GST_END_TEST
+
+GST_START_TEST (test_sdk_should_be_initialized_again_after_shutdown)
+{
+  gint i;
+
+  gst_s3_multipart_uploader_set_sdk_idle_timeout (0);
+  for (i = 0; i < 3; i++) {
+    auto handle = acquire_aws_sdk ();
+    assert_sdk_initialized ();
+  }
+}
+GST_END_TEST
+
+GST_START_TEST (test_sdk_shutdown_should_not_race_initialization)
+{
+  std::vector<std::thread> threads;
+  gint i;
+
+  gst_s3_multipart_uploader_set_sdk_idle_timeout (0);
+  for (i = 0; i < 4; i++) {
+    threads.emplace_back ([] {
+      gint j;
+
+      for (j = 0; j < 50; j++) {
+        auto handle = acquire_aws_sdk ();
+        Aws::Utils::HashingUtils::CalculateSHA256 ("abc");
+      }
+    });
+  }
+  for (auto & thread : threads)
+    thread.join ();
+
+  auto handle = acquire_aws_sdk ();
+  assert_sdk_initialized ();
+}
+GST_END_TEST
+
+GST_START_TEST (test_sdk_should_be_kept_after_last_user)
+{
+  gst_s3_multipart_uploader_set_sdk_idle_timeout (60);
+  acquire_aws_sdk ().reset ();
+
+  /* nobody holds a handle, the keeper does */
+  assert_sdk_initialized ();
+
+  gst_s3_multipart_uploader_set_sdk_idle_timeout (0);
+}
+GST_END_TEST
+
+static Suite *
+multipartuploader_suite (void)
+{
+  Suite *s = suite_create ("multipartuploader");
+  TCase *tc_chain = tcase_create ("general");
+  TCase *tc_parts = tcase_create ("parts");
+  TCase *tc_uploader = tcase_create ("uploader");
+
+  GST_DEBUG_CATEGORY_INIT (gst_s3_sink_debug, "s3sink", 0, "s3sink element");
+  GST_DEBUG_CATEGORY_INIT (gst_s3_src_debug, "s3src", 0, "s3src element");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_concurrency_should_grow_while_throughput_improves);
+  tcase_add_test (tc_chain, test_concurrency_should_back_off_once_per_round_trip);
+  tcase_add_test (tc_chain, test_concurrency_should_back_off_once_per_latency_spike);
+  tcase_add_test (tc_chain, test_fixed_concurrency_should_not_change);
+  tcase_add_test (tc_chain, test_retry_delay_should_double_within_jitter_bounds);
+  tcase_add_test (tc_chain, test_retry_delay_should_be_randomized);
+  tcase_add_test (tc_chain, test_retry_delay_should_be_capped);
+  tcase_add_test (tc_chain, test_retry_should_give_up_after_last_retry);
+  tcase_add_test (tc_chain, test_executor_should_start_configured_threads);
+  tcase_add_test (tc_chain, test_idle_worker_should_steal_tasks);
+  tcase_add_test (tc_chain, test_executor_released_by_own_task_should_not_join_itself);
+  tcase_add_test (tc_chain, test_sdk_handles_should_be_shared);
+  tcase_add_test (tc_chain, test_sdk_should_be_initialized_again_after_shutdown);
+  tcase_add_test (tc_chain, test_sdk_shutdown_should_not_race_initialization);
+  tcase_add_test (tc_chain, test_sdk_should_be_kept_after_last_user);
+
+  suite_add_tcase (s, tc_parts);
+  tcase_add_checked_fixture (tc_parts, init_sdk, shutdown_sdk);
+  tcase_add_test (tc_parts, test_part_copy_should_compute_sha256);
+  tcase_add_test (tc_parts, test_part_copy_should_compute_known_sha256);
+  tcase_add_test (tc_parts, test_part_copy_without_hash_should_not_compute_sha256);
+  tcase_add_test (tc_parts, test_composite_checksum_should_match_known_crc32c);
+  tcase_add_test (tc_parts, test_composite_checksum_should_match_known_sha256);
+  tcase_add_test (tc_parts, test_part_stream_sha256_should_match_read_digest);
+  tcase_add_test (tc_parts, test_buffer_ring_should_grow_with_parts);
+#if defined(__linux__)
+  tcase_add_test (tc_parts, test_released_ring_buffer_should_be_discarded);
+#endif
+
+  suite_add_tcase (s, tc_uploader);
+  tcase_add_checked_fixture (tc_uploader, init_sdk, shutdown_sdk);
+  tcase_add_test (tc_uploader, test_empty_stream_should_put_empty_object);
+  tcase_add_test (tc_uploader, test_small_object_should_be_put_in_one_request);
+  tcase_add_test (tc_uploader, test_object_of_several_parts_should_use_multipart_upload);
+  tcase_add_test (tc_uploader, test_small_first_part_should_join_multipart_upload);
+  tcase_add_test (tc_uploader, test_failed_part_should_be_retried);
+  tcase_add_test (tc_uploader, test_failed_part_should_fail_upload_after_last_retry);
+  tcase_add_test (tc_uploader, test_part_should_not_be_retried_on_sdk_retryable_error);
+  tcase_add_test (tc_uploader, test_missing_object_checksum_should_be_computed_from_parts);
+  tcase_add_test (tc_uploader, test_checksum_mismatch_should_not_fail_completed_upload);
+  tcase_add_test (tc_uploader, test_resume_should_ignore_unterminated_journal_line);
+  tcase_add_test (tc_uploader, test_resume_should_stop_at_corrupt_journal_part);
+  tcase_add_test (tc_uploader, test_resume_should_send_again_parts_missing_on_s3);
+  tcase_add_test (tc_uploader, test_parts_over_budget_should_be_spooled);
+  tcase_add_test (tc_uploader, test_unreachable_parts_should_be_spooled_and_drained);
+  tcase_add_test (tc_uploader, test_uploaders_should_share_spool_of_directory);
+  tcase_add_test (tc_uploader, test_parts_over_budget_should_block);
+  tcase_add_test (tc_uploader, test_leak_policy_should_drop_oldest_unsent_part);
+  tcase_add_test (tc_uploader, test_spill_policy_should_spool_to_temporary_directory_within_cap);
+  tcase_add_test (tc_uploader, test_equal_settings_should_share_client);
+  tcase_add_test (tc_uploader, test_slow_client_creation_should_not_block_other_clients);
+
+  return s;
+}
+
+GST_CHECK_MAIN (multipartuploader)
@@ -18,9 +18,12 @@
  */
 #include "gsts3uploader.h"
 #include "gsts3sink.h"
+#include "gsts3keyframeindex.h"
 
 #include <gst/check/gstcheck.h>
 
+#include <string.h>
+
 static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
@@ -33,6 +36,14 @@ typedef struct {
     gboolean fail_complete;
 
     gint upload_part_count;
+    GstBufferList *last_part_list;
+    gboolean throttle;
+    guint64 throttle_episodes;
+    const gchar *error;
+    const gchar *checksum;
+    gsize last_part_size;
+    guint resumed_parts;
+    guint64 resumed_bytes;
 } TestUploader;
 
 #define TEST_UPLOADER(uploader) ((TestUploader*) uploader)
@@ -40,15 +51,20 @@ typedef struct {
 static void
 test_uploader_destroy (GstS3Uploader * uploader)
 {
+  if (TEST_UPLOADER(uploader)->last_part_list)
+    gst_buffer_list_unref (TEST_UPLOADER(uploader)->last_part_list);
   g_free(uploader);
 }
 
 static gboolean
-test_uploader_upload_part (GstS3Uploader * uploader, G_GNUC_UNUSED const gchar * buffer, G_GNUC_UNUSED gsize size)
+test_uploader_upload_part (GstS3Uploader * uploader, G_GNUC_UNUSED const gchar * buffer, gsize size)
 {
   gboolean ok = TEST_UPLOADER(uploader)->fail_upload_retry != 0;
 
   TEST_UPLOADER(uploader)->upload_part_count++;
+  TEST_UPLOADER(uploader)->last_part_size = size;
+  if (TEST_UPLOADER(uploader)->throttle)
+    TEST_UPLOADER(uploader)->throttle_episodes++;
 
   if (ok) {
     TEST_UPLOADER(uploader)->fail_upload_retry--;
@@ -63,10 +79,46 @@ test_uploader_complete (GstS3Uploader * uploader)
   return !TEST_UPLOADER(uploader)->fail_complete;
 }
 
+static gboolean
+test_uploader_upload_part_list (GstS3Uploader * uploader, GstBufferList * list, G_GNUC_UNUSED gsize size)
+{
+  if (TEST_UPLOADER(uploader)->last_part_list)
+    gst_buffer_list_unref (TEST_UPLOADER(uploader)->last_part_list);
+  TEST_UPLOADER(uploader)->last_part_list = list;
+
+  return test_uploader_upload_part (uploader, NULL, size);
+}
+
+static GstStructure *
+test_uploader_get_stats (GstS3Uploader * uploader)
+{
+  GstStructure *stats = gst_structure_new ("s3-uploader-stats",
+      "throttle-episodes", G_TYPE_UINT64, TEST_UPLOADER(uploader)->throttle_episodes,
+      "blocked-time", G_TYPE_UINT64, TEST_UPLOADER(uploader)->throttle_episodes * GST_SECOND,
+      "resumed-parts", G_TYPE_UINT, TEST_UPLOADER(uploader)->resumed_parts,
+      "resumed-bytes", G_TYPE_UINT64, TEST_UPLOADER(uploader)->resumed_bytes,
+      NULL);
+
+  if (TEST_UPLOADER(uploader)->checksum)
+    gst_structure_set (stats, "checksum", G_TYPE_STRING, TEST_UPLOADER(uploader)->checksum, NULL);
+
+  return stats;
+}
+
+static gchar *
+test_uploader_get_error (GstS3Uploader * uploader)
+{
+  return g_strdup (TEST_UPLOADER(uploader)->error);
+}
+
 static GstS3UploaderClass test_uploader_class = {
   test_uploader_destroy,
   test_uploader_upload_part,
-  test_uploader_complete
+  test_uploader_complete,
+  test_uploader_upload_part_list,
+  test_uploader_get_stats,
+  test_uploader_get_error,
+  NULL
 };
 
 static GstS3Uploader*
@@ -78,10 +130,70 @@ test_uploader_new (gint fail_upload_retry, gboolean fail_complete)
   uploader->fail_upload_retry = fail_upload_retry;
   uploader->fail_complete = fail_complete;
   uploader->upload_part_count = 0;
+  uploader->last_part_list = NULL;
+  uploader->throttle = FALSE;
+  uploader->throttle_episodes = 0;
+  uploader->error = NULL;
+  uploader->checksum = NULL;
+  uploader->last_part_size = 0;
+  uploader->resumed_parts = 0;
+  uploader->resumed_bytes = 0;
 
   return (GstS3Uploader*) uploader;
 }
 
+static guint test_uploader_factory_calls = 0;
+static gchar *test_uploader_factory_key = NULL;
+
+static GstS3Uploader*
+test_uploader_factory (const GstS3UploaderConfig * config)
+{
+  test_uploader_factory_calls++;
+  g_free (test_uploader_factory_key);
+  test_uploader_factory_key = g_strdup (config->key);
+
+  return test_uploader_new (-1, FALSE);
+}
+
+static GByteArray *test_uploaded_index = NULL;
+
+static gboolean
+test_index_uploader_upload_part (GstS3Uploader * uploader,
+    const gchar * buffer, gsize size)
+{
+  g_byte_array_append (test_uploaded_index, (const guint8 *) buffer, size);
+  return test_uploader_upload_part (uploader, buffer, size);
+}
+
+static guint test_index_uploader_prepare_calls = 0;
+
+static gboolean
+test_index_uploader_prepare (GstS3Uploader * uploader)
+{
+  test_index_uploader_prepare_calls++;
+  return TRUE;
+}
+
+static GstS3UploaderClass test_index_uploader_class = {
+  test_uploader_destroy,
+  test_index_uploader_upload_part,
+  test_uploader_complete,
+  test_uploader_upload_part_list,
+  test_uploader_get_stats,
+  test_uploader_get_error,
+  test_index_uploader_prepare
+};
+
+/* keeps what is uploaded in test_uploaded_index */
+static GstS3Uploader*
+test_index_uploader_factory (const GstS3UploaderConfig * config)
+{
+  GstS3Uploader *uploader = test_uploader_factory (config);
+
+  uploader->klass = &test_index_uploader_class;
+  return uploader;
+}
+
 /************* TEST UPLOADER END *************/
 
 static gboolean
@@ -326,6 +438,42 @@ GST_START_TEST (test_push_buffer_should_flush_buffer_if_reaches_limit)
 }
 GST_END_TEST
 
+GST_START_TEST (test_buffer_location_should_stage_parts_in_mapped_file)
+{
+  GstElement *sink;
+  GstStateChangeReturn ret;
+  GstPad *srcpad;
+  int idx;
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+
+  sink = setup_default_s3_sink ((GstS3Uploader*) uploader);
+  fail_if (sink == NULL);
+
+  g_object_set(sink, "buffer-size", 5*1024*1024,
+      "buffer-location", g_get_tmp_dir (), NULL);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  for (idx = 0; idx < 16; idx++) {
+    PUSH_BYTES (srcpad, 1024 * 1024);
+  }
+
+  fail_unless_equals_int (3, uploader->upload_part_count);
+  fail_unless_equals_int (5*1024*1024, uploader->last_part_size);
+  fail_unless (GST_S3_SINK (sink)->buffer_map_size != 0);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_object_unref (sink);
+  gst_object_unref (srcpad);
+}
+GST_END_TEST
+
 GST_START_TEST (test_query_position)
 {
   GstElement *sink = setup_default_s3_sink (test_uploader_new (-1, FALSE));
@@ -441,6 +589,766 @@ GST_START_TEST (test_push_empty_buffer)
 }
 GST_END_TEST
 
+GST_START_TEST (test_zero_copy_should_upload_upstream_memory)
+{
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+  GstElement *sink = setup_default_s3_sink ((GstS3Uploader*) uploader);
+  GstStateChangeReturn ret;
+  GstPad *srcpad;
+  GstBuffer *buffer, *uploaded;
+  GstMemory *memory;
+  const guint bytes_to_write = 5 * 1024 * 1024;
+
+  fail_if (sink == NULL);
+
+  g_object_set (sink, "buffer-size", bytes_to_write, "zero-copy", TRUE, NULL);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  buffer = gst_buffer_new_and_alloc (bytes_to_write);
+  memory = gst_buffer_peek_memory (buffer, 0);
+  fail_unless_equals_int (gst_pad_push (srcpad, buffer), GST_FLOW_OK);
+
+  fail_unless_equals_int (1, uploader->upload_part_count);
+  fail_unless_equals_int (1, gst_buffer_list_length (uploader->last_part_list));
+  uploaded = gst_buffer_list_get (uploader->last_part_list, 0);
+  fail_unless (gst_buffer_peek_memory (uploaded, 0) == memory);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_zero_copy_should_split_buffer_across_parts)
+{
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+  GstElement *sink = setup_default_s3_sink ((GstS3Uploader*) uploader);
+  GstStateChangeReturn ret;
+  GstPad *srcpad, *sinkpad;
+  const guint buffer_size = 5 * 1024 * 1024;
+
+  fail_if (sink == NULL);
+
+  g_object_set (sink, "buffer-size", buffer_size, "zero-copy", TRUE, NULL);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  PUSH_BYTES (srcpad, buffer_size + 1024);
+  fail_unless_equals_int (1, uploader->upload_part_count);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_send_event (sinkpad, gst_event_new_eos ());
+  gst_object_unref (sinkpad);
+
+  fail_unless_equals_int (2, uploader->upload_part_count);
+  fail_unless_equals_int (1024,
+      gst_buffer_list_calculate_size (uploader->last_part_list));
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_push_buffer_list_should_fill_buffer)
+{
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+  GstElement *sink = setup_default_s3_sink ((GstS3Uploader*) uploader);
+  GstStateChangeReturn ret;
+  GstPad *srcpad, *sinkpad;
+  GstBufferList *list;
+  const guint buffer_size = 5 * 1024 * 1024;
+  gint64 position_bytes = 0;
+  guint idx;
+
+  fail_if (sink == NULL);
+
+  g_object_set (sink, "buffer-size", buffer_size, NULL);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  fail_if (sinkpad == NULL);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  list = gst_buffer_list_new ();
+  for (idx = 0; idx < 6; idx++)
+    gst_buffer_list_add (list, gst_buffer_new_and_alloc (1024 * 1024));
+  gst_buffer_list_add (list, gst_buffer_new ());
+
+  fail_unless_equals_int (gst_pad_push_list (srcpad, list), GST_FLOW_OK);
+  fail_unless_equals_int (1, uploader->upload_part_count);
+
+  gst_pad_query_position (sinkpad, GST_FORMAT_BYTES, &position_bytes);
+  fail_unless_equals_int64 (6 * 1024 * 1024, position_bytes);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_object_unref (sinkpad);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_push_multi_memory_buffer)
+{
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+  GstElement *sink = setup_default_s3_sink ((GstS3Uploader*) uploader);
+  GstStateChangeReturn ret;
+  GstPad *srcpad, *sinkpad;
+  GstBuffer *buffer;
+  const guint buffer_size = 5 * 1024 * 1024;
+  gint64 position_bytes = 0;
+
+  fail_if (sink == NULL);
+
+  g_object_set (sink, "buffer-size", buffer_size, NULL);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  fail_if (sinkpad == NULL);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  buffer = gst_buffer_new_and_alloc (buffer_size - 10);
+  gst_buffer_append_memory (buffer, gst_allocator_alloc (NULL, 20, NULL));
+  fail_unless_equals_int (2, gst_buffer_n_memory (buffer));
+
+  fail_unless_equals_int (gst_pad_push (srcpad, buffer), GST_FLOW_OK);
+  fail_unless_equals_int (1, uploader->upload_part_count);
+
+  gst_pad_query_position (sinkpad, GST_FORMAT_BYTES, &position_bytes);
+  fail_unless_equals_int64 (buffer_size + 10, position_bytes);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_object_unref (sinkpad);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_throttled_upload_should_post_message)
+{
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+  GstElement *sink = setup_default_s3_sink ((GstS3Uploader*) uploader);
+  GstStateChangeReturn ret;
+  GstPad *srcpad;
+  GstBus *bus;
+  GstMessage *message;
+  const GstStructure *structure;
+  guint64 blocked_time = 0;
+  const guint buffer_size = 5 * 1024 * 1024;
+
+  fail_if (sink == NULL);
+
+  g_object_set (sink, "buffer-size", buffer_size, NULL);
+
+  bus = gst_bus_new ();
+  gst_element_set_bus (sink, bus);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  PUSH_BYTES (srcpad, buffer_size);
+  fail_if (gst_bus_pop_filtered (bus, GST_MESSAGE_ELEMENT) != NULL);
+
+  uploader->throttle = TRUE;
+  PUSH_BYTES (srcpad, buffer_size);
+
+  message = gst_bus_pop_filtered (bus, GST_MESSAGE_ELEMENT);
+  fail_if (message == NULL);
+  structure = gst_message_get_structure (message);
+  fail_unless (gst_structure_has_name (structure, "s3sink-throttled"));
+  fail_unless (gst_structure_get_uint64 (structure, "blocked-time", &blocked_time));
+  fail_unless_equals_uint64 (GST_SECOND, blocked_time);
+  gst_message_unref (message);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_element_set_bus (sink, NULL);
+  gst_object_unref (bus);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_failed_part_should_fail_next_render)
+{
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+  GstElement *sink = setup_default_s3_sink ((GstS3Uploader*) uploader);
+  GstStateChangeReturn ret;
+  GstPad *srcpad;
+  GstBus *bus;
+  GstMessage *message;
+
+  fail_if (sink == NULL);
+
+  bus = gst_bus_new ();
+  gst_element_set_bus (sink, bus);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  PUSH_BYTES (srcpad, 1024);
+
+  uploader->error = "part 1 failed";
+  PUSH_BYTES_FAILURE (srcpad, 1024);
+  fail_unless_equals_int (0, uploader->upload_part_count);
+
+  message = gst_bus_pop_filtered (bus, GST_MESSAGE_ERROR);
+  fail_if (message == NULL);
+  gst_message_unref (message);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_element_set_bus (sink, NULL);
+  gst_object_unref (bus);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_failed_part_error_should_name_location)
+{
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+  GstElement *sink = gst_element_factory_make ("s3sink", "sink");
+  GstPad *srcpad;
+  GstBus *bus;
+  GstMessage *message;
+  GError *error = NULL;
+
+  fail_if (sink == NULL);
+  g_object_set (sink, "location", "s3://some-bucket/some-location", NULL);
+  GST_S3_SINK (sink)->uploader = (GstS3Uploader *) uploader;
+
+  bus = gst_bus_new ();
+  gst_element_set_bus (sink, bus);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  fail_unless (gst_element_set_state (sink, GST_STATE_PLAYING)
+      == GST_STATE_CHANGE_ASYNC);
+  fail_unless (prepare_to_push_bytes (srcpad, NULL));
+
+  uploader->error = "part 1 failed";
+  PUSH_BYTES_FAILURE (srcpad, 1024);
+
+  message = gst_bus_pop_filtered (bus, GST_MESSAGE_ERROR);
+  fail_if (message == NULL);
+  gst_message_parse_error (message, &error, NULL);
+  fail_unless (strstr (error->message, "s3://some-bucket/some-location") != NULL);
+  g_error_free (error);
+  gst_message_unref (message);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_element_set_bus (sink, NULL);
+  gst_object_unref (bus);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_complete_should_post_checksum_message)
+{
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+  GstElement *sink = setup_default_s3_sink ((GstS3Uploader*) uploader);
+  GstStateChangeReturn ret;
+  GstPad *srcpad;
+  GstBus *bus;
+  GstMessage *message;
+  const GstStructure *structure;
+
+  fail_if (sink == NULL);
+
+  g_object_set (sink, "checksum-algorithm", GST_S3_UPLOADER_CHECKSUM_ALGORITHM_CRC32C, NULL);
+  uploader->checksum = "AAAAAA==-1";
+
+  bus = gst_bus_new ();
+  gst_element_set_bus (sink, bus);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  PUSH_BYTES (srcpad, 1024);
+  fail_if (gst_bus_pop_filtered (bus, GST_MESSAGE_ELEMENT) != NULL);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+
+  message = gst_bus_pop_filtered (bus, GST_MESSAGE_ELEMENT);
+  fail_if (message == NULL);
+  structure = gst_message_get_structure (message);
+  fail_unless (gst_structure_has_name (structure, "s3sink-checksum"));
+  fail_unless_equals_string ("AAAAAA==-1", gst_structure_get_string (structure, "checksum"));
+  gst_message_unref (message);
+
+  gst_element_set_bus (sink, NULL);
+  gst_object_unref (bus);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_stats_property)
+{
+  GstElement *sink = setup_default_s3_sink (test_uploader_new (-1, FALSE));
+  GstStructure *stats = NULL;
+
+  fail_if (sink == NULL);
+
+  g_object_get (sink, "stats", &stats, NULL);
+  fail_if (stats == NULL);
+  fail_unless (gst_structure_has_field (stats, "throttle-episodes"));
+  gst_structure_free (stats);
+
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+static GstS3UploaderConfig test_uploader_factory_config;
+
+static GstS3Uploader*
+test_config_uploader_factory (const GstS3UploaderConfig * config)
+{
+  test_uploader_factory_config = *config;
+
+  return test_uploader_new (-1, FALSE);
+}
+
+GST_START_TEST (test_retry_properties_should_configure_uploader)
+{
+  GstElement *sink = setup_default_s3_sink (NULL);
+  guint max_part_retries, part_retry_delay;
+
+  fail_if (sink == NULL);
+
+  g_object_get (sink,
+      "max-part-retries", &max_part_retries,
+      "part-retry-delay", &part_retry_delay,
+      NULL);
+  fail_unless_equals_int (GST_S3_UPLOADER_CONFIG_DEFAULT_MAX_PART_RETRIES,
+      max_part_retries);
+  fail_unless_equals_int (GST_S3_UPLOADER_CONFIG_DEFAULT_PART_RETRY_DELAY,
+      part_retry_delay);
+
+  GST_S3_SINK (sink)->uploader_new = test_config_uploader_factory;
+  g_object_set (sink,
+      "max-part-retries", 7,
+      "part-retry-delay", 250,
+      NULL);
+
+  fail_unless (gst_element_set_state (sink, GST_STATE_PLAYING)
+      == GST_STATE_CHANGE_ASYNC);
+  gst_element_set_state (sink, GST_STATE_NULL);
+
+  fail_unless_equals_int (7, test_uploader_factory_config.max_part_retries);
+  fail_unless_equals_int (250, test_uploader_factory_config.part_retry_delay);
+
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_hash_on_copy_should_be_opt_in)
+{
+  GstElement *sink = setup_default_s3_sink (NULL);
+  gboolean hash_on_copy = TRUE;
+
+  fail_if (sink == NULL);
+
+  g_object_get (sink, "hash-on-copy", &hash_on_copy, NULL);
+  fail_if (hash_on_copy);
+
+  GST_S3_SINK (sink)->uploader_new = test_config_uploader_factory;
+  g_object_set (sink, "hash-on-copy", TRUE, NULL);
+
+  fail_unless (gst_element_set_state (sink, GST_STATE_PLAYING)
+      == GST_STATE_CHANGE_ASYNC);
+  gst_element_set_state (sink, GST_STATE_NULL);
+
+  fail_unless (test_uploader_factory_config.hash_on_copy);
+
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_part_size_should_grow_after_interval)
+{
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+  GstElement *sink = setup_default_s3_sink ((GstS3Uploader*) uploader);
+  GstStateChangeReturn ret;
+  GstPad *srcpad;
+  const guint buffer_size = 5 * 1024 * 1024;
+
+  fail_if (sink == NULL);
+
+  g_object_set (sink,
+    "buffer-size", buffer_size,
+    "part-size-growth-interval", 2,
+    NULL);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  PUSH_BYTES (srcpad, buffer_size);
+  PUSH_BYTES (srcpad, buffer_size);
+  fail_unless_equals_int (2, uploader->upload_part_count);
+
+  /* third part is twice as big */
+  PUSH_BYTES (srcpad, buffer_size);
+  fail_unless_equals_int (2, uploader->upload_part_count);
+  PUSH_BYTES (srcpad, buffer_size);
+  fail_unless_equals_int (3, uploader->upload_part_count);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_part_size_should_fit_segment_size_hint)
+{
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+  GstElement *sink = setup_default_s3_sink ((GstS3Uploader*) uploader);
+  GstStateChangeReturn ret;
+  GstPad *srcpad;
+  GstSegment segment;
+  const guint buffer_size = 5 * 1024 * 1024;
+
+  fail_if (sink == NULL);
+
+  g_object_set (sink,
+    "buffer-size", buffer_size,
+    "part-size-growth-interval", 0,
+    NULL);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  /* 10000 parts of 5 MiB aren't enough, parts need to be 10 MiB */
+  gst_segment_init (&segment, GST_FORMAT_BYTES);
+  segment.stop = (guint64) buffer_size * 12000;
+  fail_unless (gst_pad_push_event (srcpad, gst_event_new_stream_start ("test")));
+  fail_unless (gst_pad_push_event (srcpad, gst_event_new_segment (&segment)));
+
+  PUSH_BYTES (srcpad, buffer_size);
+  fail_unless_equals_int (0, uploader->upload_part_count);
+  PUSH_BYTES (srcpad, buffer_size);
+  fail_unless_equals_int (1, uploader->upload_part_count);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+/* Objects are completed in the background, so their messages may come in
+ * any order. */
+static void
+check_object_completed_message (GstBus * bus, guint index, const gchar * key, guint64 size)
+{
+  GstMessage *message;
+  const GstStructure *structure = NULL;
+  GList *skipped = NULL;
+  guint message_index = G_MAXUINT;
+  guint64 message_size = 0;
+  gboolean success = FALSE;
+
+  while ((message = gst_bus_pop_filtered (bus, GST_MESSAGE_ELEMENT)) != NULL) {
+    structure = gst_message_get_structure (message);
+    fail_unless (gst_structure_has_name (structure, "s3sink-object-completed"));
+    fail_unless (gst_structure_get_uint (structure, "index", &message_index));
+    if (message_index == index)
+      break;
+    skipped = g_list_append (skipped, message);
+  }
+  for (GList *item = skipped; item; item = item->next)
+    gst_bus_post (bus, item->data);
+  g_list_free (skipped);
+
+  fail_if (message == NULL);
+  fail_unless (gst_structure_get (structure,
+      "size", G_TYPE_UINT64, &message_size,
+      "success", G_TYPE_BOOLEAN, &success, NULL));
+  fail_unless_equals_uint64 (size, message_size);
+  fail_unless_equals_string (key, gst_structure_get_string (structure, "key"));
+  fail_unless (success);
+  gst_message_unref (message);
+}
+
+GST_START_TEST (test_rolling_upload_should_split_at_keyframe)
+{
+  GstElement *sink = setup_default_s3_sink (test_uploader_new (-1, FALSE));
+  GstStateChangeReturn ret;
+  GstPad *srcpad;
+  GstBus *bus;
+  GstBuffer *buffer;
+
+  fail_if (sink == NULL);
+
+  test_uploader_factory_calls = 0;
+  GST_S3_SINK (sink)->uploader_new = test_uploader_factory;
+  g_object_set (sink,
+    "key-template", "rec-{index:3}.ts",
+    "max-object-size", (guint64) 16,
+    NULL);
+
+  bus = gst_bus_new ();
+  gst_element_set_bus (sink, bus);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  PUSH_BYTES (srcpad, 10);
+
+  /* the object is full, but the split waits for a keyframe */
+  buffer = gst_buffer_new_and_alloc (10);
+  GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  fail_unless_equals_int (GST_FLOW_OK, gst_pad_push (srcpad, buffer));
+
+  PUSH_BYTES (srcpad, 10);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+
+  check_object_completed_message (bus, 0, "rec-000.ts", 20);
+  check_object_completed_message (bus, 1, "rec-001.ts", 10);
+
+  /* the uploader of the object after the last one is prepared, but unused */
+  fail_unless_equals_int (2, test_uploader_factory_calls);
+  fail_unless_equals_string ("rec-002.ts", test_uploader_factory_key);
+  g_clear_pointer (&test_uploader_factory_key, g_free);
+
+  gst_element_set_bus (sink, NULL);
+  gst_object_unref (bus);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+static void
+push_timed_bytes (GstPad * pad, gsize size, GstClockTime pts,
+    gboolean is_keyframe)
+{
+  GstBuffer *buffer = gst_buffer_new_and_alloc (size);
+
+  GST_BUFFER_PTS (buffer) = pts;
+  if (!is_keyframe)
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  fail_unless_equals_int (GST_FLOW_OK, gst_pad_push (pad, buffer));
+}
+
+GST_START_TEST (test_index_suffix_should_upload_keyframe_index)
+{
+  GstElement *sink = setup_default_s3_sink (test_uploader_new (-1, FALSE));
+  GstStateChangeReturn ret;
+  GstPad *srcpad;
+  GstS3KeyframeIndex *index;
+  const GstS3KeyframeIndexEntry *entry;
+
+  fail_if (sink == NULL);
+
+  test_uploader_factory_calls = 0;
+  test_index_uploader_prepare_calls = 0;
+  test_uploaded_index = g_byte_array_new ();
+  GST_S3_SINK (sink)->uploader_new = test_index_uploader_factory;
+  g_object_set (sink, "index-suffix", ".idx", NULL);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  push_timed_bytes (srcpad, 100, 0, TRUE);
+  push_timed_bytes (srcpad, 100, GST_SECOND, FALSE);
+  push_timed_bytes (srcpad, 100, 2 * GST_SECOND, TRUE);
+  /* too close to the previous keyframe to be indexed */
+  push_timed_bytes (srcpad, 100, 2 * GST_SECOND + GST_MSECOND, TRUE);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+
+  fail_unless_equals_int (1, test_uploader_factory_calls);
+  fail_unless_equals_string ("some-key.idx", test_uploader_factory_key);
+  g_clear_pointer (&test_uploader_factory_key, g_free);
+  /* small enough to be put in a single request */
+  fail_unless_equals_int (0, test_index_uploader_prepare_calls);
+
+  index = gst_s3_keyframe_index_parse (test_uploaded_index->data,
+      test_uploaded_index->len);
+  fail_if (index == NULL);
+  fail_unless_equals_int (2, gst_s3_keyframe_index_get_size (index));
+
+  entry = gst_s3_keyframe_index_lookup (index, 3 * GST_SECOND);
+  fail_unless_equals_uint64 (2 * GST_SECOND, entry->pts);
+  fail_unless_equals_uint64 (200, entry->offset);
+  fail_unless_equals_int (1, entry->part_number);
+
+  entry = gst_s3_keyframe_index_lookup (index, GST_SECOND);
+  fail_unless_equals_uint64 (0, entry->offset);
+
+  gst_s3_keyframe_index_free (index);
+  g_byte_array_unref (test_uploaded_index);
+  test_uploaded_index = NULL;
+
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_resume_should_skip_uploaded_bytes)
+{
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+  GstElement *sink = setup_default_s3_sink ((GstS3Uploader*) uploader);
+  GstStateChangeReturn ret;
+  GstPad *srcpad, *sinkpad;
+  GstBus *bus;
+  GstMessage *message;
+  const GstStructure *structure;
+  guint64 offset = 0;
+  gint64 position_bytes = 0;
+
+  fail_if (sink == NULL);
+
+  g_object_set (sink, "resume", TRUE, NULL);
+  uploader->resumed_parts = 1;
+  uploader->resumed_bytes = 1000;
+
+  bus = gst_bus_new ();
+  gst_element_set_bus (sink, bus);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  message = gst_bus_pop_filtered (bus, GST_MESSAGE_ELEMENT);
+  fail_if (message == NULL);
+  structure = gst_message_get_structure (message);
+  fail_unless (gst_structure_has_name (structure, "s3sink-resumed"));
+  fail_unless (gst_structure_get_uint64 (structure, "offset", &offset));
+  fail_unless_equals_uint64 (1000, offset);
+  gst_message_unref (message);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  PUSH_BYTES (srcpad, 600);
+  PUSH_BYTES (srcpad, 600);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_send_event (sinkpad, gst_event_new_eos ());
+
+  fail_unless_equals_int (1, uploader->upload_part_count);
+  fail_unless_equals_int (200, uploader->last_part_size);
+
+  gst_pad_query_position (sinkpad, GST_FORMAT_BYTES, &position_bytes);
+  fail_unless_equals_int64 (1200, position_bytes);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+  gst_element_set_bus (sink, NULL);
+  gst_object_unref (bus);
+  gst_object_unref (sinkpad);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
+GST_START_TEST (test_resume_should_drop_keyframe_index)
+{
+  TestUploader *uploader = (TestUploader *) test_uploader_new (-1, FALSE);
+  GstElement *sink = setup_default_s3_sink ((GstS3Uploader*) uploader);
+  GstStateChangeReturn ret;
+  GstPad *srcpad;
+  GstBus *bus;
+  GstMessage *message;
+
+  fail_if (sink == NULL);
+
+  test_uploader_factory_calls = 0;
+  GST_S3_SINK (sink)->uploader_new = test_index_uploader_factory;
+  g_object_set (sink, "index-suffix", ".idx", "resume", TRUE, NULL);
+  uploader->resumed_parts = 1;
+  uploader->resumed_bytes = 100;
+
+  bus = gst_bus_new ();
+  gst_element_set_bus (sink, bus);
+
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate);
+  gst_pad_set_active (srcpad, TRUE);
+
+  ret = gst_element_set_state (sink, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_ASYNC);
+
+  /* the keyframes of the resumed part aren't known */
+  message = gst_bus_pop_filtered (bus, GST_MESSAGE_WARNING);
+  fail_if (message == NULL);
+  gst_message_unref (message);
+
+  fail_unless(TRUE == prepare_to_push_bytes(srcpad, NULL));
+
+  push_timed_bytes (srcpad, 100, 0, TRUE);
+  push_timed_bytes (srcpad, 100, 2 * GST_SECOND, TRUE);
+
+  gst_element_set_state (sink, GST_STATE_NULL);
+
+  fail_unless_equals_int (0, test_uploader_factory_calls);
+
+  gst_element_set_bus (sink, NULL);
+  gst_object_unref (bus);
+  gst_object_unref (srcpad);
+  gst_object_unref (sink);
+}
+GST_END_TEST
+
 GST_PLUGIN_STATIC_DECLARE(s3elements);
 
 static Suite *
@@ -458,10 +1366,28 @@ s3sink_suite (void)
   tcase_add_test (tc_chain, test_change_properties_after_start_should_fail);
   tcase_add_test (tc_chain, test_send_eos_should_flush_buffer);
   tcase_add_test (tc_chain, test_push_buffer_should_flush_buffer_if_reaches_limit);
+  tcase_add_test (tc_chain, test_buffer_location_should_stage_parts_in_mapped_file);
   tcase_add_test (tc_chain, test_query_position);
   tcase_add_test (tc_chain, test_query_seeking);
   tcase_add_test (tc_chain, test_upload_part_failure);
   tcase_add_test (tc_chain, test_push_empty_buffer);
+  tcase_add_test (tc_chain, test_zero_copy_should_upload_upstream_memory);
+  tcase_add_test (tc_chain, test_zero_copy_should_split_buffer_across_parts);
+  tcase_add_test (tc_chain, test_push_buffer_list_should_fill_buffer);
+  tcase_add_test (tc_chain, test_push_multi_memory_buffer);
+  tcase_add_test (tc_chain, test_throttled_upload_should_post_message);
+  tcase_add_test (tc_chain, test_failed_part_should_fail_next_render);
+  tcase_add_test (tc_chain, test_failed_part_error_should_name_location);
+  tcase_add_test (tc_chain, test_complete_should_post_checksum_message);
+  tcase_add_test (tc_chain, test_stats_property);
+  tcase_add_test (tc_chain, test_retry_properties_should_configure_uploader);
+  tcase_add_test (tc_chain, test_hash_on_copy_should_be_opt_in);
+  tcase_add_test (tc_chain, test_part_size_should_grow_after_interval);
+  tcase_add_test (tc_chain, test_part_size_should_fit_segment_size_hint);
+  tcase_add_test (tc_chain, test_rolling_upload_should_split_at_keyframe);
+  tcase_add_test (tc_chain, test_resume_should_skip_uploaded_bytes);
+  tcase_add_test (tc_chain, test_index_suffix_should_upload_keyframe_index);
+  tcase_add_test (tc_chain, test_resume_should_drop_keyframe_index);
 
   return s;
 }
@@ -0,0 +1,757 @@
+/* amazon-s3-gst-plugin
+ * Copyright (C) 2019 Amazon <mkolny@amazon.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+#include "gsts3downloader.h"
+#include "gsts3src.h"
+#include "gsts3keyframeindex.h"
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+
+#include <string.h>
+
+/************* TEST DOWNLOADER *************/
+typedef struct {
+    GstS3Downloader base;
+    guint64 size;
+    gboolean fail_read;
+    /* the object, or NULL for byte n being n & 0xff */
+    const guint8 *data;
+
+    gint read_count;
+    gint prefetch_count;
+} TestDownloader;
+
+#define TEST_DOWNLOADER(downloader) ((TestDownloader*) downloader)
+
+static void
+test_downloader_destroy (GstS3Downloader * downloader)
+{
+  g_free (downloader);
+}
+
+static guint64
+test_downloader_get_size (GstS3Downloader * downloader)
+{
+  return TEST_DOWNLOADER(downloader)->size;
+}
+
+/* byte n of the object is n & 0xff */
+static gboolean
+test_downloader_read (GstS3Downloader * downloader, guint64 offset,
+    gchar * buffer, gsize size, gsize * read_size)
+{
+  gsize idx;
+
+  TEST_DOWNLOADER(downloader)->read_count++;
+  if (TEST_DOWNLOADER(downloader)->fail_read)
+    return FALSE;
+
+  *read_size = 0;
+  if (offset < TEST_DOWNLOADER(downloader)->size)
+    *read_size = MIN (size, TEST_DOWNLOADER(downloader)->size - offset);
+
+  if (TEST_DOWNLOADER(downloader)->data) {
+    memcpy (buffer, TEST_DOWNLOADER(downloader)->data + offset, *read_size);
+    return TRUE;
+  }
+
+  for (idx = 0; idx < *read_size; idx++)
+    buffer[idx] = (gchar) ((offset + idx) & 0xff);
+
+  return TRUE;
+}
+
+static GstStructure *
+test_downloader_get_stats (GstS3Downloader * downloader)
+{
+  return gst_structure_new ("s3-downloader-stats",
+      "size", G_TYPE_UINT64, TEST_DOWNLOADER(downloader)->size,
+      NULL);
+}
+
+static gchar *
+test_downloader_get_error (G_GNUC_UNUSED GstS3Downloader * downloader)
+{
+  return g_strdup ("test error");
+}
+
+static void
+test_downloader_prefetch (GstS3Downloader * downloader)
+{
+  TEST_DOWNLOADER(downloader)->prefetch_count++;
+}
+
+static GstS3DownloaderClass test_downloader_class = {
+  test_downloader_destroy,
+  test_downloader_get_size,
+  test_downloader_read,
+  test_downloader_get_stats,
+  test_downloader_get_error,
+  test_downloader_prefetch,
+  NULL
+};
+
+/* hands out buffers wrapping data, as a downloader sharing its memory */
+static gboolean
+test_downloader_read_buffer (GstS3Downloader * downloader, guint64 offset,
+    gsize size, GstBuffer ** buffer)
+{
+  TestDownloader *self = TEST_DOWNLOADER(downloader);
+  gsize read_size = 0;
+
+  self->read_count++;
+  if (offset < self->size)
+    read_size = MIN (size, self->size - offset);
+
+  *buffer = read_size == 0 ? NULL
+      : gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+          (gpointer) self->data, self->size, offset, read_size, NULL, NULL);
+  return TRUE;
+}
+
+static GstS3DownloaderClass test_shared_downloader_class = {
+  test_downloader_destroy,
+  test_downloader_get_size,
+  test_downloader_read,
+  test_downloader_get_stats,
+  test_downloader_get_error,
+  test_downloader_prefetch,
+  test_downloader_read_buffer
+};
+
+/* reads wait until the downloader is flushing, and fail */
+static GMutex blocking_lock;
+static GCond blocking_cond;
+static gboolean blocking_is_reading;
+static gboolean blocking_is_flushing;
+static gboolean blocking_was_flushed;
+
+static gboolean
+test_blocking_downloader_read (G_GNUC_UNUSED GstS3Downloader * downloader,
+    G_GNUC_UNUSED guint64 offset, G_GNUC_UNUSED gchar * buffer,
+    G_GNUC_UNUSED gsize size, G_GNUC_UNUSED gsize * read_size)
+{
+  g_mutex_lock (&blocking_lock);
+  blocking_is_reading = TRUE;
+  g_cond_broadcast (&blocking_cond);
+  while (!blocking_is_flushing)
+    g_cond_wait (&blocking_cond, &blocking_lock);
+  g_mutex_unlock (&blocking_lock);
+
+  return FALSE;
+}
+
+static void
+test_blocking_downloader_set_flushing (G_GNUC_UNUSED GstS3Downloader *
+    downloader, gboolean flushing)
+{
+  g_mutex_lock (&blocking_lock);
+  blocking_is_flushing = flushing;
+  blocking_was_flushed |= flushing;
+  g_cond_broadcast (&blocking_cond);
+  g_mutex_unlock (&blocking_lock);
+}
+
+static GstS3DownloaderClass test_blocking_downloader_class = {
+  test_downloader_destroy,
+  test_downloader_get_size,
+  test_blocking_downloader_read,
+  test_downloader_get_stats,
+  test_downloader_get_error,
+  test_downloader_prefetch,
+  NULL,
+  test_blocking_downloader_set_flushing
+};
+
+static GstS3Downloader*
+test_downloader_new (guint64 size, gboolean fail_read)
+{
+  TestDownloader *downloader = g_new(TestDownloader, 1);
+
+  downloader->base.klass = &test_downloader_class;
+  downloader->size = size;
+  downloader->fail_read = fail_read;
+  downloader->data = NULL;
+  downloader->read_count = 0;
+  downloader->prefetch_count = 0;
+
+  return (GstS3Downloader*) downloader;
+}
+
+#define SEQUENCE_OBJECT_SIZE 1500
+
+static gint sequence_length;
+static gint sequence_opened_count;
+static gint sequence_prefetched_count;
+static gchar *sequence_first_key;
+static gboolean sequence_is_missing;
+
+/* every object of a sequence is SEQUENCE_OBJECT_SIZE bytes; the objects past
+ * sequence_length can't be opened, and are missing if sequence_is_missing */
+static GstS3Downloader*
+test_sequence_downloader_new (const GstS3DownloaderConfig * config)
+{
+  if (sequence_opened_count >= sequence_length)
+    return NULL;
+
+  fail_unless_equals_string ("some-bucket", config->bucket);
+  if (sequence_opened_count++ == 0)
+    sequence_first_key = g_strdup (config->key);
+  return test_downloader_new (SEQUENCE_OBJECT_SIZE, FALSE);
+}
+
+static gboolean
+test_sequence_lookup_key (G_GNUC_UNUSED const GstS3DownloaderConfig * config,
+    gboolean * exists)
+{
+  *exists = !sequence_is_missing;
+  return TRUE;
+}
+
+static void
+test_sequence_downloader_destroy (GstS3Downloader * downloader)
+{
+  sequence_prefetched_count += TEST_DOWNLOADER(downloader)->prefetch_count;
+  g_free (downloader);
+}
+
+/* lists prefix/0 .. prefix/2, two keys a page */
+static gchar **
+test_list_keys (G_GNUC_UNUSED const GstS3DownloaderConfig * config,
+    const gchar * prefix, const gchar * start_after)
+{
+  guint first = 0;
+  guint idx;
+  GPtrArray *page = g_ptr_array_new ();
+
+  if (start_after)
+    first = g_ascii_strtoull (start_after + strlen (prefix), NULL, 10) + 1;
+
+  for (idx = first; idx < 3 && idx < first + 2; idx++)
+    g_ptr_array_add (page, g_strdup_printf ("%s%u", prefix, idx));
+  g_ptr_array_add (page, NULL);
+
+  return (gchar **) g_ptr_array_free (page, FALSE);
+}
+
+static guint8 *test_index_data;
+static gsize test_index_size;
+
+/* serves the keyframe index of some-key at some-key.idx: a keyframe every
+ * 1000 bytes and 2 seconds */
+static GstS3Downloader*
+test_indexed_downloader_new (const GstS3DownloaderConfig * config)
+{
+  GstS3Downloader *downloader;
+
+  if (!g_str_equal (config->key, "some-key.idx"))
+    return NULL;
+
+  downloader = test_downloader_new (test_index_size, FALSE);
+  TEST_DOWNLOADER(downloader)->data = test_index_data;
+  return downloader;
+}
+
+/************* TEST DOWNLOADER END *************/
+
+static GstHarness *
+setup_default_s3_src (GstS3Downloader *downloader)
+{
+  GstElement *src = gst_element_factory_make ("s3src", "src");
+  GstHarness *h;
+
+  fail_if (src == NULL);
+
+  g_object_set (src,
+    "bucket", "some-bucket",
+    "key", "some-key",
+    "blocksize", 1000,
+    NULL);
+  GST_S3_SRC (src)->downloader = downloader;
+
+  h = gst_harness_new_with_element (src, NULL, "src");
+  gst_object_unref (src);
+
+  return h;
+}
+
+static gboolean
+check_buffer_bytes (GstBuffer * buffer, guint64 offset)
+{
+  GstMapInfo info;
+  gsize idx;
+  gboolean ret = TRUE;
+
+  if (!gst_buffer_map (buffer, &info, GST_MAP_READ))
+    return FALSE;
+
+  for (idx = 0; idx < info.size; idx++)
+    ret &= ((guint8 *) info.data)[idx] == ((offset + idx) & 0xff);
+  gst_buffer_unmap (buffer, &info);
+
+  return ret;
+}
+
+static GstHarness *
+setup_sequence_s3_src (const gchar * property, ...)
+{
+  GstElement *src = gst_element_factory_make ("s3src", "src");
+  GstHarness *h;
+  va_list args;
+
+  fail_if (src == NULL);
+
+  g_object_set (src,
+    "bucket", "some-bucket",
+    "blocksize", 1000,
+    NULL);
+  va_start (args, property);
+  g_object_set_valist (G_OBJECT (src), property, args);
+  va_end (args);
+
+  test_downloader_class.destroy = test_sequence_downloader_destroy;
+  sequence_length = G_MAXINT;
+  sequence_is_missing = TRUE;
+  sequence_opened_count = 0;
+  sequence_prefetched_count = 0;
+  g_clear_pointer (&sequence_first_key, g_free);
+  GST_S3_SRC (src)->downloader_new = test_sequence_downloader_new;
+  GST_S3_SRC (src)->list_keys = test_list_keys;
+  GST_S3_SRC (src)->lookup_key = test_sequence_lookup_key;
+
+  h = gst_harness_new_with_element (src, NULL, "src");
+  gst_object_unref (src);
+
+  return h;
+}
+
+/* Plays the harness until EOS and returns the number of bytes pushed. */
+static guint64
+pull_until_eos (GstHarness * h)
+{
+  GstEvent *event;
+  GstBuffer *buffer;
+  gboolean is_eos = FALSE;
+  guint64 size = 0;
+
+  gst_harness_play (h);
+
+  while (!is_eos && (event = gst_harness_pull_event (h))) {
+    is_eos = GST_EVENT_TYPE (event) == GST_EVENT_EOS;
+    gst_event_unref (event);
+  }
+  fail_unless (is_eos);
+
+  while ((buffer = gst_harness_try_pull (h))) {
+    fail_unless_equals_uint64 (size, GST_BUFFER_OFFSET (buffer));
+    size += gst_buffer_get_size (buffer);
+    gst_buffer_unref (buffer);
+  }
+
+  return size;
+}
+
+GST_START_TEST (test_no_bucket_and_key_then_start_should_fail)
+{
+  GstElement *src = gst_element_factory_make ("s3src", "src");
+  GstStateChangeReturn ret;
+
+  fail_if (src == NULL);
+
+  ret = gst_element_set_state (src, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_FAILURE);
+
+  gst_element_set_state (src, GST_STATE_NULL);
+  gst_object_unref (src);
+}
+GST_END_TEST
+
+GST_START_TEST (test_gst_urihandler_interface)
+{
+  GstElement *s3Src = gst_element_make_from_uri(GST_URI_SRC, "s3://bucket/key", "s3src", NULL);
+  fail_if(NULL == s3Src);
+  gst_object_unref(s3Src);
+}
+GST_END_TEST
+
+GST_START_TEST (test_read_should_push_object_in_order)
+{
+  GstS3Downloader *downloader = test_downloader_new (2500, FALSE);
+  GstHarness *h = setup_default_s3_src (downloader);
+  GstBuffer *buffer;
+  guint64 offset = 0;
+
+  gst_harness_play (h);
+
+  while (offset < 2500) {
+    buffer = gst_harness_pull (h);
+    fail_if (buffer == NULL);
+    fail_unless_equals_uint64 (offset, GST_BUFFER_OFFSET (buffer));
+    fail_unless (check_buffer_bytes (buffer, offset));
+    offset += gst_buffer_get_size (buffer);
+    gst_buffer_unref (buffer);
+  }
+
+  fail_unless_equals_uint64 (2500, offset);
+  fail_unless_equals_int (3, TEST_DOWNLOADER(downloader)->read_count);
+
+  gst_harness_teardown (h);
+}
+GST_END_TEST
+
+GST_START_TEST (test_read_buffer_should_push_downloader_memory)
+{
+  GstS3Downloader *downloader = test_downloader_new (2500, FALSE);
+  GstHarness *h = setup_default_s3_src (downloader);
+  guint8 *data = g_malloc (2500);
+  GstBuffer *buffer;
+  GstMapInfo info;
+  guint64 offset = 0;
+  guint idx;
+
+  for (idx = 0; idx < 2500; idx++)
+    data[idx] = idx & 0xff;
+  downloader->klass = &test_shared_downloader_class;
+  TEST_DOWNLOADER(downloader)->data = data;
+
+  gst_harness_play (h);
+
+  while (offset < 2500) {
+    buffer = gst_harness_pull (h);
+    fail_if (buffer == NULL);
+    fail_unless_equals_uint64 (offset, GST_BUFFER_OFFSET (buffer));
+    fail_unless (gst_buffer_map (buffer, &info, GST_MAP_READ));
+    /* nothing was copied on the way */
+    fail_unless (info.data == data + offset);
+    gst_buffer_unmap (buffer, &info);
+    offset += gst_buffer_get_size (buffer);
+    gst_buffer_unref (buffer);
+  }
+
+  fail_unless_equals_uint64 (2500, offset);
+
+  gst_harness_teardown (h);
+  g_free (data);
+}
+GST_END_TEST
+
+GST_START_TEST (test_query_duration_should_return_object_size)
+{
+  GstHarness *h = setup_default_s3_src (test_downloader_new (2500, FALSE));
+  gint64 duration = 0;
+
+  gst_harness_play (h);
+
+  fail_unless (gst_element_query_duration (h->element, GST_FORMAT_BYTES,
+          &duration));
+  fail_unless_equals_int64 (2500, duration);
+
+  gst_harness_teardown (h);
+}
+GST_END_TEST
+
+GST_START_TEST (test_pull_mode_should_read_at_any_offset)
+{
+  GstS3Downloader *downloader = test_downloader_new (2500, FALSE);
+  GstElement *src = gst_element_factory_make ("s3src", "src");
+  GstPad *srcpad;
+  GstBuffer *buffer = NULL;
+
+  fail_if (src == NULL);
+
+  g_object_set (src, "bucket", "some-bucket", "key", "some-key", NULL);
+  GST_S3_SRC (src)->downloader = downloader;
+  fail_unless (gst_element_set_state (src,
+          GST_STATE_READY) == GST_STATE_CHANGE_SUCCESS);
+
+  srcpad = gst_element_get_static_pad (src, "src");
+  fail_unless (gst_pad_activate_mode (srcpad, GST_PAD_MODE_PULL, TRUE));
+
+  fail_unless_equals_int (GST_FLOW_OK,
+      gst_pad_get_range (srcpad, 2000, 300, &buffer));
+  fail_unless_equals_uint64 (2000, GST_BUFFER_OFFSET (buffer));
+  fail_unless_equals_int (300, gst_buffer_get_size (buffer));
+  fail_unless (check_buffer_bytes (buffer, 2000));
+  gst_buffer_unref (buffer);
+  buffer = NULL;
+
+  /* truncated at the end of the object */
+  fail_unless_equals_int (GST_FLOW_OK,
+      gst_pad_get_range (srcpad, 2400, 300, &buffer));
+  fail_unless_equals_int (100, gst_buffer_get_size (buffer));
+  fail_unless (check_buffer_bytes (buffer, 2400));
+  gst_buffer_unref (buffer);
+  buffer = NULL;
+
+  fail_unless_equals_int (GST_FLOW_OK,
+      gst_pad_get_range (srcpad, 10, 20, &buffer));
+  fail_unless (check_buffer_bytes (buffer, 10));
+  gst_buffer_unref (buffer);
+  buffer = NULL;
+
+  fail_unless_equals_int (GST_FLOW_EOS,
+      gst_pad_get_range (srcpad, 2500, 300, &buffer));
+
+  fail_unless (gst_pad_activate_mode (srcpad, GST_PAD_MODE_PULL, FALSE));
+  gst_object_unref (srcpad);
+  gst_element_set_state (src, GST_STATE_NULL);
+  gst_object_unref (src);
+}
+GST_END_TEST
+
+GST_START_TEST (test_failed_read_should_stop_with_error)
+{
+  GstS3Downloader *downloader = test_downloader_new (2500, TRUE);
+  GstHarness *h = setup_default_s3_src (downloader);
+  GstEvent *event;
+  gboolean is_eos = FALSE;
+
+  gst_harness_play (h);
+
+  /* basesrc sends EOS downstream after a flow error */
+  while (!is_eos && (event = gst_harness_pull_event (h))) {
+    is_eos = GST_EVENT_TYPE (event) == GST_EVENT_EOS;
+    gst_event_unref (event);
+  }
+
+  fail_unless (is_eos);
+  fail_unless_equals_int (0, gst_harness_buffers_received (h));
+  fail_unless_equals_int (1, TEST_DOWNLOADER(downloader)->read_count);
+
+  gst_harness_teardown (h);
+}
+GST_END_TEST
+
+GST_START_TEST (test_stop_should_interrupt_waiting_read)
+{
+  GstS3Downloader *downloader = test_downloader_new (2500, FALSE);
+  GstHarness *h;
+
+  downloader->klass = &test_blocking_downloader_class;
+  blocking_is_reading = FALSE;
+  blocking_is_flushing = FALSE;
+  blocking_was_flushed = FALSE;
+  h = setup_default_s3_src (downloader);
+
+  gst_harness_play (h);
+  g_mutex_lock (&blocking_lock);
+  while (!blocking_is_reading)
+    g_cond_wait (&blocking_cond, &blocking_lock);
+  g_mutex_unlock (&blocking_lock);
+
+  /* stopping unlocks the streaming thread rather than waiting for S3 */
+  gst_harness_teardown (h);
+  fail_unless (blocking_was_flushed);
+}
+GST_END_TEST
+
+GST_START_TEST (test_stats_property)
+{
+  GstHarness *h = setup_default_s3_src (test_downloader_new (2500, FALSE));
+  GstStructure *stats = NULL;
+  guint64 size = 0;
+
+  gst_harness_play (h);
+
+  g_object_get (h->element, "stats", &stats, NULL);
+  fail_if (stats == NULL);
+  fail_unless (gst_structure_has_name (stats, "s3-downloader-stats"));
+  fail_unless (gst_structure_get_uint64 (stats, "size", &size));
+  fail_unless_equals_uint64 (2500, size);
+  gst_structure_free (stats);
+
+  gst_harness_teardown (h);
+}
+GST_END_TEST
+
+GST_START_TEST (test_keys_should_be_read_back_to_back)
+{
+  const gchar *keys[] = { "a", "b", "c", NULL };
+  GstHarness *h = setup_sequence_s3_src ("keys", keys, NULL);
+
+  fail_unless_equals_uint64 (3 * SEQUENCE_OBJECT_SIZE, pull_until_eos (h));
+  /* 1000 + 500 bytes of each object */
+  fail_unless_equals_int (6, gst_harness_buffers_received (h));
+
+  gst_harness_teardown (h);
+
+  fail_unless_equals_int (3, sequence_opened_count);
+  /* every object was opened ahead of its first read */
+  fail_unless_equals_int (3, sequence_prefetched_count);
+  test_downloader_class.destroy = test_downloader_destroy;
+}
+GST_END_TEST
+
+GST_START_TEST (test_prefix_should_read_listed_objects)
+{
+  GstHarness *h = setup_sequence_s3_src ("prefix", "segments/", NULL);
+
+  fail_unless_equals_uint64 (3 * SEQUENCE_OBJECT_SIZE, pull_until_eos (h));
+
+  gst_harness_teardown (h);
+
+  fail_unless_equals_int (3, sequence_opened_count);
+  test_downloader_class.destroy = test_downloader_destroy;
+}
+GST_END_TEST
+
+GST_START_TEST (test_key_template_should_stop_at_missing_object)
+{
+  GstHarness *h = setup_sequence_s3_src ("key-template", "seg-{index:3}",
+      "start-index", 5, NULL);
+
+  sequence_length = 2;
+  fail_unless_equals_uint64 (2 * SEQUENCE_OBJECT_SIZE, pull_until_eos (h));
+
+  gst_harness_teardown (h);
+
+  fail_unless_equals_string ("seg-005", sequence_first_key);
+  g_clear_pointer (&sequence_first_key, g_free);
+  test_downloader_class.destroy = test_downloader_destroy;
+}
+GST_END_TEST
+
+GST_START_TEST (test_key_template_should_fail_on_unreadable_object)
+{
+  GstHarness *h = setup_sequence_s3_src ("key-template", "seg-{index}", NULL);
+  GstBus *bus = gst_bus_new ();
+  GstMessage *message;
+
+  gst_element_set_bus (h->element, bus);
+  sequence_length = 2;
+  sequence_is_missing = FALSE;
+  fail_unless_equals_uint64 (2 * SEQUENCE_OBJECT_SIZE, pull_until_eos (h));
+
+  /* the object is there, so the stream didn't just end */
+  message = gst_bus_pop_filtered (bus, GST_MESSAGE_ERROR);
+  fail_unless (message != NULL);
+  gst_message_unref (message);
+
+  gst_element_set_bus (h->element, NULL);
+  gst_object_unref (bus);
+  gst_harness_teardown (h);
+
+  g_clear_pointer (&sequence_first_key, g_free);
+  test_downloader_class.destroy = test_downloader_destroy;
+}
+GST_END_TEST
+
+GST_START_TEST (test_key_template_without_index_should_fail_to_start)
+{
+  GstElement *src = gst_element_factory_make ("s3src", "src");
+  GstStateChangeReturn ret;
+
+  fail_if (src == NULL);
+
+  g_object_set (src,
+    "bucket", "some-bucket",
+    "key-template", "recording.ts",
+    NULL);
+  ret = gst_element_set_state (src, GST_STATE_PLAYING);
+  fail_unless (ret == GST_STATE_CHANGE_FAILURE);
+
+  gst_element_set_state (src, GST_STATE_NULL);
+  gst_object_unref (src);
+}
+GST_END_TEST
+
+GST_START_TEST (test_index_suffix_should_turn_time_seek_into_offset)
+{
+  GstHarness *h = setup_default_s3_src (test_downloader_new (5000, FALSE));
+  GstS3KeyframeIndex *index = gst_s3_keyframe_index_new ();
+  GstQuery *query;
+  GstEvent *event;
+  gint64 offset = 0;
+  gboolean seekable = FALSE;
+  gboolean is_seeked = FALSE;
+  guint idx;
+
+  for (idx = 0; idx < 5; idx++)
+    gst_s3_keyframe_index_add (index, idx * 2 * GST_SECOND,
+        GST_CLOCK_TIME_NONE, idx * 1000, 1);
+  test_index_data = gst_s3_keyframe_index_serialize (index, &test_index_size);
+  gst_s3_keyframe_index_free (index);
+
+  g_object_set (h->element, "index-suffix", ".idx", NULL);
+  GST_S3_SRC (h->element)->downloader_new = test_indexed_downloader_new;
+  gst_harness_play (h);
+
+  fail_unless (gst_element_query_convert (h->element, GST_FORMAT_TIME,
+          5 * GST_SECOND, GST_FORMAT_BYTES, &offset));
+  fail_unless_equals_int64 (2000, offset);
+
+  query = gst_query_new_seeking (GST_FORMAT_TIME);
+  fail_unless (gst_element_query (h->element, query));
+  gst_query_parse_seeking (query, NULL, &seekable, NULL, NULL);
+  fail_unless (seekable);
+  gst_query_unref (query);
+
+  fail_unless (gst_harness_push_upstream_event (h,
+          gst_event_new_seek (1.0, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH,
+              GST_SEEK_TYPE_SET, 7 * GST_SECOND, GST_SEEK_TYPE_NONE, -1)));
+
+  /* the segment after the seek starts at the keyframe at 6 seconds */
+  while (!is_seeked && (event = gst_harness_pull_event (h))) {
+    if (GST_EVENT_TYPE (event) == GST_EVENT_SEGMENT) {
+      const GstSegment *segment;
+
+      gst_event_parse_segment (event, &segment);
+      is_seeked = segment->format == GST_FORMAT_BYTES
+          && segment->start == 3000;
+    }
+    gst_event_unref (event);
+  }
+  fail_unless (is_seeked);
+
+  gst_harness_teardown (h);
+  g_clear_pointer (&test_index_data, g_free);
+}
+GST_END_TEST
+
+GST_PLUGIN_STATIC_DECLARE(s3elements);
+
+static Suite *
+s3src_suite (void)
+{
+  Suite *s = suite_create ("s3src");
+  TCase *tc_chain = tcase_create ("general");
+
+  tcase_set_timeout (tc_chain, 20);
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_no_bucket_and_key_then_start_should_fail);
+  tcase_add_test (tc_chain, test_gst_urihandler_interface);
+  tcase_add_test (tc_chain, test_read_should_push_object_in_order);
+  tcase_add_test (tc_chain, test_read_buffer_should_push_downloader_memory);
+  tcase_add_test (tc_chain, test_query_duration_should_return_object_size);
+  tcase_add_test (tc_chain, test_pull_mode_should_read_at_any_offset);
+  tcase_add_test (tc_chain, test_failed_read_should_stop_with_error);
+  tcase_add_test (tc_chain, test_stop_should_interrupt_waiting_read);
+  tcase_add_test (tc_chain, test_stats_property);
+  tcase_add_test (tc_chain, test_keys_should_be_read_back_to_back);
+  tcase_add_test (tc_chain, test_prefix_should_read_listed_objects);
+  tcase_add_test (tc_chain, test_key_template_should_stop_at_missing_object);
+  tcase_add_test (tc_chain, test_key_template_should_fail_on_unreadable_object);
+  tcase_add_test (tc_chain, test_key_template_without_index_should_fail_to_start);
+  tcase_add_test (tc_chain, test_index_suffix_should_turn_time_seek_into_offset);
+
+  return s;
+}
+
+GST_CHECK_MAIN (s3src)